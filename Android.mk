@@ -10,6 +10,9 @@ LOCAL_SRC_FILES:= \
     atchannel.c \
     misc.c \
     at_tok.c \
+    at_schema.c \
+    at_capture.c \
+    at_trace.c \
     sms.c \
     sms_gsm.c \
     gsm.c
@@ -34,6 +37,11 @@ ifeq ($(TARGET_PRODUCT),dream)
   LOCAL_CFLAGS += -DPOLL_CALL_STATE -DUSE_QMI
 endif
 
+# epoll/timerfd/eventfd reactor for the AT channel reader, see atchannel.c
+ifeq ($(HUAWEI_RIL_AT_REACTOR),true)
+  LOCAL_CFLAGS += -DAT_REACTOR
+endif
+
 LOCAL_MODULE_TAGS := optional
 
 ifeq (foo,foo)
@@ -52,3 +60,135 @@ else
   LOCAL_MODULE:= huaweigeneric-ril
   include $(BUILD_EXECUTABLE)
 endif
+
+# daemon driving many dongles from one thread pool, see multimodem.h
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    multimodemd.c \
+    multimodem.c \
+    atchannel.c \
+    misc.c \
+    at_tok.c \
+    at_capture.c \
+    at_trace.c
+
+LOCAL_SHARED_LIBRARIES := libcutils libutils
+LOCAL_CFLAGS := -D_GNU_SOURCE
+
+ifeq ($(HUAWEI_RIL_AT_REACTOR),true)
+  LOCAL_CFLAGS += -DAT_REACTOR
+endif
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-multimodemd
+include $(BUILD_EXECUTABLE)
+
+# its scaling benchmark, against emulated modems
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    multimodem_bench.c \
+    multimodem.c \
+    atchannel.c \
+    misc.c \
+    at_tok.c \
+    at_capture.c \
+    at_trace.c
+
+LOCAL_SHARED_LIBRARIES := libcutils libutils
+LOCAL_CFLAGS := -D_GNU_SOURCE
+
+ifeq ($(HUAWEI_RIL_AT_REACTOR),true)
+  LOCAL_CFLAGS += -DAT_REACTOR
+endif
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-multimodem-bench
+include $(BUILD_EXECUTABLE)
+
+# at_tok microbenchmark over captured response lines
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    at_tok_bench.c \
+    at_tok.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-at-tok-bench
+include $(BUILD_EXECUTABLE)
+
+# dumps and replays AT session captures, see at_capture.h
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    at_replay.c \
+    atchannel.c \
+    misc.c \
+    at_tok.c \
+    at_capture.c \
+    at_trace.c
+
+LOCAL_SHARED_LIBRARIES := libcutils libutils
+LOCAL_CFLAGS := -D_GNU_SOURCE
+
+ifeq ($(HUAWEI_RIL_AT_REACTOR),true)
+  LOCAL_CFLAGS += -DAT_REACTOR
+endif
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-at-replay
+include $(BUILD_EXECUTABLE)
+
+# emulated dongle on a pty or loopback port, see modem_emu.c
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    modem_emu.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-modem-emu
+include $(BUILD_EXECUTABLE)
+
+# codec, tokenizer, line scanner and write path microbenchmarks, built for
+# the host with the logging shim in host/, see ril_bench.c
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    ril_bench.c \
+    gsm.c \
+    sms_gsm.c \
+    sms.c \
+    at_tok.c \
+    misc.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/host
+LOCAL_CFLAGS := -D_GNU_SOURCE -O2
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-ril-bench
+include $(BUILD_HOST_EXECUTABLE)
+
+# checks of atchannel.c against a scripted modem and of the SMS codecs,
+# built for the host like huawei-ril-bench, see ril_test.c
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    ril_test.c \
+    atchannel.c \
+    misc.c \
+    at_tok.c \
+    at_capture.c \
+    at_trace.c \
+    gsm.c \
+    sms_gsm.c \
+    sms.c \
+    at_schema.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/host
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= huawei-ril-test
+include $(BUILD_HOST_EXECUTABLE)
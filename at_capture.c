@@ -0,0 +1,365 @@
+/* //device/system/reference-ril/at_capture.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "at_capture.h"
+#include "misc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_TAG "AT"
+#include <utils/Log.h>
+
+/* backwards compatibility for pre-JB */
+#ifndef ALOGE
+#define ALOGE LOGE
+#endif
+
+#define RECORD_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+#define LOCKSTEP_TIMEOUT_MSEC 5000
+
+struct ATCapture {
+    int fd;
+    char *base;
+    size_t size;                /* of the file and mapping */
+    volatile size_t used;       /* bytes of records reserved */
+    volatile unsigned int dropped;
+    int64_t startNsec;
+};
+
+static int64_t monotonicNsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * The file's blocks are allocated up front where the filesystem allows,
+ * so a record costs no more than a page fault on the mapping
+ */
+ATCapture *at_capture_open(const char *path, size_t size)
+{
+    ATCapture *p_capture;
+    ATCaptureHeader *p_header;
+
+    size = RECORD_ALIGN(size);
+
+    if (size < sizeof(ATCaptureHeader) + sizeof(ATCaptureRecord)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    p_capture = (ATCapture *) calloc(1, sizeof(ATCapture));
+    if (p_capture == NULL) {
+        return NULL;
+    }
+
+    p_capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (p_capture->fd < 0) {
+        goto error;
+    }
+
+    if (posix_fallocate(p_capture->fd, 0, size) != 0
+            && ftruncate(p_capture->fd, size) < 0) {
+        goto error;
+    }
+
+    p_capture->base = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, p_capture->fd, 0);
+    if (p_capture->base == MAP_FAILED) {
+        p_capture->base = NULL;
+        goto error;
+    }
+
+    p_capture->size = size;
+    p_capture->startNsec = monotonicNsec();
+
+    p_header = (ATCaptureHeader *) p_capture->base;
+    memcpy(p_header->magic, AT_CAPTURE_MAGIC, sizeof(p_header->magic));
+    p_header->headerSize = sizeof(ATCaptureHeader);
+    p_header->startNsec = p_capture->startNsec;
+
+    return p_capture;
+
+error:
+    if (p_capture->fd >= 0) {
+        close(p_capture->fd);
+    }
+    free(p_capture);
+    return NULL;
+}
+
+void at_capture_write(ATCapture *p_capture, int dir, int channel,
+                        int port, const void * const *bufs,
+                        const size_t *lens, int count)
+{
+    ATCaptureRecord *p_record;
+    size_t len = 0;
+    size_t space;
+    size_t offset;
+    char *p;
+    int i;
+
+    for (i = 0 ; i < count ; i++) {
+        len += lens[i];
+    }
+
+    if (len == 0) {
+        return;
+    }
+
+    space = RECORD_ALIGN(sizeof(ATCaptureRecord) + len);
+
+    /* reserve the space; writers only race for this */
+    do {
+        offset = p_capture->used;
+
+        if (sizeof(ATCaptureHeader) + offset + space > p_capture->size) {
+            __sync_fetch_and_add(&p_capture->dropped, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&p_capture->used, offset,
+                                            offset + space));
+
+    p_record = (ATCaptureRecord *)
+            (p_capture->base + sizeof(ATCaptureHeader) + offset);
+
+    p = (char *) (p_record + 1);
+    for (i = 0 ; i < count ; i++) {
+        memcpy(p, bufs[i], lens[i]);
+        p += lens[i];
+    }
+
+    p_record->nsec = monotonicNsec() - p_capture->startNsec;
+    p_record->dir = dir;
+    p_record->port = port;
+    p_record->channel = channel;
+
+    /* publish it */
+    __sync_synchronize();
+    p_record->len = len;
+}
+
+void at_capture_close(ATCapture *p_capture)
+{
+    ATCaptureHeader *p_header = (ATCaptureHeader *) p_capture->base;
+
+    p_header->used = p_capture->used;
+    p_header->dropped = p_capture->dropped;
+
+    munmap(p_capture->base, p_capture->size);
+
+    /* give back the space that wasn't used */
+    if (ftruncate(p_capture->fd,
+                    sizeof(ATCaptureHeader) + p_capture->used) < 0) {
+        ALOGE("Can't trim the AT capture: %s", strerror(errno));
+    }
+    close(p_capture->fd);
+
+    free(p_capture);
+}
+
+int at_capture_map(ATCaptureReader *p_reader, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    memset(p_reader, 0, sizeof(*p_reader));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ATCaptureHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    p_reader->base = (const char *) mmap(NULL, st.st_size, PROT_READ,
+                                            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p_reader->base == MAP_FAILED) {
+        p_reader->base = NULL;
+        return -1;
+    }
+
+    p_reader->mapSize = p_reader->size = st.st_size;
+    p_reader->p_header = (const ATCaptureHeader *) p_reader->base;
+
+    if (memcmp(p_reader->p_header->magic, AT_CAPTURE_MAGIC,
+                sizeof(p_reader->p_header->magic)) != 0
+            || p_reader->p_header->headerSize < sizeof(ATCaptureHeader)
+            || p_reader->p_header->headerSize > p_reader->size
+    ) {
+        at_capture_unmap(p_reader);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* a capture that wasn't closed is read up to its first hole */
+    if (p_reader->p_header->used > 0
+            && p_reader->p_header->headerSize + p_reader->p_header->used
+                    < p_reader->size) {
+        p_reader->size = p_reader->p_header->headerSize
+                            + p_reader->p_header->used;
+    }
+
+    p_reader->offset = p_reader->p_header->headerSize;
+
+    return 0;
+}
+
+const ATCaptureRecord *at_capture_next(ATCaptureReader *p_reader)
+{
+    const ATCaptureRecord *p_record;
+
+    if (p_reader->offset + sizeof(ATCaptureRecord) > p_reader->size) {
+        return NULL;
+    }
+
+    p_record = (const ATCaptureRecord *) (p_reader->base + p_reader->offset);
+
+    if (p_record->len == 0 || p_record->len
+            > p_reader->size - p_reader->offset - sizeof(ATCaptureRecord)) {
+        return NULL;
+    }
+
+    p_reader->offset += RECORD_ALIGN(sizeof(ATCaptureRecord) + p_record->len);
+
+    return p_record;
+}
+
+void at_capture_unmap(ATCaptureReader *p_reader)
+{
+    if (p_reader->base != NULL) {
+        munmap((void *) p_reader->base, p_reader->mapSize);
+        p_reader->base = NULL;
+    }
+}
+
+/**
+ * Reads what was written to fd, waiting up to timeoutMsec, and counts
+ * the commands in it. returns -1 once fd is closed
+ */
+static int drainCommands(int fd, int timeoutMsec, int *p_commands)
+{
+    struct pollfd pfd;
+    char buf[512];
+    ssize_t count;
+    ssize_t i;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, timeoutMsec) <= 0) {
+        return 0;
+    }
+
+    count = read(fd, buf, sizeof(buf));
+
+    if (count <= 0) {
+        return count == 0 || errno != EINTR ? -1 : 0;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        /* command lines end in \r, SMS PDUs in ^Z */
+        if (buf[i] == '\r' || buf[i] == '\032') {
+            (*p_commands)++;
+        }
+    }
+
+    return 0;
+}
+
+long long at_capture_replay(const char *path, int fd, int port, int flags)
+{
+    ATCaptureReader reader;
+    const ATCaptureRecord *p_record;
+    int64_t lastNsec = -1;
+    long long total = 0;
+    int commands = 0;
+
+    if (at_capture_map(&reader, path) < 0) {
+        return -1;
+    }
+
+    while ((p_record = at_capture_next(&reader)) != NULL) {
+        if (p_record->port != port) {
+            continue;
+        }
+
+        if (p_record->dir == AT_CAPTURE_OUT) {
+            if (flags & AT_REPLAY_LOCKSTEP) {
+                int64_t deadline = monotonicNsec()
+                            + LOCKSTEP_TIMEOUT_MSEC * 1000000LL;
+
+                /* a command that doesn't come in time is skipped */
+                while (commands == 0 && monotonicNsec() < deadline) {
+                    if (drainCommands(fd, 100, &commands) < 0) {
+                        goto done;
+                    }
+                }
+
+                if (commands > 0) {
+                    commands--;
+                }
+
+                /* the gap to the response starts at the command */
+                lastNsec = p_record->nsec;
+            }
+            continue;
+        }
+
+        if ((flags & AT_REPLAY_REALTIME) && lastNsec >= 0
+                && p_record->nsec > lastNsec) {
+            int64_t gap = p_record->nsec - lastNsec;
+            struct timespec ts;
+
+            ts.tv_sec = gap / 1000000000LL;
+            ts.tv_nsec = gap % 1000000000LL;
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        }
+        lastNsec = p_record->nsec;
+
+        /* what the other end writes must not fill up fd */
+        if (drainCommands(fd, 0, &commands) < 0
+                || writeAll(fd, (const char *) (p_record + 1),
+                            p_record->len) < 0) {
+            goto done;
+        }
+
+        total += p_record->len;
+    }
+
+done:
+    at_capture_unmap(&reader);
+
+    return total;
+}
@@ -0,0 +1,113 @@
+/* //device/system/reference-ril/at_capture.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_CAPTURE_H
+#define AT_CAPTURE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary AT session captures. A capture file is preallocated and
+ * mapped, so recording a chunk is a reservation and a memcpy, with no
+ * lock and no system call. It holds a header, then records of the bytes
+ * as they were read from or written to the modem, each 8 byte aligned.
+ * A record is published by storing its len last, so a capture cut short
+ * by a crash ends at the first record with len 0.
+ *
+ * Captures are in host byte order, and only meant to be replayed on the
+ * same kind of machine
+ */
+
+#define AT_CAPTURE_MAGIC "ATCAPv1\n"
+#define AT_CAPTURE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+#define AT_CAPTURE_IN 0         /* read from the modem */
+#define AT_CAPTURE_OUT 1        /* written to the modem */
+
+typedef struct {
+    char magic[8];
+    uint32_t headerSize;
+    uint32_t dropped;       /* records that didn't fit, set when closed */
+    uint64_t used;          /* bytes of records, set when closed */
+    int64_t startNsec;      /* CLOCK_MONOTONIC when capture started */
+} ATCaptureHeader;
+
+typedef struct {
+    int64_t nsec;           /* since startNsec */
+    uint8_t dir;            /* AT_CAPTURE_IN or AT_CAPTURE_OUT */
+    uint8_t port;
+    uint16_t channel;
+    uint32_t len;           /* of the bytes that follow */
+} ATCaptureRecord;
+
+typedef struct ATCapture ATCapture;
+
+/* creates path with room for size bytes, NULL on error */
+ATCapture *at_capture_open(const char *path, size_t size);
+
+/*
+ * appends a record of the count buffers, which may be called from any
+ * thread. Records that don't fit are counted and dropped
+ */
+void at_capture_write(ATCapture *p_capture, int dir, int channel,
+                        int port, const void * const *bufs,
+                        const size_t *lens, int count);
+
+/* the caller must make sure no at_capture_write() is running */
+void at_capture_close(ATCapture *p_capture);
+
+/* Reading: maps a capture and walks its records */
+
+typedef struct {
+    const char *base;
+    size_t mapSize;
+    size_t size;            /* of the records read */
+    size_t offset;
+    const ATCaptureHeader *p_header;
+} ATCaptureReader;
+
+int at_capture_map(ATCaptureReader *p_reader, const char *path);
+
+/* returns the next record, its bytes following it, or NULL at the end */
+const ATCaptureRecord *at_capture_next(ATCaptureReader *p_reader);
+
+void at_capture_unmap(ATCaptureReader *p_reader);
+
+/*
+ * Replays the bytes read from the modem on port of a capture by writing
+ * them to fd, as if fd's other end were the modem. By default as fast as
+ * fd takes them; AT_REPLAY_REALTIME keeps the recorded gaps, and
+ * AT_REPLAY_LOCKSTEP waits, wherever the capture has a command written
+ * on port, for a command to be written to fd before going on, so
+ * responses aren't fed in before the command they answer
+ * returns the number of bytes replayed, or -1 on error
+ */
+#define AT_REPLAY_REALTIME 1
+#define AT_REPLAY_LOCKSTEP 2
+
+long long at_capture_replay(const char *path, int fd, int port, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*AT_CAPTURE_H*/
@@ -0,0 +1,241 @@
+/* //device/system/reference-ril/at_replay.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Offline tool for AT captures, see at_capture.h
+ *
+ * at_replay -d <capture>: prints the records as text
+ * at_replay [-t] [-p <port>] [-n <repeat>] <capture>: feeds what the
+ *   modem sent on port through an ATChannel, ie its reader, line
+ *   classification and unsolicited dispatch, as fast as it goes or with
+ *   the recorded timing (-t), and reports the throughput and the lines
+ *   seen by type. The RIL's own onUnsolicited() is exercised with its
+ *   -r option instead
+ */
+
+#include "atchannel.h"
+#include "at_capture.h"
+#include "misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define END_LINE "AT-REPLAY-END"
+#define NUM_LINE_TYPES (AT_LINE_MODE + 1)
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static int s_ended;
+static unsigned long long s_typeCounts[NUM_LINE_TYPES];
+
+static const char *s_typeNames[NUM_LINE_TYPES] = {
+    "other", "OK", "CONNECT", "ERROR", "+CMS ERROR", "+CME ERROR",
+    "NO CARRIER", "NO ANSWER", "NO DIALTONE", "+CMT", "+CDS", "+CBM",
+    "+CTZV", "+CTZDST", "+HTCCTZV", "+CRING", "RING", "+CCWA", "^RSSI",
+    "+CREG", "+CGREG", "+CGEV", "+HTC_ERIIND", "+CUSD", "^BOOT",
+    "^DSFLOWRPT", "^MODE",
+};
+
+static long long nowNsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(char *s)
+{
+    fprintf(stderr, "usage: %s -d <capture>\n"
+            "       %s [-t] [-p <port>] [-n <repeat>] <capture>\n", s, s);
+    exit(-1);
+}
+
+static int dumpCapture(const char *path)
+{
+    ATCaptureReader reader;
+    const ATCaptureRecord *p_record;
+
+    if (at_capture_map(&reader, path) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    if (reader.p_header->dropped > 0) {
+        printf("# %u records didn't fit in the capture\n",
+                reader.p_header->dropped);
+    }
+
+    while ((p_record = at_capture_next(&reader)) != NULL) {
+        const unsigned char *p = (const unsigned char *) (p_record + 1);
+        uint32_t i;
+
+        printf("%6lld.%06lld %u/AT%u %s ",
+                (long long) (p_record->nsec / 1000000000LL),
+                (long long) (p_record->nsec % 1000000000LL / 1000),
+                p_record->channel, p_record->port,
+                p_record->dir == AT_CAPTURE_IN ? "<" : ">");
+
+        /* line ends and control characters escaped, one record a line */
+        for (i = 0 ; i < p_record->len ; i++) {
+            if (p[i] == '\r') {
+                fputs("\\r", stdout);
+            } else if (p[i] == '\n') {
+                fputs("\\n", stdout);
+            } else if (p[i] < ' ' || p[i] >= 0x7f || p[i] == '\\') {
+                printf("\\x%02x", p[i]);
+            } else {
+                putchar(p[i]);
+            }
+        }
+        putchar('\n');
+    }
+
+    at_capture_unmap(&reader);
+
+    return 0;
+}
+
+static void onUnsolicited(ATChannel *p_channel, const char *s,
+                            const char *sms_pdu, ATLineType type)
+{
+    (void) p_channel;
+    (void) sms_pdu;
+
+    pthread_mutex_lock(&s_mutex);
+
+    if (strcmp(s, END_LINE) == 0) {
+        s_ended = 1;
+        pthread_cond_broadcast(&s_cond);
+    } else if ((unsigned int) type < NUM_LINE_TYPES) {
+        s_typeCounts[type]++;
+    }
+
+    pthread_mutex_unlock(&s_mutex);
+}
+
+int main (int argc, char **argv)
+{
+    static const char endLine[] = "\r\n" END_LINE "\r\n";
+    ATChannel *p_channel;
+    ATUnsolQueueStats unsol;
+    long long start, elapsed;
+    long long bytes = 0;
+    int flags = 0;
+    int port = 0;
+    int repeat = 1;
+    int dump = 0;
+    int sv[2];
+    int opt;
+    int i;
+
+    while ( -1 != (opt = getopt(argc, argv, "dtp:n:"))) {
+        switch (opt) {
+            case 'd':
+                dump = 1;
+                break;
+
+            case 't':
+                flags |= AT_REPLAY_REALTIME;
+                break;
+
+            case 'p':
+                port = atoi(optarg);
+                break;
+
+            case 'n':
+                repeat = atoi(optarg);
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || repeat < 1) {
+        usage(argv[0]);
+    }
+
+    if (dump) {
+        return dumpCapture(argv[optind]);
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    p_channel = at_channel_new(NULL);
+    if (p_channel == NULL || at_channel_open(p_channel, sv[0],
+                                                onUnsolicited) < 0) {
+        fprintf(stderr, "can't open the AT channel\n");
+        return 1;
+    }
+
+    start = nowNsec();
+
+    for (i = 0 ; i < repeat ; i++) {
+        long long count = at_capture_replay(argv[optind], sv[1], port, flags);
+
+        if (count < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+        bytes += count;
+    }
+
+    /*
+     * only status reports are dropped when the dispatcher falls behind;
+     * the marker is an ordinary line, so the reader waits for room
+     * rather than drop it, and one copy is enough
+     */
+    if (writeAll(sv[1], endLine, sizeof(endLine) - 1) < 0) {
+        perror("write");
+        return 1;
+    }
+
+    pthread_mutex_lock(&s_mutex);
+    while (!s_ended) {
+        pthread_cond_wait(&s_cond, &s_mutex);
+    }
+    pthread_mutex_unlock(&s_mutex);
+
+    elapsed = nowNsec() - start;
+
+    at_channel_get_unsol_queue_stats(p_channel, &unsol);
+
+    printf("%lld bytes in %.1f ms: %.1f MB/s, %.0f lines/s dispatched, "
+            "%llu dropped\n", bytes, elapsed / 1e6, bytes * 1e3 / elapsed,
+            (unsol.dispatched - 1) * 1e9 / elapsed, unsol.dropped);
+
+    for (i = 0 ; i < NUM_LINE_TYPES ; i++) {
+        if (s_typeCounts[i] > 0) {
+            printf("%12s %llu\n", s_typeNames[i], s_typeCounts[i]);
+        }
+    }
+
+    at_channel_dump_stats(p_channel);
+    at_channel_close(p_channel);
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+/* //device/system/reference-ril/at_schema.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "at_schema.h"
+#include "at_tok.h"
+
+#include <string.h>
+
+static const ATSchemaField s_clccFields[] = {
+    AT_FIELD(INT,  ATClcc, index, 0),
+    AT_FIELD(BOOL, ATClcc, isMT, 0),
+    AT_FIELD(INT,  ATClcc, state, 0),
+    AT_FIELD(INT,  ATClcc, mode, 0),
+    AT_FIELD(BOOL, ATClcc, isMpty, 0),
+    AT_FIELD(STR,  ATClcc, number, 1),
+    AT_FIELD(INT,  ATClcc, toa, 1),
+    AT_FIELD(STR,  ATClcc, alpha, 2),
+};
+AT_SCHEMA_DEFINE(at_schema_clcc, s_clccFields);
+
+static const ATSchemaField s_regFields[] = {
+    AT_FIELD(INT,  ATReg, n, 0),
+    AT_FIELD(INT,  ATReg, stat, 0),
+    AT_FIELD(HEX,  ATReg, lac, 1),
+    AT_FIELD(HEX,  ATReg, ci, 1),
+    AT_FIELD(HEX,  ATReg, act, 2),
+};
+AT_SCHEMA_DEFINE(at_schema_reg, s_regFields);
+
+static const ATSchemaField s_regUnsolFields[] = {
+    AT_FIELD(INT,  ATReg, stat, 0),
+    AT_FIELD(HEX,  ATReg, lac, 1),
+    AT_FIELD(HEX,  ATReg, ci, 1),
+    AT_FIELD(HEX,  ATReg, act, 2),
+};
+AT_SCHEMA_DEFINE(at_schema_reg_unsol, s_regUnsolFields);
+
+static const ATSchemaField s_copsFields[] = {
+    AT_FIELD(INT,  ATCops, mode, 0),
+    AT_FIELD(INT,  ATCops, format, 1),
+    AT_FIELD(STR,  ATCops, oper, 1),
+    AT_FIELD(INT,  ATCops, act, 2),
+};
+AT_SCHEMA_DEFINE(at_schema_cops, s_copsFields);
+
+static const ATSchemaField s_copsEntryFields[] = {
+    AT_FIELD(INT,  ATCopsEntry, stat, 0),
+    AT_FIELD(STR,  ATCopsEntry, longName, 0),
+    AT_FIELD(STR,  ATCopsEntry, shortName, 0),
+    AT_FIELD(STR,  ATCopsEntry, numeric, 0),
+    AT_FIELD(INT,  ATCopsEntry, act, 1),
+};
+AT_SCHEMA_DEFINE(at_schema_cops_entry, s_copsEntryFields);
+
+static const ATSchemaField s_cgactFields[] = {
+    AT_FIELD(INT,  ATCgact, cid, 0),
+    AT_FIELD(INT,  ATCgact, state, 0),
+};
+AT_SCHEMA_DEFINE(at_schema_cgact, s_cgactFields);
+
+static const ATSchemaField s_cgdcontFields[] = {
+    AT_FIELD(INT,  ATCgdcont, cid, 0),
+    AT_FIELD(STR,  ATCgdcont, type, 0),
+    AT_FIELD(STR,  ATCgdcont, apn, 0),
+    AT_FIELD(STR,  ATCgdcont, address, 0),
+    AT_FIELD(INT,  ATCgdcont, dComp, 1),
+    AT_FIELD(INT,  ATCgdcont, hComp, 1),
+};
+AT_SCHEMA_DEFINE(at_schema_cgdcont, s_cgdcontFields);
+
+static const ATSchemaField s_ccfcFields[] = {
+    AT_FIELD(INT,  ATCcfc, status, 0),
+    AT_FIELD(INT,  ATCcfc, serviceClass, 0),
+    AT_FIELD(STR,  ATCcfc, number, 1),
+    AT_FIELD(INT,  ATCcfc, toa, 2),
+    AT_FIELD_SKIP(3),                       /* <subaddr> */
+    AT_FIELD_SKIP(4),                       /* <satype> */
+    AT_FIELD(INT,  ATCcfc, time, 5),
+};
+AT_SCHEMA_DEFINE(at_schema_ccfc, s_ccfcFields);
+
+static const ATSchemaField s_crsmFields[] = {
+    AT_FIELD(INT,  ATCrsm, sw1, 0),
+    AT_FIELD(INT,  ATCrsm, sw2, 0),
+    AT_FIELD(STR,  ATCrsm, response, 1),
+};
+AT_SCHEMA_DEFINE(at_schema_crsm, s_crsmFields);
+
+/**
+ * Fills *p_out from the fields split out of line, which the STR fields
+ * are terminated in. Field i ends at or before the comma field i + 1
+ * starts after, so terminating it doesn't touch any later field
+ */
+static int fillFields(const ATSchema *p_schema, const ATTokLine *p_tok,
+                        void *p_out)
+{
+    const ATSchemaField *p_fields = p_schema->fields;
+    int count = p_tok->count;
+    int i;
+
+    if (count > p_schema->count) {
+        count = p_schema->count;
+    }
+
+    /* the line has to stop between two levels, not inside one */
+    if (count < p_schema->count
+            && (count == 0 || p_fields[count].level == 0
+                || p_fields[count].level == p_fields[count - 1].level)
+    ) {
+        return -1;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        const ATTokField *p_field = &p_tok->fields[i];
+        void *p_member = (char *) p_out + p_fields[i].offset;
+        int value;
+        int err;
+
+        if (p_fields[i].type == AT_SCHEMA_SKIP) {
+            continue;
+        }
+
+        if (p_fields[i].type == AT_SCHEMA_STR) {
+            char *s = (char *) p_field->p;
+
+            s[p_field->len] = '\0';
+            *(char **) p_member = s;
+            continue;
+        }
+
+        /* an empty optional number keeps its default */
+        if (p_field->len == 0 && p_fields[i].level > 0) {
+            continue;
+        }
+
+        if (p_fields[i].type == AT_SCHEMA_HEX) {
+            err = at_tok_field_hexint(p_tok, i, &value);
+        } else {
+            err = at_tok_field_int(p_tok, i, &value);
+        }
+
+        if (err < 0) {
+            return -1;
+        }
+
+        if (p_fields[i].type == AT_SCHEMA_BOOL && value != 0 && value != 1) {
+            return -1;
+        }
+
+        *(int *) p_member = value;
+    }
+
+    return count;
+}
+
+int at_schema_parse(const ATSchema *p_schema, char *line, void *p_out)
+{
+    ATTokLine tok;
+
+    if (at_tok_split(line, &tok) < 0) {
+        return -1;
+    }
+
+    return fillFields(p_schema, &tok, p_out);
+}
+
+int at_schema_parse_fields(const ATSchema *p_schema, char *fields,
+                            void *p_out)
+{
+    ATTokLine tok;
+
+    at_tok_split_fields(fields, &tok);
+
+    return fillFields(p_schema, &tok, p_out);
+}
+
+int at_schema_parse_list(const ATSchema *p_schema, char *line,
+                            void *p_out, size_t stride, int max)
+{
+    char *p = strchr(line, ':');
+    char *entry;
+    int count = 0;
+
+    if (p == NULL) {
+        return -1;
+    }
+    p++;
+
+    while (count < max) {
+        while (*p == ' ') p++;
+
+        /* ",," ends the entries, the supported modes follow */
+        if (*p != '(') {
+            break;
+        }
+
+        /* names like "Vodafone (UK)" may have parentheses in quotes */
+        entry = ++p;
+        while (*p != '\0' && *p != ')') {
+            if (*p++ == '"') {
+                while (*p != '\0' && *p != '"') p++;
+                if (*p == '"') p++;
+            }
+        }
+
+        if (*p == '\0') {
+            return -1;
+        }
+        *p++ = '\0';
+
+        if (at_schema_parse_fields(p_schema, entry,
+                    (char *) p_out + count * stride) < 0) {
+            return -1;
+        }
+        count++;
+
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * solicited lines are "<n>,<stat>..." as the RIL asks for them,
+ * unsolicited ones "<stat>..."
+ */
+int at_schema_parse_reg(char *line, int unsolicited, ATReg *p_out)
+{
+    ATTokLine tok;
+    int count;
+
+    if (at_tok_split(line, &tok) < 0) {
+        return -1;
+    }
+
+    if (unsolicited) {
+        return fillFields(&at_schema_reg_unsol, &tok, p_out);
+    }
+
+    count = fillFields(&at_schema_reg, &tok, p_out);
+
+    return count < 0 ? -1 : count - 1;
+}
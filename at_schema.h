@@ -0,0 +1,198 @@
+/* //device/system/reference-ril/at_schema.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_SCHEMA_H
+#define AT_SCHEMA_H 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Table driven response parsers. A schema lists the fields of a response
+ * line in order, each with its type and the member of a struct it goes
+ * to; at_schema_parse() splits the line once with at_tok_split() and
+ * fills the struct from the table.
+ *
+ * Optional trailing fields are nested by level, as in the 27.007
+ * syntax "<n>,<stat>[,<lac>,<ci>[,<AcT>]]" = levels 0,0,1,1,2. A line
+ * must end on a level boundary, and members of fields it doesn't have
+ * are left as the caller initialized them. Fields past the end of the
+ * schema are ignored.
+ *
+ * STR fields are \0 terminated in place, like at_tok_nextstr(), so the
+ * line must be writable and outlive the struct.
+ */
+
+typedef enum {
+    AT_SCHEMA_INT,      /* int, decimal */
+    AT_SCHEMA_HEX,      /* int, hex with or without quotes */
+    AT_SCHEMA_BOOL,     /* int, 0 or 1 */
+    AT_SCHEMA_STR,      /* char *, quotes removed */
+    AT_SCHEMA_SKIP      /* counted but not stored */
+} ATSchemaType;
+
+typedef struct {
+    unsigned char type;     /* ATSchemaType */
+    unsigned char level;
+    unsigned short offset;
+} ATSchemaField;
+
+typedef struct {
+    const char *name;
+    const ATSchemaField *fields;
+    int count;
+} ATSchema;
+
+#define AT_FIELD(type, st, member, level) \
+    { AT_SCHEMA_##type, level, offsetof(st, member) }
+#define AT_FIELD_SKIP(level) \
+    { AT_SCHEMA_SKIP, level, 0 }
+#define AT_SCHEMA_DEFINE(name, fields) \
+    const ATSchema name = { #name, fields, sizeof(fields)/sizeof(fields[0]) }
+
+/*
+ * parses a "+PREFIX: fields" line into *p_out
+ * returns the number of fields filled in, or -1 if the line doesn't
+ * match the schema
+ */
+int at_schema_parse(const ATSchema *p_schema, char *line, void *p_out);
+
+/* the same for fields without a "prefix:" */
+int at_schema_parse_fields(const ATSchema *p_schema, char *fields,
+                            void *p_out);
+
+/*
+ * parses a list of parenthesized entries like "+COPS: (...),(...),,(...)"
+ * into an array of at most max structs, stride bytes apart, stopping at
+ * an empty entry. returns the number of entries, or -1 if one of them
+ * doesn't match the schema
+ */
+int at_schema_parse_list(const ATSchema *p_schema, char *line,
+                            void *p_out, size_t stride, int max);
+
+/* 27.007 responses the RIL parses */
+
+/* +CLCC: <id>,<dir>,<stat>,<mode>,<mpty>[,<number>,<type>[,<alpha>]] */
+typedef struct {
+    int index;
+    int isMT;
+    int state;
+    int mode;
+    int isMpty;
+    char *number;
+    int toa;
+    char *alpha;
+} ATClcc;
+
+extern const ATSchema at_schema_clcc;
+
+/*
+ * +CREG/+CGREG: the solicited form has <n> before <stat>, the
+ * unsolicited one doesn't, see at_schema_parse_reg()
+ */
+typedef struct {
+    int n;
+    int stat;
+    int lac;
+    int ci;
+    int act;
+} ATReg;
+
+extern const ATSchema at_schema_reg;            /* <n>,<stat>[,<lac>,<ci>[,<AcT>]] */
+extern const ATSchema at_schema_reg_unsol;      /* <stat>[,<lac>,<ci>[,<AcT>]] */
+
+/*
+ * either form of +CREG/+CGREG, as the caller says the line came: the
+ * answer to a query, or an unsolicited report. The field count can't
+ * tell them apart, eg "+CREG: 2,1" is both.
+ * returns the number of fields after <n> (which is left alone for an
+ * unsolicited line), or -1
+ */
+int at_schema_parse_reg(char *line, int unsolicited, ATReg *p_out);
+
+/* +COPS?: <mode>[,<format>,<oper>[,<AcT>]] */
+typedef struct {
+    int mode;
+    int format;
+    char *oper;
+    int act;
+} ATCops;
+
+extern const ATSchema at_schema_cops;
+
+/* +COPS=? entry: (<stat>,<long>,<short>,<numeric>[,<AcT>]) */
+typedef struct {
+    int stat;
+    char *longName;
+    char *shortName;
+    char *numeric;
+    int act;
+} ATCopsEntry;
+
+extern const ATSchema at_schema_cops_entry;
+
+/* +CGACT?: <cid>,<state> */
+typedef struct {
+    int cid;
+    int state;
+} ATCgact;
+
+extern const ATSchema at_schema_cgact;
+
+/* +CGDCONT?: <cid>,<type>,<apn>,<addr>[,<d_comp>,<h_comp>] */
+typedef struct {
+    int cid;
+    char *type;
+    char *apn;
+    char *address;
+    int dComp;
+    int hComp;
+} ATCgdcont;
+
+extern const ATSchema at_schema_cgdcont;
+
+/*
+ * +CCFC: <status>,<class>[,<number>[,<type>[,<subaddr>[,<satype>[,<time>]]]]]
+ * as modems cut the line short anywhere after <class>
+ */
+typedef struct {
+    int status;
+    int serviceClass;
+    char *number;
+    int toa;
+    int time;
+} ATCcfc;
+
+extern const ATSchema at_schema_ccfc;
+
+/* +CRSM: <sw1>,<sw2>[,<response>] */
+typedef struct {
+    int sw1;
+    int sw2;
+    char *response;
+} ATCrsm;
+
+extern const ATSchema at_schema_crsm;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*AT_SCHEMA_H*/
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 
 /**
  * Starts tokenizing an AT response string
@@ -45,11 +46,14 @@ int at_tok_start(char **p_cur)
     return 0;
 }
 
+/* isspace() without the locale lookup */
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
 static void skipWhiteSpace(char **p_cur)
 {
     if (*p_cur == NULL) return;
 
-    while (**p_cur != '\0' && isspace(**p_cur)) {
+    while (IS_SPACE(**p_cur)) {
         (*p_cur)++;
     }
 }
@@ -67,6 +71,24 @@ static void skipNextComma(char **p_cur)
     }    
 }
 
+/** strsep() with a single delimiter, without the strcspn() call */
+static char *splitAt(char **p_cur, char delim)
+{
+    char *ret = *p_cur;
+    char *p = ret;
+
+    while (*p != '\0' && *p != delim) p++;
+
+    if (*p == '\0') {
+        *p_cur = NULL;
+    } else {
+        *p = '\0';
+        *p_cur = p + 1;
+    }
+
+    return ret;
+}
+
 static char * nextTok(char **p_cur)
 {
     char *ret = NULL;
@@ -77,24 +99,147 @@ static char * nextTok(char **p_cur)
         ret = NULL;
     } else if (**p_cur == '"') {
         (*p_cur)++;
-        ret = strsep(p_cur, "\"");
+        ret = splitAt(p_cur, '"');
         skipNextComma(p_cur);
     } else {
-        ret = strsep(p_cur, ",");
+        ret = splitAt(p_cur, ',');
     }
 
     return ret;
 }
 
 
+/* for the strings of unknown length that at_tok_next* parse */
+#define UNBOUNDED ((size_t) -1)
+
+/**
+ * Parses a decimal integer from at most len bytes at s, the way strtol
+ * does for AT responses: leading space and a sign are accepted and
+ * parsing stops at the first non-digit, so a \0 terminated string can
+ * be given with len UNBOUNDED. Values outside the int range saturate
+ * to INT_MIN/INT_MAX, as strtol does with a 32 bit long. *p_used, if
+ * not NULL, is set to the bytes parsed
+ * returns 0 on success and -1 if there are no digits
+ */
+static int parseDecimal(const char *s, size_t len, int *p_out,
+                            size_t *p_used)
+{
+    unsigned int value = 0;
+    unsigned int limit = INT_MAX;
+    int overflow = 0;
+    size_t i = 0;
+    size_t digits;
+
+    while (i < len && IS_SPACE(s[i])) i++;
+
+    if (i < len && (s[i] == '-' || s[i] == '+')) {
+        if (s[i] == '-') {
+            limit = (unsigned int) INT_MAX + 1;
+        }
+        i++;
+    }
+
+    for (digits = i ; i < len ; i++) {
+        unsigned int d = (unsigned char) s[i] - '0';
+
+        if (d > 9) break;
+
+        /* no value below this can overflow with one more digit */
+        if (value < (unsigned int) INT_MAX / 10) {
+            value = value * 10 + d;
+        } else if (value > (limit - d) / 10) {
+            overflow = 1;
+        } else {
+            value = value * 10 + d;
+        }
+    }
+
+    if (i == digits) {
+        return -1;
+    }
+
+    if (overflow) {
+        value = limit;
+    }
+
+    if (p_used != NULL) {
+        *p_used = i;
+    }
+
+    *p_out = limit == INT_MAX ? (int) value : (int) (0u - value);
+
+    return 0;
+}
+
+/**
+ * As parseDecimal(), for hex with an optional 0x prefix, the way strtoul
+ * parses it: the value is unsigned 32 bit, so "FFFFFFFF" is -1, and
+ * saturates to 0xFFFFFFFF beyond that. A '-' negates the value
+ */
+static int parseHex(const char *s, size_t len, int *p_out, size_t *p_used)
+{
+    unsigned int value = 0;
+    int negative = 0;
+    int overflow = 0;
+    size_t i = 0;
+    size_t digits;
+
+    while (i < len && IS_SPACE(s[i])) i++;
+
+    if (i < len && (s[i] == '-' || s[i] == '+')) {
+        negative = s[i] == '-';
+        i++;
+    }
+
+    if (len - i > 2 && s[i] == '0' && (s[i + 1] | 0x20) == 'x'
+        && isxdigit((unsigned char) s[i + 2])
+    ) {
+        i += 2;
+    }
+
+    for (digits = i ; i < len ; i++) {
+        unsigned int d = (unsigned char) s[i] - '0';
+
+        if (d > 9) {
+            d = ((unsigned char) s[i] | 0x20) - 'a';
+            if (d > 5) break;
+            d += 10;
+        }
+
+        if (value >> 28 != 0) {
+            overflow = 1;
+        } else {
+            value = value << 4 | d;
+        }
+    }
+
+    if (i == digits) {
+        return -1;
+    }
+
+    if (overflow) {
+        value = UINT_MAX;
+    } else if (negative) {
+        value = 0u - value;
+    }
+
+    if (p_used != NULL) {
+        *p_used = i;
+    }
+
+    *p_out = (int) value;
+
+    return 0;
+}
+
 /**
  * Parses the next integer in the AT response line and places it in *p_out
  * returns 0 on success and -1 on fail
  * updates *p_cur
- * "base" is the same as the base param in strtol
+ * "base" is 10 (signed) or 16 (unsigned)
  */
 
-static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
+static int at_tok_nextint_base(char **p_cur, int *p_out, int base)
 {
     char *ret;
     
@@ -106,23 +251,13 @@ static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
 
     if (ret == NULL) {
         return -1;
-    } else {
-        long l;
-        char *end;
-
-        if (uns)
-            l = strtoul(ret, &end, base);
-        else
-            l = strtol(ret, &end, base);
-
-        *p_out = (int)l;
+    }
 
-        if (end == ret) {
-            return -1;
-        }
+    if (base == 16) {
+        return parseHex(ret, UNBOUNDED, p_out, NULL);
     }
 
-    return 0;
+    return parseDecimal(ret, UNBOUNDED, p_out, NULL);
 }
 
 /**
@@ -133,7 +268,7 @@ static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
  */
 int at_tok_nextint(char **p_cur, int *p_out)
 {
-    return at_tok_nextint_base(p_cur, p_out, 10, 0);
+    return at_tok_nextint_base(p_cur, p_out, 10);
 }
 
 /**
@@ -144,7 +279,7 @@ int at_tok_nextint(char **p_cur, int *p_out)
  */
 int at_tok_nexthexint(char **p_cur, int *p_out)
 {
-    return at_tok_nextint_base(p_cur, p_out, 16, 1);
+    return at_tok_nextint_base(p_cur, p_out, 16);
 }
 
 int at_tok_nextbool(char **p_cur, char *p_out)
@@ -188,3 +323,160 @@ int at_tok_hasmore(char **p_cur)
 }
 
 
+
+/**
+ * Splits the fields after the first ':' of line into *p_tok, with the
+ * same rules as the at_tok_next* functions but without modifying line
+ * returns the number of fields, or -1 if there is no ':'
+ */
+int at_tok_split(const char *line, ATTokLine *p_tok)
+{
+    const char *p;
+
+    p_tok->count = 0;
+
+    if (line == NULL || (p = strchr(line, ':')) == NULL) {
+        return -1;
+    }
+
+    return at_tok_split_fields(p + 1, p_tok);
+}
+
+/** as at_tok_split(), for a string of fields without a prefix */
+int at_tok_split_fields(const char *p, ATTokLine *p_tok)
+{
+    p_tok->count = 0;
+
+    while (*p != '\0' && p_tok->count < AT_TOK_MAX_FIELDS) {
+        ATTokField *p_field = &p_tok->fields[p_tok->count++];
+
+        while (IS_SPACE(*p)) p++;
+
+        /* fields are short, a byte loop beats strchr() here */
+        if (*p == '"') {
+            p_field->p = ++p;
+            while (*p != '\0' && *p != '"') p++;
+            p_field->len = p - p_field->p;
+            p_field->quoted = 1;
+
+            /* anything between the closing quote and the comma is ignored */
+            while (*p != '\0' && *p != ',') p++;
+        } else {
+            p_field->p = p;
+            while (*p != '\0' && *p != ',') p++;
+            p_field->len = p - p_field->p;
+            p_field->quoted = 0;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+        p++;
+
+        if (*p == '\0' && p_tok->count < AT_TOK_MAX_FIELDS) {
+            /* a trailing comma leaves an empty last field */
+            p_field = &p_tok->fields[p_tok->count++];
+            p_field->p = p;
+            p_field->len = 0;
+            p_field->quoted = 0;
+        }
+    }
+
+    return p_tok->count;
+}
+
+/** returns 1 if the len bytes at s are all space */
+static int isBlank(const char *s, size_t len)
+{
+    while (len > 0 && IS_SPACE(*s)) {
+        s++;
+        len--;
+    }
+
+    return len == 0;
+}
+
+/**
+ * Unlike at_tok_nextint(), the number has to fill its field, and a
+ * quoted field is a string, eg the "<lac>" of a +CREG report, not an int
+ */
+int at_tok_field_int(const ATTokLine *p_tok, int i, int *p_out)
+{
+    const ATTokField *p_field;
+    size_t used;
+
+    if (i < 0 || i >= p_tok->count || p_tok->fields[i].quoted) {
+        return -1;
+    }
+
+    p_field = &p_tok->fields[i];
+
+    if (parseDecimal(p_field->p, p_field->len, p_out, &used) < 0
+            || !isBlank(p_field->p + used, p_field->len - used)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/** as at_tok_field_int(), but quoted is fine: 27.007 quotes hex values */
+int at_tok_field_hexint(const ATTokLine *p_tok, int i, int *p_out)
+{
+    const ATTokField *p_field;
+    size_t used;
+
+    if (i < 0 || i >= p_tok->count) {
+        return -1;
+    }
+
+    p_field = &p_tok->fields[i];
+
+    if (parseHex(p_field->p, p_field->len, p_out, &used) < 0
+            || !isBlank(p_field->p + used, p_field->len - used)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/** *pp_out points into the line, and is not \0 terminated */
+int at_tok_field_str(const ATTokLine *p_tok, int i,
+                        const char **pp_out, size_t *p_len)
+{
+    if (i < 0 || i >= p_tok->count) {
+        return -1;
+    }
+
+    *pp_out = p_tok->fields[i].p;
+    *p_len = p_tok->fields[i].len;
+
+    return 0;
+}
+
+int at_tok_field_strcpy(const ATTokLine *p_tok, int i,
+                        char *out, size_t size)
+{
+    if (i < 0 || i >= p_tok->count || p_tok->fields[i].len >= size) {
+        return -1;
+    }
+
+    memcpy(out, p_tok->fields[i].p, p_tok->fields[i].len);
+    out[p_tok->fields[i].len] = '\0';
+
+    return 0;
+}
+
+int at_tok_field_present(const ATTokLine *p_tok, int i)
+{
+    return i >= 0 && i < p_tok->count && p_tok->fields[i].len > 0;
+}
+
+int at_tok_field_optint(const ATTokLine *p_tok, int i, int *p_out, int def)
+{
+    if (!at_tok_field_present(p_tok, i)) {
+        *p_out = def;
+        return 0;
+    }
+
+    return at_tok_field_int(p_tok, i, p_out);
+}
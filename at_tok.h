@@ -27,4 +27,49 @@ int at_tok_nextstr(char **p_cur, char **out);
 
 int at_tok_hasmore(char **p_cur);
 
+/*
+ * Span tokenizer: splits the part of a line after the "prefix:" into
+ * comma separated fields in one pass, without writing to the line.
+ * Quoted fields are given without their quotes. Fields past
+ * AT_TOK_MAX_FIELDS are ignored
+ */
+
+#include <stddef.h>
+
+#define AT_TOK_MAX_FIELDS 24
+
+typedef struct {
+    const char *p;      /* not \0 terminated */
+    size_t len;
+    int quoted;
+} ATTokField;
+
+typedef struct {
+    int count;
+    ATTokField fields[AT_TOK_MAX_FIELDS];
+} ATTokLine;
+
+/* returns the number of fields, or -1 if there is no ':' */
+int at_tok_split(const char *line, ATTokLine *p_tok);
+/* the same for fields without a "prefix:", eg inside parentheses */
+int at_tok_split_fields(const char *fields, ATTokLine *p_tok);
+
+/*
+ * these return 0 on success, -1 if field i is missing or malformed:
+ * a number must fill its field, and an int can't be quoted
+ */
+int at_tok_field_int(const ATTokLine *p_tok, int i, int *p_out);
+int at_tok_field_hexint(const ATTokLine *p_tok, int i, int *p_out);
+int at_tok_field_str(const ATTokLine *p_tok, int i,
+                        const char **pp_out, size_t *p_len);
+/* copies field i to out as a \0 terminated string, -1 if it won't fit */
+int at_tok_field_strcpy(const ATTokLine *p_tok, int i,
+                        char *out, size_t size);
+
+/* optional fields: 1 if field i is there and not empty */
+int at_tok_field_present(const ATTokLine *p_tok, int i);
+/* *p_out = def if field i is absent or empty, -1 if it is malformed */
+int at_tok_field_optint(const ATTokLine *p_tok, int i, int *p_out,
+                        int def);
+
 #endif /*AT_TOK_H */
@@ -0,0 +1,199 @@
+/* //device/system/reference-ril/at_tok_bench.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Tokenizer microbenchmark over response lines captured from E1550 and
+ * E173 sticks. Each line is parsed field by field the way the RIL does,
+ * with strtol (the old at_tok), with at_tok_next* and with
+ * at_tok_split(), and the time per line is reported
+ *
+ * usage: at_tok_bench [iterations, default 1000000]
+ */
+
+#include "at_tok.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * fields: i decimal, x hex, s string. The RIL copies a line before
+ * tokenizing it with at_tok_next*, so the benchmark does too
+ */
+static const struct {
+    const char *line;
+    const char *fields;
+} s_lines[] = {
+    { "+CLCC: 1,0,0,0,0,\"+491701234567\",145",             "iiiiisi" },
+    { "+CLCC: 2,1,5,0,0,\"03012345678\",129",               "iiiiisi" },
+    { "+CREG: 2,1,\"0F3C\",\"0099B2A1\",2",                 "iixxi" },
+    { "+CGREG: 2,1,\"0F3C\",\"01D2B2A1\",2",                "iixxi" },
+    { "+CREG: 1,\"0F3C\",\"0099B2A1\"",                     "ixx" },
+    { "+CSQ: 17,99",                                        "ii" },
+    { "^RSSI:14",                                           "i" },
+    { "+CGACT: 1,1",                                        "ii" },
+    { "+COPS: 0,2,\"26202\",2",                             "iisi" },
+    { "+CGDCONT: 1,\"IP\",\"web.vodafone.de\",\"0.0.0.0\",0,0",
+                                                            "isssii" },
+    { "^DSFLOWRPT:0000003C,00000F3A,00000D2E,000000000004A0F2,"
+      "00000000001B21C4,0003E800,0003E800",                 "xxxxxxx" },
+    { "^MODE:5,4",                                          "ii" },
+    { "+CMTI: \"SM\",12",                                   "si" },
+    { "+CRSM: 144,0,\"98941000103132F4F9\"",                "iis" },
+};
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static volatile int s_sink;
+
+static long long nowNsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the tokenizer before the span parser, for comparison */
+static char *strtolNextTok(char **p_cur)
+{
+    char *ret;
+
+    while (**p_cur == ' ') (*p_cur)++;
+
+    if (**p_cur == '"') {
+        (*p_cur)++;
+        ret = strsep(p_cur, "\"");
+        if (*p_cur != NULL) {
+            while (**p_cur != '\0' && **p_cur != ',') (*p_cur)++;
+            if (**p_cur == ',') (*p_cur)++;
+        }
+    } else {
+        ret = strsep(p_cur, ",");
+    }
+
+    return ret;
+}
+
+static void parseStrtol(char *line, const char *fields)
+{
+    char *cur = strchr(line, ':') + 1;
+    char *tok;
+    char *end;
+
+    for ( ; *fields != '\0' && cur != NULL ; fields++) {
+        tok = strtolNextTok(&cur);
+
+        if (*fields == 'i') {
+            s_sink += (int) strtol(tok, &end, 10);
+        } else if (*fields == 'x') {
+            s_sink += (int) strtoul(tok, &end, 16);
+        } else {
+            s_sink += tok[0];
+        }
+    }
+}
+
+static void parseNext(char *line, const char *fields)
+{
+    char *cur = line;
+    char *str;
+    int value;
+
+    at_tok_start(&cur);
+
+    for ( ; *fields != '\0' ; fields++) {
+        if (*fields == 'i') {
+            at_tok_nextint(&cur, &value);
+        } else if (*fields == 'x') {
+            at_tok_nexthexint(&cur, &value);
+        } else {
+            at_tok_nextstr(&cur, &str);
+            value = str[0];
+        }
+        s_sink += value;
+    }
+}
+
+static void parseSpan(const char *line, const char *fields)
+{
+    ATTokLine tok;
+    const char *str;
+    size_t len;
+    int value;
+    int i;
+
+    at_tok_split(line, &tok);
+
+    for (i = 0 ; fields[i] != '\0' ; i++) {
+        if (fields[i] == 'i') {
+            at_tok_field_int(&tok, i, &value);
+        } else if (fields[i] == 'x') {
+            at_tok_field_hexint(&tok, i, &value);
+        } else {
+            at_tok_field_str(&tok, i, &str, &len);
+            value = str[0];
+        }
+        s_sink += value;
+    }
+}
+
+int main (int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    char copy[256];
+    long long start, strtolNsec, nextNsec, spanNsec;
+    size_t l;
+    long n;
+
+    printf("%-28.28s %10s %10s %10s  (ns/line)\n",
+            "line", "strtol", "next", "split");
+
+    for (l = 0 ; l < NUM_ELEMS(s_lines) ; l++) {
+        const char *line = s_lines[l].line;
+        const char *fields = s_lines[l].fields;
+
+        start = nowNsec();
+        for (n = 0 ; n < iterations ; n++) {
+            strcpy(copy, line);
+            parseStrtol(copy, fields);
+        }
+        strtolNsec = nowNsec() - start;
+
+        start = nowNsec();
+        for (n = 0 ; n < iterations ; n++) {
+            strcpy(copy, line);
+            parseNext(copy, fields);
+        }
+        nextNsec = nowNsec() - start;
+
+        start = nowNsec();
+        for (n = 0 ; n < iterations ; n++) {
+            parseSpan(line, fields);
+        }
+        spanNsec = nowNsec() - start;
+
+        printf("%-28.28s %10.1f %10.1f %10.1f\n", line,
+                (double) strtolNsec / iterations,
+                (double) nextNsec / iterations,
+                (double) spanNsec / iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,406 @@
+/* //device/system/reference-ril/at_trace.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "at_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOG_TAG "AT"
+#include <utils/Log.h>
+
+/* backwards compatibility for pre-JB */
+#ifndef ALOGI
+#define ALOGI LOGI
+#endif
+
+typedef struct {
+    volatile unsigned int seq;  /* index + 1 once written, 0 while not */
+    unsigned int category;
+    unsigned int len;           /* of the data traced, may be more
+                                   than was kept */
+    int phase;                  /* AT_SPAN_*, 0 for other records */
+    const char *label;
+    const void *key;
+    long long track;
+    long long nsec;
+    char data[AT_TRACE_DATA];
+} ATTraceEntry;
+
+/*
+ * A thread's ring. Only its thread writes it; rings are never freed,
+ * the ring of a thread that exits goes to the next new thread
+ */
+typedef struct ATTraceRing {
+    struct ATTraceRing *p_next;
+    volatile int inUse;
+    int id;                     /* shown in the dump */
+    unsigned int head;          /* records written */
+    long long track;            /* see at_trace_set_track() */
+    ATTraceEntry entries[AT_TRACE_RING_SIZE];
+} ATTraceRing;
+
+volatile unsigned int at_trace_mask = AT_TRACE_ALL;
+
+static ATTraceRing * volatile s_rings;
+static volatile int s_ringCount;
+static pthread_key_t s_ringKey;
+static pthread_once_t s_ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static void releaseRing(void *p_ring)
+{
+    ((ATTraceRing *) p_ring)->inUse = 0;
+}
+
+static void createRingKey()
+{
+    pthread_key_create(&s_ringKey, releaseRing);
+}
+
+/** returns the calling thread's ring, NULL if it can't have one */
+static ATTraceRing *getRing()
+{
+    ATTraceRing *p_ring;
+
+    pthread_once(&s_ringKeyOnce, createRingKey);
+
+    p_ring = (ATTraceRing *) pthread_getspecific(s_ringKey);
+    if (p_ring != NULL) {
+        return p_ring;
+    }
+
+    for (p_ring = s_rings ; p_ring != NULL ; p_ring = p_ring->p_next) {
+        if (__sync_bool_compare_and_swap(&p_ring->inUse, 0, 1)) {
+            break;
+        }
+    }
+
+    if (p_ring == NULL) {
+        p_ring = (ATTraceRing *) calloc(1, sizeof(ATTraceRing));
+        if (p_ring == NULL) {
+            return NULL;
+        }
+
+        p_ring->inUse = 1;
+        p_ring->id = __sync_fetch_and_add(&s_ringCount, 1);
+
+        do {
+            p_ring->p_next = s_rings;
+        } while (!__sync_bool_compare_and_swap(&s_rings, p_ring->p_next,
+                                                p_ring));
+    }
+
+    pthread_setspecific(s_ringKey, p_ring);
+
+    return p_ring;
+}
+
+static void record(unsigned int category, int phase, long long track,
+                    const void *key, const char *label,
+                    const void *data, size_t len)
+{
+    ATTraceRing *p_ring = getRing();
+    ATTraceEntry *p_entry;
+    struct timespec ts;
+
+    if (p_ring == NULL) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    p_entry = &p_ring->entries[p_ring->head & (AT_TRACE_RING_SIZE - 1)];
+
+    /* the dumper skips the entry while it's rewritten */
+    p_entry->seq = 0;
+    __sync_synchronize();
+
+    p_entry->category = category;
+    p_entry->phase = phase;
+    p_entry->label = label;
+    p_entry->key = key;
+    p_entry->track = track;
+    p_entry->len = len;
+    p_entry->nsec = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (len > 0) {
+        memcpy(p_entry->data, data,
+                len < AT_TRACE_DATA ? len : AT_TRACE_DATA);
+    }
+
+    __sync_synchronize();
+    p_entry->seq = ++p_ring->head;
+}
+
+void at_trace_record(unsigned int category, const char *label,
+                        const void *data, size_t len)
+{
+    record(category, 0, 0, NULL, label, data, len);
+}
+
+void at_trace_span(int phase, long long track, const void *key,
+                    const char *label, const void *data, size_t len)
+{
+    record(AT_TRACE_SPANS, phase, track, key, label, data, len);
+}
+
+void at_trace_set_track(long long track)
+{
+    ATTraceRing *p_ring = getRing();
+
+    if (p_ring != NULL) {
+        p_ring->track = track;
+    }
+}
+
+long long at_trace_get_track()
+{
+    ATTraceRing *p_ring = getRing();
+
+    return p_ring != NULL ? p_ring->track : 0;
+}
+
+void at_trace_set_mask(unsigned int mask)
+{
+    at_trace_mask = mask;
+}
+
+/* a record copied out of a ring for the dump */
+typedef struct {
+    ATTraceEntry entry;
+    int ring;
+} ATTraceDumpEntry;
+
+static int compareEntries(const void *a, const void *b)
+{
+    long long na = ((const ATTraceDumpEntry *) a)->entry.nsec;
+    long long nb = ((const ATTraceDumpEntry *) b)->entry.nsec;
+
+    return na < nb ? -1 : na > nb;
+}
+
+/**
+ * Copies out the records of every ring, skipping those being rewritten
+ * as it reads them, sorted by time. returns NULL if there are none
+ */
+static ATTraceDumpEntry *collectEntries(int *p_count)
+{
+    ATTraceDumpEntry *p_entries;
+    ATTraceRing *p_ring;
+    int rings = s_ringCount;
+    int count = 0;
+    int i;
+
+    if (rings == 0) {
+        return NULL;
+    }
+
+    p_entries = (ATTraceDumpEntry *) malloc(
+            sizeof(ATTraceDumpEntry) * rings * AT_TRACE_RING_SIZE);
+    if (p_entries == NULL) {
+        return NULL;
+    }
+
+    for (p_ring = s_rings ; p_ring != NULL ; p_ring = p_ring->p_next) {
+        /* a ring added since rings was read doesn't fit */
+        if (p_ring->id >= rings) {
+            continue;
+        }
+
+        for (i = 0 ; i < AT_TRACE_RING_SIZE ; i++) {
+            const ATTraceEntry *p_entry = &p_ring->entries[i];
+            ATTraceDumpEntry *p_out = &p_entries[count];
+            unsigned int seq = p_entry->seq;
+
+            if (seq == 0) {
+                continue;
+            }
+
+            __sync_synchronize();
+            p_out->entry = *p_entry;
+            __sync_synchronize();
+
+            if (p_entry->seq != seq) {
+                continue;
+            }
+
+            p_out->ring = p_ring->id;
+            count++;
+        }
+    }
+
+    qsort(p_entries, count, sizeof(ATTraceDumpEntry), compareEntries);
+
+    *p_count = count;
+
+    return p_entries;
+}
+
+/** Only this and at_trace_export_json() format anything */
+void at_trace_dump()
+{
+    ATTraceDumpEntry *p_entries;
+    int count = 0;
+    int i;
+
+    p_entries = collectEntries(&count);
+    if (p_entries == NULL) {
+        return;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        const ATTraceEntry *p_entry = &p_entries[i].entry;
+        int len = p_entry->len < AT_TRACE_DATA ? p_entry->len
+                                                : AT_TRACE_DATA;
+
+        if (p_entry->len > AT_TRACE_DATA) {
+            ALOGI("%lld.%06lld T%d %s %.*s... (%u bytes)",
+                    p_entry->nsec / 1000000000LL,
+                    p_entry->nsec % 1000000000LL / 1000, p_entries[i].ring,
+                    p_entry->label, len, p_entry->data, p_entry->len);
+        } else {
+            ALOGI("%lld.%06lld T%d %s %.*s",
+                    p_entry->nsec / 1000000000LL,
+                    p_entry->nsec % 1000000000LL / 1000, p_entries[i].ring,
+                    p_entry->label, len, p_entry->data);
+        }
+    }
+
+    free(p_entries);
+}
+
+/** writes len bytes of s as a JSON string */
+static void writeJsonString(FILE *fp, const char *s, int len)
+{
+    int i;
+
+    fputc('"', fp);
+
+    for (i = 0 ; i < len ; i++) {
+        unsigned char c = (unsigned char) s[i];
+
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < ' ' || c >= 0x7f) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
+
+/** writes the name of the begin record of a span */
+static void writeSpanName(FILE *fp, const ATTraceEntry *p_entry)
+{
+    if (p_entry->len > 0) {
+        writeJsonString(fp, p_entry->data, p_entry->len < AT_TRACE_DATA
+                                            ? p_entry->len : AT_TRACE_DATA);
+    } else {
+        writeJsonString(fp, p_entry->label, strlen(p_entry->label));
+    }
+}
+
+int at_trace_export_json(const char *path)
+{
+    ATTraceDumpEntry *p_entries;
+    const ATTraceEntry **pp_open;
+    int openCount = 0;
+    int count = 0;
+    int first = 1;
+    FILE *fp;
+    int i;
+    int j;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    fputs("{\"traceEvents\":[", fp);
+
+    p_entries = collectEntries(&count);
+
+    /* the spans begun and not yet ended, to name the end records */
+    pp_open = (const ATTraceEntry **) malloc(
+            sizeof(const ATTraceEntry *) * (count > 0 ? count : 1));
+
+    for (i = 0 ; p_entries != NULL && pp_open != NULL && i < count ; i++) {
+        const ATTraceEntry *p_entry = &p_entries[i].entry;
+        const ATTraceEntry *p_begin = NULL;
+
+        if (p_entry->phase == AT_SPAN_END) {
+            for (j = openCount - 1 ; j >= 0 ; j--) {
+                if (pp_open[j]->track == p_entry->track
+                        && pp_open[j]->key == p_entry->key) {
+                    p_begin = pp_open[j];
+                    pp_open[j] = pp_open[--openCount];
+                    break;
+                }
+            }
+
+            /* its begin record was overwritten */
+            if (p_begin == NULL) {
+                continue;
+            }
+        }
+
+        fputs(first ? "\n{\"name\":" : ",\n{\"name\":", fp);
+        first = 0;
+
+        if (p_entry->phase == AT_SPAN_BEGIN) {
+            writeSpanName(fp, p_entry);
+            pp_open[openCount++] = p_entry;
+        } else if (p_entry->phase == AT_SPAN_END) {
+            writeSpanName(fp, p_begin);
+        } else {
+            writeJsonString(fp, p_entry->label, strlen(p_entry->label));
+        }
+
+        fprintf(fp, ",\"ts\":%lld.%03lld,\"pid\":0,\"tid\":%d",
+                p_entry->nsec / 1000, p_entry->nsec % 1000,
+                p_entries[i].ring);
+
+        if (p_entry->phase != 0) {
+            fprintf(fp, ",\"cat\":\"request\",\"ph\":\"%c\","
+                    "\"id\":\"0x%llx\"", p_entry->phase,
+                    (unsigned long long) p_entry->track);
+        } else {
+            fputs(",\"cat\":\"at\",\"ph\":\"i\",\"s\":\"t\"", fp);
+        }
+
+        if (p_entry->phase != AT_SPAN_BEGIN && p_entry->len > 0) {
+            fputs(",\"args\":{\"data\":", fp);
+            writeJsonString(fp, p_entry->data, p_entry->len < AT_TRACE_DATA
+                                            ? p_entry->len : AT_TRACE_DATA);
+            fputc('}', fp);
+        }
+
+        fputc('}', fp);
+    }
+
+    fputs("\n]}\n", fp);
+
+    free(pp_open);
+    free(p_entries);
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
@@ -0,0 +1,109 @@
+/* //device/system/reference-ril/at_trace.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_TRACE_H
+#define AT_TRACE_H 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In-memory trace of the AT traffic, in place of a log line per AT line.
+ * Each thread records into a ring of its own, so recording takes no lock:
+ * a timestamp, a static label, the length and the first AT_TRACE_DATA
+ * bytes. Nothing is formatted until at_trace_dump() logs the rings,
+ * merged by time. A category whose bit isn't in the mask costs a load
+ * and a test
+ */
+
+#define AT_TRACE_RX     0x01    /* lines read from the modem */
+#define AT_TRACE_TX     0x02    /* commands written to the modem */
+#define AT_TRACE_SMS    0x04    /* SMS PDUs, sent and received */
+#define AT_TRACE_SPANS  0x08    /* request and command spans, see below */
+#define AT_TRACE_ALL    0x0f
+
+#define AT_TRACE_DATA 48        /* bytes kept of each record */
+#define AT_TRACE_RING_SIZE 256  /* records kept per thread, a power of 2 */
+
+extern volatile unsigned int at_trace_mask;
+
+#define AT_TRACE(category, label, data, len)                        \
+    do {                                                            \
+        if (at_trace_mask & (category)) {                           \
+            at_trace_record((category), (label), (data), (len));    \
+        }                                                           \
+    } while (0)
+
+/* label must be a string constant, only its pointer is kept */
+void at_trace_record(unsigned int category, const char *label,
+                        const void *data, size_t len);
+
+void at_trace_set_mask(unsigned int mask);
+
+/*
+ * Spans, for timing a RIL request end to end: a track is one request,
+ * and its spans nest, eg the request, then each AT command it sends
+ * from queued to completed with a mark when it's written. A span is
+ * begun and ended with the same track and key; the key only has to be
+ * unique among the spans open on the track. The name of a begin record
+ * is its data if it has any, label otherwise.
+ *
+ * Each thread has a current track, which the spans of the AT commands
+ * it queues go to
+ */
+#define AT_SPAN_BEGIN   'b'
+#define AT_SPAN_END     'e'
+#define AT_SPAN_MARK    'n'
+
+#define AT_TRACE_SPAN(phase, track, key, label, data, len)          \
+    do {                                                            \
+        if (at_trace_mask & AT_TRACE_SPANS) {                       \
+            at_trace_span((phase), (track), (key), (label),         \
+                            (data), (len));                         \
+        }                                                           \
+    } while (0)
+
+/* a blocking step, eg a sleep, of the request of the calling thread */
+#define AT_TRACE_STEP_BEGIN(name) \
+    AT_TRACE_SPAN(AT_SPAN_BEGIN, at_trace_get_track(), (name), (name), NULL, 0)
+#define AT_TRACE_STEP_END(name) \
+    AT_TRACE_SPAN(AT_SPAN_END, at_trace_get_track(), (name), (name), NULL, 0)
+
+void at_trace_span(int phase, long long track, const void *key,
+                    const char *label, const void *data, size_t len);
+
+void at_trace_set_track(long long track);
+long long at_trace_get_track();
+
+/*
+ * Writes the records of every thread to path in the Chrome trace event
+ * format, for chrome://tracing or Perfetto: spans as async events,
+ * other records as instant events. returns 0 on success, -1 on error
+ */
+int at_trace_export_json(const char *path);
+
+/* Logs the records of every thread, oldest first, at info level */
+void at_trace_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*AT_TRACE_H*/
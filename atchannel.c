@@ -17,15 +17,27 @@
 
 #include "atchannel.h"
 #include "at_tok.h"
+#include "at_capture.h"
+#include "at_trace.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef AT_REACTOR
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif /*AT_REACTOR*/
 #include <time.h>
 #include <unistd.h>
 
@@ -47,29 +59,23 @@
 
 #include "misc.h"
 
-#ifdef HAVE_ANDROID_OS
-#define USE_NP 1
-#endif /* HAVE_ANDROID_OS */
-
-
 #define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
 
-#define MAX_AT_RESPONSE (8 * 1024)
+#define MAX_AT_RESPONSE (8 * 1024) /* must be a power of two */
+#define MAX_AT_LINE (1024 * 1024) /* longest line kept, see spillLine() */
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
-
-static pthread_t s_tid_reader;
-static int s_fd = -1;    /* fd of the AT channel */
-static ATUnsolHandler s_unsolHandler;
-
-/* for input buffering */
-
-static char s_ATBuffer[MAX_AT_RESPONSE+1];
-static char *s_ATBufferCur = s_ATBuffer;
-
-static int s_ackPowerIoctl; /* true if TTY has android byte-count
-                                handshake for low power*/
-static int s_readCount = 0;
+#define RESYNC_QUIET_MSEC 500 /* see ATPort.resyncUntil */
+#define UNSOL_QUEUE_SIZE 1024 /* must be a power of two */
+#define UNSOL_QUEUE_RESERVE 256 /* kept free of lines that may be dropped */
+#define MAX_UNBATCHABLE 32
+
+/* an unsolicited line waiting for the dispatch thread */
+typedef struct {
+    char *line;     /* owns the allocation, sms_pdu points into it */
+    char *sms_pdu;
+    ATLineType type;
+} ATUnsolEntry;
 
 #if AT_DEBUG
 void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
@@ -81,40 +87,406 @@ void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
 #endif
 
 /*
- * for current pending command
- * these are protected by s_commandmutex
+ * Commands are queued and written one at a time. The reader writes the
+ * next one as soon as it sees the final response to the one in flight,
+ * so the link does not wait for the thread that queued it to wake up.
+ * The reader also enforces the deadline of the command in flight
+ */
+typedef struct ATCommand {
+    struct ATCommand *p_next;
+    ATCommandType type;
+    const char *responsePrefix;     /* NULL, or in the same allocation */
+    const char *smsPDU;             /* NULL, or in the same allocation */
+    ATCommandPriority priority;
+    long long timeoutMsec;
+    long long queuedNsec;           /* monotonic */
+    long long writtenNsec;          /* monotonic */
+    long long deadline;             /* monotonic nsec, 0 until written */
+    size_t verb;                    /* index into s_verbPolicies */
+    long long track;                /* of the queuing thread, see at_trace.h */
+    ATCommandCallback callback;
+    void *param;
+    int reportTimeout;              /* no caller waits to call onTimeout */
+    int err;                        /* result, once completed */
+    ATResponse *p_response;
+    struct ATCommand *p_followers;  /* identical queries sharing this one */
+    char command[];
+} ATCommand;
+
+/*
+ * Waiting commands are kept in one FIFO per priority class. The highest
+ * class goes first, unless the oldest command of a lower class has waited
+ * longer than its class's aging limit, in which case the command that
+ * has waited longest goes first: call control stays fast under load
+ * without starving a network scan forever
+ */
+
+static const long long s_priorityAgingMsec[AT_PRIORITY_COUNT] = {
+    0,          /* AT_PRIORITY_CALL: never waits behind anything else */
+    2000,       /* AT_PRIORITY_SMS */
+    5000,       /* AT_PRIORITY_STATUS */
+    10000,      /* AT_PRIORITY_BACKGROUND */
+};
+
+static const char *s_priorityNames[AT_PRIORITY_COUNT] = {
+    "call", "sms", "status", "background"
+};
+
+/*
+ * Read-only queries that can share a round trip: a query identical to
+ * one still queued is not sent again, its caller gets a copy of the
+ * same response. A command already written is never joined, its
+ * response may predate the state the new caller asks about.
+ * Only list commands without side effects
+ */
+static const char * const s_coalescible[] = {
+    "AT+CSQ",
+    "AT+CLCC",
+    "AT+CREG?",
+    "AT+CGREG?",
+    "AT+COPS?",
+    "AT+COPS=?",
+    "AT+CGACT?",
+    "AT+CGDCONT?",
+    "AT+CPIN?",
+    "AT+CFUN?",
+    "AT+CIMI",
+    "AT+CGSN",
+    "AT+CNUM",
+};
+
+/*
+ * One AT port of the modem, with its own reader thread, input ring and
+ * command queue. Port 0 is opened by at_open() and is the only one
+ * unsolicited responses are taken from; at_open_port() adds secondary
+ * ports, which take the commands s_verbPolicies routes to them.
+ * The command state is protected by the channel's commandmutex, which
+ * all ports share
+ */
+typedef struct {
+    struct ATChannel *p_channel;
+    int index;
+    int fd;                         /* fd of the AT port, -1 if closed */
+    pthread_t tid_reader;
+    int readerClosed;
+    int initialized;                /* wakeup fds have been set up */
+    int routable;                   /* its init is queued, see routeCommand() */
+
+    /*
+     * for input buffering
+     *
+     * ATBuffer is a ring indexed by free-running counters. Bytes in
+     * [ATHead, ATTail) have been read but not consumed, and there is
+     * no end-of-line in [ATHead, ATScan), so each byte is scanned once
+     * no matter how many reads it takes to complete a line.
+     * The spare byte at the end holds the terminator of a line that ends
+     * exactly at the wrap point; lines that straddle it are copied to ATLine
+     */
+    char ATBuffer[MAX_AT_RESPONSE+1];
+    char ATLine[MAX_AT_RESPONSE+1];
+    unsigned int ATHead;
+    unsigned int ATScan;
+    unsigned int ATTail;
+
+    /*
+     * A line longer than the ring (a big +COPS=? or +CRSM answer) is
+     * moved here piece by piece as the ring fills up. It is freed once
+     * the line has been consumed, so it costs nothing in steady state
+     */
+    char *longLine;
+    size_t longLen;
+    size_t longSize;
+    int longLineReturned;           /* free it on the next nextLine() */
+    int longLineDropping;           /* discarding a line over MAX_AT_LINE */
+
+    /* reader throughput, reported by at_dump_stats() */
+    unsigned long long readerBytes;
+    unsigned long long readerLines;
+    long long readerBusyNsec;       /* time spent outside of read() */
+    long long readerLastReadNsec;
+    unsigned long long readerWakeups; /* returns from poll/epoll */
+    long long readerOpenNsec;
+    unsigned long long readerUnsolDropped; /* secondary ports only */
+
+    /* writer counters, protected by s_commandmutex like the writes */
+    unsigned long long writerCommands;
+    unsigned long long writerSyscalls;
+    unsigned long long writerBytes;
+
+    int ackPowerIoctl;              /* true if TTY has android byte-count
+                                       handshake for low power*/
+    int readCount;
+
+    /*
+     * Waiting commands are kept in one FIFO per priority class, see
+     * dequeueCommand()
+     */
+    ATCommand *pQueueHead[AT_PRIORITY_COUNT];
+    ATCommand *pQueueTail[AT_PRIORITY_COUNT];
+    ATCommand *pCurrent;            /* written, waiting for a final response */
+    unsigned int depth;             /* commands queued or in flight */
+
+    /*
+     * After a timeout the modem may still answer the command it gave up
+     * on. Nothing is written until no final response has arrived for
+     * RESYNC_QUIET_MSEC (monotonic nsec, 0 when not resyncing), and the
+     * late ones are discarded instead of completing the next command
+     */
+    long long resyncUntil;
+    unsigned long long resyncDiscarded;
+
+    /* polled ports: the first line of a two-line SMS unsolicited */
+    char *pendingSMS;
+    ATLineType pendingSMSType;
+
+    /* mirror pCurrent while it is in flight */
+    ATCommandType type;
+    const char *responsePrefix;
+    const char *smsPDU;
+    ATResponse *p_response;
+
+    /* utilisation, reported by at_get_port_stats() */
+    unsigned long long commands;    /* commands completed on this port */
+    long long busyNsec;             /* time with a command in flight */
+
+#ifdef AT_REACTOR
+    /*
+     * Reactor mode: the reader thread owns all I/O on its port. It sleeps
+     * in epoll_wait() on the port, an eventfd that other threads signal
+     * after queueing a command, and a timerfd armed with the deadline of
+     * the command in flight. Other threads never write to the port
+     */
+    int epollFd;
+    int eventFd;
+    int timerFd;
+    int timerArmed;
+    int epollHasChannel;            /* fd has been added to epollFd */
+#else
+    int wakeFds[2];                 /* wakes the reader from poll() */
+#endif /*AT_REACTOR*/
+} ATPort;
+
+#define AT_BUFFER_MASK (MAX_AT_RESPONSE - 1)
+#define AT_BUFFER_AT(p_port, i) ((p_port)->ATBuffer[(i) & AT_BUFFER_MASK])
+
+static void onReaderClosed(ATPort *p_port);
+static int writeCtrlZ (ATPort *p_port, const char *s);
+static int writeline (ATPort *p_port, const char *s);
+static ATResponse * at_response_new();
+static int queueCommand (ATChannel *p_channel, ATPort *p_port,
+                    const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec,
+                    ATCommandCallback callback, void *param);
+static void onCommandComplete(int err, ATResponse *p_response, void *param);
+
+/*
+ * Per-verb policy, keyed by the text after "AT". The longest matching
+ * verb wins; the empty verb at the end is the default.
+ * timeoutMsec is how long a command may wait for its final response, so
+ * a lost final response costs one timeout (and a channel reset by the
+ * RIL) instead of hanging the request thread forever.
+ * priority is the scheduling class the command is queued in.
+ * route is AT_ROUTE_SECONDARY for the long-running and bulk commands
+ * that go to a secondary port when one is open, and AT_ROUTE_PINNED for
+ * those that also depend on state an earlier command set on the port
+ * (+CPBS selects the phonebook +CPBR and +CPBF read), which all go to
+ * the same one, see routeCommand()
  */
+typedef enum {
+    AT_ROUTE_PRIMARY = 0,
+    AT_ROUTE_SECONDARY,
+    AT_ROUTE_PINNED
+} ATPortRoute;
+
+typedef struct {
+    const char *verb;
+    long long timeoutMsec;
+    ATCommandPriority priority;
+    ATPortRoute route;
+} ATVerbPolicy;
+
+#define P AT_ROUTE_PRIMARY
+#define S AT_ROUTE_SECONDARY
+#define F AT_ROUTE_PINNED
+
+static const ATVerbPolicy s_verbPolicies[] = {
+    { "D",           60000, AT_PRIORITY_CALL,       P },
+    { "A",           30000, AT_PRIORITY_CALL,       P },
+    { "H",           30000, AT_PRIORITY_CALL,       P },
+    { "+CHLD",       30000, AT_PRIORITY_CALL,       P },
+    { "+CHUP",       30000, AT_PRIORITY_CALL,       P },
+    { "+CLCC",        5000, AT_PRIORITY_CALL,       P },
+    { "+VTS",         5000, AT_PRIORITY_CALL,       P },
+    { "+CMGS",       60000, AT_PRIORITY_SMS,        P },
+    { "+CMGW",       60000, AT_PRIORITY_SMS,        P },
+    { "+CMGD",       20000, AT_PRIORITY_SMS,        P },
+    { "+CNMA",       20000, AT_PRIORITY_SMS,        P },
+    { "+CSQ",         5000, AT_PRIORITY_STATUS,     P },
+    { "+CREG",        5000, AT_PRIORITY_STATUS,     P },
+    { "+CGREG",       5000, AT_PRIORITY_STATUS,     P },
+    { "+COPS?",       5000, AT_PRIORITY_STATUS,     P },
+    { "+CUSD",       30000, AT_PRIORITY_STATUS,     P },
+    { "+CFUN",       30000, AT_PRIORITY_STATUS,     P },
+    { "+COPS=?",    180000, AT_PRIORITY_BACKGROUND, S }, /* network scan */
+    { "+COPS",       60000, AT_PRIORITY_BACKGROUND, P }, /* registration */
+    { "+CMGL",       60000, AT_PRIORITY_BACKGROUND, S },
+    { "+CPBS",       20000, AT_PRIORITY_BACKGROUND, F }, /* with +CPBR */
+    { "+CPBF",       60000, AT_PRIORITY_BACKGROUND, F },
+    { "+CPBR",       60000, AT_PRIORITY_BACKGROUND, F },
+    { "+CRSM",       30000, AT_PRIORITY_BACKGROUND, S },
+    { "+CGACT",      60000, AT_PRIORITY_BACKGROUND, P },
+    { "+CGATT",      60000, AT_PRIORITY_BACKGROUND, P },
+    { "",            20000, AT_PRIORITY_STATUS,     P },
+};
+
+#undef P
+#undef S
+#undef F
+
+/*
+ * Everything about one modem: its ports, the unsolicited dispatch
+ * thread and the counters. at_open() and the other functions without
+ * a channel argument use s_defaultChannel
+ */
+struct ATChannel {
+    void *param;                    /* see at_channel_get_param() */
+
+    /* protects the command state of every port and the counters below */
+    pthread_mutex_t commandmutex;
+    pthread_cond_t commandcond;
+
+    ATPort ports[AT_MAX_PORTS];
+
+    ATChannelUnsolHandler unsolHandler;
+    void (*onTimeout)(ATChannel *p_channel);
+    void (*onReaderClosed)(ATChannel *p_channel);
+
+    /*
+     * A polled channel has no reader or dispatch thread: the caller's
+     * event loop calls at_channel_poll(), and tid_poll is the thread
+     * doing so while polling is set
+     */
+    int polled;
+    volatile int polling;
+    pthread_t tid_poll;
+
+    /*
+     * Unsolicited lines are handed from the reader thread to a dispatch
+     * thread through a bounded single-producer/single-consumer ring, so
+     * the handler never runs on the reader or under commandmutex.
+     * Only the reader advances unsolTail and only the dispatch thread
+     * advances unsolHead; unsolSem counts the queued entries. A reader
+     * waiting for room sets unsolWaiting and sleeps on unsolSpaceSem.
+     */
+    pthread_t tid_unsol;
+    int unsolStarted;
+    sem_t unsolSem;
+    sem_t unsolSpaceSem;
+    volatile int unsolWaiting;
+    ATUnsolEntry unsolQueue[UNSOL_QUEUE_SIZE];
+    volatile unsigned int unsolHead;
+    volatile unsigned int unsolTail;
+    unsigned int unsolMaxDepth;
+    unsigned long long unsolDispatched;
+    unsigned long long unsolDropped;
+    unsigned long long unsolWaits;
+    int unsolDropping;  /* only the first drop of a burst is logged */
+
+    /* round trips of successful commands */
+    unsigned long long commandRoundTrips;
+    long long commandRoundTripNsec;
+
+    ATCommandClassStats classStats[AT_PRIORITY_COUNT];
+
+    /* round trips saved per s_coalescible entry */
+    unsigned long long coalescedCounts[NUM_ELEMS(s_coalescible)];
+
+    /* timeouts seen per s_verbPolicies entry */
+    unsigned int verbTimeoutCounts[NUM_ELEMS(s_verbPolicies)];
+
+    /*
+     * latency per s_verbPolicies entry, see recordLatency(); only
+     * updated with atomic adds, so reading it takes no lock
+     */
+    ATLatencyStats latency[NUM_ELEMS(s_verbPolicies)];
+
+    /* sent on each secondary port as it opens, see at_channel_set_port_init() */
+    const char * const *portInit;
+    int portInitCount;
+
+    /*
+     * at_channel_send_batch() state: hashes of the commands that failed
+     * in a batch, which are sent alone from then on, and the counters
+     */
+    int batchMaxLine;
+    unsigned int unbatchable[MAX_UNBATCHABLE];
+    int unbatchableCount;
+    unsigned long long batchLines;
+    unsigned long long batchCommands;
+    unsigned long long batchFallbacks;
+
+    /*
+     * Capture of the traffic, see at_channel_set_capture(). The I/O
+     * paths hold captureUsers while they use p_capture, so it can be
+     * swapped out without a lock
+     */
+    ATCapture * volatile p_capture;
+    volatile int captureUsers;
+    int captureId;
+};
 
-static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t s_commandcond = PTHREAD_COND_INITIALIZER;
+static ATChannel s_defaultChannel;
+static pthread_once_t s_defaultChannelOnce = PTHREAD_ONCE_INIT;
 
-static ATCommandType s_type;
-static const char *s_responsePrefix = NULL;
-static const char *s_smsPDU = NULL;
-static ATResponse *sp_response = NULL;
+/*
+ * Commands at_channel_send_batch() never concatenates: resets, which
+ * drop the rest of the line, commands that leave command mode, and
+ * +COPS, which can hold the line for as long as the network takes.
+ * Verbs are matched without the "AT" as in s_verbPolicies
+ */
+static const char * const s_unbatchableVerbs[] = {
+    "Z", "&F", "D", "A", "H", "O", "+CFUN", "+CMGS", "+CMGW", "+COPS",
+};
 
+/* the handlers given to the channel-less API */
+static ATUnsolHandler s_unsolHandler;
 static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
-static int s_readerClosed;
 
-static void onReaderClosed();
-static int writeCtrlZ (const char *s);
-static int writeline (const char *s);
+/** returns the index of the s_verbPolicies entry for command */
+static size_t findVerbPolicy(const char *command)
+{
+    size_t best = NUM_ELEMS(s_verbPolicies) - 1;
+    size_t bestLen = 0;
+    size_t i;
+
+    if (strncasecmp(command, "AT", 2) == 0) {
+        command += 2;
+    }
+
+    for (i = 0 ; i < NUM_ELEMS(s_verbPolicies) ; i++) {
+        size_t len = strlen(s_verbPolicies[i].verb);
+
+        if (len > bestLen
+            && strncasecmp(command, s_verbPolicies[i].verb, len) == 0
+        ) {
+            best = i;
+            bestLen = len;
+        }
+    }
+
+    return best;
+}
 
-#ifndef USE_NP
-static void setTimespecRelative(struct timespec *p_ts, long long msec)
+static long long monotonicNsec()
 {
-    struct timeval tv;
+    struct timespec ts;
 
-    gettimeofday(&tv, (struct timezone *) NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    /* what's really funny about this is that I know
-       pthread_cond_timedwait just turns around and makes this
-       a relative time again */
-    p_ts->tv_sec = tv.tv_sec + (msec / 1000);
-    p_ts->tv_nsec = (tv.tv_usec + (msec % 1000) * 1000L ) * 1000L;
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
-#endif /*USE_NP*/
 
 static void sleepMsec(long long msec)
 {
@@ -131,487 +503,1636 @@ static void sleepMsec(long long msec)
 
 
 
-/** add an intermediate response to sp_response*/
-static void addIntermediate(const char *line)
+/*
+ * Each pending command gets an arena that owns its ATResponse, the
+ * ATLines and the bytes of every line. The first block is allocated
+ * together with the response, so short responses cost one malloc, and
+ * at_response_free() releases everything in one pass over the blocks.
+ */
+
+#define AT_ARENA_BLOCK_SIZE 1024
+#define AT_ARENA_ALIGN 8
+
+typedef struct ATArenaBlock {
+    struct ATArenaBlock *p_next;
+    size_t used;
+    size_t size;
+    char data[];
+} ATArenaBlock;
+
+/* the first block directly follows the ATArena in the same allocation */
+typedef struct {
+    ATResponse response;    /* must be first, see at_response_free() */
+    ATLine *p_last;         /* tail of response.p_intermediates */
+    ATArenaBlock *p_block;  /* block being filled, head of the list */
+} ATArena;
+
+static void *arenaAlloc(ATArena *p_arena, size_t size)
+{
+    ATArenaBlock *p_block = p_arena->p_block;
+    void *ret;
+
+    size = (size + AT_ARENA_ALIGN - 1) & ~(size_t)(AT_ARENA_ALIGN - 1);
+
+    if (p_block->size - p_block->used < size) {
+        size_t blockSize = size > AT_ARENA_BLOCK_SIZE
+                                ? size : AT_ARENA_BLOCK_SIZE;
+
+        p_block = (ATArenaBlock *) malloc(sizeof(ATArenaBlock) + blockSize);
+        p_block->used = 0;
+        p_block->size = blockSize;
+        p_block->p_next = p_arena->p_block;
+        p_arena->p_block = p_block;
+    }
+
+    ret = p_block->data + p_block->used;
+    p_block->used += size;
+
+    return ret;
+}
+
+static char *arenaStrdup(ATArena *p_arena, const char *s)
 {
+    size_t len = strlen(s) + 1;
+
+    return (char *) memcpy(arenaAlloc(p_arena, len), s, len);
+}
+
+/** add an intermediate response to p_response */
+static void appendIntermediate(ATResponse *p_response, const char *line)
+{
+    ATArena *p_arena = (ATArena *) p_response;
     ATLine *p_new;
 
-    p_new = (ATLine  *) malloc(sizeof(ATLine));
+    p_new = (ATLine *) arenaAlloc(p_arena, sizeof(ATLine));
 
-    p_new->line = strdup(line);
+    p_new->line = arenaStrdup(p_arena, line);
+    p_new->p_next = NULL;
 
-    /* note: this adds to the head of the list, so the list
-       will be in reverse order of lines received. the order is flipped
-       again before passing on to the command issuer */
-    p_new->p_next = sp_response->p_intermediates;
-    sp_response->p_intermediates = p_new;
+    /* append, so the list is in the order the lines were received */
+    if (p_arena->p_last == NULL) {
+        p_response->p_intermediates = p_new;
+    } else {
+        p_arena->p_last->p_next = p_new;
+    }
+    p_arena->p_last = p_new;
 }
 
+/** add an intermediate response to p_port->p_response*/
+static void addIntermediate(ATPort *p_port, const char *line)
+{
+    appendIntermediate(p_port->p_response, line);
+}
 
 /**
- * returns 1 if line is a final response indicating error
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * returns a copy of p_response with its own arena, since callers
+ * tokenize the lines in place. NULL is copied as NULL
  */
-static const char * s_finalResponsesError[] = {
-    "ERROR",
-    "+CMS ERROR:",
-    "+CME ERROR:",
-    "NO CARRIER", /* sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
-};
-static int isFinalResponseError(const char *line)
+static ATResponse *cloneResponse(const ATResponse *p_response)
 {
-    size_t i;
+    ATResponse *p_clone;
+    ATLine *p_line;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesError) ; i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return 1;
-        }
+    if (p_response == NULL) {
+        return NULL;
     }
 
-    return 0;
+    p_clone = at_response_new();
+
+    p_clone->success = p_response->success;
+    if (p_response->finalResponse != NULL) {
+        p_clone->finalResponse = arenaStrdup((ATArena *) p_clone,
+                                        p_response->finalResponse);
+    }
+
+    for (p_line = p_response->p_intermediates ; p_line != NULL
+            ; p_line = p_line->p_next
+    ) {
+        appendIntermediate(p_clone, p_line->line);
+    }
+
+    return p_clone;
 }
 
+
 /**
- * returns 1 if line is a final response indicating success
- * See 27.007 annex B
+ * Every final response and unsolicited code we know of, with the
+ * ATLineType it classifies as. The table is compiled into a trie on the
+ * first at_open(), so a line is classified in a single walk over its
+ * prefix; the type then travels with the line to the unsolicited handler.
+ * New unsolicited codes only need an entry here and an ATLineType.
+ * See 27.007 annex B for the final responses
  * WARNING: NO CARRIER and others are sometimes unsolicited
  */
-static const char * s_finalResponsesSuccess[] = {
-    "OK",
-    "CONNECT"       /* some stacks start up data on another channel */
+static const struct {
+    const char *prefix;
+    ATLineType type;
+} s_linePrefixes[] = {
+    { "OK",                 AT_LINE_OK },
+    { "CONNECT",            AT_LINE_CONNECT }, /* some stacks start up data
+                                                  on another channel */
+    { "ERROR",              AT_LINE_ERROR },
+    { "+CMS ERROR:",        AT_LINE_CMS_ERROR },
+    { "+CME ERROR:",        AT_LINE_CME_ERROR },
+    { "NO CARRIER",         AT_LINE_NO_CARRIER }, /* sometimes! */
+    { "NO ANSWER",          AT_LINE_NO_ANSWER },
+    { "NO DIALTONE",        AT_LINE_NO_DIALTONE },
+
+    { "+CMT:",              AT_LINE_CMT },
+    { "+CDS:",              AT_LINE_CDS },
+    { "+CBM:",              AT_LINE_CBM },
+
+    { "%CTZV:",             AT_LINE_CTZV },
+    { "+CTZV:",             AT_LINE_CTZV },
+    { "+CTZDST:",           AT_LINE_CTZDST },
+    { "+HTCCTZV:",          AT_LINE_HTCCTZV },
+    { "+CRING:",            AT_LINE_CRING },
+    { "RING",               AT_LINE_RING },
+    { "+CCWA",              AT_LINE_CCWA },
+    { "^RSSI:",             AT_LINE_RSSI },
+    { "+CREG:",             AT_LINE_CREG },
+    { "+CGREG:",            AT_LINE_CGREG },
+    { "+CGEV:",             AT_LINE_CGEV },
+    { "$HTC_ERIIND:",       AT_LINE_HTC_ERIIND },
+    { "+CUSD:",             AT_LINE_CUSD },
+    { "^BOOT:",             AT_LINE_BOOT },
+    { "^DSFLOWRPT:",        AT_LINE_DSFLOWRPT },
+    { "^MODE:",             AT_LINE_MODE },
 };
-static int isFinalResponseSuccess(const char *line)
+
+#define MAX_TRIE_NODES 256
+
+/* children of a node are a linked list of siblings, except for the
+   first character, which is looked up directly in s_trieRoot */
+typedef struct {
+    char c;
+    unsigned char type;     /* ATLineType of the prefix ending here */
+    short child;            /* index of the first child, or -1 */
+    short sibling;          /* index of the next sibling, or -1 */
+} ATTrieNode;
+
+static ATTrieNode s_trie[MAX_TRIE_NODES];
+static short s_trieRoot[256];
+
+static short newTrieNode(int *p_count, char c)
+{
+    ATTrieNode *p_node;
+
+    if (*p_count == MAX_TRIE_NODES) {
+        ALOGE("Line prefix table does not fit in %d nodes\n", MAX_TRIE_NODES);
+        return -1;
+    }
+
+    p_node = &s_trie[*p_count];
+    p_node->c = c;
+    p_node->type = AT_LINE_OTHER;
+    p_node->child = -1;
+    p_node->sibling = -1;
+
+    return (*p_count)++;
+}
+
+static void buildLineTrie()
 {
+    int count = 0;
     size_t i;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesSuccess) ; i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return 1;
+    memset(s_trieRoot, 0xff, sizeof(s_trieRoot));
+
+    for (i = 0 ; i < NUM_ELEMS(s_linePrefixes) ; i++) {
+        const char *p = s_linePrefixes[i].prefix;
+        short node;
+
+        node = s_trieRoot[(unsigned char) *p];
+        if (node < 0) {
+            node = s_trieRoot[(unsigned char) *p] = newTrieNode(&count, *p);
         }
-    }
 
-    return 0;
+        while (node >= 0 && *++p != '\0') {
+            short child = s_trie[node].child;
+
+            while (child >= 0 && s_trie[child].c != *p) {
+                child = s_trie[child].sibling;
+            }
+
+            if (child < 0) {
+                child = newTrieNode(&count, *p);
+                if (child < 0) break;
+                s_trie[child].sibling = s_trie[node].child;
+                s_trie[node].child = child;
+            }
+
+            node = child;
+        }
+
+        if (node >= 0) {
+            s_trie[node].type = s_linePrefixes[i].type;
+        }
+    }
 }
 
 /**
- * returns 1 if line is a final response, either  error or success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * returns the type of the longest known prefix of line,
+ * or AT_LINE_OTHER if it starts with none of them
  */
-static int isFinalResponse(const char *line)
+static ATLineType classifyLine(const char *line)
+{
+    ATLineType type = AT_LINE_OTHER;
+    short node;
+
+    node = s_trieRoot[(unsigned char) *line];
+
+    while (node >= 0) {
+        if (s_trie[node].type != AT_LINE_OTHER) {
+            type = (ATLineType) s_trie[node].type;
+        }
+
+        if (*++line == '\0') break;
+
+        node = s_trie[node].child;
+        while (node >= 0 && s_trie[node].c != *line) {
+            node = s_trie[node].sibling;
+        }
+    }
+
+    return type;
+}
+
+/** returns 1 if type is a final response indicating success */
+static int isFinalResponseSuccess(ATLineType type)
 {
-    return isFinalResponseSuccess(line) || isFinalResponseError(line);
+    return type == AT_LINE_OK || type == AT_LINE_CONNECT;
 }
 
+/** returns 1 if type is a final response indicating error */
+static int isFinalResponseError(ATLineType type)
+{
+    return type >= AT_LINE_ERROR && type <= AT_LINE_NO_DIALTONE;
+}
 
 /**
- * returns 1 if line is the first line in (what will be) a two-line
+ * returns 1 if type is the first line in (what will be) a two-line
  * SMS unsolicited response
  */
-static const char * s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
-};
-static int isSMSUnsolicited(const char *line)
+static int isSMSUnsolicited(ATLineType type)
 {
-    size_t i;
+    return type >= AT_LINE_CMT && type <= AT_LINE_CBM;
+}
 
-    for (i = 0 ; i < NUM_ELEMS(s_smsUnsoliciteds) ; i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return 1;
-        }
+
+/** lets the reader see a new deadline, command or closed channel */
+static void wakeReader(ATPort *p_port)
+{
+    if (!p_port->initialized
+        || pthread_equal(p_port->tid_reader, pthread_self())) {
+        return;
     }
 
-    return 0;
-}
+#ifdef AT_REACTOR
+    if (p_port->eventFd >= 0) {
+        uint64_t one = 1;
 
+        if (write(p_port->eventFd, &one, sizeof(one)) < 0) {}
+    }
+#else
+    if (p_port->wakeFds[1] >= 0) {
+        /* if the pipe is full the reader is about to wake up anyway */
+        if (write(p_port->wakeFds[1], "", 1) < 0) {}
+    }
+#endif /*AT_REACTOR*/
+}
 
-/** assumes s_commandmutex is held */
-static void handleFinalResponse(const char *line)
+/**
+ * Makes the reader wake up at the monotonic time deadline (nsec), or
+ * not at all for 0. assumes commandmutex is held
+ */
+static void setReaderDeadline(ATPort *p_port, long long deadline)
 {
-    sp_response->finalResponse = strdup(line);
+#ifdef AT_REACTOR
+    struct itimerspec its;
+
+    if (p_port->p_channel->polled) {
+        /* at_channel_poll() returns the timeout instead */
+        if (deadline != 0) {
+            wakeReader(p_port);
+        }
+        return;
+    }
 
-    pthread_cond_signal(&s_commandcond);
+    if (deadline == 0 && !p_port->timerArmed) {
+        return;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000LL;
+    its.it_value.tv_nsec = deadline % 1000000000LL;
+
+    timerfd_settime(p_port->timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+    p_port->timerArmed = deadline != 0;
+#else
+    /* the reader computes its poll() timeout when it wakes up */
+    if (deadline != 0) {
+        wakeReader(p_port);
+    }
+#endif /*AT_REACTOR*/
 }
 
-static void handleUnsolicited(const char *line)
+/** appends p_cmd to the list *pp_list */
+static void appendCommand(ATCommand **pp_list, ATCommand *p_cmd)
 {
-    if (s_unsolHandler != NULL) {
-        s_unsolHandler(line, NULL);
+    while (*pp_list != NULL) {
+        pp_list = &(*pp_list)->p_next;
     }
+
+    p_cmd->p_next = NULL;
+    *pp_list = p_cmd;
 }
 
-static void processLine(const char *line)
+/** returns the ATLatencyStats bucket of a time in nsec */
+static int latencyBucket(long long nsec)
 {
-    pthread_mutex_lock(&s_commandmutex);
-
-    if (sp_response == NULL) {
-        /* no command pending */
-        handleUnsolicited(line);
-    } else if (isFinalResponseSuccess(line)) {
-        sp_response->success = 1;
-        handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
-        sp_response->success = 0;
-        handleFinalResponse(line);
-    } else if (s_smsPDU != NULL && 0 == strcmp(line, "> ")) {
-        // See eg. TS 27.005 4.3
-        // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(s_smsPDU);
-        s_smsPDU = NULL;
-    } else switch (s_type) {
-        case NO_RESULT:
-            handleUnsolicited(line);
-            break;
-        case NUMERIC:
-            if (sp_response->p_intermediates == NULL
-                && isdigit(line[0])
-            ) {
-                addIntermediate(line);
-            } else {
-                /* either we already have an intermediate response or
-                   the line doesn't begin with a digit */
-                handleUnsolicited(line);
-            }
-            break;
-        case SINGLELINE:
-            if (sp_response->p_intermediates == NULL
-                && strStartsWith (line, s_responsePrefix)
-            ) {
-                addIntermediate(line);
-            } else {
-                /* we already have an intermediate response */
-                handleUnsolicited(line);
-            }
-            break;
-        case MULTILINE:
-            if (strStartsWith (line, s_responsePrefix)) {
-                addIntermediate(line);
-            } else {
-                handleUnsolicited(line);
-            }
-        break;
+    unsigned long long usec = nsec > 0 ? nsec / 1000 : 0;
+    int bucket;
 
-        default: /* this should never be reached */
-            ALOGE("Unsupported AT command type %d\n", s_type);
-            handleUnsolicited(line);
-        break;
+    if (usec == 0) {
+        return 0;
     }
 
-    pthread_mutex_unlock(&s_commandmutex);
+    bucket = 64 - __builtin_clzll(usec);
+
+    return bucket < AT_LATENCY_BUCKETS ? bucket : AT_LATENCY_BUCKETS - 1;
 }
 
+/**
+ * Adds a command that was written at writtenNsec and completed at now
+ * to the latency histograms of its verb
+ */
+static void recordLatency(ATChannel *p_channel, const ATCommand *p_cmd,
+                            long long now)
+{
+    ATLatencyStats *p_stats = &p_channel->latency[p_cmd->verb];
+    long long wait = p_cmd->writtenNsec - p_cmd->queuedNsec;
+    long long wire = now - p_cmd->writtenNsec;
+
+    __sync_fetch_and_add(&p_stats->count, 1);
+    __sync_fetch_and_add(&p_stats->waitUsec, wait > 0 ? wait / 1000 : 0);
+    __sync_fetch_and_add(&p_stats->wireUsec, wire > 0 ? wire / 1000 : 0);
+    __sync_fetch_and_add(&p_stats->wait[latencyBucket(wait)], 1);
+    __sync_fetch_and_add(&p_stats->wire[latencyBucket(wire)], 1);
+}
 
 /**
- * Returns a pointer to the end of the next line
- * special-cases the "> " SMS prompt
- *
- * returns NULL if there is no complete line
+ * Finishes the command in flight with err and moves it to *pp_done
+ * assumes commandmutex is held
  */
-static char * findNextEOL(char *cur)
+static void completeCommand(ATPort *p_port, int err, ATCommand **pp_done)
 {
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur+2;
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommand *p_cmd = p_port->pCurrent;
+    long long now = monotonicNsec();
+
+    if (err == 0
+        && (p_cmd->type == SINGLELINE || p_cmd->type == NUMERIC)
+        && p_port->p_response->success > 0
+        && p_port->p_response->p_intermediates == NULL
+    ) {
+        /* successful command must have an intermediate response */
+        err = AT_ERROR_INVALID_RESPONSE;
+    }
+
+    if (err == 0) {
+        p_cmd->p_response = p_port->p_response;
+        p_channel->commandRoundTrips++;
+        p_channel->commandRoundTripNsec += now - p_cmd->writtenNsec;
+    } else {
+        at_response_free(p_port->p_response);
     }
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
+    p_port->commands++;
+    p_port->busyNsec += now - p_cmd->writtenNsec;
+    p_port->depth--;
 
-    return *cur == '\0' ? NULL : cur;
-}
+    recordLatency(p_channel, p_cmd, now);
+
+    p_cmd->err = err;
+    appendCommand(pp_done, p_cmd);
 
+    p_port->pCurrent = NULL;
+    p_port->p_response = NULL;
+    p_port->responsePrefix = NULL;
+    p_port->smsPDU = NULL;
+}
 
 /**
- * Reads a line from the AT channel, returns NULL on timeout.
- * Assumes it has exclusive read access to the FD
- *
- * This line is valid only until the next call to readline
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * Removes and returns the next command to write, or NULL if none is queued
+ * assumes commandmutex is held
  */
-
-static const char *readline()
+static ATCommand *dequeueCommand(ATPort *p_port, long long now)
 {
-    ssize_t count;
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommandClassStats *p_stats;
+    ATCommand *p_cmd;
+    int next = -1;
+    int overdue = -1;
+    int i;
 
-    char *p_read = NULL;
-    char *p_eol = NULL;
-    char *ret;
+    for (i = 0 ; i < AT_PRIORITY_COUNT ; i++) {
+        if (p_port->pQueueHead[i] == NULL) continue;
 
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
+        if (next < 0) {
+            next = i;
+        }
+
+        if (i > 0 && now - p_port->pQueueHead[i]->queuedNsec
+                        > s_priorityAgingMsec[i] * 1000000LL
+            && (overdue < 0 || p_port->pQueueHead[i]->queuedNsec
+                                < p_port->pQueueHead[overdue]->queuedNsec)
+        ) {
+            overdue = i;
+        }
+    }
+
+    if (next < 0) {
+        return NULL;
+    }
 
-        // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
+    if (overdue > next) {
+        p_channel->classStats[overdue].promoted++;
+        next = overdue;
+    }
 
-        p_eol = findNextEOL(s_ATBufferCur);
+    p_cmd = p_port->pQueueHead[next];
+    p_port->pQueueHead[next] = p_cmd->p_next;
+    if (p_port->pQueueHead[next] == NULL) {
+        p_port->pQueueTail[next] = NULL;
+    }
 
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
+    p_stats = &p_channel->classStats[next];
+    p_stats->depth--;
+    p_stats->commands++;
+    p_stats->totalWaitMsec += (now - p_cmd->queuedNsec) / 1000000LL;
+    if ((now - p_cmd->queuedNsec) / 1000000LL > p_stats->maxWaitMsec) {
+        p_stats->maxWaitMsec = (now - p_cmd->queuedNsec) / 1000000LL;
+    }
 
-            len = strlen(s_ATBufferCur);
+    return p_cmd;
+}
 
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
-        }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
+/**
+ * Writes queued commands until one is in flight or the queue is empty.
+ * Commands that can't be written are moved to *pp_done
+ * assumes commandmutex is held
+ */
+static void startNextCommand(ATPort *p_port, ATCommand **pp_done)
+{
+    if (p_port->resyncUntil != 0) {
+        /* serviceCommands() resumes once the port is quiet */
+        setReaderDeadline(p_port, p_port->resyncUntil);
+        return;
     }
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
-            ALOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
+    while (p_port->pCurrent == NULL) {
+        ATCommand *p_cmd = dequeueCommand(p_port, monotonicNsec());
+        int err;
+
+        if (p_cmd == NULL) {
+            break;
         }
 
-        do {
-            count = read(s_fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - s_ATBuffer));
-        } while (count < 0 && errno == EINTR);
+        p_port->pCurrent = p_cmd;
+        p_port->type = p_cmd->type;
+        p_port->responsePrefix = p_cmd->responsePrefix;
+        p_port->smsPDU = p_cmd->smsPDU;
+        p_port->p_response = at_response_new();
 
-        if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
-            s_readCount += count;
+        err = writeline (p_port, p_cmd->command);
 
-            p_read[count] = '\0';
+        p_cmd->writtenNsec = monotonicNsec();
 
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
+        AT_TRACE_SPAN(AT_SPAN_MARK, p_cmd->track, p_cmd, "written",
+                        NULL, 0);
 
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
-        } else if (count <= 0) {
-            /* read error encountered or EOF reached */
-            if(count == 0) {
-                ALOGD("atchannel: EOF reached");
-            } else {
-                ALOGD("atchannel: read error %s", strerror(errno));
-            }
-            return NULL;
+        if (err < 0) {
+            completeCommand(p_port, err, pp_done);
+        } else if (p_cmd->timeoutMsec > 0) {
+            p_cmd->deadline = p_cmd->writtenNsec
+                                + p_cmd->timeoutMsec * 1000000LL;
         }
     }
 
-    /* a full line in the buffer. Place a \0 over the \r and return */
-
-    ret = s_ATBufferCur;
-    *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
-
-    ALOGD("AT< %s\n", ret);
-    return ret;
+    /* only the command in flight has a deadline */
+    setReaderDeadline(p_port, p_port->pCurrent != NULL
+                                ? p_port->pCurrent->deadline : 0);
 }
 
-
-static void onReaderClosed()
+/**
+ * Fails the command in flight and every queued command with err
+ * assumes commandmutex is held
+ */
+static void failAllCommands(ATPort *p_port, int err, ATCommand **pp_done)
 {
-    if (s_onReaderClosed != NULL && s_readerClosed == 0) {
+    ATChannel *p_channel = p_port->p_channel;
+    int i;
 
-        pthread_mutex_lock(&s_commandmutex);
+    if (p_port->pCurrent != NULL) {
+        completeCommand(p_port, err, pp_done);
+    }
 
-        s_readerClosed = 1;
+    for (i = 0 ; i < AT_PRIORITY_COUNT ; i++) {
+        while (p_port->pQueueHead[i] != NULL) {
+            ATCommand *p_cmd = p_port->pQueueHead[i];
 
-        pthread_cond_signal(&s_commandcond);
+            p_port->pQueueHead[i] = p_cmd->p_next;
+            p_cmd->err = err;
+            appendCommand(pp_done, p_cmd);
 
-        pthread_mutex_unlock(&s_commandmutex);
+            /* the class stats are shared with the other ports */
+            p_channel->classStats[i].depth--;
+            p_port->depth--;
+        }
 
-        s_onReaderClosed();
+        p_port->pQueueTail[i] = NULL;
     }
 }
 
-
-static void *readerLoop(void *arg)
+/**
+ * Invokes the callbacks of the completed commands in p_done, in order,
+ * and frees them. Must be called without commandmutex held
+ */
+static void runCompletions(ATCommand *p_done)
 {
-    for (;;) {
-        const char * line;
+    while (p_done != NULL) {
+        ATCommand *p_next = p_done->p_next;
 
-        line = readline();
+        /* followers first: the leader's callback owns the response */
+        while (p_done->p_followers != NULL) {
+            ATCommand *p_follower = p_done->p_followers;
 
-        if (line == NULL) {
-            break;
-        }
+            p_done->p_followers = p_follower->p_next;
+            p_follower->err = p_done->err;
+            p_follower->p_response = cloneResponse(p_done->p_response);
+            p_follower->p_next = NULL;
 
-        if(isSMSUnsolicited(line)) {
-            char *line1;
-            const char *line2;
+            runCompletions(p_follower);
+        }
 
-            // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
-            line2 = readline();
+        if (at_trace_mask & AT_TRACE_SPANS) {
+            const char *result = p_done->p_response != NULL
+                                ? p_done->p_response->finalResponse : NULL;
 
-            if (line2 == NULL) {
-                break;
-            }
+            at_trace_span(AT_SPAN_END, p_done->track, p_done, "AT", result,
+                            result != NULL ? strlen(result) : 0);
+        }
 
-            if (s_unsolHandler != NULL) {
-                s_unsolHandler (line1, line2);
-            }
-            free(line1);
+        if (p_done->callback != NULL) {
+            p_done->callback(p_done->err, p_done->p_response, p_done->param);
         } else {
-            processLine(line);
+            at_response_free(p_done->p_response);
         }
 
-#ifdef HAVE_ANDROID_OS
-        if (s_ackPowerIoctl > 0) {
-            /* acknowledge that bytes have been read and processed */
-            ioctl(s_fd, OMAP_CSMI_TTY_ACK, &s_readCount);
-            s_readCount = 0;
+        free(p_done);
+        p_done = p_next;
+    }
+}
+
+/**
+ * Called by the reader each time it wakes up. Times out the command in
+ * flight if its deadline has passed, writes the next queued command if
+ * the link is idle, and returns how long the reader may then block, in
+ * msec (-1 is forever)
+ */
+static int serviceCommands(ATPort *p_port)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommand *p_done = NULL;
+    long long remaining;
+    int reportTimeout = 0;
+    int ret = -1;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    if (p_port->resyncUntil != 0 && p_port->resyncUntil <= monotonicNsec()) {
+        p_port->resyncUntil = 0;
+    }
+
+    /* in reactor mode, other threads only queue commands */
+    startNextCommand(p_port, &p_done);
+
+    if (p_port->pCurrent != NULL && p_port->pCurrent->deadline != 0
+        && p_port->pCurrent->deadline <= monotonicNsec()
+    ) {
+        ALOGE("AT timeout after %lld ms on %s",
+                p_port->pCurrent->timeoutMsec, p_port->pCurrent->command);
+        p_channel->verbTimeoutCounts[p_port->pCurrent->verb]++;
+        reportTimeout = p_port->pCurrent->reportTimeout;
+
+        completeCommand(p_port, AT_ERROR_TIMEOUT, &p_done);
+
+        p_port->resyncUntil = monotonicNsec()
+                                + RESYNC_QUIET_MSEC * 1000000LL;
+        startNextCommand(p_port, &p_done);
+    }
+
+    if (p_port->pCurrent != NULL && p_port->pCurrent->deadline != 0) {
+        remaining = p_port->pCurrent->deadline - monotonicNsec();
+        ret = remaining > 0 ? (int) ((remaining + 999999) / 1000000) : 0;
+    } else if (p_port->resyncUntil != 0) {
+        remaining = p_port->resyncUntil - monotonicNsec();
+        ret = remaining > 0 ? (int) ((remaining + 999999) / 1000000) : 0;
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    runCompletions(p_done);
+
+    /* a synchronous caller calls it itself, see at_channel_send_command */
+    if (reportTimeout && p_channel->onTimeout != NULL) {
+        p_channel->onTimeout(p_channel);
+    }
+
+    return ret;
+}
+
+/** assumes commandmutex is held */
+static void handleFinalResponse(ATPort *p_port, const char *line,
+                                    ATCommand **pp_done)
+{
+    p_port->p_response->finalResponse = arenaStrdup(
+                                (ATArena *) p_port->p_response, line);
+
+    completeCommand(p_port, 0, pp_done);
+    startNextCommand(p_port, pp_done);
+}
+
+/**
+ * returns 1 for the status reports that only repeat a state a later one
+ * replaces, which may be dropped when the dispatcher falls behind
+ */
+static int isDroppableUnsolicited(ATLineType type)
+{
+    return type == AT_LINE_RSSI || type == AT_LINE_MODE
+            || type == AT_LINE_BOOT || type == AT_LINE_DSFLOWRPT;
+}
+
+static void dispatchUnsolicited(ATChannel *p_channel);
+
+/**
+ * Waits until the unsolicited queue has room for one more line
+ * Called on the reader thread only, without commandmutex
+ */
+static void waitForUnsolSpace(ATChannel *p_channel)
+{
+    while (p_channel->unsolTail - p_channel->unsolHead == UNSOL_QUEUE_SIZE) {
+        if (p_channel->polled) {
+            /* the dispatcher is this thread */
+            dispatchUnsolicited(p_channel);
+            continue;
         }
-#endif /*HAVE_ANDROID_OS*/
+
+        p_channel->unsolWaits++;
+        p_channel->unsolWaiting = 1;
+
+        /* see the waiting flag set, or the head it advanced */
+        __sync_synchronize();
+
+        if (p_channel->unsolTail - p_channel->unsolHead
+                == UNSOL_QUEUE_SIZE) {
+            while (sem_wait(&p_channel->unsolSpaceSem) < 0
+                    && errno == EINTR);
+        }
+    }
+}
+
+/**
+ * Queues an unsolicited line (and the PDU line of a two-line SMS
+ * unsolicited) for the dispatch thread. Called on the reader thread only,
+ * without commandmutex.
+ * If the dispatcher has fallen behind, status reports that a later one
+ * replaces are dropped and counted once the queue is within
+ * UNSOL_QUEUE_RESERVE lines of full; any other line (SMS, rings, call
+ * state) makes the reader wait for room instead
+ */
+static void queueUnsolicited(ATChannel *p_channel, const char *line,
+                                const char *sms_pdu, ATLineType type)
+{
+    unsigned int tail = p_channel->unsolTail;
+    unsigned int depth = tail - p_channel->unsolHead;
+    ATUnsolEntry *p_entry;
+    size_t len;
+
+    if (isDroppableUnsolicited(type)
+        && depth >= UNSOL_QUEUE_SIZE - UNSOL_QUEUE_RESERVE
+    ) {
+        p_channel->unsolDropped++;
+        if (!p_channel->unsolDropping) {
+            ALOGE("Unsolicited queue backed up, dropping '%s'\n", line);
+            p_channel->unsolDropping = 1;
+        }
+        return;
+    }
+
+    p_channel->unsolDropping = 0;
+
+    if (depth == UNSOL_QUEUE_SIZE) {
+        waitForUnsolSpace(p_channel);
+        depth = tail - p_channel->unsolHead;
+    }
+
+    p_entry = &p_channel->unsolQueue[tail & (UNSOL_QUEUE_SIZE - 1)];
+
+    len = strlen(line) + 1;
+
+    if (sms_pdu == NULL) {
+        p_entry->line = (char *) malloc(len);
+        p_entry->sms_pdu = NULL;
+    } else {
+        size_t pduLen = strlen(sms_pdu) + 1;
+
+        p_entry->line = (char *) malloc(len + pduLen);
+        p_entry->sms_pdu = p_entry->line + len;
+        memcpy(p_entry->sms_pdu, sms_pdu, pduLen);
+    }
+    memcpy(p_entry->line, line, len);
+    p_entry->type = type;
+
+    /* publish the entry before the new tail */
+    __sync_synchronize();
+    p_channel->unsolTail = tail + 1;
+
+    if (depth + 1 > p_channel->unsolMaxDepth) {
+        p_channel->unsolMaxDepth = depth + 1;
+    }
+
+    if (!p_channel->polled) {
+        sem_post(&p_channel->unsolSem);
+    }
+}
+
+/**
+ * Unsolicited responses are enabled on port 0 only, and the dispatch
+ * queue has a single producer, so anything else that turns up on a
+ * secondary port (eg the echo of a command) is counted and dropped
+ * Called without commandmutex, as queueing may wait
+ */
+static void handleUnsolicited(ATPort *p_port, const char *line,
+                                ATLineType type)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    if (p_port->index != 0) {
+        p_port->readerUnsolDropped++;
+    } else if (p_channel->unsolHandler != NULL) {
+        queueUnsolicited(p_channel, line, NULL, type);
+    }
+}
+
+/** passes the oldest queued unsolicited line to the handler */
+static void dispatchUnsolicited(ATChannel *p_channel)
+{
+    ATUnsolEntry entry;
+    unsigned int head;
+
+    head = p_channel->unsolHead;
+
+    /* read the entry only after seeing the tail that published it */
+    __sync_synchronize();
+    entry = p_channel->unsolQueue[head & (UNSOL_QUEUE_SIZE - 1)];
+    __sync_synchronize();
+
+    p_channel->unsolHead = head + 1;
+
+    /* publish the new head before looking for a waiting reader */
+    __sync_synchronize();
+
+    if (p_channel->unsolWaiting) {
+        p_channel->unsolWaiting = 0;
+        sem_post(&p_channel->unsolSpaceSem);
     }
 
-    onReaderClosed();
+    if (p_channel->unsolHandler != NULL) {
+        p_channel->unsolHandler(p_channel, entry.line, entry.sms_pdu,
+                                    entry.type);
+    }
+    p_channel->unsolDispatched++;
+
+    free(entry.line);
+}
+
+static void *unsolLoop(void *arg)
+{
+    ATChannel *p_channel = (ATChannel *) arg;
+
+    for (;;) {
+        while (sem_wait(&p_channel->unsolSem) < 0 && errno == EINTR);
+
+        dispatchUnsolicited(p_channel);
+    }
 
     return NULL;
 }
 
+static void processLine(ATPort *p_port, const char *line, ATLineType type)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommand *p_done = NULL;
+    int unsolicited = 0;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    if (p_port->p_response == NULL && p_port->resyncUntil != 0
+        && (isFinalResponseSuccess(type) || isFinalResponseError(type))
+    ) {
+        /* the late answer to a command that timed out */
+        ALOGD("AT resync: discarding '%s'", line);
+        p_port->resyncDiscarded++;
+        p_port->resyncUntil = monotonicNsec()
+                                + RESYNC_QUIET_MSEC * 1000000LL;
+        setReaderDeadline(p_port, p_port->resyncUntil);
+    } else if (p_port->p_response == NULL) {
+        /* no command pending */
+        unsolicited = 1;
+    } else if (isFinalResponseSuccess(type)) {
+        p_port->p_response->success = 1;
+        handleFinalResponse(p_port, line, &p_done);
+    } else if (isFinalResponseError(type)) {
+        p_port->p_response->success = 0;
+        handleFinalResponse(p_port, line, &p_done);
+    } else if (p_port->smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        // See eg. TS 27.005 4.3
+        // Commands like AT+CMGS have a "> " prompt
+        writeCtrlZ(p_port, p_port->smsPDU);
+        p_port->smsPDU = NULL;
+    } else switch (p_port->type) {
+        case NO_RESULT:
+            unsolicited = 1;
+            break;
+        case NUMERIC:
+            if (p_port->p_response->p_intermediates == NULL
+                && isdigit(line[0])
+            ) {
+                addIntermediate(p_port, line);
+            } else {
+                /* either we already have an intermediate response or
+                   the line doesn't begin with a digit */
+                unsolicited = 1;
+            }
+            break;
+        case SINGLELINE:
+            if (p_port->p_response->p_intermediates == NULL
+                && strStartsWith (line, p_port->responsePrefix)
+            ) {
+                addIntermediate(p_port, line);
+            } else {
+                /* we already have an intermediate response */
+                unsolicited = 1;
+            }
+            break;
+        case MULTILINE:
+            if (strStartsWith (line, p_port->responsePrefix)) {
+                addIntermediate(p_port, line);
+            } else {
+                unsolicited = 1;
+            }
+        break;
+
+        default: /* this should never be reached */
+            ALOGE("Unsupported AT command type %d\n", p_port->type);
+            unsolicited = 1;
+        break;
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    /* queueing may wait for the dispatcher, which must not hold us up */
+    if (unsolicited) {
+        handleUnsolicited(p_port, line, type);
+    }
+
+    runCompletions(p_done);
+}
+
+
 /**
- * Sends string s to the radio with a \r appended.
- * Returns AT_ERROR_* on error, 0 on success
+ * Returns the counter of the end of the next line in the input ring
+ * special-cases the "> " SMS prompt, for which *p_skip is set to 0
+ * since there is no terminator to consume
  *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * returns -1 if there is no complete line
+ *
+ * a NUL from the modem doesn't end the line (see findLineEnd()); it goes
+ * out at the next terminator and readers of the line see it cut at the NUL
  */
-static int writeline (const char *s)
+static int findNextEOL(ATPort *p_port, unsigned int *p_eol,
+                        unsigned int *p_skip)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
-
-    if (s_fd < 0 || s_readerClosed > 0) {
-        return AT_ERROR_CHANNEL_CLOSED;
+    if (p_port->ATTail - p_port->ATHead == 2
+        && AT_BUFFER_AT(p_port, p_port->ATHead) == '>'
+        && AT_BUFFER_AT(p_port, p_port->ATHead + 1) == ' '
+    ) {
+        /* SMS prompt character...not \r terminated */
+        *p_eol = p_port->ATHead + 2;
+        *p_skip = 0;
+        return 0;
     }
 
-    ALOGD("AT> %s\n", s);
+    // Find next newline, starting where the last scan stopped
+    while (p_port->ATScan != p_port->ATTail) {
+        unsigned int start = p_port->ATScan & AT_BUFFER_MASK;
+        unsigned int len = p_port->ATTail - p_port->ATScan;
+        size_t n;
 
-    AT_DUMP( ">> ", s, strlen(s) );
+        if (start + len > MAX_AT_RESPONSE) {
+            len = MAX_AT_RESPONSE - start;
+        }
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write (s_fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+        n = findLineEnd(p_port->ATBuffer + start, len);
+        p_port->ATScan += n;
 
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
+        if (n < len) {
+            *p_eol = p_port->ATScan;
+            *p_skip = 1;
+            return 0;
         }
+    }
 
-        cur += written;
+    return -1;
+}
+
+/**
+ * Appends the ring bytes [from, to) to p_port->longLine, growing it
+ * as needed. Returns -1 and drops the line if it gets longer than
+ * MAX_AT_LINE
+ */
+static int appendLongLine(ATPort *p_port, unsigned int from, unsigned int to)
+{
+    size_t len = to - from;
+    size_t start = from & AT_BUFFER_MASK;
+    size_t first;
+
+    if (p_port->longLen + len + 1 > MAX_AT_LINE) {
+        ALOGE("ERROR: Input line exceeded %d bytes\n", MAX_AT_LINE);
+        goto error;
     }
 
-    /* the \r  */
+    if (p_port->longLen + len + 1 > p_port->longSize) {
+        size_t size = p_port->longSize == 0 ? 2 * MAX_AT_RESPONSE
+                                            : p_port->longSize;
+        char *grown;
 
-    do {
-        written = write (s_fd, "\r" , 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+        while (size < p_port->longLen + len + 1) {
+            size *= 2;
+        }
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
+        grown = (char *) realloc(p_port->longLine, size);
+        if (grown == NULL) {
+            ALOGE("ERROR: No memory for a %u byte line\n",
+                    (unsigned) (p_port->longLen + len));
+            goto error;
+        }
+
+        p_port->longLine = grown;
+        p_port->longSize = size;
     }
 
+    first = start + len > MAX_AT_RESPONSE ? MAX_AT_RESPONSE - start : len;
+
+    memcpy(p_port->longLine + p_port->longLen, p_port->ATBuffer + start,
+            first);
+    memcpy(p_port->longLine + p_port->longLen + first, p_port->ATBuffer,
+            len - first);
+    p_port->longLen += len;
+
     return 0;
+
+error:
+    /* drop what we have, and the rest of the line as it arrives */
+    free(p_port->longLine);
+    p_port->longLine = NULL;
+    p_port->longLen = p_port->longSize = 0;
+    p_port->longLineDropping = 1;
+    return -1;
 }
-static int writeCtrlZ (const char *s)
+
+/**
+ * Called when the ring is full without a complete line: moves the
+ * partial line out of the ring so reading can go on
+ */
+static void spillLine(ATPort *p_port)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
+    if (!p_port->longLineDropping) {
+        appendLongLine(p_port, p_port->ATHead, p_port->ATTail);
+    }
 
-    if (s_fd < 0 || s_readerClosed > 0) {
-        return AT_ERROR_CHANNEL_CLOSED;
+    p_port->ATHead = p_port->ATScan = p_port->ATTail;
+}
+
+/**
+ * Returns the next complete line in the input ring, or NULL if there
+ * is none yet. The line is \0 terminated in place unless it wraps
+ * around the end of the ring, in which case it is copied to p_port->ATLine,
+ * or was spilled, in which case it is in p_port->longLine
+ */
+static const char *nextLine(ATPort *p_port)
+{
+    unsigned int eol, skip, start, len;
+    char *ret;
+
+    if (p_port->longLineReturned) {
+        free(p_port->longLine);
+        p_port->longLine = NULL;
+        p_port->longLen = p_port->longSize = 0;
+        p_port->longLineReturned = 0;
     }
 
-    ALOGD("AT> %s^Z\n", s);
+again:
+    // skip over leading newlines, unless continuing a spilled line
+    while (p_port->longLen == 0 && !p_port->longLineDropping
+            && p_port->ATHead != p_port->ATTail
+    ) {
+        unsigned int start = p_port->ATHead & AT_BUFFER_MASK;
+        unsigned int len = p_port->ATTail - p_port->ATHead;
+        size_t n;
 
-    AT_DUMP( ">* ", s, strlen(s) );
+        if (start + len > MAX_AT_RESPONSE) {
+            len = MAX_AT_RESPONSE - start;
+        }
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write (s_fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+        n = skipLineEnds(p_port->ATBuffer + start, len);
+        p_port->ATHead += n;
 
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
+        if (n < len) {
+            break;
         }
+    }
+
+    if ((int)(p_port->ATScan - p_port->ATHead) < 0) {
+        p_port->ATScan = p_port->ATHead;
+    }
 
-        cur += written;
+    if (findNextEOL(p_port, &eol, &skip) < 0) {
+        return NULL;
     }
 
-    /* the ^Z  */
+    start = p_port->ATHead & AT_BUFFER_MASK;
+    len = eol - p_port->ATHead;
 
-    do {
-        written = write (s_fd, "\032" , 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+    if (p_port->longLineDropping
+        || (p_port->longLen > 0
+            && appendLongLine(p_port, p_port->ATHead, eol) < 0)
+    ) {
+        /* the end of a line that was too long */
+        p_port->longLineDropping = 0;
+        p_port->ATHead = p_port->ATScan = eol + skip;
+        goto again;
+    } else if (p_port->longLen > 0) {
+        /* the end of a spilled line */
+        p_port->longLine[p_port->longLen] = '\0';
+        p_port->longLineReturned = 1;
+        ret = p_port->longLine;
+    } else if (start + len <= MAX_AT_RESPONSE) {
+        /* overwrites the terminator, or the spare byte at the end */
+        ret = p_port->ATBuffer + start;
+        ret[len] = '\0';
+    } else {
+        size_t first = MAX_AT_RESPONSE - start;
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
+        memcpy(p_port->ATLine, p_port->ATBuffer + start, first);
+        memcpy(p_port->ATLine + first, p_port->ATBuffer, len - first);
+        p_port->ATLine[len] = '\0';
+        ret = p_port->ATLine;
     }
 
-    return 0;
+    p_port->ATHead = eol + skip;
+    p_port->ATScan = p_port->ATHead;
+
+    return ret;
 }
 
-static void clearPendingCommand()
+#ifdef AT_REACTOR
+/**
+ * Waits until the channel is readable, servicing queued commands and
+ * the command timer meanwhile. Returns 0 once readable, -1 if the
+ * channel was closed
+ */
+static int waitForInput(ATPort *p_port)
 {
-    if (sp_response != NULL) {
-        at_response_free(sp_response);
-    }
+    struct epoll_event events[3];
+    struct epoll_event ev;
+    uint64_t count;
+    int readable;
+    int ret;
+    int i;
 
-    sp_response = NULL;
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-}
+    for (;;) {
+        serviceCommands(p_port);
+
+        if (p_port->fd < 0) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (!p_port->epollHasChannel) {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = p_port->fd;
+
+            if (epoll_ctl(p_port->epollFd, EPOLL_CTL_ADD,
+                            p_port->fd, &ev) < 0
+            ) {
+                return -1;
+            }
+            p_port->epollHasChannel = 1;
+        }
+
+        ret = epoll_wait(p_port->epollFd, events, NUM_ELEMS(events), -1);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        p_port->readerWakeups++;
+        readable = 0;
 
+        for (i = 0 ; i < ret ; i++) {
+            if (events[i].data.fd == p_port->eventFd
+                || events[i].data.fd == p_port->timerFd
+            ) {
+                /* both are reset by reading their counter */
+                if (read(events[i].data.fd, &count, sizeof(count)) < 0) {}
+            } else {
+                /* includes hangup and errors, which the read will report */
+                readable = 1;
+            }
+        }
 
+        if (readable) {
+            return 0;
+        }
+    }
+}
+#else
 /**
- * Starts AT handler on stream "fd'
- * returns 0 on success, -1 on error
+ * Waits until the channel is readable, timing out the command in flight
+ * if its deadline passes first. Returns 0 once readable, -1 if the
+ * channel was closed
  */
-int at_open(int fd, ATUnsolHandler h)
+static int waitForInput(ATPort *p_port)
 {
+    struct pollfd fds[2];
+    char drain[16];
     int ret;
-    pthread_t tid;
-    pthread_attr_t attr;
 
-    s_fd = fd;
-    s_unsolHandler = h;
-    s_readerClosed = 0;
+    for (;;) {
+        int timeout = serviceCommands(p_port);
 
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-    sp_response = NULL;
+        if (p_port->fd < 0) {
+            errno = EBADF;
+            return -1;
+        }
 
-    /* Android power control ioctl */
-#ifdef HAVE_ANDROID_OS
-#ifdef OMAP_CSMI_POWER_CONTROL
-    ret = ioctl(fd, OMAP_CSMI_TTY_ENABLE_ACK);
-    if(ret == 0) {
-        int ack_count;
-		int read_count;
+        fds[0].fd = p_port->fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = p_port->wakeFds[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        ret = poll(fds, 2, timeout);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        p_port->readerWakeups++;
+
+        if (fds[1].revents != 0) {
+            while (read(p_port->wakeFds[0], drain, sizeof(drain)) > 0);
+        }
+
+        if (fds[0].revents != 0) {
+            /* includes hangup and errors, which the read will report */
+            return 0;
+        }
+    }
+}
+#endif /*AT_REACTOR*/
+
+/** records the buffers in the channel's capture, if it has one */
+static void captureBytes(ATPort *p_port, int dir, const void * const *bufs,
+                            const size_t *lens, int count)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    ATCapture *p_capture;
+
+    if (p_channel->p_capture == NULL) {
+        return;
+    }
+
+    __sync_fetch_and_add(&p_channel->captureUsers, 1);
+
+    p_capture = p_channel->p_capture;
+    if (p_capture != NULL) {
+        at_capture_write(p_capture, dir, p_channel->captureId,
+                            p_port->index, bufs, lens, count);
+    }
+
+    __sync_fetch_and_sub(&p_channel->captureUsers, 1);
+}
+
+/**
+ * Reads whatever is available from the AT channel into the free part
+ * of the input ring, with a single read even if the free space wraps.
+ * Returns the result of the read
+ */
+static ssize_t readInput(ATPort *p_port)
+{
+    unsigned int used = p_port->ATTail - p_port->ATHead;
+    unsigned int tail;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t count;
+
+    if (used == 0) {
+        /* restart at the beginning so that lines stay contiguous */
+        p_port->ATHead = p_port->ATScan = p_port->ATTail = 0;
+    }
+
+    tail = p_port->ATTail & AT_BUFFER_MASK;
+
+    iov[0].iov_base = p_port->ATBuffer + tail;
+    iov[0].iov_len = MAX_AT_RESPONSE - used;
+
+    if (tail + iov[0].iov_len > MAX_AT_RESPONSE) {
+        iov[1].iov_base = p_port->ATBuffer;
+        iov[1].iov_len = tail + iov[0].iov_len - MAX_AT_RESPONSE;
+        iov[0].iov_len -= iov[1].iov_len;
+        iovcnt = 2;
+    }
+
+    do {
+        count = readv(p_port->fd, iov, iovcnt);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        size_t first = (size_t)count < iov[0].iov_len
+                            ? (size_t)count : iov[0].iov_len;
+
+        AT_DUMP( "<< ", iov[0].iov_base, first );
+        if ((size_t)count > first) {
+            AT_DUMP( "<< ", iov[1].iov_base, count - first );
+        }
+
+        if (p_port->p_channel->p_capture != NULL) {
+            const void *bufs[2];
+            size_t lens[2];
+            int n = 0;
+
+            /* iov[1] is only set up when the read could wrap */
+            bufs[n] = iov[0].iov_base;
+            lens[n++] = first;
+            if ((size_t)count > first) {
+                bufs[n] = iov[1].iov_base;
+                lens[n++] = count - first;
+            }
+
+            captureBytes(p_port, AT_CAPTURE_IN, bufs, lens, n);
+        }
+
+        p_port->readCount += count;
+        p_port->readerBytes += count;
+        p_port->ATTail += count;
+    }
+
+    return count;
+}
+
+/** waits for input on the reader thread, then reads it */
+static ssize_t fillBuffer(ATPort *p_port)
+{
+    ssize_t count;
+    long long now;
+
+    now = monotonicNsec();
+    if (p_port->readerLastReadNsec != 0) {
+        p_port->readerBusyNsec += now - p_port->readerLastReadNsec;
+    }
+
+    if (waitForInput(p_port) < 0) {
+        return -1;
+    }
+
+    count = readInput(p_port);
+
+    p_port->readerLastReadNsec = monotonicNsec();
+
+    return count;
+}
+
+/**
+ * Reads a line from the AT channel, returns NULL on timeout.
+ * Assumes it has exclusive read access to the FD
+ *
+ * This line is valid only until the next call to readline
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ */
+
+static const char *readline(ATPort *p_port)
+{
+    ssize_t count;
+    const char *ret;
+
+    while ((ret = nextLine(p_port)) == NULL) {
+        if (p_port->ATTail - p_port->ATHead == MAX_AT_RESPONSE) {
+            spillLine(p_port);
+        }
+
+        count = fillBuffer(p_port);
+
+        if (count <= 0) {
+            /* read error encountered or EOF reached */
+            if(count == 0) {
+                ALOGD("atchannel: EOF reached");
+            } else {
+                ALOGD("atchannel: read error %s", strerror(errno));
+            }
+            return NULL;
+        }
+    }
+
+    p_port->readerLines++;
+
+    AT_TRACE(AT_TRACE_RX, "AT<", ret, strlen(ret));
+    return ret;
+}
+
+
+static void onReaderClosed(ATPort *p_port)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommand *p_done = NULL;
+    int wasClosed;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    wasClosed = p_port->readerClosed;
+    p_port->readerClosed = 1;
+
+    failAllCommands(p_port, AT_ERROR_CHANNEL_CLOSED, &p_done);
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    runCompletions(p_done);
+
+    if (p_port->index != 0) {
+        /* routed commands fall back to port 0 */
+        if (wasClosed == 0) {
+            ALOGI("AT port %d closed\n", p_port->index);
+        }
+        return;
+    }
+
+    if (p_channel->onReaderClosed != NULL && wasClosed == 0) {
+        p_channel->onReaderClosed(p_channel);
+    }
+}
+
+
+static void *readerLoop(void *arg)
+{
+    ATPort *p_port = (ATPort *) arg;
+    ATChannel *p_channel = p_port->p_channel;
+
+    for (;;) {
+        const char * line;
+        ATLineType type;
+
+        line = readline(p_port);
+
+        if (line == NULL) {
+            break;
+        }
+
+        type = classifyLine(line);
+
+        if(isSMSUnsolicited(type)) {
+            char *line1;
+            const char *line2;
+
+            // The scope of string returned by 'readline()' is valid only
+            // till next call to 'readline()' hence making a copy of line
+            // before calling readline again.
+            line1 = strdup(line);
+            line2 = readline(p_port);
+
+            if (line2 == NULL) {
+                break;
+            }
+
+            if (p_port->index != 0) {
+                p_port->readerUnsolDropped++;
+            } else if (p_channel->unsolHandler != NULL) {
+                queueUnsolicited(p_channel, line1, line2, type);
+            }
+            free(line1);
+        } else {
+            processLine(p_port, line, type);
+        }
+
+#ifdef HAVE_ANDROID_OS
+        if (p_port->ackPowerIoctl > 0) {
+            /* acknowledge that bytes have been read and processed */
+            ioctl(p_port->fd, OMAP_CSMI_TTY_ACK, &p_port->readCount);
+            p_port->readCount = 0;
+        }
+#endif /*HAVE_ANDROID_OS*/
+    }
+
+    onReaderClosed(p_port);
+
+    return NULL;
+}
+
+/**
+ * Writes s and its one-byte terminator with a single writev(), so that
+ * on USB serial links a command costs one transfer instead of two.
+ * Partial writes are continued from where they stopped.
+ * Returns AT_ERROR_* on error, 0 on success
+ */
+static int writeTerminated (ATPort *p_port, const char *s, size_t len,
+                                char terminator)
+{
+    struct iovec iov[2];
+    struct iovec *p_iov = iov;
+    int iovcnt = 2;
+    ssize_t written;
+
+    iov[0].iov_base = (void *) s;
+    iov[0].iov_len = len;
+    iov[1].iov_base = &terminator;
+    iov[1].iov_len = 1;
+
+    if (p_port->p_channel->p_capture != NULL) {
+        const void *bufs[2] = { s, &terminator };
+        size_t lens[2] = { len, 1 };
+
+        captureBytes(p_port, AT_CAPTURE_OUT, bufs, lens, 2);
+    }
+
+    while (iovcnt > 0) {
+        do {
+            written = writev (p_port->fd, p_iov, iovcnt);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0) {
+            return AT_ERROR_GENERIC;
+        }
+
+        p_port->writerSyscalls++;
+        p_port->writerBytes += written;
+
+        /* skip what went out, which may end in the middle of an iovec */
+        while (iovcnt > 0 && (size_t) written >= p_iov->iov_len) {
+            written -= p_iov->iov_len;
+            p_iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            p_iov->iov_base = (char *) p_iov->iov_base + written;
+            p_iov->iov_len -= written;
+        }
+    }
+
+    p_port->writerCommands++;
+
+    return 0;
+}
+
+/**
+ * Sends string s to the radio with a \r appended.
+ * Returns AT_ERROR_* on error, 0 on success
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ */
+static int writeline (ATPort *p_port, const char *s)
+{
+    if (p_port->fd < 0 || p_port->readerClosed > 0) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    AT_TRACE(AT_TRACE_TX, "AT>", s, strlen(s));
+
+    AT_DUMP( ">> ", s, strlen(s) );
+
+    return writeTerminated(p_port, s, strlen(s), '\r');
+}
+
+/** Sends the SMS PDU s to the radio with a ^Z appended */
+static int writeCtrlZ (ATPort *p_port, const char *s)
+{
+    if (p_port->fd < 0 || p_port->readerClosed > 0) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    AT_TRACE(AT_TRACE_SMS, "AT> PDU", s, strlen(s));
+
+    AT_DUMP( ">* ", s, strlen(s) );
+
+    return writeTerminated(p_port, s, strlen(s), '\032');
+}
+
+static pthread_once_t s_initOnce = PTHREAD_ONCE_INIT;
+
+/** one-time setup, done by the first at_open() */
+static void initChannel()
+{
+    buildLineTrie();
+}
+
+/** sets up what wakes the reader of p_port, once per port */
+static void initPortWakeup(ATPort *p_port)
+{
+#ifdef AT_REACTOR
+    struct epoll_event ev;
+
+    p_port->epollFd = epoll_create(3);
+    p_port->eventFd = eventfd(0, EFD_NONBLOCK);
+    p_port->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    if (p_port->epollFd < 0 || p_port->eventFd < 0 || p_port->timerFd < 0) {
+        ALOGE("Can't set up the AT reactor: %s", strerror(errno));
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = p_port->eventFd;
+    epoll_ctl(p_port->epollFd, EPOLL_CTL_ADD, p_port->eventFd, &ev);
+
+    ev.data.fd = p_port->timerFd;
+    epoll_ctl(p_port->epollFd, EPOLL_CTL_ADD, p_port->timerFd, &ev);
+#else
+    if (pipe(p_port->wakeFds) == 0) {
+        fcntl(p_port->wakeFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(p_port->wakeFds[1], F_SETFL, O_NONBLOCK);
+    } else {
+        ALOGE("Can't create reader wakeup pipe: %s", strerror(errno));
+        p_port->wakeFds[0] = p_port->wakeFds[1] = -1;
+    }
+#endif /*AT_REACTOR*/
+
+    p_port->initialized = 1;
+}
+
+/**
+ * Starts the reader of p_port on stream "fd"
+ * returns 0 on success, -1 on error
+ */
+static int startPort(ATPort *p_port, int fd)
+{
+    int ret;
+    pthread_attr_t attr;
+
+    p_port->fd = fd;
+    p_port->readerClosed = 0;
+    p_port->routable = 0;
+
+    p_port->ATHead = p_port->ATScan = p_port->ATTail = 0;
+    p_port->readerLastReadNsec = 0;
+    p_port->readerOpenNsec = monotonicNsec();
+
+    free(p_port->pendingSMS);
+    p_port->pendingSMS = NULL;
+
+    free(p_port->longLine);
+    p_port->longLine = NULL;
+    p_port->longLen = p_port->longSize = 0;
+    p_port->longLineReturned = 0;
+    p_port->longLineDropping = 0;
+#ifdef AT_REACTOR
+    /* closing the old fd removed it from the set */
+    p_port->epollHasChannel = 0;
+#endif /*AT_REACTOR*/
+
+    p_port->responsePrefix = NULL;
+    p_port->smsPDU = NULL;
+    p_port->p_response = NULL;
+    p_port->pCurrent = NULL;
+    p_port->resyncUntil = 0;
+    p_port->depth = 0;
+    p_port->commands = 0;
+    p_port->busyNsec = 0;
+
+    /* Android power control ioctl */
+#ifdef HAVE_ANDROID_OS
+#ifdef OMAP_CSMI_POWER_CONTROL
+    ret = ioctl(fd, OMAP_CSMI_TTY_ENABLE_ACK);
+    if(ret == 0) {
+        int ack_count;
+		int read_count;
         int old_flags;
         char sync_buf[256];
         old_flags = fcntl(fd, F_GETFL, 0);
@@ -627,375 +2148,1635 @@ int at_open(int fd, ATUnsolHandler h)
             ioctl(fd, OMAP_CSMI_TTY_ACK, &ack_count);
          } while(ack_count > 0 || read_count > 0);
         fcntl(fd, F_SETFL, old_flags);
-        s_readCount = 0;
-        s_ackPowerIoctl = 1;
+        p_port->readCount = 0;
+        p_port->ackPowerIoctl = 1;
     }
     else
-        s_ackPowerIoctl = 0;
+        p_port->ackPowerIoctl = 0;
+
+#else // OMAP_CSMI_POWER_CONTROL
+    p_port->ackPowerIoctl = 0;
+
+#endif // OMAP_CSMI_POWER_CONTROL
+#endif /*HAVE_ANDROID_OS*/
+
+    if (!p_port->initialized) {
+        initPortWakeup(p_port);
+    }
+
+    if (p_port->p_channel->polled) {
+        /* at_channel_poll() does the reading */
+        return 0;
+    }
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    ret = pthread_create(&p_port->tid_reader, &attr, readerLoop, p_port);
+
+    if (ret < 0) {
+        perror ("pthread_create");
+        return -1;
+    }
+
+    return 0;
+}
+
+/** sets up a zeroed channel */
+static void initChannelState(ATChannel *p_channel, void *param)
+{
+    int i;
+
+    p_channel->param = param;
+    p_channel->batchMaxLine = AT_BATCH_MAX_LINE;
+
+    pthread_mutex_init(&p_channel->commandmutex, NULL);
+    pthread_cond_init(&p_channel->commandcond, NULL);
+
+    for (i = 0 ; i < AT_MAX_PORTS ; i++) {
+        p_channel->ports[i].p_channel = p_channel;
+        p_channel->ports[i].index = i;
+        p_channel->ports[i].fd = -1;
+    }
+}
+
+/**
+ * Returns a new channel, not yet open, or NULL if out of memory
+ * "param" is for the caller, see at_channel_get_param()
+ */
+ATChannel *at_channel_new(void *param)
+{
+    ATChannel *p_channel;
+
+    p_channel = (ATChannel *) calloc(1, sizeof(ATChannel));
+
+    if (p_channel != NULL) {
+        initChannelState(p_channel, param);
+    }
+
+    return p_channel;
+}
+
+static void initDefaultChannel()
+{
+    initChannelState(&s_defaultChannel, NULL);
+}
+
+/** returns the channel the functions without a channel argument use */
+ATChannel *at_channel_default()
+{
+    pthread_once(&s_defaultChannelOnce, initDefaultChannel);
+
+    return &s_defaultChannel;
+}
+
+void *at_channel_get_param(ATChannel *p_channel)
+{
+    return p_channel->param;
+}
+
+/**
+ * Starts AT handler on stream "fd'
+ * returns 0 on success, -1 on error
+ */
+int at_channel_open(ATChannel *p_channel, int fd, ATChannelUnsolHandler h)
+{
+    int ret;
+    pthread_attr_t attr;
+
+    p_channel->unsolHandler = h;
+
+    pthread_once(&s_initOnce, initChannel);
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* the dispatch thread and its queue outlive reopens of the channel */
+    if (!p_channel->unsolStarted) {
+        sem_init(&p_channel->unsolSem, 0, 0);
+        sem_init(&p_channel->unsolSpaceSem, 0, 0);
+
+        ret = pthread_create(&p_channel->tid_unsol, &attr, unsolLoop,
+                                p_channel);
+
+        if (ret < 0) {
+            perror ("pthread_create");
+            return -1;
+        }
+
+        p_channel->unsolStarted = 1;
+    }
+
+    return startPort(&p_channel->ports[0], fd);
+}
+
+/**
+ * Starts a secondary AT port on stream "fd"
+ * returns 0 on success, -1 on error
+ */
+int at_channel_open_port(ATChannel *p_channel, int port, int fd)
+{
+    ATPort *p_port;
+    const char * const *portInit;
+    int count;
+    int ret;
+    int i;
+
+    if (port <= 0 || port >= AT_MAX_PORTS
+        || p_channel->ports[port].fd >= 0
+        || p_channel->polled
+    ) {
+        return -1;
+    }
+
+    pthread_once(&s_initOnce, initChannel);
+
+    p_port = &p_channel->ports[port];
+    ret = startPort(p_port, fd);
+
+    if (ret == 0) {
+        /* the port may come up with echo on, like port 0 */
+        queueCommand(p_channel, p_port, "ATE0Q0V1",
+                        NO_RESULT, NULL, NULL, HANDSHAKE_TIMEOUT_MSEC,
+                        NULL, NULL);
+
+        pthread_mutex_lock(&p_channel->commandmutex);
+        portInit = p_channel->portInit;
+        count = p_channel->portInitCount;
+        pthread_mutex_unlock(&p_channel->commandmutex);
+
+        /* and its settings go out before any routed command */
+        for (i = 0 ; i < count ; i++) {
+            queueCommand(p_channel, p_port, portInit[i], NO_RESULT, NULL,
+                            NULL, AT_TIMEOUT_DEFAULT, NULL, NULL);
+        }
+
+        pthread_mutex_lock(&p_channel->commandmutex);
+        p_port->routable = 1;
+        pthread_mutex_unlock(&p_channel->commandmutex);
+    }
+
+    return ret;
+}
+
+/**
+ * Sets the commands each secondary port gets when it opens, after
+ * ATE0Q0V1 and before any command is routed to it: the per-port
+ * settings (eg +CMEE, +CSCS) the routed commands' answers depend on.
+ * commands must stay valid while the channel is in use; set it before
+ * opening the secondary ports
+ */
+void at_channel_set_port_init(ATChannel *p_channel,
+                                const char * const *commands, int count)
+{
+    pthread_mutex_lock(&p_channel->commandmutex);
+    p_channel->portInit = commands;
+    p_channel->portInitCount = count;
+    pthread_mutex_unlock(&p_channel->commandmutex);
+}
+
+void at_set_port_init(const char * const *commands, int count)
+{
+    at_channel_set_port_init(at_channel_default(), commands, count);
+}
+
+/**
+ * Starts AT handler on stream "fd" without reader or dispatch threads:
+ * the caller watches fd and at_channel_get_wake_fd() and calls
+ * at_channel_poll(), which runs the unsolicited handler and the command
+ * callbacks. A polled channel has port 0 only
+ * returns 0 on success, -1 on error
+ */
+int at_channel_open_polled(ATChannel *p_channel, int fd,
+                            ATChannelUnsolHandler h)
+{
+    if (p_channel->unsolStarted) {
+        /* already has a dispatch thread */
+        return -1;
+    }
+
+    p_channel->unsolHandler = h;
+    p_channel->polled = 1;
+
+    pthread_once(&s_initOnce, initChannel);
+
+    return startPort(&p_channel->ports[0], fd);
+}
+
+/**
+ * Returns the fd that becomes readable when a polled channel needs
+ * at_channel_poll() for something other than input: a command queued
+ * by another thread, a new deadline or a close. -1 if there is none
+ */
+int at_channel_get_wake_fd(ATChannel *p_channel)
+{
+    const ATPort *p_port = &p_channel->ports[0];
+
+    if (!p_port->initialized) {
+        return -1;
+    }
+
+#ifdef AT_REACTOR
+    return p_port->eventFd;
+#else
+    return p_port->wakeFds[0];
+#endif /*AT_REACTOR*/
+}
+
+/** handles the complete lines in the input of a polled port */
+static void processPolledLines(ATPort *p_port)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    const char *line;
+
+    while ((line = nextLine(p_port)) != NULL) {
+        ATLineType type;
+
+        p_port->readerLines++;
+
+        AT_TRACE(AT_TRACE_RX, "AT<", line, strlen(line));
+
+        if (p_port->pendingSMS != NULL) {
+            /* line is the PDU of the SMS unsolicited before it */
+            if (p_channel->unsolHandler != NULL) {
+                queueUnsolicited(p_channel, p_port->pendingSMS, line,
+                                    p_port->pendingSMSType);
+            }
+            free(p_port->pendingSMS);
+            p_port->pendingSMS = NULL;
+        } else {
+            type = classifyLine(line);
+
+            if (isSMSUnsolicited(type)) {
+                /* the line is only valid until the next nextLine() */
+                p_port->pendingSMS = strdup(line);
+                p_port->pendingSMSType = type;
+            } else {
+                processLine(p_port, line, type);
+            }
+        }
+
+        /* dispatch as we go, so a burst never fills the queue */
+        while (p_channel->unsolHead != p_channel->unsolTail) {
+            dispatchUnsolicited(p_channel);
+        }
+    }
+
+    if (p_port->ATTail - p_port->ATHead == MAX_AT_RESPONSE) {
+        spillLine(p_port);
+    }
+}
+
+/**
+ * Does the work of the reader and dispatch threads for a polled channel:
+ * reads the channel if "readable" is set (only call it then, the read
+ * blocks), handles complete lines, writes queued commands and times out
+ * the command in flight. Unsolicited handlers and command callbacks run
+ * on the calling thread, which must therefore not send synchronous
+ * commands on this channel.
+ * Calls for the same channel must not overlap.
+ *
+ * Returns how long the caller may wait for input before calling again,
+ * in msec (-1 is until fd or the wake fd is readable), or
+ * AT_ERROR_CHANNEL_CLOSED once the channel is closed
+ */
+int at_channel_poll(ATChannel *p_channel, int readable)
+{
+    ATPort *p_port = &p_channel->ports[0];
+    int timeout;
+
+    if (!p_channel->polled || !p_port->initialized) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    /* drain the wakeups this call is about to handle, even when closed */
+#ifdef AT_REACTOR
+    {
+        uint64_t count;
+
+        if (read(p_port->eventFd, &count, sizeof(count)) < 0) {}
+    }
+#else
+    {
+        char drain[16];
+
+        while (read(p_port->wakeFds[0], drain, sizeof(drain)) > 0);
+    }
+#endif /*AT_REACTOR*/
+
+    if (p_port->fd < 0 || p_port->readerClosed) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    p_channel->tid_poll = pthread_self();
+    p_channel->polling = 1;
+
+    p_port->readerWakeups++;
+
+    if (readable) {
+        ssize_t count = readInput(p_port);
+
+        if (count <= 0) {
+            if(count == 0) {
+                ALOGD("atchannel: EOF reached");
+            } else {
+                ALOGD("atchannel: read error %s", strerror(errno));
+            }
+
+            p_channel->polling = 0;
+            onReaderClosed(p_port);
+            return AT_ERROR_CHANNEL_CLOSED;
+        }
+
+        processPolledLines(p_port);
+    }
+
+    timeout = serviceCommands(p_port);
+
+    p_channel->polling = 0;
+
+    return timeout;
+}
+
+/** closes p_port and fails its commands */
+static void closePort(ATPort *p_port)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommand *p_done = NULL;
+
+    if (p_port->fd >= 0) {
+        close(p_port->fd);
+    }
+    p_port->fd = -1;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    p_port->readerClosed = 1;
+
+    failAllCommands(p_port, AT_ERROR_CHANNEL_CLOSED, &p_done);
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    runCompletions(p_done);
+
+    /* the reader thread should eventually die */
+    wakeReader(p_port);
+}
+
+/* FIXME is it ok to call this from the reader and the command thread? */
+void at_channel_close(ATChannel *p_channel)
+{
+    int i;
+
+    for (i = 0 ; i < AT_MAX_PORTS ; i++) {
+        closePort(&p_channel->ports[i]);
+    }
+}
+
+static void onDefaultUnsolicited(ATChannel *p_channel, const char *s,
+                                    const char *sms_pdu, ATLineType type)
+{
+    (void) p_channel;
+
+    if (s_unsolHandler != NULL) {
+        s_unsolHandler(s, sms_pdu, type);
+    }
+}
+
+int at_open(int fd, ATUnsolHandler h)
+{
+    s_unsolHandler = h;
+
+    return at_channel_open(at_channel_default(), fd,
+                            h != NULL ? onDefaultUnsolicited : NULL);
+}
+
+int at_open_port(int port, int fd)
+{
+    return at_channel_open_port(at_channel_default(), port, fd);
+}
+
+void at_close()
+{
+    at_channel_close(at_channel_default());
+}
+
+static ATResponse * at_response_new()
+{
+    ATArena *p_arena;
+    ATArenaBlock *p_first;
+
+    p_arena = (ATArena *) malloc(sizeof(ATArena) + sizeof(ATArenaBlock)
+                                    + AT_ARENA_BLOCK_SIZE);
+    p_first = (ATArenaBlock *) (p_arena + 1);
+
+    memset(&p_arena->response, 0, sizeof(ATResponse));
+    p_arena->p_last = NULL;
+    p_first->p_next = NULL;
+    p_first->used = 0;
+    p_first->size = AT_ARENA_BLOCK_SIZE;
+    p_arena->p_block = p_first;
+
+    return &p_arena->response;
+}
+
+void at_response_free(ATResponse *p_response)
+{
+    ATArena *p_arena = (ATArena *) p_response;
+    ATArenaBlock *p_block;
+
+    if (p_response == NULL) return;
+
+    p_block = p_arena->p_block;
+
+    /* every block but the first was allocated on its own */
+    while (p_block->p_next != NULL) {
+        ATArenaBlock *p_toFree;
+
+        p_toFree = p_block;
+        p_block = p_block->p_next;
+
+        free(p_toFree);
+    }
+
+    free (p_arena);
+}
+
+/** returns 1 if p_a and p_b would get the same response */
+static int isSameQuery(const ATCommand *p_a, const ATCommand *p_b)
+{
+    if (p_a->type != p_b->type || p_a->smsPDU != NULL
+        || strcmp(p_a->command, p_b->command) != 0
+    ) {
+        return 0;
+    }
+
+    if (p_a->responsePrefix == NULL || p_b->responsePrefix == NULL) {
+        return p_a->responsePrefix == p_b->responsePrefix;
+    }
+
+    return strcmp(p_a->responsePrefix, p_b->responsePrefix) == 0;
+}
+
+/**
+ * returns a queued command, not yet written, that p_cmd can share the
+ * response of, or NULL
+ * assumes commandmutex is held
+ */
+static ATCommand *findLeader(ATPort *p_port, const ATCommand *p_cmd)
+{
+    ATChannel *p_channel = p_port->p_channel;
+    ATCommand *p_leader;
+    size_t i;
+
+    if (p_cmd->smsPDU != NULL) {
+        return NULL;
+    }
+
+    for (i = 0 ; i < NUM_ELEMS(s_coalescible) ; i++) {
+        if (strcmp(p_cmd->command, s_coalescible[i]) == 0) break;
+    }
+
+    if (i == NUM_ELEMS(s_coalescible)) {
+        return NULL;
+    }
+
+    /* not pCurrent: the modem may have answered it before p_cmd was made */
+    for (p_leader = p_port->pQueueHead[p_cmd->priority]
+            ; p_leader != NULL ; p_leader = p_leader->p_next
+    ) {
+        if (isSameQuery(p_leader, p_cmd)) break;
+    }
+
+    if (p_leader != NULL) {
+        p_channel->coalescedCounts[i]++;
+    }
+
+    return p_leader;
+}
+
+/**
+ * returns the port p_cmd goes to: port 0, unless its verb is routed to
+ * a secondary port and one is open, in which case the open secondary
+ * port with the fewest commands, or for a pinned verb the first open
+ * secondary port
+ * assumes commandmutex is held
+ */
+static ATPort *routeCommand(ATChannel *p_channel, const ATCommand *p_cmd)
+{
+    ATPortRoute route = s_verbPolicies[p_cmd->verb].route;
+    ATPort *p_best = &p_channel->ports[0];
+    int i;
+
+    if (route == AT_ROUTE_PRIMARY) {
+        return p_best;
+    }
+
+    for (i = 1 ; i < AT_MAX_PORTS ; i++) {
+        ATPort *p_port = &p_channel->ports[i];
+
+        if (p_port->fd < 0 || p_port->readerClosed > 0
+            || !p_port->routable
+        ) {
+            continue;
+        }
+
+        if (route == AT_ROUTE_PINNED) {
+            return p_port;
+        }
+
+        if (p_best == &p_channel->ports[0]
+            || p_port->depth < p_best->depth
+        ) {
+            p_best = p_port;
+        }
+    }
+
+    return p_best;
+}
+
+/**
+ * Internal async send_command implementation
+ * Returns 0 if the command was queued, in which case callback will be
+ * called exactly once (with NULL, the response is just freed)
+ *
+ * p_port is the port to queue on, or NULL to route by the verb
+ * timeoutMsec == AT_TIMEOUT_DEFAULT means the command verb's timeout,
+ * AT_TIMEOUT_INFINITE means no timeout
+ */
+static int queueCommand (ATChannel *p_channel, ATPort *p_port,
+                    const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec,
+                    ATCommandCallback callback, void *param)
+{
+    size_t commandLen = strlen(command) + 1;
+    size_t prefixLen = responsePrefix != NULL ? strlen(responsePrefix) + 1 : 0;
+    size_t pduLen = smspdu != NULL ? strlen(smspdu) + 1 : 0;
+    ATCommand *p_cmd;
+    ATCommand *p_leader;
+    ATCommand *p_done = NULL;
+    int err = 0;
+
+    p_cmd = (ATCommand *) malloc(sizeof(ATCommand)
+                                    + commandLen + prefixLen + pduLen);
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    memcpy(p_cmd->command, command, commandLen);
+    p_cmd->responsePrefix = NULL;
+    p_cmd->smsPDU = NULL;
+
+    if (responsePrefix != NULL) {
+        p_cmd->responsePrefix = p_cmd->command + commandLen;
+        memcpy((char *) p_cmd->responsePrefix, responsePrefix, prefixLen);
+    }
+
+    if (smspdu != NULL) {
+        p_cmd->smsPDU = p_cmd->command + commandLen + prefixLen;
+        memcpy((char *) p_cmd->smsPDU, smspdu, pduLen);
+    }
+
+    p_cmd->type = type;
+    p_cmd->verb = findVerbPolicy(command);
+    p_cmd->priority = s_verbPolicies[p_cmd->verb].priority;
+    p_cmd->timeoutMsec = timeoutMsec == AT_TIMEOUT_DEFAULT
+                            ? s_verbPolicies[p_cmd->verb].timeoutMsec
+                            : timeoutMsec;
+    p_cmd->deadline = 0;
+    p_cmd->callback = callback;
+    p_cmd->param = param;
+    p_cmd->reportTimeout = callback != NULL && callback != onCommandComplete;
+    p_cmd->err = 0;
+    p_cmd->p_response = NULL;
+    p_cmd->p_next = NULL;
+    p_cmd->p_followers = NULL;
+    p_cmd->track = (at_trace_mask & AT_TRACE_SPANS)
+                        ? at_trace_get_track() : 0;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    if (p_port == NULL) {
+        p_port = routeCommand(p_channel, p_cmd);
+    }
+
+    if (p_port->fd < 0 || p_port->readerClosed > 0) {
+        err = AT_ERROR_CHANNEL_CLOSED;
+        free(p_cmd);
+    } else if ((p_leader = findLeader(p_port, p_cmd)) != NULL) {
+        AT_TRACE_SPAN(AT_SPAN_BEGIN, p_cmd->track, p_cmd, "AT",
+                        command, commandLen - 1);
+        appendCommand(&p_leader->p_followers, p_cmd);
+    } else {
+        ATCommandPriority priority = p_cmd->priority;
+
+        AT_TRACE_SPAN(AT_SPAN_BEGIN, p_cmd->track, p_cmd, "AT",
+                        command, commandLen - 1);
+
+        p_cmd->queuedNsec = monotonicNsec();
+
+        if (p_port->pQueueTail[priority] == NULL) {
+            p_port->pQueueHead[priority] = p_cmd;
+        } else {
+            p_port->pQueueTail[priority]->p_next = p_cmd;
+        }
+        p_port->pQueueTail[priority] = p_cmd;
+        p_port->depth++;
+        p_channel->classStats[priority].depth++;
+
+#ifdef AT_REACTOR
+        /* the reactor does the write */
+        wakeReader(p_port);
+#else
+        startNextCommand(p_port, &p_done);
+#endif /*AT_REACTOR*/
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    runCompletions(p_done);
+
+    return err;
+}
+
+/* a blocking caller, waiting on commandcond for its command */
+typedef struct {
+    ATChannel *p_channel;
+    int done;
+    int err;
+    ATResponse *p_response;
+} ATCommandWaiter;
+
+static void onCommandComplete(int err, ATResponse *p_response, void *param)
+{
+    ATCommandWaiter *p_waiter = (ATCommandWaiter *) param;
+    ATChannel *p_channel = p_waiter->p_channel;
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    p_waiter->err = err;
+    p_waiter->p_response = p_response;
+    p_waiter->done = 1;
+
+    pthread_cond_broadcast(&p_channel->commandcond);
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+}
+
+/**
+ * Queues a command and waits for it to complete
+ * Doesn't check the thread or call the timeout callback
+ */
+static int sendCommandAndWait (ATChannel *p_channel,
+                    const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    ATCommandWaiter waiter;
+    int err;
+
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.p_channel = p_channel;
+
+    err = queueCommand (p_channel, NULL, command, type, responsePrefix,
+                            smspdu, timeoutMsec, onCommandComplete, &waiter);
+
+    if (err < 0) {
+        return err;
+    }
+
+    pthread_mutex_lock(&p_channel->commandmutex);
+
+    while (!waiter.done) {
+        pthread_cond_wait(&p_channel->commandcond,
+                            &p_channel->commandmutex);
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    if (pp_outResponse == NULL) {
+        at_response_free(waiter.p_response);
+    } else {
+        *pp_outResponse = waiter.p_response;
+    }
+
+    return waiter.err;
+}
+
+/**
+ * returns 1 if called from a port's reader thread, the unsolicited
+ * dispatch thread or the thread polling a polled channel, which must
+ * not wait for commands
+ */
+static int isChannelThread(ATChannel *p_channel)
+{
+    int i;
+
+    for (i = 0 ; i < AT_MAX_PORTS ; i++) {
+        const ATPort *p_port = &p_channel->ports[i];
+
+        if (p_port->fd >= 0
+            && 0 != pthread_equal(p_port->tid_reader, pthread_self())
+        ) {
+            return 1;
+        }
+    }
+
+    if (p_channel->polling
+        && 0 != pthread_equal(p_channel->tid_poll, pthread_self())
+    ) {
+        return 1;
+    }
+
+    return 0 != pthread_equal(p_channel->tid_unsol, pthread_self());
+}
+
+/**
+ * Issue a command on p_channel and wait for its response
+ *
+ * timeoutMsec == AT_TIMEOUT_DEFAULT means the command verb's timeout,
+ * AT_TIMEOUT_INFINITE means no timeout
+ */
+int at_channel_send_command (ATChannel *p_channel, const char *command,
+                    ATCommandType type, const char *responsePrefix,
+                    const char *smspdu, long long timeoutMsec,
+                    ATResponse **pp_outResponse)
+{
+    int err;
+
+    if (isChannelThread(p_channel)) {
+        /* cannot be called from reader thread or unsolicited handler */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    err = sendCommandAndWait(p_channel, command, type, responsePrefix,
+                    smspdu, timeoutMsec, pp_outResponse);
+
+    if (err == AT_ERROR_TIMEOUT && p_channel->onTimeout != NULL) {
+        p_channel->onTimeout(p_channel);
+    }
+
+    return err;
+}
+
+/** Queue a command on p_channel, see at_send_command_async */
+int at_channel_send_command_async (ATChannel *p_channel,
+                    const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec,
+                    ATCommandCallback callback, void *param)
+{
+    return queueCommand (p_channel, NULL, command, type, responsePrefix,
+                    smspdu, timeoutMsec, callback, param);
+}
+
+/**
+ * Internal send_command implementation, on the default channel
+ */
+static int at_send_command_full (const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    return at_channel_send_command (at_channel_default(), command, type,
+                    responsePrefix, smspdu, timeoutMsec, pp_outResponse);
+}
+
+
+/**
+ * Issue a single normal AT command with no intermediate response expected
+ *
+ * "command" should not include \r
+ * pp_outResponse can be NULL
+ *
+ * if non-NULL, the resulting ATResponse * must be eventually freed with
+ * at_response_free
+ */
+int at_send_command (const char *command, ATResponse **pp_outResponse)
+{
+    return at_send_command_timeout (command, AT_TIMEOUT_DEFAULT,
+                                    pp_outResponse);
+}
+
+
+int at_send_command_timeout (const char *command, long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, NO_RESULT, NULL,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_singleline (const char *command,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    return at_send_command_singleline_timeout (command, responsePrefix,
+                                    AT_TIMEOUT_DEFAULT, pp_outResponse);
+}
+
+
+int at_send_command_singleline_timeout (const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, SINGLELINE, responsePrefix,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_numeric (const char *command,
+                                 ATResponse **pp_outResponse)
+{
+    return at_send_command_numeric_timeout (command, AT_TIMEOUT_DEFAULT,
+                                    pp_outResponse);
+}
+
+
+int at_send_command_numeric_timeout (const char *command,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, NUMERIC, NULL,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_sms (const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    return at_send_command_sms_timeout (command, pdu, responsePrefix,
+                                    AT_TIMEOUT_DEFAULT, pp_outResponse);
+}
+
+
+int at_send_command_sms_timeout (const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, SINGLELINE, responsePrefix,
+                                    pdu, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+
+int at_send_command_multiline (const char *command,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    return at_send_command_multiline_timeout (command, responsePrefix,
+                                    AT_TIMEOUT_DEFAULT, pp_outResponse);
+}
+
+
+int at_send_command_multiline_timeout (const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    int err;
+
+    err = at_send_command_full (command, MULTILINE, responsePrefix,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+
+/**
+ * Queue a command without waiting for its response
+ *
+ * Returns 0 if the command was queued, AT_ERROR_* otherwise. Once queued,
+ * callback is invoked exactly once with the result: usually on the reader
+ * thread, or on the calling thread if the command can't be written.
+ * The callback owns the response and may queue further commands, but
+ * must not block in the synchronous at_send_command_* functions.
+ * callback may be NULL if the result is not wanted
+ */
+int at_send_command_async (const char *command, long long timeoutMsec,
+                                ATCommandCallback callback, void *param)
+{
+    return at_channel_send_command_async (at_channel_default(), command,
+                                NO_RESULT, NULL, NULL,
+                                timeoutMsec, callback, param);
+}
+
+
+int at_send_command_singleline_async (const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *param)
+{
+    return at_channel_send_command_async (at_channel_default(), command,
+                                SINGLELINE, responsePrefix, NULL,
+                                timeoutMsec, callback, param);
+}
+
+
+int at_send_command_numeric_async (const char *command,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *param)
+{
+    return at_channel_send_command_async (at_channel_default(), command,
+                                NUMERIC, NULL, NULL,
+                                timeoutMsec, callback, param);
+}
+
+
+int at_send_command_sms_async (const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *param)
+{
+    return at_channel_send_command_async (at_channel_default(), command,
+                                SINGLELINE, responsePrefix, pdu,
+                                timeoutMsec, callback, param);
+}
+
+
+int at_send_command_multiline_async (const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *param)
+{
+    return at_channel_send_command_async (at_channel_default(), command,
+                                MULTILINE, responsePrefix, NULL,
+                                timeoutMsec, callback, param);
+}
+
+
+/**
+ * This callback is invoked on the command thread, or for a command
+ * queued with a callback, on the reader thread (the polling thread of a
+ * polled channel) once that callback has run
+ */
+void at_channel_set_on_timeout(ATChannel *p_channel,
+                                void (*onTimeout)(ATChannel *p_channel))
+{
+    p_channel->onTimeout = onTimeout;
+}
+
+/**
+ *  This callback is invoked on the reader thread (like ATUnsolHandler)
+ *  when the input stream closes before you call at_channel_close
+ *  (not when you call at_channel_close())
+ *  You should still call at_channel_close()
+ */
+
+void at_channel_set_on_reader_closed(ATChannel *p_channel,
+                                void (*onClose)(ATChannel *p_channel))
+{
+    p_channel->onReaderClosed = onClose;
+}
+
+static void onDefaultTimeout(ATChannel *p_channel)
+{
+    (void) p_channel;
+
+    if (s_onTimeout != NULL) {
+        s_onTimeout();
+    }
+}
+
+static void onDefaultReaderClosed(ATChannel *p_channel)
+{
+    (void) p_channel;
+
+    if (s_onReaderClosed != NULL) {
+        s_onReaderClosed();
+    }
+}
+
+void at_set_on_timeout(void (*onTimeout)(void))
+{
+    s_onTimeout = onTimeout;
+    at_channel_set_on_timeout(at_channel_default(),
+                                onTimeout != NULL ? onDefaultTimeout : NULL);
+}
+
+void at_set_on_reader_closed(void (*onClose)(void))
+{
+    s_onReaderClosed = onClose;
+    at_channel_set_on_reader_closed(at_channel_default(),
+                                onClose != NULL ? onDefaultReaderClosed : NULL);
+}
+
+
+/**
+ * Periodically issue an AT command and wait for a response.
+ * Used to ensure channel has start up and is active
+ */
 
-#else // OMAP_CSMI_POWER_CONTROL
-    s_ackPowerIoctl = 0;
+int at_channel_handshake(ATChannel *p_channel)
+{
+    int i;
+    int err = 0;
 
-#endif // OMAP_CSMI_POWER_CONTROL
-#endif /*HAVE_ANDROID_OS*/
+    if (isChannelThread(p_channel)) {
+        /* cannot be called from reader thread or unsolicited handler */
+        return AT_ERROR_INVALID_THREAD;
+    }
 
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
+        /* some stacks start with verbose off */
+        err = sendCommandAndWait (p_channel, "ATE0Q0V1", NO_RESULT,
+                    NULL, NULL, HANDSHAKE_TIMEOUT_MSEC, NULL);
+
+        if (err == 0) {
+            break;
+        }
+    }
 
-    ret = pthread_create(&s_tid_reader, &attr, readerLoop, &attr);
+    if (err == 0) {
+        /* pause for a bit to let the input buffer drain any unmatched OK's
+           (they will appear as extraneous unsolicited responses) */
 
-    if (ret < 0) {
-        perror ("pthread_create");
-        return -1;
+        sleepMsec(HANDSHAKE_TIMEOUT_MSEC);
     }
 
+    return err;
+}
 
-    return 0;
+int at_handshake()
+{
+    return at_channel_handshake(at_channel_default());
 }
 
-/* FIXME is it ok to call this from the reader and the command thread? */
-void at_close()
+/**
+ * Starts recording the channel's traffic into p_capture, which several
+ * channels may share, with id in their records to tell them apart.
+ * NULL stops recording; once it returns the caller may close the
+ * capture it replaced
+ */
+void at_channel_set_capture(ATChannel *p_channel, ATCapture *p_capture,
+                            int id)
 {
-    if (s_fd >= 0) {
-        close(s_fd);
+    if (p_capture != NULL) {
+        p_channel->captureId = id;
     }
-    s_fd = -1;
 
-    pthread_mutex_lock(&s_commandmutex);
+    (void) __sync_lock_test_and_set(&p_channel->p_capture, p_capture);
+
+    /* wait for the I/O paths that may still use the old one */
+    while (p_channel->captureUsers > 0) {
+        sched_yield();
+    }
+}
+
+static ATCapture *s_defaultCapture;
 
-    s_readerClosed = 1;
+/**
+ * Records the default channel's traffic into a new capture file of
+ * size bytes, replacing any capture already running
+ * returns 0 on success, -1 on error
+ */
+int at_start_capture(const char *path, size_t size)
+{
+    ATCapture *p_capture = at_capture_open(path, size);
 
-    pthread_cond_signal(&s_commandcond);
+    if (p_capture == NULL) {
+        ALOGE("Can't create AT capture %s: %s", path, strerror(errno));
+        return -1;
+    }
 
-    pthread_mutex_unlock(&s_commandmutex);
+    at_stop_capture();
 
-    /* the reader thread should eventually die */
+    at_channel_set_capture(at_channel_default(), p_capture, 0);
+    s_defaultCapture = p_capture;
+
+    return 0;
 }
 
-static ATResponse * at_response_new()
+void at_stop_capture()
 {
-    return (ATResponse *) calloc(1, sizeof(ATResponse));
+    at_channel_set_capture(at_channel_default(), NULL, 0);
+
+    if (s_defaultCapture != NULL) {
+        at_capture_close(s_defaultCapture);
+        s_defaultCapture = NULL;
+    }
 }
 
-void at_response_free(ATResponse *p_response)
+/** FNV-1a, case-insensitive like the verb matching */
+static unsigned int hashCommand(const char *command)
 {
-    ATLine *p_line;
+    unsigned int hash = 2166136261U;
 
-    if (p_response == NULL) return;
+    for ( ; *command != '\0' ; command++) {
+        hash = (hash ^ (unsigned char) tolower(*command)) * 16777619U;
+    }
 
-    p_line = p_response->p_intermediates;
+    return hash;
+}
 
-    while (p_line != NULL) {
-        ATLine *p_toFree;
+/**
+ * returns 1 if command may share a line with others
+ * assumes commandmutex is held
+ */
+static int isBatchable(ATChannel *p_channel, const char *command)
+{
+    unsigned int hash;
+    size_t i;
+    int j;
 
-        p_toFree = p_line;
-        p_line = p_line->p_next;
+    if (strncasecmp(command, "AT", 2) != 0 || command[2] == '\0') {
+        return 0;
+    }
 
-        free(p_toFree->line);
-        free(p_toFree);
+    for (i = 0 ; i < NUM_ELEMS(s_unbatchableVerbs) ; i++) {
+        if (strncasecmp(command + 2, s_unbatchableVerbs[i],
+                    strlen(s_unbatchableVerbs[i])) == 0) {
+            return 0;
+        }
     }
 
-    free (p_response->finalResponse);
-    free (p_response);
+    hash = hashCommand(command);
+
+    for (j = 0 ; j < p_channel->unbatchableCount ; j++) {
+        if (p_channel->unbatchable[j] == hash) {
+            return 0;
+        }
+    }
+
+    return 1;
 }
 
 /**
- * The line reader places the intermediate responses in reverse order
- * here we flip them back
+ * returns 1 if command ends with an extended syntax command, eg
+ * "AT+CMEE=1" or "ATE0;^CURC=0", which V.250 wants a ';' after if
+ * another command follows on the line. Basic commands ("E0", "&C1",
+ * "S0=0") are concatenated without one
  */
-static void reverseIntermediates(ATResponse *p_response)
+static int endsExtended(const char *command)
 {
-    ATLine *pcur,*pnext;
+    int extended = 0;
+    int quoted = 0;
+
+    for (command += 2 ; *command != '\0' ; command++) {
+        if (*command == '"') {
+            quoted = !quoted;
+        } else if (quoted) {
+            continue;
+        } else if (*command == ';') {
+            extended = 0;
+        } else if (strchr("+^%$", *command) != NULL) {
+            extended = 1;
+        }
+    }
 
-    pcur = p_response->p_intermediates;
-    p_response->p_intermediates = NULL;
+    return extended;
+}
 
-    while (pcur != NULL) {
-        pnext = pcur->p_next;
-        pcur->p_next = p_response->p_intermediates;
-        p_response->p_intermediates = pcur;
-        pcur = pnext;
+/** assumes commandmutex is held */
+static void setUnbatchable(ATChannel *p_channel, const char *command)
+{
+    if (p_channel->unbatchableCount < MAX_UNBATCHABLE) {
+        ALOGI("AT batching: sending %s alone from now on", command);
+        p_channel->unbatchable[p_channel->unbatchableCount++] =
+                hashCommand(command);
     }
 }
 
 /**
- * Internal send_command implementation
- * Doesn't lock or call the timeout callback
+ * Sends count commands, packed "ATE0&C1+A;+B" into as few lines of at
+ * most the channel's batch limit as their order allows, see
+ * at_channel_set_batch_limit(). A line that fails is resent one command
+ * at a time; the commands that fail alone, or all of them if none does,
+ * are not batched again on this channel
  *
- * timeoutMsec == 0 means infinite timeout
+ * returns the number of commands answered with an error, or the
+ * AT_ERROR_* that stopped the batch
  */
-
-static int at_send_command_full_nolock (const char *command, ATCommandType type,
-                    const char *responsePrefix, const char *smspdu,
-                    long long timeoutMsec, ATResponse **pp_outResponse)
+int at_channel_send_batch(ATChannel *p_channel,
+                            const char * const *commands, int count)
 {
-    int err = 0;
-#ifndef USE_NP
-    struct timespec ts;
-#endif /*USE_NP*/
+    ATResponse *p_response = NULL;
+    char line[AT_BATCH_MAX_LINE + 1];
+    size_t maxLine;
+    int errors = 0;
+    int failed;
+    int first;
+    int last;
+    int err;
+    int i;
 
-    if(sp_response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
+    if (isChannelThread(p_channel)) {
+        return AT_ERROR_INVALID_THREAD;
     }
 
-    err = writeline (command);
+    pthread_mutex_lock(&p_channel->commandmutex);
+    maxLine = p_channel->batchMaxLine;
+    pthread_mutex_unlock(&p_channel->commandmutex);
 
-    if (err < 0) {
-        goto error;
-    }
+    for (first = 0 ; first < count ; first = last) {
+        size_t len = strlen(commands[first]);
 
-    s_type = type;
-    s_responsePrefix = responsePrefix;
-    s_smsPDU = smspdu;
-    sp_response = at_response_new();
+        last = first + 1;
 
-#ifndef USE_NP
-    if (timeoutMsec != 0) {
-        setTimespecRelative(&ts, timeoutMsec);
-    }
-#endif /*USE_NP*/
+        pthread_mutex_lock(&p_channel->commandmutex);
 
-    while (sp_response->finalResponse == NULL && s_readerClosed == 0) {
-        if (timeoutMsec != 0) {
-#ifdef USE_NP
-            err = pthread_cond_timeout_np(&s_commandcond, &s_commandmutex, timeoutMsec);
-#else
-            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex, &ts);
-#endif /*USE_NP*/
+        if (len <= maxLine && isBatchable(p_channel, commands[first])) {
+            memcpy(line, commands[first], len);
+
+            /* the next ones go in without their "AT" */
+            while (last < count
+                && len + strlen(commands[last]) - 1 <= maxLine
+                && isBatchable(p_channel, commands[last])
+            ) {
+                if (endsExtended(commands[last - 1])) {
+                    line[len++] = ';';
+                }
+                strcpy(line + len, commands[last] + 2);
+                len += strlen(commands[last] + 2);
+                last++;
+            }
+            line[len] = '\0';
+        }
+
+        pthread_mutex_unlock(&p_channel->commandmutex);
+
+        if (last == first + 1) {
+            err = at_channel_send_command(p_channel, commands[first],
+                        NO_RESULT, NULL, NULL, AT_TIMEOUT_DEFAULT,
+                        &p_response);
         } else {
-            err = pthread_cond_wait(&s_commandcond, &s_commandmutex);
+            err = at_channel_send_command(p_channel, line, NO_RESULT,
+                        NULL, NULL, AT_TIMEOUT_DEFAULT, &p_response);
         }
 
-        if (err == ETIMEDOUT) {
-            err = AT_ERROR_TIMEOUT;
-            goto error;
+        if (err < 0) {
+            return err;
         }
-    }
 
-    if (pp_outResponse == NULL) {
-        at_response_free(sp_response);
-    } else {
-        /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(sp_response);
-        *pp_outResponse = sp_response;
-    }
+        pthread_mutex_lock(&p_channel->commandmutex);
+        p_channel->batchLines++;
+        p_channel->batchCommands += last - first;
+        pthread_mutex_unlock(&p_channel->commandmutex);
 
-    sp_response = NULL;
+        if (p_response->success) {
+            at_response_free(p_response);
+            continue;
+        }
 
-    if(s_readerClosed > 0) {
-        err = AT_ERROR_CHANNEL_CLOSED;
-        goto error;
-    }
+        at_response_free(p_response);
 
-    err = 0;
-error:
-    clearPendingCommand();
+        if (last == first + 1) {
+            errors++;
 
-    return err;
-}
+            /* it would sink the next batch it were in */
+            pthread_mutex_lock(&p_channel->commandmutex);
+            if (isBatchable(p_channel, commands[first])) {
+                setUnbatchable(p_channel, commands[first]);
+            }
+            pthread_mutex_unlock(&p_channel->commandmutex);
+            continue;
+        }
 
-/**
- * Internal send_command implementation
- *
- * timeoutMsec == 0 means infinite timeout
- */
-static int at_send_command_full (const char *command, ATCommandType type,
-                    const char *responsePrefix, const char *smspdu,
-                    long long timeoutMsec, ATResponse **pp_outResponse)
-{
-    int err;
+        /* settings are idempotent, so the ones that took can be resent */
+        ALOGI("AT batching: \"%s\" failed, sending it one by one", line);
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
-        /* cannot be called from reader thread */
-        return AT_ERROR_INVALID_THREAD;
-    }
+        failed = 0;
 
-    pthread_mutex_lock(&s_commandmutex);
+        for (i = first ; i < last ; i++) {
+            err = at_channel_send_command(p_channel, commands[i], NO_RESULT,
+                        NULL, NULL, AT_TIMEOUT_DEFAULT, &p_response);
 
-    err = at_send_command_full_nolock(command, type,
-                    responsePrefix, smspdu,
-                    timeoutMsec, pp_outResponse);
+            if (err < 0) {
+                return err;
+            }
 
-    pthread_mutex_unlock(&s_commandmutex);
+            if (!p_response->success) {
+                failed++;
 
-    if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
-        s_onTimeout();
+                pthread_mutex_lock(&p_channel->commandmutex);
+                setUnbatchable(p_channel, commands[i]);
+                pthread_mutex_unlock(&p_channel->commandmutex);
+            }
+
+            at_response_free(p_response);
+        }
+
+        pthread_mutex_lock(&p_channel->commandmutex);
+
+        p_channel->batchFallbacks++;
+        p_channel->batchLines += last - first;
+        errors += failed;
+
+        if (failed == 0) {
+            /* they only fail together, eg the line is too long */
+            for (i = first ; i < last ; i++) {
+                setUnbatchable(p_channel, commands[i]);
+            }
+        }
+
+        pthread_mutex_unlock(&p_channel->commandmutex);
     }
 
-    return err;
+    return errors;
 }
 
+int at_send_batch(const char * const *commands, int count)
+{
+    return at_channel_send_batch(at_channel_default(), commands, count);
+}
 
 /**
- * Issue a single normal AT command with no intermediate response expected
- *
- * "command" should not include \r
- * pp_outResponse can be NULL
- *
- * if non-NULL, the resulting ATResponse * must be eventually freed with
- * at_response_free
+ * maxLine is capped at AT_BATCH_MAX_LINE, and 0 sends every command on
+ * its own line
  */
-int at_send_command (const char *command, ATResponse **pp_outResponse)
+void at_channel_set_batch_limit(ATChannel *p_channel, int maxLine)
 {
-    int err;
-
-    err = at_send_command_full (command, NO_RESULT, NULL,
-                                    NULL, 0, pp_outResponse);
+    if (maxLine < 0) {
+        maxLine = 0;
+    } else if (maxLine > AT_BATCH_MAX_LINE) {
+        maxLine = AT_BATCH_MAX_LINE;
+    }
 
-    return err;
+    pthread_mutex_lock(&p_channel->commandmutex);
+    p_channel->batchMaxLine = maxLine;
+    pthread_mutex_unlock(&p_channel->commandmutex);
 }
 
+void at_set_batch_limit(int maxLine)
+{
+    at_channel_set_batch_limit(at_channel_default(), maxLine);
+}
 
-int at_send_command_timeout (const char *command, long long timeout, ATResponse **pp_outResponse)
+/**
+ * Logs the channel counters at info level
+ */
+void at_channel_dump_stats(ATChannel *p_channel)
 {
-    int err;
+    ATUnsolQueueStats unsol;
+    size_t i;
+    int port;
 
-    err = at_send_command_full (command, NO_RESULT, NULL,
-                                    NULL, timeout, pp_outResponse);
+    for (port = 0 ; port < AT_MAX_PORTS ; port++) {
+        ATPort *p_port = &p_channel->ports[port];
+        long long busy = p_port->readerBusyNsec;
+        long long elapsed = monotonicNsec() - p_port->readerOpenNsec;
+        ATPortStats stats;
 
-    return err;
-}
+        if (p_port->readerOpenNsec == 0) {
+            /* never opened */
+            continue;
+        }
 
+        ALOGI("AT%d reader: %llu bytes, %llu lines, %llu bytes/s sustained",
+                port, p_port->readerBytes, p_port->readerLines,
+                busy > 0 ? p_port->readerBytes * 1000000000ULL / busy : 0);
 
-int at_send_command_singleline (const char *command,
-                                const char *responsePrefix,
-                                 ATResponse **pp_outResponse)
-{
-    int err;
+        ALOGI("AT%d reader: %llu wakeups, %llu/s (%s)",
+                port, p_port->readerWakeups, elapsed > 0
+                    ? p_port->readerWakeups * 1000000000ULL / elapsed : 0,
+#ifdef AT_REACTOR
+                "epoll reactor"
+#else
+                "poll"
+#endif /*AT_REACTOR*/
+                );
+
+        ALOGI("AT%d writer: %llu commands, %llu bytes in %llu write calls",
+                port, p_port->writerCommands, p_port->writerBytes,
+                p_port->writerSyscalls);
+
+        at_channel_get_port_stats(p_channel, port, &stats);
+
+        ALOGI("AT%d port: %s, %llu commands, %u queued, %lld%% busy, "
+                "%llu stray lines dropped, %llu late responses discarded",
+                port, stats.open ? "open" : "closed", stats.commands,
+                stats.depth, stats.openMsec > 0
+                    ? stats.busyMsec * 100 / stats.openMsec : 0,
+                p_port->readerUnsolDropped, p_port->resyncDiscarded);
+    }
 
-    err = at_send_command_full (command, SINGLELINE, responsePrefix,
-                                    NULL, 0, pp_outResponse);
+    at_channel_get_unsol_queue_stats(p_channel, &unsol);
 
-    if (err == 0 && pp_outResponse != NULL
-        && (*pp_outResponse)->success > 0
-        && (*pp_outResponse)->p_intermediates == NULL
-    ) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
-    }
+    ALOGI("AT unsolicited queue: depth %u (max %u), %llu dispatched, "
+            "%llu status reports dropped, %llu waits for room",
+            unsol.depth, unsol.maxDepth, unsol.dispatched, unsol.dropped,
+            unsol.waits);
 
-    return err;
-}
+    pthread_mutex_lock(&p_channel->commandmutex);
 
+    ALOGI("AT commands: %llu answered, average round trip %lld us",
+            p_channel->commandRoundTrips, p_channel->commandRoundTrips > 0
+                ? p_channel->commandRoundTripNsec / 1000
+                    / (long long) p_channel->commandRoundTrips
+                : 0);
 
-int at_send_command_numeric (const char *command,
-                                 ATResponse **pp_outResponse)
-{
-    int err;
+    for (i = 0 ; i < AT_PRIORITY_COUNT ; i++) {
+        const ATCommandClassStats *p_stats = &p_channel->classStats[i];
 
-    err = at_send_command_full (command, NUMERIC, NULL,
-                                    NULL, 0, pp_outResponse);
+        ALOGI("AT %s commands: %llu written, %u queued, wait avg %lld ms "
+                "max %lld ms, %llu promoted by aging",
+                s_priorityNames[i], p_stats->commands, p_stats->depth,
+                p_stats->commands > 0
+                    ? p_stats->totalWaitMsec / (long long) p_stats->commands
+                    : 0,
+                p_stats->maxWaitMsec, p_stats->promoted);
+    }
 
-    if (err == 0 && pp_outResponse != NULL
-        && (*pp_outResponse)->success > 0
-        && (*pp_outResponse)->p_intermediates == NULL
-    ) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
+    for (i = 0 ; i < NUM_ELEMS(s_coalescible) ; i++) {
+        if (p_channel->coalescedCounts[i] > 0) {
+            ALOGI("AT round trips saved on %s: %llu",
+                    s_coalescible[i], p_channel->coalescedCounts[i]);
+        }
     }
 
-    return err;
+    if (p_channel->batchLines > 0) {
+        ALOGI("AT batching: %llu commands in %llu lines, %llu fallbacks, "
+                "%d commands sent alone", p_channel->batchCommands,
+                p_channel->batchLines, p_channel->batchFallbacks,
+                p_channel->unbatchableCount);
+    }
+
+    for (i = 0 ; i < NUM_ELEMS(s_verbPolicies) ; i++) {
+        if (p_channel->verbTimeoutCounts[i] > 0) {
+            ALOGI("AT timeouts on %s: %u (limit %lld ms)",
+                    s_verbPolicies[i].verb[0] != '\0'
+                        ? s_verbPolicies[i].verb : "other commands",
+                    p_channel->verbTimeoutCounts[i],
+                    s_verbPolicies[i].timeoutMsec);
+        }
+    }
+
+    pthread_mutex_unlock(&p_channel->commandmutex);
+
+    at_channel_dump_latency(p_channel);
 }
 
+void at_dump_stats()
+{
+    at_channel_dump_stats(at_channel_default());
+}
 
-int at_send_command_sms (const char *command,
-                                const char *pdu,
-                                const char *responsePrefix,
-                                 ATResponse **pp_outResponse)
+/**
+ * Copies the latency of the index'th verb. The counters are read one
+ * at a time while commands complete, so the copy may be off by the
+ * commands completing meanwhile
+ */
+int at_channel_get_latency_stats(ATChannel *p_channel, int index,
+                                    ATLatencyStats *p_stats)
 {
-    int err;
+    if (index < 0 || (size_t) index >= NUM_ELEMS(s_verbPolicies)) {
+        return -1;
+    }
 
-    err = at_send_command_full (command, SINGLELINE, responsePrefix,
-                                    pdu, 0, pp_outResponse);
+    *p_stats = p_channel->latency[index];
+    p_stats->verb = s_verbPolicies[index].verb;
 
-    if (err == 0 && pp_outResponse != NULL
-        && (*pp_outResponse)->success > 0
-        && (*pp_outResponse)->p_intermediates == NULL
-    ) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
+    return 0;
+}
+
+/** returns the upper bound in usec of the bucket holding percentile pct */
+static unsigned long long latencyPercentile(const unsigned int *buckets,
+                                            unsigned long long count,
+                                            int pct)
+{
+    unsigned long long rank = (count * pct + 99) / 100;
+    unsigned long long seen = 0;
+    int i;
+
+    for (i = 0 ; i < AT_LATENCY_BUCKETS - 1 ; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            break;
+        }
     }
 
-    return err;
+    return 1ULL << i;
 }
 
-
-int at_send_command_multiline (const char *command,
-                                const char *responsePrefix,
-                                 ATResponse **pp_outResponse)
+void at_channel_dump_latency(ATChannel *p_channel)
 {
-    int err;
+    ATLatencyStats stats;
+    int i;
 
-    err = at_send_command_full (command, MULTILINE, responsePrefix,
-                                    NULL, 0, pp_outResponse);
+    for (i = 0 ; at_channel_get_latency_stats(p_channel, i, &stats) == 0
+                ; i++) {
+        if (stats.count == 0) {
+            continue;
+        }
 
-    return err;
+        ALOGI("AT latency %s: %llu commands, wait avg %llu p50 <%llu "
+                "p99 <%llu us, wire avg %llu p50 <%llu p90 <%llu "
+                "p99 <%llu us",
+                stats.verb[0] != '\0' ? stats.verb : "other commands",
+                stats.count, stats.waitUsec / stats.count,
+                latencyPercentile(stats.wait, stats.count, 50),
+                latencyPercentile(stats.wait, stats.count, 99),
+                stats.wireUsec / stats.count,
+                latencyPercentile(stats.wire, stats.count, 50),
+                latencyPercentile(stats.wire, stats.count, 90),
+                latencyPercentile(stats.wire, stats.count, 99));
+    }
 }
 
-
-/** This callback is invoked on the command thread */
-void at_set_on_timeout(void (*onTimeout)(void))
+int at_get_latency_stats(int index, ATLatencyStats *p_stats)
 {
-    s_onTimeout = onTimeout;
+    return at_channel_get_latency_stats(at_channel_default(), index,
+                                        p_stats);
 }
 
-/**
- *  This callback is invoked on the reader thread (like ATUnsolHandler)
- *  when the input stream closes before you call at_close
- *  (not when you call at_close())
- *  You should still call at_close()
- */
-
-void at_set_on_reader_closed(void (*onClose)(void))
+void at_dump_latency()
 {
-    s_onReaderClosed = onClose;
+    at_channel_dump_latency(at_channel_default());
 }
 
+void at_channel_get_command_class_stats(ATChannel *p_channel,
+                                    ATCommandPriority priority,
+                                    ATCommandClassStats *p_stats)
+{
+    pthread_mutex_lock(&p_channel->commandmutex);
+    *p_stats = p_channel->classStats[priority];
+    pthread_mutex_unlock(&p_channel->commandmutex);
+}
 
 /**
- * Periodically issue an AT command and wait for a response.
- * Used to ensure channel has start up and is active
+ * Fills p_stats with the utilisation of port, ie the share of the time
+ * since it was opened that it had a command in flight
  */
-
-int at_handshake()
+void at_channel_get_port_stats(ATChannel *p_channel, int port,
+                                    ATPortStats *p_stats)
 {
-    int i;
-    int err = 0;
+    ATPort *p_port;
+    long long now = monotonicNsec();
+    long long busy;
 
-    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
-        /* cannot be called from reader thread */
-        return AT_ERROR_INVALID_THREAD;
+    memset(p_stats, 0, sizeof(*p_stats));
+
+    if (port < 0 || port >= AT_MAX_PORTS) {
+        return;
     }
 
-    pthread_mutex_lock(&s_commandmutex);
+    p_port = &p_channel->ports[port];
 
-    for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
-        /* some stacks start with verbose off */
-        err = at_send_command_full_nolock ("ATE0Q0V1", NO_RESULT,
-                    NULL, NULL, HANDSHAKE_TIMEOUT_MSEC, NULL);
+    pthread_mutex_lock(&p_channel->commandmutex);
 
-        if (err == 0) {
-            break;
-        }
+    busy = p_port->busyNsec;
+    if (p_port->pCurrent != NULL) {
+        busy += now - p_port->pCurrent->writtenNsec;
     }
 
-    if (err == 0) {
-        /* pause for a bit to let the input buffer drain any unmatched OK's
-           (they will appear as extraneous unsolicited responses) */
+    p_stats->open = p_port->fd >= 0 && p_port->readerClosed == 0;
+    p_stats->depth = p_port->depth;
+    p_stats->commands = p_port->commands;
+    p_stats->busyMsec = busy / 1000000LL;
+    p_stats->openMsec = p_port->readerOpenNsec != 0
+                            ? (now - p_port->readerOpenNsec) / 1000000LL : 0;
+    p_stats->written = p_port->writerCommands;
+    p_stats->writeCalls = p_port->writerSyscalls;
 
-        sleepMsec(HANDSHAKE_TIMEOUT_MSEC);
-    }
+    pthread_mutex_unlock(&p_channel->commandmutex);
+}
+
+void at_channel_get_unsol_queue_stats(ATChannel *p_channel,
+                                    ATUnsolQueueStats *p_stats)
+{
+    p_stats->depth = p_channel->unsolTail - p_channel->unsolHead;
+    p_stats->maxDepth = p_channel->unsolMaxDepth;
+    p_stats->dispatched = p_channel->unsolDispatched;
+    p_stats->dropped = p_channel->unsolDropped;
+    p_stats->waits = p_channel->unsolWaits;
+}
 
-    pthread_mutex_unlock(&s_commandmutex);
+void at_get_command_class_stats(ATCommandPriority priority,
+                                    ATCommandClassStats *p_stats)
+{
+    at_channel_get_command_class_stats(at_channel_default(), priority,
+                                        p_stats);
+}
 
-    return err;
+void at_get_port_stats(int port, ATPortStats *p_stats)
+{
+    at_channel_get_port_stats(at_channel_default(), port, p_stats);
+}
+
+void at_get_unsol_queue_stats(ATUnsolQueueStats *p_stats)
+{
+    at_channel_get_unsol_queue_stats(at_channel_default(), p_stats);
 }
 
 /**
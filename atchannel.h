@@ -18,6 +18,8 @@
 #ifndef ATCHANNEL_H
 #define ATCHANNEL_H 1
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,6 +53,47 @@ typedef enum {
                     starting with a prefix */
 } ATCommandType;
 
+/**
+ * Lines are classified by their prefix once, on the reader thread,
+ * and the type is passed on to the unsolicited handler
+ * The order of the final responses and SMS types matters to atchannel.c
+ */
+typedef enum {
+    AT_LINE_OTHER = 0,      /* none of the prefixes below */
+
+    /* final responses, see 27.007 annex B */
+    AT_LINE_OK,
+    AT_LINE_CONNECT,
+    AT_LINE_ERROR,
+    AT_LINE_CMS_ERROR,
+    AT_LINE_CME_ERROR,
+    AT_LINE_NO_CARRIER,     /* sometimes unsolicited */
+    AT_LINE_NO_ANSWER,
+    AT_LINE_NO_DIALTONE,
+
+    /* first line of a two-line SMS unsolicited response */
+    AT_LINE_CMT,
+    AT_LINE_CDS,
+    AT_LINE_CBM,
+
+    /* unsolicited result codes */
+    AT_LINE_CTZV,           /* +CTZV: or %CTZV: */
+    AT_LINE_CTZDST,
+    AT_LINE_HTCCTZV,
+    AT_LINE_CRING,
+    AT_LINE_RING,
+    AT_LINE_CCWA,
+    AT_LINE_RSSI,           /* ^RSSI: */
+    AT_LINE_CREG,
+    AT_LINE_CGREG,
+    AT_LINE_CGEV,
+    AT_LINE_HTC_ERIIND,
+    AT_LINE_CUSD,
+    AT_LINE_BOOT,           /* ^BOOT: */
+    AT_LINE_DSFLOWRPT,      /* ^DSFLOWRPT: */
+    AT_LINE_MODE            /* ^MODE: */
+} ATLineType;
+
 /** a singly-lined list of intermediate responses */
 typedef struct ATLine  {
     struct ATLine *p_next;
@@ -67,17 +110,46 @@ typedef struct {
 
 /**
  * a user-provided unsolicited response handler function
- * this will be called from the reader thread, so do not block
+ * this will be called from the unsolicited dispatch thread, in the order
+ * the lines were received. AT commands may not be issued from it, and
+ * blocking delays the lines queued behind
  * "s" is the line, and "sms_pdu" is either NULL or the PDU response
  * for multi-line TS 27.005 SMS PDU responses (eg +CMT:)
+ * "type" is what the prefix of "s" classified as
  */
-typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu);
+typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu,
+                                ATLineType type);
 
 int at_open(int fd, ATUnsolHandler h);
 void at_close();
 
+/*
+ * Huawei dongles expose several AT ports. Port 0 is the one at_open()
+ * starts on and the only one unsolicited responses are taken from.
+ * at_open_port() adds a secondary port (1 to AT_MAX_PORTS - 1), which
+ * takes the slow and bulk commands (eg +COPS=?, +CPBR) routed to it by
+ * atchannel.c's verb table, so they don't hold up calls and SMS.
+ * Routed commands go to port 0 while no secondary port is open.
+ * at_close() closes every port
+ * returns 0 on success, -1 on error
+ */
+#define AT_MAX_PORTS 4
+
+int at_open_port(int port, int fd);
+
+/*
+ * Commands sent on each secondary port as it opens, before any command
+ * is routed to it, so that the routed commands are answered as on
+ * port 0 (eg +CMEE, +CSCS). Set it before at_open_port(); commands
+ * must stay valid while the channel is in use
+ */
+void at_set_port_init(const char * const *commands, int count);
+
 /* This callback is invoked on the command thread.
-   You should reset or handshake here to avoid getting out of sync */
+   You should reset or handshake here to avoid getting out of sync
+   Asynchronous commands that time out invoke it on the reader thread,
+   after their callback got AT_ERROR_TIMEOUT; those queued without a
+   callback don't invoke it */
 void at_set_on_timeout(void (*onTimeout)(void));
 /* This callback is invoked on the reader thread (like ATUnsolHandler)
    when the input stream closes before you call at_close
@@ -87,28 +159,184 @@ void at_set_on_timeout(void (*onTimeout)(void));
    channel is already closed */
 void at_set_on_reader_closed(void (*onClose)(void));
 
+/*
+ * Timeouts for the at_send_command_*_timeout variants, in msec
+ * The plain variants use AT_TIMEOUT_DEFAULT, which picks the timeout
+ * for the command's verb (eg +CSQ, +COPS=?, D) from atchannel.c's table
+ */
+#define AT_TIMEOUT_DEFAULT 0
+#define AT_TIMEOUT_INFINITE (-1)
+
 int at_send_command_singleline (const char *command,
                                 const char *responsePrefix,
                                  ATResponse **pp_outResponse);
 
+int at_send_command_singleline_timeout (const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse);
+
 int at_send_command_numeric (const char *command,
                                  ATResponse **pp_outResponse);
 
+int at_send_command_numeric_timeout (const char *command,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse);
+
 int at_send_command_multiline (const char *command,
                                 const char *responsePrefix,
                                  ATResponse **pp_outResponse);
 
+int at_send_command_multiline_timeout (const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse);
+
 
 int at_handshake();
 
 int at_send_command (const char *command, ATResponse **pp_outResponse);
 
+int at_send_command_timeout (const char *command, long long timeoutMsec,
+                            ATResponse **pp_outResponse);
+
 int at_send_command_sms (const char *command, const char *pdu,
                             const char *responsePrefix,
                             ATResponse **pp_outResponse);
 
+int at_send_command_sms_timeout (const char *command, const char *pdu,
+                            const char *responsePrefix,
+                            long long timeoutMsec,
+                            ATResponse **pp_outResponse);
+
 void at_response_free(ATResponse *p_response);
 
+/**
+ * Completion of an asynchronous command, normally on the reader thread
+ * "err" is 0 or AT_ERROR_*. p_response is NULL unless err is 0, and must
+ * be freed with at_response_free
+ */
+typedef void (*ATCommandCallback)(int err, ATResponse *p_response,
+                                    void *param);
+
+int at_send_command_async (const char *command, long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+int at_send_command_singleline_async (const char *command,
+                            const char *responsePrefix,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+int at_send_command_numeric_async (const char *command,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+int at_send_command_multiline_async (const char *command,
+                            const char *responsePrefix,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+int at_send_command_sms_async (const char *command, const char *pdu,
+                            const char *responsePrefix,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+/*
+ * Sends independent settings, commands without an intermediate
+ * response, packed "ATE0&C1+A;+B" into lines of at most the batch limit
+ * (AT_BATCH_MAX_LINE unless lowered), so they take one round trip per
+ * line instead of one each. A line that fails is resent one command at
+ * a time, and the commands that failed are sent alone from then on.
+ * Resets (ATZ, AT&F), dial/answer commands and +COPS are never packed
+ * returns the number of commands answered with an error, or the
+ * AT_ERROR_* that stopped the batch
+ */
+#define AT_BATCH_MAX_LINE 256
+
+int at_send_batch(const char * const *commands, int count);
+void at_set_batch_limit(int maxLine);
+
+/*
+ * Records everything read from and written to the modem into a binary
+ * capture file, see at_capture.h, that can be replayed offline
+ * returns 0 on success, -1 on error
+ */
+int at_start_capture(const char *path, size_t size);
+void at_stop_capture();
+
+/* Logs channel counters (reader throughput etc) at info level */
+void at_dump_stats();
+
+/*
+ * Scheduling classes of queued commands, highest first
+ * The class of a command is picked from its verb, see atchannel.c
+ */
+typedef enum {
+    AT_PRIORITY_CALL = 0,       /* emergency and call control: ATD, ATA... */
+    AT_PRIORITY_SMS,
+    AT_PRIORITY_STATUS,         /* polls like +CSQ, +CREG, and the default */
+    AT_PRIORITY_BACKGROUND,     /* slow refreshes like +COPS=?, +CPBR */
+    AT_PRIORITY_COUNT
+} ATCommandPriority;
+
+typedef struct {
+    unsigned int depth;             /* commands waiting to be written */
+    unsigned long long commands;    /* commands written */
+    unsigned long long promoted;    /* written ahead of a higher class
+                                       because they waited too long */
+    long long totalWaitMsec;        /* time spent queued, over all commands */
+    long long maxWaitMsec;
+} ATCommandClassStats;
+
+void at_get_command_class_stats(ATCommandPriority priority,
+                                    ATCommandClassStats *p_stats);
+
+typedef struct {
+    unsigned int depth;             /* lines waiting for the handler */
+    unsigned int maxDepth;          /* high-water mark of depth */
+    unsigned long long dispatched;  /* lines passed to the handler */
+    unsigned long long dropped;     /* status reports dropped as it backed up */
+    unsigned long long waits;       /* times the reader waited for room */
+} ATUnsolQueueStats;
+
+void at_get_unsol_queue_stats(ATUnsolQueueStats *p_stats);
+
+typedef struct {
+    int open;
+    unsigned int depth;             /* commands queued or in flight */
+    unsigned long long commands;    /* commands completed on the port */
+    long long busyMsec;             /* time with a command in flight */
+    long long openMsec;             /* time since the port was opened */
+    unsigned long long written;     /* commands and PDUs written */
+    unsigned long long writeCalls;  /* write() calls it took */
+} ATPortStats;
+
+void at_get_port_stats(int port, ATPortStats *p_stats);
+
+/*
+ * Latency of the commands of one verb of the timeout policy table, split
+ * into the time from being queued to being written (wait) and from
+ * being written to the final response or timeout (wire). The buckets
+ * are log2 microseconds: bucket 0 counts times under 1 us, bucket i
+ * those in [2^(i-1), 2^i) us, and the last one everything longer
+ */
+#define AT_LATENCY_BUCKETS 28
+
+typedef struct {
+    const char *verb;               /* without "AT"; "" for other commands */
+    unsigned long long count;
+    unsigned long long waitUsec;    /* over all commands */
+    unsigned long long wireUsec;
+    unsigned int wait[AT_LATENCY_BUCKETS];
+    unsigned int wire[AT_LATENCY_BUCKETS];
+} ATLatencyStats;
+
+/* returns -1 once index is past the last verb */
+int at_get_latency_stats(int index, ATLatencyStats *p_stats);
+
+/* Logs the latency percentiles of every verb used, at info level */
+void at_dump_latency();
+
 typedef enum {
     CME_ERROR_NON_CME = -1,
     CME_SUCCESS = 0,
@@ -117,6 +345,87 @@ typedef enum {
 
 AT_CME_Error at_get_cme_error(const ATResponse *p_response);
 
+/*
+ * Channel API
+ *
+ * An ATChannel holds all the state of one modem: its AT ports, their
+ * readers and command queues, the unsolicited dispatch thread and the
+ * counters, so one process can drive several modems. The functions
+ * above are wrappers around a default channel, the same as
+ * at_channel_default()
+ *
+ * Channels are never freed: close one with at_channel_close() and
+ * reopen it with at_channel_open() when the modem comes back
+ */
+
+typedef struct ATChannel ATChannel;
+
+/* as ATUnsolHandler, with the channel the line arrived on */
+typedef void (*ATChannelUnsolHandler)(ATChannel *p_channel, const char *s,
+                                const char *sms_pdu, ATLineType type);
+
+/* "param" is returned by at_channel_get_param() */
+ATChannel *at_channel_new(void *param);
+ATChannel *at_channel_default();
+void *at_channel_get_param(ATChannel *p_channel);
+
+int at_channel_open(ATChannel *p_channel, int fd, ATChannelUnsolHandler h);
+int at_channel_open_port(ATChannel *p_channel, int port, int fd);
+void at_channel_set_port_init(ATChannel *p_channel,
+                                const char * const *commands, int count);
+void at_channel_close(ATChannel *p_channel);
+
+/*
+ * Polled channels have no threads of their own, so one event loop can
+ * drive many modems: watch the fd and at_channel_get_wake_fd() and call
+ * at_channel_poll() when either is readable or its timeout expires.
+ * Handlers and callbacks run on the polling thread, which may only use
+ * at_channel_send_command_async() on the channel
+ */
+int at_channel_open_polled(ATChannel *p_channel, int fd,
+                            ATChannelUnsolHandler h);
+int at_channel_get_wake_fd(ATChannel *p_channel);
+int at_channel_poll(ATChannel *p_channel, int readable);
+
+void at_channel_set_on_timeout(ATChannel *p_channel,
+                            void (*onTimeout)(ATChannel *p_channel));
+void at_channel_set_on_reader_closed(ATChannel *p_channel,
+                            void (*onClose)(ATChannel *p_channel));
+
+/* responsePrefix and pdu as for the at_send_command_* variants of type */
+int at_channel_send_command (ATChannel *p_channel, const char *command,
+                            ATCommandType type, const char *responsePrefix,
+                            const char *pdu, long long timeoutMsec,
+                            ATResponse **pp_outResponse);
+
+int at_channel_send_command_async (ATChannel *p_channel,
+                            const char *command, ATCommandType type,
+                            const char *responsePrefix, const char *pdu,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *param);
+
+int at_channel_handshake(ATChannel *p_channel);
+
+struct ATCapture;
+void at_channel_set_capture(ATChannel *p_channel,
+                            struct ATCapture *p_capture, int id);
+
+int at_channel_send_batch(ATChannel *p_channel,
+                            const char * const *commands, int count);
+void at_channel_set_batch_limit(ATChannel *p_channel, int maxLine);
+
+void at_channel_dump_stats(ATChannel *p_channel);
+void at_channel_get_command_class_stats(ATChannel *p_channel,
+                            ATCommandPriority priority,
+                            ATCommandClassStats *p_stats);
+void at_channel_get_unsol_queue_stats(ATChannel *p_channel,
+                            ATUnsolQueueStats *p_stats);
+void at_channel_get_port_stats(ATChannel *p_channel, int port,
+                            ATPortStats *p_stats);
+int at_channel_get_latency_stats(ATChannel *p_channel, int index,
+                            ATLatencyStats *p_stats);
+void at_channel_dump_latency(ATChannel *p_channel);
+
 #ifdef __cplusplus
 }
 #endif
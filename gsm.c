@@ -339,7 +339,7 @@ utf8_skip( cbytes_t   utf8,
     for ( ; count > 0; count-- ) {
         int  c;
 
-        if (p > end)
+        if (p >= end)
             break;
 
         c = *p++;
@@ -369,6 +369,7 @@ utf8_next( cbytes_t  *pp, cbytes_t  end )
 
             while (p < end && (p[0] & 0xc0) == 0x80) {
                 c = (c << 6) | (p[0] & 0x3f);
+                p++;
             }
         }
         result = c;
@@ -379,7 +380,7 @@ Exit:
 }
 
 
-__inline__ int
+static __inline__ int
 utf8_write( bytes_t  utf8, int  offset, int  v )
 {
     int  result;
@@ -612,6 +613,7 @@ utf8_from_gsm7( cbytes_t  src,
 
         if (escaped) {
             v = gsm7bits_extend_to_unicode[c];
+            escaped = 0;
         } else if (c == GSM_7BITS_ESCAPE) {
             escaped = 1;
             goto NextSeptet;
@@ -0,0 +1,28 @@
+/*
+ * Host stand-in for <utils/Log.h>, so the codec and tokenizer files
+ * build off the device, see ril_bench.c. Logging is compiled out, it
+ * would only time stdio; build with -DHOST_LOG to get it on stderr
+ */
+
+#ifndef HOST_UTILS_LOG_H
+#define HOST_UTILS_LOG_H 1
+
+#include <stdio.h>
+
+#ifdef HOST_LOG
+#define HOST_LOG_PRINT(level, ...) \
+    (fprintf(stderr, level "/" LOG_TAG ": " __VA_ARGS__), \
+     fputc('\n', stderr))
+#else
+/* never called, but the arguments still count as used and are checked */
+#define HOST_LOG_PRINT(level, ...) \
+    ((void) (0 && fprintf(stderr, __VA_ARGS__)))
+#endif
+
+#define ALOGV(...) HOST_LOG_PRINT("V", __VA_ARGS__)
+#define ALOGD(...) HOST_LOG_PRINT("D", __VA_ARGS__)
+#define ALOGI(...) HOST_LOG_PRINT("I", __VA_ARGS__)
+#define ALOGW(...) HOST_LOG_PRINT("W", __VA_ARGS__)
+#define ALOGE(...) HOST_LOG_PRINT("E", __VA_ARGS__)
+
+#endif /* HOST_UTILS_LOG_H */
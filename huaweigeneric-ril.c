@@ -28,12 +28,16 @@
 #include <alloca.h>
 #include "atchannel.h"
 #include "at_tok.h"
+#include "at_schema.h"
+#include "at_capture.h"
+#include "at_trace.h"
 #include "misc.h"
 #include "gsm.h"
 #include <getopt.h>
 #include <sys/socket.h>
 #include <cutils/sockets.h>
 #include <termios.h>
+#include <time.h>
 #include <cutils/properties.h>
 
 #define LOG_NDEBUG 0
@@ -52,6 +56,8 @@
 /* pathname returned from RIL_REQUEST_SETUP_DATA_CALL / RIL_REQUEST_SETUP_DEFAULT_PDP */
 #define PPP_TTY_PATH "ppp0"
 
+#define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
+
 #ifdef USE_TI_COMMANDS
 
 // Enable workaround for bug in (TI-based) HTC stack
@@ -101,11 +107,20 @@ static const RIL_RadioFunctions s_callbacks = {
 #ifdef RIL_SHLIB
 static const struct RIL_Env *s_rilenv;
 
-#define RIL_onRequestComplete(t, e, response, responselen) s_rilenv->OnRequestComplete(t,e, response, responselen)
+#define completeRequest(t, e, response, responselen) s_rilenv->OnRequestComplete(t,e, response, responselen)
 #define RIL_onUnsolicitedResponse(a,b,c) s_rilenv->OnUnsolicitedResponse(a,b,c)
 #define RIL_requestTimedCallback(a,b,c) s_rilenv->RequestTimedCallback(a,b,c)
+#else
+#define completeRequest(t, e, response, responselen) (RIL_onRequestComplete)(t,e, response, responselen)
 #endif
 
+/* ends the span onRequest() began for the request, see -J */
+#define RIL_onRequestComplete(t, e, response, responselen) \
+	do { \
+		AT_TRACE_SPAN(AT_SPAN_END, (intptr_t) (t), (t), "complete", NULL, 0); \
+		completeRequest(t, e, response, responselen); \
+	} while (0)
+
 static RIL_RadioState sState = RADIO_STATE_UNAVAILABLE;
 
 static pthread_mutex_t s_state_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -115,13 +130,26 @@ static int s_port = -1;
 static const char * s_device_path = NULL;
 static int          s_device_socket = 0;
 
+/* secondary AT ports (-D), for the commands atchannel routes off port 0 */
+static const char * s_secondary_paths[AT_MAX_PORTS - 1];
+static int          s_secondary_count = 0;
+
+/* a capture (-r) replayed in place of the modem, over and over */
+static const char * s_replay_path = NULL;
+
+/* where the request spans go when the AT channel goes down (-J) */
+static const char * s_trace_json_path = NULL;
+
 /* trigger change to this with s_state_cond */
 static int s_closed = 0;
 
 static int sFD;     /* file desc of AT channel */
 static char sATBuffer[MAX_AT_RESPONSE+1];
 static char *sATBufferCur = NULL;
-static char *sNITZtime = NULL;
+static char sNITZtime[64];
+
+/* when initializeCallback started, for the time to radio ready */
+static long long s_initStartMsec;
 
 static const struct timeval TIMEVAL_SIMPOLL = {1,0};
 static const struct timeval TIMEVAL_CALLSTATEPOLL = {0,500000};
@@ -143,6 +171,15 @@ static int s_expectAnswer = 0;
 static void pollSIMState (void *param);
 static void setRadioState(RIL_RadioState newState);
 
+static long long monotonicMsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
 static int isgsm=0;
 static char erisystem[50];
 static char *callwaiting_num;
@@ -150,18 +187,16 @@ static int countValidCalls=0;
 
 static void handle_cdma_ccwa (const char *s)
 {
-	int err;
-	char *line, *tmp;
+	ATTokLine tok;
+	const char *num;
+	size_t len;
 
-	line = tmp = strdup(s);
-	err = at_tok_start(&tmp);
-	if (err)
+	if (at_tok_split(s, &tok) < 0)
 		return;
-	err = at_tok_nextstr(&tmp, &callwaiting_num);
-	if (err)
+	if (at_tok_field_str(&tok, 0, &num, &len) < 0)
 		return;
-	callwaiting_num = strdup(callwaiting_num);
-	free(line);
+	free(callwaiting_num);
+	callwaiting_num = strndup(num, len);
 	ALOGE("successfully set callwaiting_numn");
 }
 
@@ -240,50 +275,32 @@ static int callFromCLCCLine(char *line, RIL_Call *p_call)
 	//+CLCC: 1,0,2,0,0,\"+18005551212\",145
 	//     index,isMT,state,mode,isMpty(,number,TOA)?
 
+	ATClcc clcc;
 	int err;
-	int state;
-	int mode;
-
-	err = at_tok_start(&line);
-	if (err < 0) goto error;
-
-	err = at_tok_nextint(&line, &(p_call->index));
-	if (err < 0) goto error;
-
-	err = at_tok_nextbool(&line, &(p_call->isMT));
-	if (err < 0) goto error;
 
-	err = at_tok_nextint(&line, &state);
-	if (err < 0) goto error;
+	clcc.number = NULL;
+	clcc.toa = 0;
 
-	err = clccStateToRILState(state, &(p_call->state));
+	err = at_schema_parse(&at_schema_clcc, line, &clcc);
 	if (err < 0) goto error;
 
-	err = at_tok_nextint(&line, &mode);
+	err = clccStateToRILState(clcc.state, &(p_call->state));
 	if (err < 0) goto error;
 
-	p_call->isVoice = (mode == 0);
-
-	err = at_tok_nextbool(&line, &(p_call->isMpty));
-	if (err < 0) goto error;
-
-	if (at_tok_hasmore(&line)) {
-		err = at_tok_nextstr(&line, &(p_call->number));
-
-		/* tolerate null here */
-		if (err < 0) return 0;
+	p_call->index = clcc.index;
+	p_call->isMT = clcc.isMT;
+	p_call->isVoice = (clcc.mode == 0);
+	p_call->isMpty = clcc.isMpty;
+	p_call->toa = clcc.toa;
 
-		// Some lame implementations return strings
-		// like "NOT AVAILABLE" in the CLCC line
-		if (p_call->number != NULL
-				&& 0 == strspn(p_call->number, "+0123456789")
-		   ) {
-			p_call->number = NULL;
-		}
-
-		err = at_tok_nextint(&line, &p_call->toa);
-		if (err < 0) goto error;
+	// Some lame implementations return strings
+	// like "NOT AVAILABLE" in the CLCC line
+	if (clcc.number != NULL
+			&& 0 == strspn(clcc.number, "+0123456789")
+	   ) {
+		clcc.number = NULL;
 	}
+	p_call->number = clcc.number;
 
 	return 0;
 
@@ -379,6 +396,40 @@ static void onRadioPowerOn()
 	pollSIMState(NULL);
 }
 
+/* settings that need the SIM, sent by onSIMReady() */
+static const char * const s_simReadyCommands[] = {
+	/* Preferred RAT - UMTS Dualmode */
+	//"AT+XRAT=1,2",
+
+	//debug what type of sim is it?
+	//"AT+SIMTYPE",
+
+	/*
+	 * Always send SMS messages directly to the TE
+	 *
+	 * mode = 1 // discard when link is reserved (link should never be
+	 *             reserved)
+	 * mt = 2   // most messages routed to TE
+	 * bm = 2   // new cell BM's routed to TE
+	 * ds = 1   // Status reports routed to TE
+	 * bfr = 1  // flush buffer
+	 */
+	"AT+CNMI=1,2,2,1,1",
+
+	"AT+CSCB=1",
+
+	/*  Enable +CGEV GPRS event notifications, but don't buffer */
+	//"AT+CGEREP=1,0",
+
+	/* Enable NITZ reporting */
+	"AT+CTZU=1",
+	"AT+CTZR=1",
+	//"AT+HTCCTZR=1",
+
+	/* Enable unsolizited RSSI reporting */
+	//"AT@HTCCSQ=1",
+};
+
 /** do post- SIM ready initialization */
 static void onSIMReady()
 {
@@ -388,46 +439,17 @@ static void onSIMReady()
 	at_send_command("AT+COPS=0", NULL);
 
 	if(isgsm) {
-		/* Preferred RAT - UMTS Dualmode */
-//		at_send_command("AT+XRAT=1,2", NULL);
-
-		//debug what type of sim is it?
-		//at_send_command("AT+SIMTYPE", NULL);
-
-		/*
-		 * Always send SMS messages directly to the TE
-		 *
-		 * mode = 1 // discard when link is reserved (link should never be
-		 *             reserved)
-		 * mt = 2   // most messages routed to TE
-		 * bm = 2   // new cell BM's routed to TE
-		 * ds = 1   // Status reports routed to TE
-		 * bfr = 1  // flush buffer
-		 */
-		at_send_command("AT+CNMI=1,2,2,1,1", NULL);
-
-		at_send_command("AT+CSCB=1", NULL);
-
-		/*  Enable +CGEV GPRS event notifications, but don't buffer */
-//		at_send_command("AT+CGEREP=1,0", NULL);
-
-		/* Enable NITZ reporting */
-		at_send_command("AT+CTZU=1", NULL);
-		at_send_command("AT+CTZR=1", NULL);
-		//at_send_command("AT+HTCCTZR=1", NULL);
-
-		/* Enable unsolizited RSSI reporting */
-		//at_send_command("AT@HTCCSQ=1", NULL);
+		at_send_batch(s_simReadyCommands, NUM_ELEMS(s_simReadyCommands));
 
 		at_send_command_singleline("AT+CSMS=1", "+CSMS:", NULL);
-
-
 	} else {
-
 		//at_send_command("AT+HTC_GPSONE=4", NULL);
 		at_send_command("AT+CLVL=5", NULL);
 		at_send_command("AT+CLVL=4", NULL);
 	}
+
+	ALOGI("radio ready %lld ms after initialization started",
+			monotonicMsec() - s_initStartMsec);
 }
 
 static void requestRadioPower(void *data, size_t datalen, RIL_Token t)
@@ -495,7 +517,6 @@ static void requestOrSendDataCallList(RIL_Token *t)
 	int fd;
 	int pppConnected = 0;
 	int n = 0;
-	char *out;
 
 	if (isgsm) {
 		err = at_send_command_multiline ("AT+CGACT?", "+CGACT:", &p_response);
@@ -530,20 +551,14 @@ static void requestOrSendDataCallList(RIL_Token *t)
 		RIL_Data_Call_Response_v6 *response = responses;
 		for (p_cur = p_response->p_intermediates; p_cur != NULL;
 				p_cur = p_cur->p_next) {
-			char *line = p_cur->line;
-
-			err = at_tok_start(&line);
-			if (err < 0)
-				goto error;
-
-			err = at_tok_nextint(&line, &response->cid);
-			if (err < 0)
-				goto error;
+			ATCgact cgact;
 
-			err = at_tok_nextint(&line, &response->active);
+			err = at_schema_parse(&at_schema_cgact, p_cur->line, &cgact);
 			if (err < 0)
 				goto error;
 
+			response->cid = cgact.cid;
+			response->active = cgact.state;
 			response++;
 		}
 
@@ -561,19 +576,14 @@ static void requestOrSendDataCallList(RIL_Token *t)
 
 		for (p_cur = p_response->p_intermediates; p_cur != NULL;
 				p_cur = p_cur->p_next) {
-			char *line = p_cur->line;
-			int cid;
-
-			err = at_tok_start(&line);
-			if (err < 0)
-				goto error;
+			ATCgdcont cgdcont;
 
-			err = at_tok_nextint(&line, &cid);
+			err = at_schema_parse(&at_schema_cgdcont, p_cur->line, &cgdcont);
 			if (err < 0)
 				goto error;
 
 			for (i = 0; i < n; i++) {
-				if (responses[i].cid == cid)
+				if (responses[i].cid == cgdcont.cid)
 					break;
 			}
 
@@ -581,31 +591,18 @@ static void requestOrSendDataCallList(RIL_Token *t)
 				/* details for a context we didn't hear about in the last request */
 				continue;
 			}
-      
-      // Assume no error
-      responses[i].status = 0;
 
-      // type
-      err = at_tok_nextstr(&line, &out);
-      if (err < 0)
-        goto error;
-      responses[i].type = alloca(strlen(out) + 1);
-      strcpy(responses[i].type, out);
+			// Assume no error, APN ignored for v5
+			responses[i].status = 0;
 
-      // APN ignored for v5
-      err = at_tok_nextstr(&line, &out);
-      if (err < 0)
-        goto error;
+			responses[i].type = alloca(strlen(cgdcont.type) + 1);
+			strcpy(responses[i].type, cgdcont.type);
 
-      responses[i].ifname = alloca(strlen(PPP_TTY_PATH) + 1);
-      strcpy(responses[i].ifname, PPP_TTY_PATH);
+			responses[i].ifname = alloca(strlen(PPP_TTY_PATH) + 1);
+			strcpy(responses[i].ifname, PPP_TTY_PATH);
 
-      err = at_tok_nextstr(&line, &out);
-      if (err < 0)
-        goto error;
-      
-			responses[i].addresses = alloca(strlen(out) + 1);
-			strcpy(responses[i].addresses, out);
+			responses[i].addresses = alloca(strlen(cgdcont.address) + 1);
+			strcpy(responses[i].addresses, cgdcont.address);
 		}
 
 		at_response_free(p_response);
@@ -736,9 +733,10 @@ static void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token
 	   +COPS: (2,"AT&T","AT&T","310410",0),(1,"T-Mobile ","TMO","310260",0)
 	 */
 
-	int err, operators, i, skip, status;
+	int err, operators, i;
 	ATResponse *p_response = NULL;
-	char * c_skip, *line, *p = NULL;
+	ATCopsEntry *entries;
+	char *line, *p;
 	char ** response = NULL;
 
 	err = at_send_command_singleline("AT+COPS=?", "+COPS:", &p_response);
@@ -747,41 +745,26 @@ static void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token
 
 	line = p_response->p_intermediates->line;
 
-	err = at_tok_start(&line);
-	if (err < 0) goto error;
-
 	/* Count number of '(' in the +COPS response to get number of operators*/
 	operators = 0;
 	for (p = line ; *p != '\0' ;p++) {
 		if (*p == '(') operators++;
 	}
 
+	entries = (ATCopsEntry *)alloca(operators * sizeof(ATCopsEntry));
+
+	operators = at_schema_parse_list(&at_schema_cops_entry, line,
+			entries, sizeof(ATCopsEntry), operators);
+	if (operators < 0) goto error;
+
 	response = (char **)alloca(operators * 4 * sizeof(char *));
 
 	for (i = 0 ; i < operators ; i++ )
 	{
-		err = at_tok_nextstr(&line, &c_skip);
-		if (err < 0) goto error;
-		if (strcmp(c_skip,"") == 0)
-		{
-			operators = i;
-			continue;
-		}
-		status = atoi(&c_skip[1]);
-		response[i*4+3] = (char*)networkStatusToRilString(status);
-
-		err = at_tok_nextstr(&line, &(response[i*4+0]));
-		if (err < 0) goto error;
-
-		err = at_tok_nextstr(&line, &(response[i*4+1]));
-		if (err < 0) goto error;
-
-		err = at_tok_nextstr(&line, &(response[i*4+2]));
-		if (err < 0) goto error;
-
-		err = at_tok_nextstr(&line, &c_skip);
-
-		if (err < 0) goto error;
+		response[i*4+0] = entries[i].longName;
+		response[i*4+1] = entries[i].shortName;
+		response[i*4+2] = entries[i].numeric;
+		response[i*4+3] = (char*)networkStatusToRilString(entries[i].stat);
 	}
 
 	RIL_onRequestComplete(t, RIL_E_SUCCESS, response, (operators * 4 * sizeof(char *)));
@@ -1361,6 +1344,26 @@ error:
 	at_response_free(p_response);
 }
 
+static const char * const s_screenOnCommands[] = {
+	"AT+CREG=2",
+	"AT+CGREG=2",
+	"AT+CGEREP=1,0",
+	//"AT@HTCPDPFD=0",
+	//"AT+ENCSQ=1",
+	//"AT@HTCCSQ=1",
+	//"AT+HTCCTZR=1",
+};
+
+static const char * const s_screenOffCommands[] = {
+	"AT+CREG=0",
+	"AT+CGREG=0",
+	"AT+CGEREP=0,0",
+	//"AT@HTCPDPFD=1",
+	//"AT+ENCSQ=0",
+	//"AT@HTCCSQ=0",
+	//"AT+HTCCTZR=2",
+};
+
 static void requestScreenState(void *data, size_t datalen, RIL_Token t)
 {
 	int err, screenState;
@@ -1372,40 +1375,18 @@ static void requestScreenState(void *data, size_t datalen, RIL_Token t)
 	{
 		if (isgsm) {
 			/* Screen is on - be sure to enable all unsolicited notifications again */
-			err = at_send_command("AT+CREG=2", NULL);
-			if (err < 0) goto error;
-			err = at_send_command("AT+CGREG=2", NULL);
-			if (err < 0) goto error;
-			err = at_send_command("AT+CGEREP=1,0", NULL);
+			err = at_send_batch(s_screenOnCommands,
+					NUM_ELEMS(s_screenOnCommands));
 			if (err < 0) goto error;
-			//err = at_send_command("AT@HTCPDPFD=0", NULL);
-			//if (err < 0) goto error;
-			//err = at_send_command("AT+ENCSQ=1",NULL);
-			//if (err < 0) goto error;
-			//err = at_send_command("AT@HTCCSQ=1", NULL);
-			//if (err < 0) goto error;
-			//err = at_send_command("AT+HTCCTZR=1", NULL);
-			//if (err < 0) goto error;
 		} else {
 
 		}
 	} else if (screenState == 0) {
 		if (isgsm) {
 			/* Screen is off - disable all unsolicited notifications */
-			err = at_send_command("AT+CREG=0", NULL);
+			err = at_send_batch(s_screenOffCommands,
+					NUM_ELEMS(s_screenOffCommands));
 			if (err < 0) goto error;
-			err = at_send_command("AT+CGREG=0", NULL);
-			if (err < 0) goto error;
-			err = at_send_command("AT+CGEREP=0,0", NULL);
-			if (err < 0) goto error;
-			//err = at_send_command("AT@HTCPDPFD=1", NULL);
-			//if (err < 0) goto error;
-			//err = at_send_command("AT+ENCSQ=0",NULL);
-			//if (err < 0) goto error;
-			//err = at_send_command("AT@HTCCSQ=0", NULL);
-			//if (err < 0) goto error;
-			//err = at_send_command("AT+HTCCTZR=2", NULL);
-			//if (err < 0) goto error;
 		} else {
 
 		}
@@ -1431,9 +1412,9 @@ static void requestRegistrationState(int request, void *data,
 	ATResponse *p_response = NULL;
 	const char *cmd;
 	const char *prefix;
-	char *line, *p;
-	int commas;
-	int skip;
+	char *line;
+	ATReg reg;
+	int fields;
 	int i;
 	int count = 4;
 	int fd;
@@ -1477,140 +1458,96 @@ static void requestRegistrationState(int request, void *data,
 	if (err < 0 || p_response->success == 0)
 		goto error;
 
-	line = p_response->p_intermediates->line;
+	/* Ok you have to be careful here
+	 * The solicited version of the CREG response is
+	 * +CREG: n, stat, [lac, cid]
+	 * and the unsolicited version is
+	 * +CREG: stat, [lac, cid]
+	 * The <n> parameter is basically "is unsolicited creg on?"
+	 * which it should always be
+	 *
+	 * This is the answer to our query, so it's the solicited version,
+	 * unless an unsolicited report came in just ahead of the answer
+	 * and took its place; that one doesn't parse, so ask again.
+	 * Some modems answer with a bare <stat>, which a report of just
+	 * <stat> in its place says the same as
+	 *
+	 * finally, a +CGREG: answer may have a fifth value that corresponds
+	 * to the network type, as in;
+	 *
+	 *   +CGREG: n, stat [,lac, cid [,networkType]]
+	 */
+	reg.n = -1;
+	reg.stat = response[0];
+	reg.lac = response[1];
+	reg.ci = response[2];
+	reg.act = response[3];
 
-	err = at_tok_start(&line);
-	if (err < 0) goto error;
+	for (i = 0; ; i++) {
+		line = p_response->p_intermediates->line;
 
-		/* Ok you have to be careful here
-		 * The solicited version of the CREG response is
-		 * +CREG: n, stat, [lac, cid]
-		 * and the unsolicited version is
-		 * +CREG: stat, [lac, cid]
-		 * The <n> parameter is basically "is unsolicited creg on?"
-		 * which it should always be
-		 *
-		 * Now we should normally get the solicited version here,
-		 * but the unsolicited version could have snuck in
-		 * so we have to handle both
-		 *
-		 * Also since the LAC and CID are only reported when registered,
-		 * we can have 1, 2, 3, or 4 arguments here
-		 *
-		 * finally, a +CGREG: answer may have a fifth value that corresponds
-		 * to the network type, as in;
-		 *
-		 *   +CGREG: n, stat [,lac, cid [,networkType]]
-		 */
+		fields = at_schema_parse_reg(line, 0, &reg);
+		if (fields < 0 && at_schema_parse_reg(line, 1, &reg) == 1)
+			fields = 0;
 
-		/* count number of commas */
-		commas = 0;
-		for (p = line ; *p != '\0' ;p++) {
-			if (*p == ',') commas++;
-		}
-
-		switch (commas) {
-			case 0: /* +CREG: <stat> */
-				err = at_tok_nextint(&line, &response[0]);
-				if (err < 0) goto error;
-				break;
+		if (fields >= 0 || i > 0)
+			break;
 
-			case 1: /* +CREG: <n>, <stat> */
-				err = at_tok_nextint(&line, &skip);
-				if (err < 0) goto error;
-				err = at_tok_nextint(&line, &response[0]);
-				if (err < 0) goto error;
-				if (err < 0) goto error;
-				break;
+		at_response_free(p_response);
+		p_response = NULL;
 
-			case 2: /* +CREG: <stat>, <lac>, <cid> */
-				err = at_tok_nextint(&line, &response[0]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[1]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[2]);
-				if (err < 0) goto error;
-				break;
-			case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-				err = at_tok_nextint(&line, &skip);
-				if (err < 0) goto error;
-				err = at_tok_nextint(&line, &response[0]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[1]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[2]);
-				if (err < 0) goto error;
-
-				/* Hack for broken +CGREG responses which don't return the network type */
-				if(request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
-					ATResponse *p_response_op = NULL;
-					err = at_send_command_singleline("AT+COPS?", "+COPS:", &p_response_op);
-					/* We need to get the 4th return param */
-					int commas_op;
-					commas_op = 0;
-					char *p_op, *line_op;
-					line_op = p_response_op->p_intermediates->line;
-
-					for (p_op = line_op ; *p_op != '\0' ;p_op++) {
-						if (*p_op == ',') commas_op++;
-					}
-
-					if (commas_op == 3) {
-						err = at_tok_start(&line_op);
-						err = at_tok_nextint(&line_op, &skip);
-						if (err < 0) goto error;
-						err = at_tok_nextint(&line_op, &skip);
-						if (err < 0) goto error;
-						err = at_tok_nextint(&line_op, &skip);
-						if (err < 0) goto error;
-						err = at_tok_nextint(&line_op, &response[3]);
-						if (err < 0) goto error;
-						/* Now translate to 'Broken Android Speak' - can't follow the GSM spec */
-						switch(response[3]) {
-							/* GSM/GSM Compact - aka GRPS */
-							case 0:
-							case 1:
-								response[3] = 1;
-								break;
-								/* EGPRS - aka EDGE */
-							case 3:
-								response[3] = 2;
-								break;
-                                                               /* UTRAN - UMTS aka 3G */
-                                                        case 2:
-                                                        case 7:
-                                                                response[3] = 3;
-                                                                break;
-                                                                /* UTRAN with HSDPA and/or HSUPA aka Turbo-3G*/
-                                                        case 4:
-                                                        case 5:
-                                                        case 6:
-                                                                response[3] = 9;
-                                                                break;
-						}
-					}
-
-					at_response_free(p_response_op);
-				}
-				break;
-				/* special case for CGREG, there is a fourth parameter
-				 * that is the network type (unknown/gprs/edge/umts)
-				 */
-			case 4: /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
-				err = at_tok_nextint(&line, &skip);
-				if (err < 0) goto error;
-				err = at_tok_nextint(&line, &response[0]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[1]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[2]);
-				if (err < 0) goto error;
-				err = at_tok_nexthexint(&line, &response[3]);
-				if (err < 0) goto error;
-				break;
-			default:
-				goto error;
+		err = at_send_command_singleline(cmd, prefix, &p_response);
+		if (err < 0 || p_response->success == 0)
+			goto error;
+	}
+	if (fields < 0) goto error;
+
+	response[0] = reg.stat;
+	response[1] = reg.lac;
+	response[2] = reg.ci;
+	response[3] = reg.act;
+
+	/* Hack for broken +CGREG responses which don't return the network type,
+	 * a solicited <n>,<stat>,<lac>,<cid> */
+	if (fields == 3
+			&& request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
+		ATResponse *p_response_op = NULL;
+		ATCops cops;
+
+		err = at_send_command_singleline("AT+COPS?", "+COPS:", &p_response_op);
+
+		/* We need the <AcT>, the 4th param */
+		if (err == 0 && p_response_op->success
+				&& at_schema_parse(&at_schema_cops,
+					p_response_op->p_intermediates->line, &cops) == 4) {
+			/* Now translate to 'Broken Android Speak' - can't follow the GSM spec */
+			switch(cops.act) {
+				/* GSM/GSM Compact - aka GRPS */
+				case 0:
+				case 1:
+					response[3] = 1;
+					break;
+					/* EGPRS - aka EDGE */
+				case 3:
+					response[3] = 2;
+					break;
+					/* UTRAN - UMTS aka 3G */
+				case 2:
+				case 7:
+					response[3] = 3;
+					break;
+					/* UTRAN with HSDPA and/or HSUPA aka Turbo-3G*/
+				case 4:
+				case 5:
+				case 6:
+					response[3] = 9;
+					break;
+			}
 		}
+
+		at_response_free(p_response_op);
+	}
+
 	if(!isgsm) {
 		if(cdma_systype==3)
 			cdma_systype=9;
@@ -1755,7 +1692,7 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t, int request)
 	pdu = ((const char **)data)[1];
 
 	tpLayerLength = strlen(pdu)/2;
-	ALOGI("SMSC=%s  PDU=%s",testSmsc,pdu);
+	AT_TRACE(AT_TRACE_SMS, "SMS PDU", pdu, strlen(pdu));
 	// "NULL for default SMSC"
 	if (testSmsc == NULL) {
 		if(isgsm){
@@ -1802,13 +1739,13 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t, int request)
 	}
 	else
 		strcpy(smsc,testSmsc);
-	ALOGI("SMSC=%s  PDU=%s",smsc,pdu);
+	AT_TRACE(AT_TRACE_SMS, "SMS SMSC", smsc, strlen(smsc));
 
 	if(!isgsm) {
 		strcpy(sendstr,"00");
 		strcat(sendstr,pdu);
-		ALOGI("GSM PDU=%s",pdu);
 		cdma=gsm_to_cdmapdu(sendstr);
+		if (cdma[0] == '\0') goto error;
 		tpLayerLength = strlen(cdma)/2;
 	}
 	asprintf(&cmd1, "AT+CMGS=%d", tpLayerLength);
@@ -1868,15 +1805,20 @@ static int wait_for_property(const char *name, const char *desired_value, int ma
         maxnaps = 1;
     }
 
+    AT_TRACE_STEP_BEGIN("wait_for_property");
+
     while (maxnaps-- > 0) {
         usleep(1000000);
         if (property_get(name, value, NULL)) {
             if (desired_value == NULL ||
                     strcmp(value, desired_value) == 0) {
+                AT_TRACE_STEP_END("wait_for_property");
                 return 0;
             }
         }
     }
+
+    AT_TRACE_STEP_END("wait_for_property");
     return -1; /* failure */
 }
 
@@ -1954,7 +1896,9 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
 		}
 		at_response_free(p_response);
 		ALOGI("ATD sent!!!\n");
+		AT_TRACE_STEP_BEGIN("sleep");
 		sleep(2); //Wait for the modem to finish
+		AT_TRACE_STEP_END("sleep");
 	} else {
 		//CDMA
 		err = at_send_command("AT+HTC_DUN=0", NULL);
@@ -1964,7 +1908,9 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
 			goto error;
 		}
 		at_response_free(p_response);
+		AT_TRACE_STEP_BEGIN("sleep");
 		sleep(2); //Wait for the modem to finish
+		AT_TRACE_STEP_END("sleep");
 	}
 
 	//set up the pap/chap secrets file
@@ -2014,7 +1960,9 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
 		free(buffer);
 	}*/
 
+	AT_TRACE_STEP_BEGIN("pppd");
 	system("/system/bin/pppd /dev/ttyUSB0 115200 nocrtscts usepeerdns debug ipcp-accept-local ipcp-accept-remote defaultroute");
+	AT_TRACE_STEP_END("pppd");
 
 	if (wait_for_property("net.ppp0.local-ip", NULL, 10) < 0) {
 		ALOGE("Timeout waiting net.ppp0.local-ip - giving up!\n");
@@ -2069,7 +2017,9 @@ static int killConn(char * cid)
 			goto error;
 		i++;
 			close(fd);
+		AT_TRACE_STEP_BEGIN("sleep");
 		sleep(2);
+		AT_TRACE_STEP_END("sleep");
 	}
 	ALOGD("killall pppd finished");
 
@@ -2153,6 +2103,7 @@ static void  requestSIM_IO(void *data, size_t datalen, RIL_Token t)
 	int err;
 	char *cmd = NULL;
 	RIL_SIM_IO_v6 *p_args;
+	ATCrsm crsm;
 	char *line;
 
 	memset(&sr, 0, sizeof(sr));
@@ -2177,21 +2128,15 @@ static void  requestSIM_IO(void *data, size_t datalen, RIL_Token t)
 			goto error;
 		}
 
-		line = p_response->p_intermediates->line;
-
-		err = at_tok_start(&line);
-		if (err < 0) goto error;
+		crsm.response = NULL;
 
-		err = at_tok_nextint(&line, &(sr.sw1));
+		err = at_schema_parse(&at_schema_crsm,
+				p_response->p_intermediates->line, &crsm);
 		if (err < 0) goto error;
 
-		err = at_tok_nextint(&line, &(sr.sw2));
-		if (err < 0) goto error;
-
-		if (at_tok_hasmore(&line)) {
-			err = at_tok_nextstr(&line, &(sr.simResponse));
-			if (err < 0) goto error;
-		}
+		sr.sw1 = crsm.sw1;
+		sr.sw2 = crsm.sw2;
+		sr.simResponse = crsm.response;
 	} else {
 		//CDMA
 		if(p_args->fileid != 0x6f40) {
@@ -2332,56 +2277,46 @@ error:
 
 static void unsolicitedNitzTime(const char * s)
 {
-	int err;
-	char * response = NULL;
-	char * line = NULL;
-	char * p = NULL;
-	char * tz = NULL; /* Timezone */
-	line = strdup(s);
+	ATTokLine tok;
+	char response[96];
+	const char * tz = NULL; /* Timezone */
+	const char * time = NULL;
+	size_t tzLen, timeLen;
 
 	/* Higher layers expect a NITZ string in this format:
 	 *  08/10/28,19:08:37-20,1 (yy/mm/dd,hh:mm:ss(+/-)tz,dst)
 	 */
 
+	if (at_tok_split(s, &tok) < 0) goto error;
+
 	if(strStartsWith(s,"+CTZV:")){
 
 		/* Get Time and Timezone data and store in static variable.
 		 * Wait until DST is received to send response to upper layers
 		 */
-		at_tok_start(&line);
+		if (at_tok_field_str(&tok, 0, &tz, &tzLen) < 0) goto error;
+		if (at_tok_field_str(&tok, 1, &time, &timeLen) < 0) goto error;
 
-		err = at_tok_nextstr(&line, &tz);
-		if (err < 0) goto error;
-
-		err = at_tok_nextstr(&line, &response);
-		if (err < 0) goto error;
-
-		strcat(response,tz);
-
-		sNITZtime = response;
+		snprintf(sNITZtime, sizeof(sNITZtime), "%.*s%.*s",
+				(int)timeLen, time, (int)tzLen, tz);
 		return;
 
 	}
 	else if(strStartsWith(s,"+CTZDST:")){
 
 		/* We got DST, now assemble the response and send to upper layers */
-		at_tok_start(&line);
+		if (at_tok_field_str(&tok, 0, &tz, &tzLen) < 0) goto error;
 
-		err = at_tok_nextstr(&line, &tz);
-		if (err < 0) goto error;
-
-		asprintf(&response, "%s,%s", sNITZtime, tz);
+		snprintf(response, sizeof(response), "%s,%.*s",
+				sNITZtime, (int)tzLen, tz);
 
 		RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED, response, strlen(response));
-		free(response);
 		return;
 
 	}
 	else if(strStartsWith(s, "+HTCCTZV:")){
-		at_tok_start(&line);
-
-		err = at_tok_nextstr(&line, &response);
-		if (err < 0) goto error;
+		if (at_tok_field_strcpy(&tok, 0, response, sizeof(response)) < 0)
+			goto error;
 		RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED, response, strlen(response));
 		return;
 
@@ -2397,14 +2332,12 @@ static void unsolicitedRSSI(const char * s)
 	int err;
 	int signalStrength;
 	RIL_SignalStrength_v6 curSignalStrength;
-	char * line = NULL;
+	ATTokLine tok;
 
-	line = strdup(s);
-
-	err = at_tok_start(&line);
+	err = at_tok_split(s, &tok);
 	if (err < 0) goto error;
 
-	err = at_tok_nextint(&line, &signalStrength);
+	err = at_tok_field_int(&tok, 0, &signalStrength);
 	if (err < 0) goto error;
 
 	curSignalStrength.GW_SignalStrength.signalStrength = signalStrength;
@@ -2519,7 +2452,6 @@ static void requestQueryCallForwardStatus(RIL_Token t)
 	int err = 0;
 	int i = 0;
 	int n = 0;
-	int tmp = 0;
 	ATResponse *p_response = NULL;
 	ATLine *p_cur;
 	RIL_CallForwardInfo **responses = NULL;
@@ -2546,37 +2478,20 @@ static void requestQueryCallForwardStatus(RIL_Token t)
 	}
 
 	for (i = 0,p_cur = p_response->p_intermediates; p_cur != NULL; p_cur = p_cur->p_next, i++) {
-		char *line = p_cur->line;
-
-		err = at_tok_start(&line);
-		if (err < 0) goto error;
-
-		err = at_tok_nextint(&line, &(responses[i]->status));
-		if (err < 0) goto error;
-
-		err = at_tok_nextint(&line, &(responses[i]->serviceClass));
-		if (err < 0) goto error;
-
-		if(!at_tok_hasmore(&line)) continue;
-
-		err = at_tok_nextstr(&line, &(responses[i]->number));
-		if (err < 0) goto error;
-
-		if(!at_tok_hasmore(&line)) continue;
-
-		err = at_tok_nextint(&line, &(responses[i]->toa));
-		if (err < 0) goto error;
-
-		if(!at_tok_hasmore(&line)) continue;
-		at_tok_nextint(&line,&tmp);
+		ATCcfc ccfc;
 
-		if(!at_tok_hasmore(&line)) continue;
-		at_tok_nextint(&line,&tmp);
+		ccfc.number = "";
+		ccfc.toa = 0;
+		ccfc.time = 0;
 
-		if(!at_tok_hasmore(&line)) continue;
-		err = at_tok_nextint(&line, &(responses[i]->timeSeconds));
+		err = at_schema_parse(&at_schema_ccfc, p_cur->line, &ccfc);
 		if (err < 0) goto error;
 
+		responses[i]->status = ccfc.status;
+		responses[i]->serviceClass = ccfc.serviceClass;
+		responses[i]->number = ccfc.number;
+		responses[i]->toa = ccfc.toa;
+		responses[i]->timeSeconds = ccfc.time;
 	}
 
 	at_response_free(p_response);
@@ -2711,39 +2626,42 @@ error:
 
 static void  unsolicitedUSSD(const char *s)
 {
-	char *line, *linestart;
+	ATTokLine tok;
 	int typeCode, count, err, len;
-	char *message;
+	const char *message;
+	size_t messageLen;
 	char *outputmessage;
 	char *responseStr[2];
+	char typeStr[12];
 
 	ALOGD("unsolicitedUSSD %s\n",s);
 
-	linestart=line=strdup(s);
-	err = at_tok_start(&line);
+	err = at_tok_split(s, &tok);
 	if(err < 0) goto error;
 
-	err = at_tok_nextint(&line, &typeCode);
+	err = at_tok_field_int(&tok, 0, &typeCode);
 	if(err < 0) goto error;
 
-	if(at_tok_hasmore(&line)) {
-		err = at_tok_nextstr(&line, &message);
+	if(tok.count > 1) {
+		err = at_tok_field_str(&tok, 1, &message, &messageLen);
 		if(err < 0) goto error;
-		outputmessage = malloc(strlen(message)*2+1);
-		gsm_hex_to_bytes((cbytes_t)message,strlen(message),(bytes_t)outputmessage);
-		responseStr[1] = malloc(strlen(outputmessage)*2+1);
-		len = utf8_from_gsm8((cbytes_t)outputmessage,strlen(outputmessage),(bytes_t)responseStr[1]);
-		responseStr[1][strlen(message)/2]='\0';
+		outputmessage = malloc(messageLen/2+1);
+		gsm_hex_to_bytes((cbytes_t)message,messageLen,(bytes_t)outputmessage);
+		len = utf8_from_gsm8((cbytes_t)outputmessage,messageLen/2,NULL);
+		responseStr[1] = malloc(len+1);
+		utf8_from_gsm8((cbytes_t)outputmessage,messageLen/2,(bytes_t)responseStr[1]);
+		responseStr[1][len]='\0';
 		free(outputmessage);
 		count = 2;
 	} else {
 		responseStr[1]=NULL;
 		count = 1;
 	}
-	free(linestart);
-	asprintf(&responseStr[0], "%d", typeCode);
-	
+	snprintf(typeStr, sizeof(typeStr), "%d", typeCode);
+	responseStr[0] = typeStr;
+
 	RIL_onUnsolicitedResponse (RIL_UNSOL_ON_USSD, responseStr, count*sizeof(char*));
+	free(responseStr[1]);
 	return;
 
 error:
@@ -2751,24 +2669,12 @@ error:
 }
 
 static void  unsolicitedERI(const char *s) {
-	char *line;
-	int temp;
-	char *newEri;
-
-	line = strdup(s);
-	at_tok_start(&line);
-
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextint(&line, &temp);
-	at_tok_nextstr(&line, &newEri);
-	if(strlen(newEri)<50)
-		strcpy(erisystem,newEri);
-	free(line);
+	ATTokLine tok;
+
+	/* the system name follows seven integers; keep the old one if it
+	   is missing or too long */
+	at_tok_split(s, &tok);
+	at_tok_field_strcpy(&tok, 7, erisystem, sizeof(erisystem));
 }
 
 static void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t)
@@ -3672,7 +3578,7 @@ error:
  * the previous command has completed).
  */
 	static void
-onRequest (int request, void *data, size_t datalen, RIL_Token t)
+handleRequest (int request, void *data, size_t datalen, RIL_Token t)
 {
 	ATResponse *p_response;
 	int err;
@@ -4016,6 +3922,22 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
 	}
 }
 
+/**
+ * Traces the request as a span from here to its RIL_onRequestComplete(),
+ * with the AT commands it sends on the way nested in it
+ */
+	static void
+onRequest (int request, void *data, size_t datalen, RIL_Token t)
+{
+	at_trace_set_track((intptr_t) t);
+	AT_TRACE_SPAN(AT_SPAN_BEGIN, (intptr_t) t, t, requestToString(request),
+			NULL, 0);
+
+	handleRequest(request, data, datalen, t);
+
+	at_trace_set_track(0);
+}
+
 /**
  * Synchronous call from the RIL to us to return current radio state.
  * RADIO_STATE_UNAVAILABLE should be the initial state.
@@ -4327,6 +4249,52 @@ error:
 	return -1;
 }
 
+/* Common initialization strings, sent after ATZV1 */
+static const char * const s_initCommands[] = {
+	"ATE0",			/*  echo off */
+	"ATS0=0",		/*  No auto-answer */
+	"ATQ0",			/*  send results */
+	"ATX3",			/*  check for busy, don't check for dialone */
+	"AT&C1",		/*  set DCD depending on service */
+	"AT&D1",		/*  set DTR according to service */
+	"AT+CMEE=1",		/*  Extended errors */
+	"AT+CMOD=0",		/*  Alternating voice/data off */
+	//"AT+CMUT=0",		/*  Not muted */
+	"AT+CRC=1;+CR=1",	/*  detailed rings, unknown */
+	"AT+CLIP=1",		/*  caller id = yes */
+	"AT+CLIR=0",		/*  don't hide outgoing callerID */
+};
+
+static const char * const s_initGsmCommands[] = {
+	"AT+CCWA=1",		/*  Call Waiting notifications */
+	"AT+COLP=0",		/*  No connected line identification */
+	"AT+CUSD=1",		/*  USSD unsolicited */
+	"AT+CMGF=0",		/*  SMS PDU mode */
+	//"AT+GTKC=2",
+	"AT+CSSN=0,1",		/*  +CSSU unsolicited supp service notifications */
+	//"AT+CSCS=\"HEX\"",	/*  HEX character set */
+	"AT+CSCS=\"IRA\"",
+	"AT+FCLASS=0",		/*  Extra stuff */
+	"AT+CNMI=1,2,2,2,0",
+	//"AT+CPPP=1",
+};
+
+/*
+ * The settings of the above that the commands routed to a -D port
+ * depend on, see at_set_port_init(): error codes, the character set
+ * of +CPBR and +COPS=? names and the PDU mode of +CMGL
+ */
+static const char * const s_portInitCommands[] = {
+	"AT+CMEE=1",
+	"AT+CSCS=\"IRA\"",
+	"AT+CMGF=0",
+};
+
+static const char * const s_initGprsCommands[] = {
+	"AT+CGREG=2",		/*  GPRS registration events */
+	"AT+CGEQREQ=1,4,0,0,0,0,2,0,\"0E0\",\"0E0\",3,0,0",
+};
+
 /**
  * Initialize everything that can be configured while we're still in
  * AT+CFUN=0
@@ -4336,6 +4304,8 @@ static void initializeCallback(void *param)
 	ATResponse *p_response = NULL;
 	int err;
 
+	s_initStartMsec = monotonicMsec();
+
 	at_handshake();
 
 	/* make sure the radio is off */
@@ -4354,79 +4324,18 @@ static void initializeCallback(void *param)
 	/* note: we don't check errors here. Everything important will
 	   be handled in onATTimeout and onATReaderClosed */
 
-	/* Common initialization strings */
-
 	/*  atchannel is tolerant of echo but it must */
 	/*  reset and have verbose result codes */
 	at_send_command("ATZV1", NULL);
 
-	/*  echo off */
-	at_send_command("ATE0", NULL);
-
-	/*  No auto-answer */
-	at_send_command("ATS0=0", NULL);
-
-	/*  send results */
-	at_send_command("ATQ0", NULL);
-
-	/*  check for busy, don't check for dialone */
-	at_send_command("ATX3", NULL);
-
-	/*  set DCD depending on service */
-	at_send_command("AT&C1", NULL);
-
-	/*  set DTR according to service */
-	at_send_command("AT&D1", NULL);
-
-	/*  Extended errors */
-	at_send_command("AT+CMEE=1", NULL);
-
-	/*  Alternating voice/data off */
-	at_send_command("AT+CMOD=0", NULL);
-
-	/*  Not muted */
-	//at_send_command("AT+CMUT=0", NULL);
-
-	/*  detailed rings, unknown */
-	at_send_command("AT+CRC=1;+CR=1", NULL);
-
-	/*  caller id = yes */
-	at_send_command("AT+CLIP=1", NULL);
-
-	/*  don't hide outgoing callerID */
-	at_send_command("AT+CLIR=0", NULL);
+	/* the settings are packed into a few lines, see at_send_batch() */
+	at_send_batch(s_initCommands, NUM_ELEMS(s_initCommands));
 
 	/*  bring up the device, also resets the stack. Don't do this! Handled elsewhere */
 //	at_send_command("AT+CFUN=1", NULL);
 
 	if(isgsm) {
-		/*  Call Waiting notifications */
-		at_send_command("AT+CCWA=1", NULL);
-
-		/*  No connected line identification */
-		at_send_command("AT+COLP=0", NULL);
-
-		/*  USSD unsolicited */
-		at_send_command("AT+CUSD=1", NULL);
-
-		/*  SMS PDU mode */
-		at_send_command("AT+CMGF=0", NULL);
-
-		//at_send_command("AT+GTKC=2", NULL);
-
-		/*  +CSSU unsolicited supp service notifications */
-		at_send_command("AT+CSSN=0,1", NULL);
-
-		/*  HEX character set */
-		//at_send_command("AT+CSCS=\"HEX\"", NULL);
-		at_send_command("AT+CSCS=\"IRA\"", NULL);
-
-		/*  Extra stuff */
-		at_send_command("AT+FCLASS=0", NULL);
-
-               at_send_command("AT+CNMI=1,2,2,2,0", NULL);
-		//at_send_command("AT+CPPP=1", NULL);
-
+		at_send_batch(s_initGsmCommands, NUM_ELEMS(s_initGsmCommands));
 
 		/*  Network registration events */
 		err = at_send_command("AT+CREG=2", &p_response);
@@ -4437,15 +4346,13 @@ static void initializeCallback(void *param)
 
 		at_response_free(p_response);
 
-		/*  GPRS registration events */
-		at_send_command("AT+CGREG=2", NULL);
+		at_send_batch(s_initGprsCommands, NUM_ELEMS(s_initGprsCommands));
 
                /* Disable RSSI Indicators for Now */
                //at_send_command("AT@HTCCSQ=0", NULL);
 		//at_send_command("AT+ENCSQ=1", NULL);
 		//at_send_command("AT@HTCDIS=1;@HTCSAP=1", NULL);
 		//at_send_command("AT+HTCmaskW1=262143,162161", NULL);
-		at_send_command("AT+CGEQREQ=1,4,0,0,0,0,2,0,\"0E0\",\"0E0\",3,0,0", NULL);
 		//at_send_command("AT+HTCNV=1,12,6", NULL);
 //		at_send_command("AT+HSDPA=1", NULL);
 		//at_send_command("AT+HTCCNIV=0", NULL);
@@ -4461,6 +4368,8 @@ static void initializeCallback(void *param)
 
 
 	}
+	ALOGI("initialization took %lld ms", monotonicMsec() - s_initStartMsec);
+
 	/* assume radio is off on error */
 	if (isRadioOn() > 0) {
 		setRadioState (RADIO_STATE_SIM_NOT_READY);
@@ -4480,10 +4389,11 @@ static void waitForClose()
 
 /**
  * Called by atchannel when an unsolicited line appears
- * This is called on atchannel's reader thread. AT commands may
- * not be issued here
+ * This is called on atchannel's unsolicited dispatch thread. AT commands
+ * may not be issued here
  */
-static void onUnsolicited (const char *s, const char *sms_pdu)
+static void onUnsolicited (const char *s, const char *sms_pdu,
+		ATLineType type)
 {
 	char *line = NULL;
 	int err;
@@ -4495,35 +4405,39 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 		return;
 	}
 
-	if (strStartsWith(s, "%CTZV:")
-			|| strStartsWith(s,"+CTZV:")
-			|| strStartsWith(s,"+CTZDST:")
-			|| strStartsWith(s,"+HTCCTZV:")) {
+	switch (type) {
+	case AT_LINE_CTZV:
+	case AT_LINE_CTZDST:
+	case AT_LINE_HTCCTZV:
 		unsolicitedNitzTime(s);
-	} else if (strStartsWith(s,"+CRING:")
-			|| strStartsWith(s,"RING")
-			|| strStartsWith(s,"NO CARRIER")
-			|| strStartsWith(s,"+CCWA")
-		  ) {
-		if (strStartsWith(s,"+CCWA") && !isgsm) {
+		break;
+	case AT_LINE_CCWA:
+		if (!isgsm) {
 			/* Handle CCWA specially */
 			handle_cdma_ccwa(s);
 		}
+		/* fall through */
+	case AT_LINE_CRING:
+	case AT_LINE_RING:
+	case AT_LINE_NO_CARRIER:
 		RIL_onUnsolicitedResponse (
 				RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
 				NULL, 0);
 		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
-	} else if (strStartsWith(s,"^RSSI:")) {
+		break;
+	case AT_LINE_RSSI:
 		unsolicitedRSSI(s);
-	} else if (strStartsWith(s,"+CREG:")
-			|| strStartsWith(s,"+CGREG:"))
-		/*	|| strStartsWith(s,"$HTC_SYSTYPE:")) */{
+		break;
+	case AT_LINE_CREG:
+	case AT_LINE_CGREG:
+	/*	case AT_LINE_HTC_SYSTYPE: */
 		RIL_onUnsolicitedResponse (
 				RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
 				NULL, 0);
 		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
-	} else if (strStartsWith(s, "+CMT:")) {
-		ALOGD("GSM_PDU=%s\n",sms_pdu);
+		break;
+	case AT_LINE_CMT:
+		AT_TRACE(AT_TRACE_SMS, "+CMT PDU", sms_pdu, strlen(sms_pdu));
 		if(!isgsm) {
 			char **pdu;
 			pdu=cdma_to_gsmpdu(sms_pdu);
@@ -4537,25 +4451,35 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 			RIL_onUnsolicitedResponse (
 					RIL_UNSOL_RESPONSE_NEW_SMS,
 					sms_pdu, strlen(sms_pdu));
-	} else if (strStartsWith(s, "+CDS:")) {
+		break;
+	case AT_LINE_CDS:
 		RIL_onUnsolicitedResponse (
 				RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
 				sms_pdu, strlen(sms_pdu));
-	} else if (strStartsWith(s, "+CGEV:")) {
+		break;
+	case AT_LINE_CGEV:
 		/* Really, we can ignore NW CLASS and ME CLASS events here,
 		 * but right now we don't since extranous
 		 * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
 		 */
 		/* can't issue AT commands here -- call on main thread */
 		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+		break;
 #ifdef WORKAROUND_FAKE_CGEV
-	} else if (strStartsWith(s, "+CME ERROR: 150")) {
-		RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+	case AT_LINE_CME_ERROR:
+		if (strStartsWith(s, "+CME ERROR: 150")) {
+			RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+		}
+		break;
 #endif /* WORKAROUND_FAKE_CGEV */
-	} else if (strStartsWith(s, "$HTC_ERIIND:")) {
+	case AT_LINE_HTC_ERIIND:
 		unsolicitedERI(s);
-	} else if (strStartsWith(s, "+CUSD:")) {
+		break;
+	case AT_LINE_CUSD:
 		unsolicitedUSSD(s);
+		break;
+	default:
+		break;
 	}
 }
 
@@ -4563,16 +4487,24 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 static void onATReaderClosed()
 {
 	ALOGI("AT channel closed\n");
+	at_dump_stats();
+	at_trace_dump();
+	if (s_trace_json_path != NULL)
+		at_trace_export_json(s_trace_json_path);
 	at_close();
 	s_closed = 1;
 
 	setRadioState (RADIO_STATE_UNAVAILABLE);
 }
 
-/* Called on command thread */
+/* Called on command thread, or the reader for an async command */
 static void onATTimeout()
 {
 	ALOGI("AT channel timeout; closing\n");
+	at_dump_stats();
+	at_trace_dump();
+	if (s_trace_json_path != NULL)
+		at_trace_export_json(s_trace_json_path);
 	at_close();
 
 	s_closed = 1;
@@ -4585,13 +4517,111 @@ static void onATTimeout()
 static void usage(char *s)
 {
 #ifdef RIL_SHLIB
-	fprintf(stderr, "htcgeneric-ril requires: -p <tcp port> or -d /dev/tty_device\n");
+	fprintf(stderr, "htcgeneric-ril requires: -p <tcp port> or -d /dev/tty_device\n"
+			"  optional: -D /dev/tty_device for each secondary AT port\n"
+			"            -B <chars> longest batched command line, 0 to not batch\n"
+			"            -C <file> capture the AT session to file\n"
+			"            -T <mask> AT trace categories, see at_trace.h\n"
+			"            -J <file> write request spans as Chrome trace JSON\n"
+			"  or: -r <file> to replay a capture instead of a modem\n");
 #else
-	fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device]\n", s);
+	fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device] [-D /dev/tty_device]... [-B <batch line>] [-C <capture>] [-r <capture>] [-T <trace mask>] [-J <trace json>]\n", s);
 	exit(-1);
 #endif
 }
 
+/* opens a tty AT port, returns the fd or -1 */
+static int openTTY(const char *path)
+{
+	int fd;
+
+	fd = open (path, O_RDWR);
+	if ( fd >= 0 && !memcmp( path, "/dev/ttyUSB", 11 ) ) {
+
+		/* disable echo on serial ports */
+		struct termios  ios;
+		tcgetattr( fd, &ios );
+		ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
+		tcsetattr( fd, TCSANOW, &ios );
+	}
+
+	return fd;
+}
+
+/* opens the -D ports after the primary one; a port that fails is skipped */
+static void openSecondaryPorts()
+{
+	int i;
+	int fd;
+
+	at_set_port_init(s_portInitCommands, NUM_ELEMS(s_portInitCommands));
+
+	for (i = 0; i < s_secondary_count; i++) {
+		fd = openTTY(s_secondary_paths[i]);
+
+		if (fd < 0 || at_open_port(i + 1, fd) < 0) {
+			ALOGE("Can't open secondary AT port %s, using the primary port\n",
+					s_secondary_paths[i]);
+			if (fd >= 0)
+				close(fd);
+		}
+	}
+}
+
+/* adds a -D port, returns -1 if there are too many */
+static int addSecondaryPort(const char *path)
+{
+	if (s_secondary_count == AT_MAX_PORTS - 1)
+		return -1;
+
+	s_secondary_paths[s_secondary_count++] = path;
+	ALOGI("Opening secondary tty device %s\n", path);
+
+	return 0;
+}
+
+static void *replayLoop(void *param)
+{
+	int fd = (int) (intptr_t) param;
+	long long bytes;
+
+	bytes = at_capture_replay(s_replay_path, fd, 0,
+			AT_REPLAY_LOCKSTEP | AT_REPLAY_REALTIME);
+
+	if (bytes < 0)
+		ALOGE("Can't replay %s: %s\n", s_replay_path, strerror(errno));
+	else
+		ALOGI("Replayed %lld bytes of %s\n", bytes, s_replay_path);
+
+	/* the reader sees the modem go away, and mainLoop starts over */
+	close(fd);
+
+	return NULL;
+}
+
+/* starts replaying the -r capture, returns the fd to read it from or -1 */
+static int openReplay()
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&tid, &attr, replayLoop,
+				(void *) (intptr_t) sv[1]) != 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	return sv[0];
+}
+
 	static void *
 mainLoop(void *param)
 {
@@ -4605,22 +4635,16 @@ mainLoop(void *param)
 	for (;;) {
 		fd = -1;
 		while  (fd < 0) {
-			if (s_port > 0) {
+			if (s_replay_path != NULL) {
+				fd = openReplay();
+			} else if (s_port > 0) {
 				fd = socket_loopback_client(s_port, SOCK_STREAM);
 			} else if (s_device_socket) {
 				fd = socket_local_client( s_device_path,
 						ANDROID_SOCKET_NAMESPACE_FILESYSTEM,
 						SOCK_STREAM );
 			} else if (s_device_path != NULL) {
-				fd = open (s_device_path, O_RDWR);
-				if ( fd >= 0 && !memcmp( s_device_path, "/dev/ttyUSB", 11 ) ) {
-
-					/* disable echo on serial ports */
-					struct termios  ios;
-					tcgetattr( fd, &ios );
-					ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
-					tcsetattr( fd, TCSANOW, &ios );
-				}
+				fd = openTTY(s_device_path);
 			}
 
 			if (fd < 0) {
@@ -4638,6 +4662,8 @@ mainLoop(void *param)
 			return 0;
 		}
 
+		openSecondaryPorts();
+
 		RIL_requestTimedCallback(initializeCallback, NULL, &TIMEVAL_0);
 
 		// Give initializeCallback a chance to dispatched, since
@@ -4667,7 +4693,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 //	else
 //		isgsm=0;
 
-	while ( -1 != (opt = getopt(argc, argv, "p:d:s:"))) {
+	while ( -1 != (opt = getopt(argc, argv, "p:d:s:D:B:C:r:T:J:"))) {
 		switch (opt) {
 			case 'p':
 				s_port = atoi(optarg);
@@ -4690,13 +4716,41 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 				ALOGI("Opening socket %s\n", s_device_path);
 				break;
 
+			case 'D':
+				if (addSecondaryPort(optarg) < 0) {
+					usage(argv[0]);
+					return NULL;
+				}
+				break;
+
+			case 'B':
+				at_set_batch_limit(atoi(optarg));
+				break;
+
+			case 'C':
+				at_start_capture(optarg, AT_CAPTURE_DEFAULT_SIZE);
+				break;
+
+			case 'r':
+				s_replay_path = optarg;
+				ALOGI("Replaying capture %s\n", s_replay_path);
+				break;
+
+			case 'T':
+				at_trace_set_mask(strtoul(optarg, NULL, 0));
+				break;
+
+			case 'J':
+				s_trace_json_path = optarg;
+				break;
+
 			default:
 				usage(argv[0]);
 				return NULL;
 		}
 	}
 
-	if (s_port < 0 && s_device_path == NULL) {
+	if (s_port < 0 && s_device_path == NULL && s_replay_path == NULL) {
 		usage(argv[0]);
 		return NULL;
 	}
@@ -4714,7 +4768,7 @@ int main (int argc, char **argv)
 	int fd = -1;
 	int opt;
 
-	while ( -1 != (opt = getopt(argc, argv, "p:d:"))) {
+	while ( -1 != (opt = getopt(argc, argv, "p:d:D:B:C:r:T:J:"))) {
 		switch (opt) {
 			case 'p':
 				s_port = atoi(optarg);
@@ -4736,12 +4790,38 @@ int main (int argc, char **argv)
 				ALOGI("Opening socket %s\n", s_device_path);
 				break;
 
+			case 'D':
+				if (addSecondaryPort(optarg) < 0)
+					usage(argv[0]);
+				break;
+
+			case 'B':
+				at_set_batch_limit(atoi(optarg));
+				break;
+
+			case 'C':
+				at_start_capture(optarg, AT_CAPTURE_DEFAULT_SIZE);
+				break;
+
+			case 'r':
+				s_replay_path = optarg;
+				ALOGI("Replaying capture %s\n", s_replay_path);
+				break;
+
+			case 'T':
+				at_trace_set_mask(strtoul(optarg, NULL, 0));
+				break;
+
+			case 'J':
+				s_trace_json_path = optarg;
+				break;
+
 			default:
 				usage(argv[0]);
 		}
 	}
 
-	if (s_port < 0 && s_device_path == NULL) {
+	if (s_port < 0 && s_device_path == NULL && s_replay_path == NULL) {
 		usage(argv[0]);
 	}
 
@@ -15,6 +15,25 @@
 ** limitations under the License.
 */
 
+#include "misc.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The line-end scanners compare 16 bytes at a time with SSE2 or NEON
+ * when the compiler targets them, and a machine word at a time otherwise.
+ * Define AT_SCAN_SCALAR to force the word-at-a-time version.
+ */
+#if !defined(AT_SCAN_SCALAR) && defined(__SSE2__)
+#define AT_SCAN_SSE2 1
+#include <emmintrin.h>
+#elif !defined(AT_SCAN_SCALAR) && (defined(__ARM_NEON__) || defined(__ARM_NEON))
+#define AT_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
 /** returns 1 if line starts with prefix, 0 if it does not */
 int strStartsWith(const char *line, const char *prefix)
 {
@@ -27,3 +46,145 @@ int strStartsWith(const char *line, const char *prefix)
     return *prefix == '\0';
 }
 
+#if !defined(AT_SCAN_SSE2) && !defined(AT_SCAN_NEON)
+#define ONES  ((unsigned long)-1 / 0xff)
+#define HIGHS (ONES * 0x80)
+
+/** sets the high bit of exactly those bytes of w that are '\r' or '\n' */
+static unsigned long lineEndBytes(unsigned long w)
+{
+    unsigned long cr = w ^ (ONES * '\r');
+    unsigned long lf = w ^ (ONES * '\n');
+
+    cr = ~(((cr & ~HIGHS) + ~HIGHS) | cr | ~HIGHS);
+    lf = ~(((lf & ~HIGHS) + ~HIGHS) | lf | ~HIGHS);
+
+    return cr | lf;
+}
+#endif
+
+size_t findLineEnd(const char *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(AT_SCAN_SSE2)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for ( ; i + 16 <= len ; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(AT_SCAN_NEON)
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+
+    for ( ; i + 16 <= len ; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(s + i));
+        uint8x16_t eq = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+        /* 4 bits per input byte */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                    vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#else
+    for ( ; i + sizeof(unsigned long) <= len ; i += sizeof(unsigned long)) {
+        unsigned long w;
+
+        memcpy(&w, s + i, sizeof(w));
+
+        if (lineEndBytes(w) != 0) {
+            break;
+        }
+    }
+#endif
+
+    for ( ; i < len ; i++) {
+        if (s[i] == '\r' || s[i] == '\n') {
+            break;
+        }
+    }
+
+    return i;
+}
+
+size_t skipLineEnds(const char *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(AT_SCAN_SSE2)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for ( ; i + 16 <= len ; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#elif defined(AT_SCAN_NEON)
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+
+    for ( ; i + 16 <= len ; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(s + i));
+        uint8x16_t ne = vmvnq_u8(vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf)));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                    vshrn_n_u16(vreinterpretq_u16_u8(ne), 4)), 0);
+
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#else
+    for ( ; i + sizeof(unsigned long) <= len ; i += sizeof(unsigned long)) {
+        unsigned long w;
+
+        memcpy(&w, s + i, sizeof(w));
+
+        if (lineEndBytes(w) != HIGHS) {
+            break;
+        }
+    }
+#endif
+
+    for ( ; i < len ; i++) {
+        if (s[i] != '\r' && s[i] != '\n') {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/** writes all of buf to fd, see misc.h */
+int writeAll(int fd, const void *buf, size_t len)
+{
+    const char *s = (const char *) buf;
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, s, len);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        s += written;
+        len -= written;
+    }
+
+    return 0;
+}
@@ -17,3 +17,21 @@
 
 /** returns 1 if line starts with prefix, 0 if it does not */
 int strStartsWith(const char *line, const char *prefix);
+
+#include <stddef.h>
+
+/**
+ * returns the offset of the first '\r' or '\n' in s[0..len), or len
+ *
+ * a NUL is an ordinary byte here; the reader used to take one as the end
+ * of its input and stall the line until the buffer overflowed
+ */
+size_t findLineEnd(const char *s, size_t len);
+
+/** returns the offset of the first byte in s[0..len) that is neither
+    '\r' nor '\n', or len */
+size_t skipLineEnds(const char *s, size_t len);
+
+/** writes all of buf to fd, retrying short writes and EINTR;
+    returns 0 on success, -1 with errno set on error */
+int writeAll(int fd, const void *buf, size_t len);
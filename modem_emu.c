@@ -0,0 +1,1139 @@
+/* //device/system/reference-ril/modem_emu.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Huawei dongle emulator, for running the RIL and its benchmarks without
+ * a dongle. It serves one AT port, either on a pty whose slave it links
+ * to a path for the RIL's -d, or on a loopback TCP port for its -p:
+ *
+ *   huawei-modem-emu -d /data/emu-tty &
+ *   rild.libargs=-d /data/emu-tty
+ *
+ * It answers the commands the RIL sends, keeping the state they change
+ * (calls, registration, PDP context, CFUN), including "ATE0&C1+A;+B" batched
+ * lines, the +CMGS "> " prompt and +COPS=? scans, and sends ^RSSI,
+ * +CREG/+CGREG, +CMT and RING unsolicited at configurable periods.
+ * Faults are injected at configurable rates: final OKs dropped, garbage
+ * lines before a response, and the port closed after every n commands.
+ *
+ * usage: huawei-modem-emu (-d <link> | -p <port>) [-l <latency ms>]
+ *        [-R <rssi ms>] [-G <creg ms>] [-M <sms ms>] [-o <drop OK %>]
+ *        [-g <garbage %>] [-e <eof after n commands>] [-S <seed>] [-v]
+ *        [-s <script>]
+ *
+ * A script holds one setting per line, # starting a comment. Each of the
+ * options has one, and the script adds:
+ *
+ *   latency <ms>            delay before each response
+ *   scan <ms>               delay before the +COPS=? response
+ *   rssi <ms>               ^RSSI period, 0 for none
+ *   creg <ms>               +CREG/+CGREG period, 0 for none
+ *   sms <ms>                +CMT period, 0 for none
+ *   drop-ok <percent>
+ *   garbage <percent>
+ *   eof-after <commands>
+ *   urc <ms> <text>         sends "\r\n<text>\r\n" every ms
+ *   call <ms> <number>      rings with a call from number every ms,
+ *                           unless a call is up
+ *   reply <prefix> <text>   answers lines starting with prefix with text,
+ *                           which must hold the final result
+ *
+ * Texts take the C escapes \r, \n, \\, \" and \xHH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAX_LINE 4096
+#define MAX_OUTPUT 8192
+#define MAX_URCS 16
+#define MAX_REPLIES 32
+#define MAX_CALLS 7
+
+#define SMS_PDU_END '\032'      /* ^Z */
+#define SMS_PDU_CANCEL '\033'   /* ESC */
+
+/* an SMS-DELIVER from 3GPP TS 23.040 */
+static const char s_cmtPdu[] =
+    "07911326040000F0040B911346610089F60000208062917314080CC8F71D14969741"
+    "F977FD07";
+
+/* answers of the commands that only return a fixed text */
+static const struct {
+    const char *command;
+    const char *response;
+} s_fixedResponses[] = {
+    { "AT+CGMI",    "huawei" },
+    { "AT+CGMM",    "E1750" },
+    { "AT+CGMR",    "11.126.16.04.284" },
+    { "AT+CGSN",    "351234567890128" },
+    { "AT+CIMI",    "001010123456789" },
+    { "AT+CPIN?",   "+CPIN: READY" },
+    { "AT+CSCA?",   "+CSCA: \"+15555550000\",145" },
+    { "AT+CGATT?",  "+CGATT: 1" },
+    { "AT^SYSINFO", "^SYSINFO:2,3,0,5,1,,4" },
+    { "AT+CNUM",    "+CNUM: \"\",\"+15555551234\",145" },
+};
+
+/* a few SIM elementary files, for +CRSM READ BINARY */
+static const struct {
+    int fileId;
+    const char *data;
+} s_simFiles[] = {
+    { 0x2FE2, "98101430121181157002" },                     /* ICCID */
+    { 0x6F46, "00456D75204D6F62696C65FFFFFFFFFFFFFF" },     /* SPN */
+    { 0x6FAD, "00000002" },                                 /* AD */
+    { 0x6F07, "080910100000000000" },                       /* IMSI */
+};
+
+typedef enum {
+    RESULT_OK,
+    RESULT_ERROR,
+    RESULT_PROMPT,      /* "> ", then the SMS PDU */
+    RESULT_CONNECT,
+} EmuResult;
+
+typedef struct {
+    long long periodMsec;
+    long long nextNsec;
+    char text[256];
+} EmuUrc;
+
+typedef struct {
+    char prefix[64];
+    char text[512];
+} EmuReply;
+
+typedef struct {
+    int used;
+    int isMT;
+    int state;          /* as +CLCC: 0 active, 1 held, 4 incoming ... */
+    char number[32];
+} EmuCall;
+
+typedef struct {
+    /* settings */
+    long long latencyMsec;
+    long long scanMsec;
+    long long rssiMsec;
+    long long regMsec;
+    long long smsMsec;
+    int dropOkPercent;
+    int garbagePercent;
+    int eofAfter;
+    EmuUrc urcs[MAX_URCS];
+    int urcCount;
+    EmuUrc callUrcs[MAX_URCS];  /* text is the number */
+    int callUrcCount;
+    EmuReply replies[MAX_REPLIES];
+    int replyCount;
+    const char *linkPath;
+    int port;
+    int verbose;
+
+    /* the port */
+    int fd;             /* to the RIL, -1 while there's none */
+    int listenFd;
+    int ptySlave;       /* kept open, so the master never sees a hangup */
+    char line[MAX_LINE];
+    size_t lineLen;
+    int inPdu;          /* reading the PDU after a "> " prompt */
+    char output[MAX_OUTPUT];
+    size_t outputLen;
+    long long outputDue; /* when the pending output goes, 0 if none */
+    long long extraDelayMsec;
+    unsigned int commands;
+
+    /* the modem */
+    int cregN;
+    int cgregN;
+    int regStat;
+    int lac;
+    int rssi;
+    int cfun;
+    int cgact;
+    int messageRef;
+    char apn[64];
+    EmuCall calls[MAX_CALLS];
+    long long nextRssi;
+    long long nextReg;
+    long long nextSms;
+} Emu;
+
+static long long nowNsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(char *s)
+{
+    fprintf(stderr, "usage: %s (-d <link> | -p <port>) [-l <latency ms>] "
+            "[-R <rssi ms>] [-G <creg ms>] [-M <sms ms>] [-o <drop OK %%>] "
+            "[-g <garbage %%>] [-e <eof after n commands>] [-S <seed>] "
+            "[-v] [-s <script>]\n", s);
+    exit(-1);
+}
+
+/** decodes the C escapes of s into out, returns -1 if it doesn't fit */
+static int unescape(const char *s, char *out, size_t size)
+{
+    size_t len = 0;
+
+    while (*s != '\0') {
+        char c = *s++;
+
+        if (c == '\\' && *s != '\0') {
+            c = *s++;
+
+            switch (c) {
+                case 'r': c = '\r'; break;
+                case 'n': c = '\n'; break;
+                case 'x':
+                    c = (char) strtol(s, (char **) &s, 16);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (len + 1 >= size) {
+            return -1;
+        }
+        out[len++] = c;
+    }
+
+    out[len] = '\0';
+
+    return 0;
+}
+
+/**
+ * Applies the setting name with its argument, from a script or an
+ * option. returns -1 if it's not one
+ */
+static int applySetting(Emu *p_emu, const char *name, char *arg)
+{
+    char *text;
+
+    if (arg == NULL) {
+        return -1;
+    }
+
+    if (0 == strcmp(name, "latency")) {
+        p_emu->latencyMsec = atoll(arg);
+    } else if (0 == strcmp(name, "scan")) {
+        p_emu->scanMsec = atoll(arg);
+    } else if (0 == strcmp(name, "rssi")) {
+        p_emu->rssiMsec = atoll(arg);
+    } else if (0 == strcmp(name, "creg")) {
+        p_emu->regMsec = atoll(arg);
+    } else if (0 == strcmp(name, "sms")) {
+        p_emu->smsMsec = atoll(arg);
+    } else if (0 == strcmp(name, "drop-ok")) {
+        p_emu->dropOkPercent = atoi(arg);
+    } else if (0 == strcmp(name, "garbage")) {
+        p_emu->garbagePercent = atoi(arg);
+    } else if (0 == strcmp(name, "eof-after")) {
+        p_emu->eofAfter = atoi(arg);
+    } else if (0 == strcmp(name, "urc") || 0 == strcmp(name, "call")) {
+        int isCall = name[0] == 'c';
+        EmuUrc *p_urc;
+
+        /* "<ms> <text>" */
+        text = strchr(arg, ' ');
+        if (text == NULL || (isCall ? p_emu->callUrcCount
+                                    : p_emu->urcCount) == MAX_URCS) {
+            return -1;
+        }
+        *text++ = '\0';
+
+        p_urc = isCall ? &p_emu->callUrcs[p_emu->callUrcCount++]
+                        : &p_emu->urcs[p_emu->urcCount++];
+        p_urc->periodMsec = atoll(arg);
+
+        if (p_urc->periodMsec <= 0
+                || unescape(text, p_urc->text, sizeof(p_urc->text)) < 0) {
+            return -1;
+        }
+    } else if (0 == strcmp(name, "reply")) {
+        EmuReply *p_reply;
+
+        /* "<prefix> <text>" */
+        text = strchr(arg, ' ');
+        if (text == NULL || p_emu->replyCount == MAX_REPLIES) {
+            return -1;
+        }
+        *text++ = '\0';
+
+        p_reply = &p_emu->replies[p_emu->replyCount++];
+        if (unescape(arg, p_reply->prefix, sizeof(p_reply->prefix)) < 0
+                || unescape(text, p_reply->text,
+                            sizeof(p_reply->text)) < 0) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int loadScript(Emu *p_emu, const char *path)
+{
+    char buf[1024];
+    FILE *fp;
+    int lineNumber = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        char *name = buf;
+        char *arg;
+
+        lineNumber++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+
+        while (isspace((unsigned char) *name)) name++;
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+
+        arg = strchr(name, ' ');
+        if (arg != NULL) {
+            *arg++ = '\0';
+            while (*arg == ' ') arg++;
+        }
+
+        if (applySetting(p_emu, name, arg) < 0) {
+            fprintf(stderr, "%s:%d: bad setting '%s'\n", path, lineNumber,
+                    name);
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/** appends to the output waiting to be sent */
+static void emuOutput(Emu *p_emu, const char *s, size_t len)
+{
+    if (p_emu->outputLen + len > sizeof(p_emu->output)) {
+        len = sizeof(p_emu->output) - p_emu->outputLen;
+    }
+
+    memcpy(p_emu->output + p_emu->outputLen, s, len);
+    p_emu->outputLen += len;
+}
+
+/** appends "\r\n<formatted>\r\n" to the output */
+static void emuPrintf(Emu *p_emu, const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf + 2, sizeof(buf) - 4, fmt, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        return;
+    }
+    if (len > (int) sizeof(buf) - 5) {
+        len = sizeof(buf) - 5;
+    }
+
+    buf[0] = '\r';
+    buf[1] = '\n';
+    buf[len + 2] = '\r';
+    buf[len + 3] = '\n';
+
+    emuOutput(p_emu, buf, len + 4);
+}
+
+/** writes s to the RIL now, bypassing the latency */
+static void emuWrite(Emu *p_emu, const char *s, size_t len)
+{
+    ssize_t ret;
+
+    if (p_emu->verbose) {
+        fprintf(stderr, "emu> %.*s\n", (int) len, s);
+    }
+
+    while (len > 0 && p_emu->fd >= 0) {
+        ret = write(p_emu->fd, s, len);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        s += ret;
+        len -= ret;
+    }
+}
+
+static void emuUnsolicited(Emu *p_emu, const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (len > 0) {
+        emuWrite(p_emu, "\r\n", 2);
+        emuWrite(p_emu, buf, len < (int) sizeof(buf) ? len
+                                                    : (int) sizeof(buf) - 1);
+        emuWrite(p_emu, "\r\n", 2);
+    }
+}
+
+static int percentChance(int percent)
+{
+    return percent > 0 && rand() % 100 < percent;
+}
+
+static EmuCall *addCall(Emu *p_emu, int isMT, int state, const char *number)
+{
+    int i;
+
+    for (i = 0 ; i < MAX_CALLS ; i++) {
+        EmuCall *p_call = &p_emu->calls[i];
+
+        if (!p_call->used) {
+            p_call->used = 1;
+            p_call->isMT = isMT;
+            p_call->state = state;
+            snprintf(p_call->number, sizeof(p_call->number), "%s", number);
+            return p_call;
+        }
+    }
+
+    return NULL;
+}
+
+static int callCount(Emu *p_emu)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0 ; i < MAX_CALLS ; i++) {
+        count += p_emu->calls[i].used;
+    }
+
+    return count;
+}
+
+static void emuReg(Emu *p_emu, const char *name, int n)
+{
+    if (n == 2) {
+        emuPrintf(p_emu, "+%s: %d,%d,\"%04X\",\"%08X\"", name, n,
+                    p_emu->regStat, p_emu->lac, 0xC0FE);
+    } else {
+        emuPrintf(p_emu, "+%s: %d,%d", name, n, p_emu->regStat);
+    }
+}
+
+/* +CRSM=<command>,<fileid>[,<P1>,<P2>,<P3>[,<data>]] */
+static EmuResult emuSimIO(Emu *p_emu, const char *args)
+{
+    int command = 0;
+    int fileId = 0;
+    size_t i;
+
+    if (sscanf(args, "%d,%d", &command, &fileId) != 2) {
+        return RESULT_ERROR;
+    }
+
+    for (i = 0 ; i < sizeof(s_simFiles) / sizeof(s_simFiles[0]) ; i++) {
+        if (s_simFiles[i].fileId != fileId) continue;
+
+        if (command == 176) {                   /* READ BINARY */
+            emuPrintf(p_emu, "+CRSM: 144,0,\"%s\"", s_simFiles[i].data);
+        } else if (command == 192) {            /* GET RESPONSE */
+            emuPrintf(p_emu, "+CRSM: 144,0,\"0000%04X%04X040011F04401020000\"",
+                        (unsigned int) strlen(s_simFiles[i].data) / 2,
+                        fileId);
+        } else {
+            emuPrintf(p_emu, "+CRSM: 106,129");  /* not supported */
+        }
+        return RESULT_OK;
+    }
+
+    emuPrintf(p_emu, "+CRSM: 106,130");         /* file not found */
+
+    return RESULT_OK;
+}
+
+/** handles one command of a line, with its "AT" */
+static EmuResult emuCommand(Emu *p_emu, const char *command)
+{
+    const char *args;
+    size_t i;
+    int n;
+
+    for (i = 0 ; i < sizeof(s_fixedResponses) / sizeof(s_fixedResponses[0])
+            ; i++) {
+        if (0 == strcasecmp(command, s_fixedResponses[i].command)) {
+            emuPrintf(p_emu, "%s", s_fixedResponses[i].response);
+            return RESULT_OK;
+        }
+    }
+
+    if (0 == strncasecmp(command, "ATD", 3)) {
+        char number[32];
+
+        snprintf(number, sizeof(number), "%.*s",
+                    (int) strcspn(command + 3, ";"), command + 3);
+
+        if (number[0] == '*') {
+            /* *99# and friends: data */
+            p_emu->cgact = 1;
+            return RESULT_CONNECT;
+        }
+
+        return addCall(p_emu, 0, 0, number) != NULL ? RESULT_OK
+                                                    : RESULT_ERROR;
+    } else if (0 == strcasecmp(command, "ATA")) {
+        for (i = 0 ; i < MAX_CALLS ; i++) {
+            if (p_emu->calls[i].used && p_emu->calls[i].state == 4) {
+                p_emu->calls[i].state = 0;
+                return RESULT_OK;
+            }
+        }
+        emuOutput(p_emu, "\r\nNO CARRIER\r\n", 14);
+        return RESULT_OK;
+    } else if (0 == strcasecmp(command, "ATH")
+                || 0 == strcasecmp(command, "AT+CHUP")) {
+        memset(p_emu->calls, 0, sizeof(p_emu->calls));
+    } else if (0 == strncasecmp(command, "AT+CHLD=", 8)) {
+        args = command + 8;
+
+        if (args[0] == '1' && isdigit((unsigned char) args[1])) {
+            n = atoi(args + 1) - 1;
+            if (n < 0 || n >= MAX_CALLS || !p_emu->calls[n].used) {
+                return RESULT_ERROR;
+            }
+            p_emu->calls[n].used = 0;
+        } else if (args[0] == '0' || args[0] == '1') {
+            for (i = 0 ; i < MAX_CALLS ; i++) {
+                if (p_emu->calls[i].state == (args[0] == '0' ? 1 : 0)) {
+                    p_emu->calls[i].used = 0;
+                }
+            }
+        }
+    } else if (0 == strcasecmp(command, "AT+CLCC")) {
+        for (i = 0 ; i < MAX_CALLS ; i++) {
+            const EmuCall *p_call = &p_emu->calls[i];
+
+            if (p_call->used) {
+                emuPrintf(p_emu, "+CLCC: %d,%d,%d,0,0,\"%s\",%d", (int) i + 1,
+                            p_call->isMT, p_call->state, p_call->number,
+                            p_call->number[0] == '+' ? 145 : 129);
+            }
+        }
+    } else if (0 == strcasecmp(command, "AT+CREG?")) {
+        emuReg(p_emu, "CREG", p_emu->cregN);
+    } else if (0 == strcasecmp(command, "AT+CGREG?")) {
+        emuReg(p_emu, "CGREG", p_emu->cgregN);
+    } else if (0 == strncasecmp(command, "AT+CREG=", 8)) {
+        p_emu->cregN = atoi(command + 8);
+    } else if (0 == strncasecmp(command, "AT+CGREG=", 9)) {
+        p_emu->cgregN = atoi(command + 9);
+    } else if (0 == strcasecmp(command, "AT+CSQ")) {
+        emuPrintf(p_emu, "+CSQ: %d,99", p_emu->rssi);
+    } else if (0 == strcasecmp(command, "AT+COPS=?")) {
+        p_emu->extraDelayMsec = p_emu->scanMsec;
+        emuPrintf(p_emu, "+COPS: (2,\"Emu Mobile\",\"Emu\",\"00101\",2),"
+                    "(1,\"Other (Test) Net\",\"Other\",\"00102\",0),,"
+                    "(0,1,2,3,4),(0,1,2)");
+    } else if (0 == strcasecmp(command, "AT+COPS?")) {
+        emuPrintf(p_emu, "+COPS: 0,0,\"Emu Mobile\",2");
+    } else if (0 == strncasecmp(command, "AT+CMGS=", 8)) {
+        return RESULT_PROMPT;
+    } else if (0 == strncasecmp(command, "AT+CRSM=", 8)) {
+        return emuSimIO(p_emu, command + 8);
+    } else if (0 == strcasecmp(command, "AT+CFUN?")) {
+        emuPrintf(p_emu, "+CFUN: %d", p_emu->cfun);
+    } else if (0 == strncasecmp(command, "AT+CFUN=", 8)) {
+        p_emu->cfun = atoi(command + 8);
+    } else if (0 == strcasecmp(command, "AT+CGACT?")) {
+        emuPrintf(p_emu, "+CGACT: 1,%d", p_emu->cgact);
+    } else if (0 == strncasecmp(command, "AT+CGACT=", 9)) {
+        p_emu->cgact = atoi(command + 9);
+    } else if (0 == strcasecmp(command, "AT+CGDCONT?")) {
+        if (p_emu->apn[0] != '\0') {
+            emuPrintf(p_emu, "+CGDCONT: 1,\"IP\",\"%s\",\"%s\",0,0",
+                        p_emu->apn, p_emu->cgact ? "10.0.0.2" : "0.0.0.0");
+        }
+    } else if (0 == strncasecmp(command, "AT+CGDCONT=", 11)) {
+        const char *apn = strchr(command, ',');
+
+        /* 1,"IP","<apn>"... */
+        if (apn != NULL && (apn = strchr(apn + 1, ',')) != NULL) {
+            apn += apn[1] == '"' ? 2 : 1;
+            snprintf(p_emu->apn, sizeof(p_emu->apn), "%.*s",
+                        (int) strcspn(apn, "\","), apn);
+        }
+    } else if (0 == strcasecmp(command, "AT+CGDCONT=?")
+                || 0 == strcasecmp(command, "AT+CGACT=?")) {
+        /* supported, nothing more */
+    } else if (strncasecmp(command, "AT", 2) != 0) {
+        return RESULT_ERROR;
+    }
+
+    /* everything else, eg the settings of the init sequence, is OK */
+    return RESULT_OK;
+}
+
+/** queues the output for when the latency has passed */
+static void emuFlushLater(Emu *p_emu)
+{
+    long long delay = p_emu->latencyMsec + p_emu->extraDelayMsec;
+
+    p_emu->extraDelayMsec = 0;
+
+    if (p_emu->outputLen == 0) {
+        return;
+    }
+
+    if (delay <= 0) {
+        emuWrite(p_emu, p_emu->output, p_emu->outputLen);
+        p_emu->outputLen = 0;
+        p_emu->outputDue = 0;
+    } else {
+        p_emu->outputDue = nowNsec() + delay * 1000000LL;
+    }
+}
+
+static void emuClose(Emu *p_emu);
+
+/**
+ * returns the length of the basic syntax command s starts with, eg "E0",
+ * "&C1" or "S0=0", or 0 if it starts an extended one like "+CMEE=1"
+ */
+static size_t basicCommandLen(const char *s)
+{
+    size_t n = *s == '&' ? 1 : 0;
+
+    if (!isalpha((unsigned char) s[n])) {
+        return 0;
+    }
+
+    for (n++ ; isdigit((unsigned char) s[n]) ; n++) ;
+
+    if (s[n] == '?') {
+        n++;
+    } else if (s[n] == '=') {
+        for (n++ ; isdigit((unsigned char) s[n]) ; n++) ;
+    }
+
+    return n;
+}
+
+/** handles a complete command line */
+static void emuLine(Emu *p_emu, char *line)
+{
+    static const char * const garbage[] = {
+        "\r\n\377\376garbage\001\r\n",
+        "\r\n+CREG: ,,\r\n",
+        "\r\n^BOGUS\r\n",
+        "\r\n+CMT: \r\n",
+    };
+    EmuResult result = RESULT_OK;
+    char command[MAX_LINE + 2];
+    char *part;
+    int i;
+
+    if (p_emu->verbose) {
+        fprintf(stderr, "emu< %s\n", line);
+    }
+
+    if (strncasecmp(line, "AT", 2) != 0) {
+        /* noise between commands; real modems ignore it too */
+        return;
+    }
+
+    p_emu->commands++;
+
+    if (p_emu->eofAfter > 0 && p_emu->commands % p_emu->eofAfter == 0) {
+        fprintf(stderr, "emu: closing the port after %u commands\n",
+                p_emu->commands);
+        emuClose(p_emu);
+        return;
+    }
+
+    if (percentChance(p_emu->garbagePercent)) {
+        const char *s = garbage[rand() % (sizeof(garbage) / sizeof(garbage[0]))];
+
+        emuOutput(p_emu, s, strlen(s));
+    }
+
+    for (i = 0 ; i < p_emu->replyCount ; i++) {
+        const EmuReply *p_reply = &p_emu->replies[i];
+
+        if (0 == strncasecmp(line, p_reply->prefix,
+                                strlen(p_reply->prefix))) {
+            emuOutput(p_emu, p_reply->text, strlen(p_reply->text));
+            emuFlushLater(p_emu);
+            return;
+        }
+    }
+
+    if (0 == strncasecmp(line, "ATD", 3)) {
+        /* the ';' of a voice call is no separator */
+        result = emuCommand(p_emu, line);
+    } else {
+        /* "ATE0&C1+A;+B": each command after the first one without its "AT" */
+        part = line + 2;
+
+        while (part != NULL && result == RESULT_OK) {
+            char *end = part;
+            int quoted = 0;
+            size_t n = basicCommandLen(part);
+
+            if (n > 0) {
+                snprintf(command, sizeof(command), "AT%.*s", (int) n, part);
+                result = emuCommand(p_emu, command);
+
+                part += n;
+                part += *part == ';';
+                part = *part != '\0' ? part : NULL;
+                continue;
+            }
+
+            while (*end != '\0' && (quoted || *end != ';')) {
+                if (*end == '"') quoted = !quoted;
+                end++;
+            }
+
+            snprintf(command, sizeof(command), "AT%.*s",
+                        (int) (end - part), part);
+            result = emuCommand(p_emu, command);
+
+            part = *end == ';' && end[1] != '\0' ? end + 1 : NULL;
+        }
+    }
+
+    switch (result) {
+        case RESULT_OK:
+            if (!percentChance(p_emu->dropOkPercent)) {
+                emuOutput(p_emu, "\r\nOK\r\n", 6);
+            } else if (p_emu->verbose) {
+                fprintf(stderr, "emu: dropping the OK\n");
+            }
+            break;
+
+        case RESULT_ERROR:
+            emuOutput(p_emu, "\r\nERROR\r\n", 9);
+            break;
+
+        case RESULT_CONNECT:
+            emuOutput(p_emu, "\r\nCONNECT\r\n", 11);
+            break;
+
+        case RESULT_PROMPT:
+            emuOutput(p_emu, "\r\n> ", 4);
+            p_emu->inPdu = 1;
+            break;
+    }
+
+    emuFlushLater(p_emu);
+}
+
+/** handles the PDU after a +CMGS prompt, ended with ^Z or ESC */
+static void emuPdu(Emu *p_emu, int cancelled)
+{
+    if (p_emu->verbose) {
+        fprintf(stderr, "emu< PDU %.*s%s\n", (int) p_emu->lineLen,
+                p_emu->line, cancelled ? " cancelled" : "");
+    }
+
+    p_emu->inPdu = 0;
+
+    if (!cancelled) {
+        p_emu->messageRef = (p_emu->messageRef + 1) % 256;
+        emuPrintf(p_emu, "+CMGS: %d", p_emu->messageRef);
+    }
+
+    emuOutput(p_emu, "\r\nOK\r\n", 6);
+    emuFlushLater(p_emu);
+}
+
+static void emuRead(Emu *p_emu)
+{
+    char buf[1024];
+    ssize_t count;
+    ssize_t i;
+
+    count = read(p_emu->fd, buf, sizeof(buf));
+
+    if (count <= 0) {
+        if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+            return;
+        }
+        fprintf(stderr, "emu: the RIL went away\n");
+        emuClose(p_emu);
+        return;
+    }
+
+    for (i = 0 ; i < count && p_emu->fd >= 0 ; i++) {
+        char c = buf[i];
+
+        if (p_emu->inPdu && (c == SMS_PDU_END || c == SMS_PDU_CANCEL)) {
+            emuPdu(p_emu, c == SMS_PDU_CANCEL);
+            p_emu->lineLen = 0;
+        } else if (!p_emu->inPdu && (c == '\r' || c == '\n')) {
+            p_emu->line[p_emu->lineLen] = '\0';
+            if (p_emu->lineLen > 0) {
+                emuLine(p_emu, p_emu->line);
+            }
+            p_emu->lineLen = 0;
+        } else if (p_emu->lineLen < sizeof(p_emu->line) - 1) {
+            p_emu->line[p_emu->lineLen++] = c;
+        }
+    }
+}
+
+/** sends the periodic unsolicited that are due, returns the next one */
+static long long emuUnsolicitedDue(Emu *p_emu, long long now)
+{
+    long long next = 0;
+    int i;
+
+#define DUE(at, periodMsec) \
+    ((periodMsec) > 0 && ((at) == 0 ? ((at) = now + (periodMsec) * 1000000LL, 0) \
+                                    : (at) <= now))
+#define NEXT(at, periodMsec) \
+    do { \
+        if ((periodMsec) > 0 && (next == 0 || (at) < next)) next = (at); \
+    } while (0)
+
+    if (DUE(p_emu->nextRssi, p_emu->rssiMsec)) {
+        p_emu->rssi = 10 + rand() % 16;
+        emuUnsolicited(p_emu, "^RSSI:%d", p_emu->rssi);
+        p_emu->nextRssi = now + p_emu->rssiMsec * 1000000LL;
+    }
+    NEXT(p_emu->nextRssi, p_emu->rssiMsec);
+
+    if (DUE(p_emu->nextReg, p_emu->regMsec)) {
+        /* a cell change */
+        p_emu->lac = 0x100 + rand() % 0x100;
+        if (p_emu->cregN == 2) {
+            emuUnsolicited(p_emu, "+CREG: %d,\"%04X\",\"%08X\"",
+                            p_emu->regStat, p_emu->lac, 0xC0FE);
+        } else if (p_emu->cregN == 1) {
+            emuUnsolicited(p_emu, "+CREG: %d", p_emu->regStat);
+        }
+        if (p_emu->cgregN == 2) {
+            emuUnsolicited(p_emu, "+CGREG: %d,\"%04X\",\"%08X\"",
+                            p_emu->regStat, p_emu->lac, 0xC0FE);
+        } else if (p_emu->cgregN == 1) {
+            emuUnsolicited(p_emu, "+CGREG: %d", p_emu->regStat);
+        }
+        p_emu->nextReg = now + p_emu->regMsec * 1000000LL;
+    }
+    NEXT(p_emu->nextReg, p_emu->regMsec);
+
+    if (DUE(p_emu->nextSms, p_emu->smsMsec)) {
+        emuUnsolicited(p_emu, "+CMT: ,%d\r\n%s",
+                        (int) (strlen(s_cmtPdu) / 2 - 8), s_cmtPdu);
+        p_emu->nextSms = now + p_emu->smsMsec * 1000000LL;
+    }
+    NEXT(p_emu->nextSms, p_emu->smsMsec);
+
+    for (i = 0 ; i < p_emu->urcCount ; i++) {
+        EmuUrc *p_urc = &p_emu->urcs[i];
+
+        if (DUE(p_urc->nextNsec, p_urc->periodMsec)) {
+            emuUnsolicited(p_emu, "%s", p_urc->text);
+            p_urc->nextNsec = now + p_urc->periodMsec * 1000000LL;
+        }
+        NEXT(p_urc->nextNsec, p_urc->periodMsec);
+    }
+
+    for (i = 0 ; i < p_emu->callUrcCount ; i++) {
+        EmuUrc *p_urc = &p_emu->callUrcs[i];
+
+        if (DUE(p_urc->nextNsec, p_urc->periodMsec)) {
+            if (callCount(p_emu) == 0
+                    && addCall(p_emu, 1, 4, p_urc->text) != NULL) {
+                emuUnsolicited(p_emu, "RING");
+                emuUnsolicited(p_emu, "+CLIP: \"%s\",%d,,,,0", p_urc->text,
+                                p_urc->text[0] == '+' ? 145 : 129);
+            }
+            p_urc->nextNsec = now + p_urc->periodMsec * 1000000LL;
+        }
+        NEXT(p_urc->nextNsec, p_urc->periodMsec);
+    }
+
+#undef DUE
+#undef NEXT
+
+    return next;
+}
+
+/** makes the pty pair and links path to its slave, returns the master */
+static int openPty(Emu *p_emu)
+{
+    struct termios ios;
+    const char *name;
+    int fd;
+
+    fd = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0
+            || (name = ptsname(fd)) == NULL) {
+        perror("/dev/ptmx");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    p_emu->ptySlave = open(name, O_RDWR | O_NOCTTY);
+    if (p_emu->ptySlave < 0) {
+        perror(name);
+        close(fd);
+        return -1;
+    }
+
+    /* raw, as a dongle's port: no echo, no line editing, no CR/NL mapping */
+    tcgetattr(p_emu->ptySlave, &ios);
+    ios.c_iflag = 0;
+    ios.c_oflag = 0;
+    ios.c_lflag = 0;
+    ios.c_cc[VMIN] = 1;
+    ios.c_cc[VTIME] = 0;
+    tcsetattr(p_emu->ptySlave, TCSANOW, &ios);
+
+    unlink(p_emu->linkPath);
+    if (symlink(name, p_emu->linkPath) < 0) {
+        perror(p_emu->linkPath);
+        close(p_emu->ptySlave);
+        close(fd);
+        return -1;
+    }
+
+    fprintf(stderr, "emu: %s -> %s\n", p_emu->linkPath, name);
+
+    return fd;
+}
+
+static int openListener(Emu *p_emu)
+{
+    struct sockaddr_in addr;
+    int fd;
+    int on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(p_emu->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    fprintf(stderr, "emu: listening on 127.0.0.1:%d\n", p_emu->port);
+
+    return fd;
+}
+
+/** starts over with a fresh modem and port, as after a dongle reset */
+static void emuClose(Emu *p_emu)
+{
+    int i;
+
+    if (p_emu->fd >= 0) {
+        close(p_emu->fd);
+        p_emu->fd = -1;
+    }
+
+    if (p_emu->linkPath != NULL) {
+        close(p_emu->ptySlave);
+        p_emu->fd = openPty(p_emu);
+    }
+
+    p_emu->lineLen = 0;
+    p_emu->inPdu = 0;
+    p_emu->outputLen = 0;
+    p_emu->outputDue = 0;
+    p_emu->nextRssi = p_emu->nextReg = p_emu->nextSms = 0;
+    for (i = 0 ; i < p_emu->urcCount ; i++) {
+        p_emu->urcs[i].nextNsec = 0;
+    }
+    for (i = 0 ; i < p_emu->callUrcCount ; i++) {
+        p_emu->callUrcs[i].nextNsec = 0;
+    }
+
+    p_emu->cregN = p_emu->cgregN = 0;
+    p_emu->cfun = 1;
+    p_emu->cgact = 0;
+    memset(p_emu->calls, 0, sizeof(p_emu->calls));
+}
+
+static void emuLoop(Emu *p_emu)
+{
+    struct pollfd pfd;
+
+    for (;;) {
+        long long now = nowNsec();
+        long long next;
+        int timeout = -1;
+
+        if (p_emu->fd < 0) {
+            if (p_emu->listenFd < 0) {
+                /* the pty couldn't be made again */
+                return;
+            }
+
+            p_emu->fd = accept(p_emu->listenFd, NULL, NULL);
+            if (p_emu->fd >= 0) {
+                fprintf(stderr, "emu: RIL connected\n");
+            }
+            continue;
+        }
+
+        if (p_emu->outputDue != 0 && p_emu->outputDue <= now) {
+            emuWrite(p_emu, p_emu->output, p_emu->outputLen);
+            p_emu->outputLen = 0;
+            p_emu->outputDue = 0;
+        }
+
+        next = emuUnsolicitedDue(p_emu, now);
+        if (p_emu->outputDue != 0 && (next == 0 || p_emu->outputDue < next)) {
+            next = p_emu->outputDue;
+        }
+        if (next != 0) {
+            timeout = next > now ? (int) ((next - now + 999999) / 1000000) : 0;
+        }
+
+        pfd.fd = p_emu->fd;
+        /* the next command waits for the response to the last one */
+        pfd.events = p_emu->outputDue == 0 ? POLLIN : 0;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, timeout) > 0) {
+            if (pfd.revents & POLLIN) {
+                emuRead(p_emu);
+            } else if (pfd.revents & (POLLHUP | POLLERR)) {
+                fprintf(stderr, "emu: the RIL went away\n");
+                emuClose(p_emu);
+            }
+        }
+    }
+}
+
+int main (int argc, char **argv)
+{
+    static Emu emu;
+    int opt;
+
+    emu.fd = -1;
+    emu.listenFd = -1;
+    emu.ptySlave = -1;
+    emu.scanMsec = 1000;
+    emu.rssiMsec = 5000;
+    emu.regMsec = 30000;
+    emu.regStat = 1;
+    emu.lac = 0x1A2;
+    emu.rssi = 20;
+    emu.cfun = 1;
+    srand(1);
+
+    while ( -1 != (opt = getopt(argc, argv, "d:p:l:R:G:M:o:g:e:S:s:v"))) {
+        switch (opt) {
+            case 'd': emu.linkPath = optarg; break;
+            case 'p': emu.port = atoi(optarg); break;
+            case 'l': applySetting(&emu, "latency", optarg); break;
+            case 'R': applySetting(&emu, "rssi", optarg); break;
+            case 'G': applySetting(&emu, "creg", optarg); break;
+            case 'M': applySetting(&emu, "sms", optarg); break;
+            case 'o': applySetting(&emu, "drop-ok", optarg); break;
+            case 'g': applySetting(&emu, "garbage", optarg); break;
+            case 'e': applySetting(&emu, "eof-after", optarg); break;
+            case 'S': srand(atoi(optarg)); break;
+            case 'v': emu.verbose = 1; break;
+
+            case 's':
+                if (loadScript(&emu, optarg) < 0) {
+                    return 1;
+                }
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if ((emu.linkPath == NULL) == (emu.port <= 0)) {
+        usage(argv[0]);
+    }
+
+    /* the RIL closing its end mustn't kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (emu.linkPath != NULL) {
+        emu.fd = openPty(&emu);
+    } else {
+        emu.listenFd = openListener(&emu);
+    }
+
+    if (emu.fd < 0 && emu.listenFd < 0) {
+        fprintf(stderr, "emu: can't open the port\n");
+        return 1;
+    }
+
+    emuLoop(&emu);
+
+    return 1;
+}
@@ -0,0 +1,801 @@
+/* //device/system/reference-ril/multimodem.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "multimodem.h"
+#include "atchannel.h"
+#include "at_tok.h"
+#include "misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "MULTIMODEM"
+#include <utils/Log.h>
+
+/* backwards compatibility for pre-JB */
+#ifndef ALOGD
+#define ALOGD LOGD
+#define ALOGE LOGE
+#define ALOGI LOGI
+#endif
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+#define REOPEN_DELAY_MSEC 10000
+#define INIT_TIMEOUT_MSEC 5000
+#define MAX_EVENTS 8
+
+/* epoll data of the stop pipe; modems use index * 2 + (wake fd ? 1 : 0) */
+#define STOP_EVENT (~(uint64_t) 0)
+
+/* run in order on each open, each one once the previous has completed */
+static const char *s_initCommands[] = {
+    "ATE0Q0V1",
+    "AT+CMEE=1",
+    "AT+CREG=2",
+    "AT+CGREG=2",
+    "AT+CMGF=0",
+    "AT+CSMS=1",
+    "AT+CNMI=1,2,2,2,0",
+    "AT^CURC=1",
+    "AT+CSQ",
+};
+
+typedef struct {
+    struct MultiModem *p_mm;
+    int index;
+    char *name;
+    char *path;                 /* NULL for a stream given by the caller */
+    int fd;                     /* given stream, until the first open */
+    int channelFd;              /* fd of the open channel */
+    ATChannel *p_channel;
+
+    /*
+     * Held by the pool thread polling the modem; protects everything
+     * below but the timers
+     */
+    pthread_mutex_t lock;
+    MultiModemState state;
+    int wakeFdAdded;
+    size_t initStep;
+    long long openNsec;
+    long long readyNsec;
+    int rssi;
+    int regState;
+    unsigned long long opens;
+    unsigned long long commands;
+    unsigned long long commandErrors;
+    unsigned long long unsolicited;
+    unsigned long long smsReceived;
+    unsigned long long polls;
+
+    /* monotonic nsec, 0 for none. protected by the pool's timerLock */
+    long long pollNsec;         /* at_channel_poll() timeout */
+    long long reopenNsec;
+} Modem;
+
+struct MultiModem {
+    Modem *modems;
+    int count;
+    int capacity;
+    int started;
+
+    int epollFd;
+    int stopFds[2];
+    int threadCount;
+    pthread_t threads[MULTIMODEM_MAX_THREADS];
+
+    pthread_mutex_t timerLock;
+
+    MultiModemSmsHandler smsHandler;
+    void *smsParam;
+};
+
+static long long monotonicNsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void setPollTimeout(Modem *m, int msec)
+{
+    pthread_mutex_lock(&m->p_mm->timerLock);
+    m->pollNsec = msec < 0 ? 0 : monotonicNsec() + msec * 1000000LL;
+    pthread_mutex_unlock(&m->p_mm->timerLock);
+}
+
+static void setReopenTime(Modem *m, long long nsec)
+{
+    pthread_mutex_lock(&m->p_mm->timerLock);
+    m->reopenNsec = nsec;
+    pthread_mutex_unlock(&m->p_mm->timerLock);
+}
+
+/** (re)arms the one-shot epoll registration of fd for modem m */
+static int watchFd(Modem *m, int fd, int isWake, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = (uint64_t) m->index * 2 + (isWake ? 1 : 0);
+
+    return epoll_ctl(m->p_mm->epollFd, op, fd, &ev);
+}
+
+/* opens a tty AT port, returns the fd or -1 */
+static int openTTY(const char *path)
+{
+    int fd;
+
+    fd = open (path, O_RDWR);
+    if (fd >= 0 && isatty(fd)) {
+        /* disable echo on serial ports */
+        struct termios  ios;
+        tcgetattr( fd, &ios );
+        ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
+        tcsetattr( fd, TCSANOW, &ios );
+    }
+
+    return fd;
+}
+
+static void openModem(Modem *m);
+static void closeModem(Modem *m);
+
+/** counts a completed command that needs no other handling */
+static void onCommandDone(int err, ATResponse *p_response, void *param)
+{
+    Modem *m = (Modem *) param;
+
+    m->commands++;
+    if (err < 0 || p_response->success == 0) {
+        m->commandErrors++;
+    }
+
+    at_response_free(p_response);
+}
+
+static void sendInitStep(Modem *m);
+
+static void onInitStep(int err, ATResponse *p_response, void *param)
+{
+    Modem *m = (Modem *) param;
+    const char *command = s_initCommands[m->initStep];
+    char *line;
+    int rssi;
+
+    m->commands++;
+
+    if (err == AT_ERROR_CHANNEL_CLOSED || m->state != MULTIMODEM_INIT) {
+        at_response_free(p_response);
+        return;
+    }
+
+    if (err < 0 || p_response->success == 0) {
+        m->commandErrors++;
+
+        if (m->initStep == 0) {
+            /* no answer to the handshake, try again later */
+            ALOGE("%s: no response to %s\n", m->name, command);
+            at_response_free(p_response);
+            closeModem(m);
+            return;
+        }
+
+        /* not all dongles have every command */
+        ALOGI("%s: %s failed\n", m->name, command);
+    } else if (0 == strcmp(command, "AT+CSQ")) {
+        line = p_response->p_intermediates->line;
+
+        if (at_tok_start(&line) == 0 && at_tok_nextint(&line, &rssi) == 0) {
+            m->rssi = rssi;
+        }
+    }
+
+    at_response_free(p_response);
+
+    m->initStep++;
+    sendInitStep(m);
+}
+
+/** runs the next step of the init sequence, or finishes it */
+static void sendInitStep(Modem *m)
+{
+    const char *command;
+    int err;
+
+    if (m->initStep == NUM_ELEMS(s_initCommands)) {
+        m->state = MULTIMODEM_READY;
+        m->readyNsec = monotonicNsec();
+        ALOGI("%s: ready after %lld ms\n", m->name,
+                (m->readyNsec - m->openNsec) / 1000000LL);
+        return;
+    }
+
+    command = s_initCommands[m->initStep];
+
+    if (0 == strcmp(command, "AT+CSQ")) {
+        err = at_channel_send_command_async(m->p_channel, command,
+                        SINGLELINE, "+CSQ:", NULL, INIT_TIMEOUT_MSEC,
+                        onInitStep, m);
+    } else {
+        err = at_channel_send_command_async(m->p_channel, command,
+                        NO_RESULT, NULL, NULL, INIT_TIMEOUT_MSEC,
+                        onInitStep, m);
+    }
+
+    if (err < 0) {
+        closeModem(m);
+    }
+}
+
+static void onUnsolicited(ATChannel *p_channel, const char *s,
+                            const char *sms_pdu, ATLineType type)
+{
+    Modem *m = (Modem *) at_channel_get_param(p_channel);
+    char copy[64];
+    char *line = copy;
+    int value;
+
+    /* the tokenizer writes to the line, and these are short */
+    snprintf(copy, sizeof(copy), "%s", s);
+
+    m->unsolicited++;
+
+    switch (type) {
+        case AT_LINE_CMT:
+            m->smsReceived++;
+
+            if (m->p_mm->smsHandler != NULL) {
+                m->p_mm->smsHandler(m->index, sms_pdu, m->p_mm->smsParam);
+            }
+
+            at_channel_send_command_async(p_channel, "AT+CNMA=1",
+                        NO_RESULT, NULL, NULL, AT_TIMEOUT_DEFAULT,
+                        onCommandDone, m);
+            break;
+
+        case AT_LINE_RSSI:
+            if (at_tok_start(&line) == 0
+                && at_tok_nextint(&line, &value) == 0
+            ) {
+                m->rssi = value;
+            }
+            break;
+
+        case AT_LINE_CREG:
+            if (at_tok_start(&line) == 0
+                && at_tok_nextint(&line, &value) == 0
+            ) {
+                m->regState = value;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/** opens m and starts its init sequence; assumes m->lock is held */
+static void openModem(Modem *m)
+{
+    int fd;
+
+    setReopenTime(m, 0);
+
+    if (m->path != NULL) {
+        fd = openTTY(m->path);
+    } else {
+        fd = m->fd;
+        m->fd = -1;
+    }
+
+    if (fd < 0) {
+        if (m->path != NULL) {
+            setReopenTime(m, monotonicNsec()
+                                + REOPEN_DELAY_MSEC * 1000000LL);
+        }
+        return;
+    }
+
+    if (at_channel_open_polled(m->p_channel, fd, onUnsolicited) < 0) {
+        close(fd);
+        return;
+    }
+
+    if (!m->wakeFdAdded) {
+        /* the wake fd outlives reopens of the channel */
+        watchFd(m, at_channel_get_wake_fd(m->p_channel), 1, EPOLL_CTL_ADD);
+        m->wakeFdAdded = 1;
+    }
+
+    m->channelFd = fd;
+
+    if (watchFd(m, fd, 0, EPOLL_CTL_ADD) < 0) {
+        ALOGE("%s: can't watch fd: %s\n", m->name, strerror(errno));
+    }
+
+    m->opens++;
+    m->openNsec = monotonicNsec();
+    m->readyNsec = 0;
+    m->rssi = 99;
+    m->regState = -1;
+    m->state = MULTIMODEM_INIT;
+    m->initStep = 0;
+
+    sendInitStep(m);
+}
+
+/**
+ * closes m, failing its commands, and schedules the reopen of a device
+ * assumes m->lock is held
+ */
+static void closeModem(Modem *m)
+{
+    if (m->state == MULTIMODEM_CLOSED) {
+        return;
+    }
+
+    ALOGI("%s: closed\n", m->name);
+
+    m->state = MULTIMODEM_CLOSED;
+    setPollTimeout(m, -1);
+
+    /* closing the fd also takes it out of the epoll set */
+    at_channel_close(m->p_channel);
+
+    if (m->path != NULL) {
+        setReopenTime(m, monotonicNsec() + REOPEN_DELAY_MSEC * 1000000LL);
+    }
+}
+
+/** assumes m->lock is held */
+static void pollModem(Modem *m, int readable)
+{
+    int ret;
+
+    /* called for a closed modem too, to drain its wake fd */
+    ret = at_channel_poll(m->p_channel, readable);
+
+    if (m->state == MULTIMODEM_CLOSED) {
+        /* possibly closed by a callback just now */
+        return;
+    }
+
+    m->polls++;
+
+    if (ret == AT_ERROR_CHANNEL_CLOSED) {
+        closeModem(m);
+    } else {
+        setPollTimeout(m, ret);
+    }
+}
+
+/**
+ * Handles the poll timeouts and reopens that are due, and returns the
+ * epoll_wait() timeout until the next one in msec, or -1.
+ * A modem another thread is polling is skipped, that thread computes a
+ * new timeout for it anyway
+ */
+static int runTimers(MultiModem *p_mm)
+{
+    long long now = monotonicNsec();
+    long long next = 0;
+    int i;
+
+    for (i = 0 ; i < p_mm->count ; i++) {
+        Modem *m = &p_mm->modems[i];
+        long long pollNsec, reopenNsec;
+
+        pthread_mutex_lock(&p_mm->timerLock);
+        pollNsec = m->pollNsec;
+        reopenNsec = m->reopenNsec;
+        pthread_mutex_unlock(&p_mm->timerLock);
+
+        if ((pollNsec != 0 && pollNsec <= now)
+            || (reopenNsec != 0 && reopenNsec <= now)
+        ) {
+            if (pthread_mutex_trylock(&m->lock) != 0) {
+                continue;
+            }
+
+            if (m->state != MULTIMODEM_CLOSED) {
+                pollModem(m, 0);
+            } else if (reopenNsec != 0 && reopenNsec <= now) {
+                openModem(m);
+            } else {
+                setPollTimeout(m, -1);
+            }
+
+            pthread_mutex_unlock(&m->lock);
+
+            pthread_mutex_lock(&p_mm->timerLock);
+            pollNsec = m->pollNsec;
+            reopenNsec = m->reopenNsec;
+            pthread_mutex_unlock(&p_mm->timerLock);
+        }
+
+        if (pollNsec != 0 && (next == 0 || pollNsec < next)) {
+            next = pollNsec;
+        }
+        if (reopenNsec != 0 && (next == 0 || reopenNsec < next)) {
+            next = reopenNsec;
+        }
+    }
+
+    if (next == 0) {
+        return -1;
+    }
+
+    now = monotonicNsec();
+
+    return next > now ? (int) ((next - now + 999999) / 1000000) : 0;
+}
+
+static void *poolLoop(void *arg)
+{
+    MultiModem *p_mm = (MultiModem *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout;
+    int ret;
+    int i;
+
+    for (;;) {
+        timeout = runTimers(p_mm);
+
+        ret = epoll_wait(p_mm->epollFd, events, MAX_EVENTS, timeout);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            ALOGE("epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+
+        for (i = 0 ; i < ret ; i++) {
+            Modem *m;
+            int isWake;
+            int fd;
+
+            if (events[i].data.u64 == STOP_EVENT) {
+                /* level triggered, so every thread sees it */
+                return NULL;
+            }
+
+            m = &p_mm->modems[events[i].data.u64 / 2];
+            isWake = (int) (events[i].data.u64 & 1);
+
+            pthread_mutex_lock(&m->lock);
+
+            pollModem(m, !isWake);
+
+            /* re-arm what fired, unless the channel was closed meanwhile */
+            fd = isWake ? at_channel_get_wake_fd(m->p_channel)
+                        : m->state != MULTIMODEM_CLOSED ? m->channelFd : -1;
+            if (fd >= 0) {
+                watchFd(m, fd, isWake, EPOLL_CTL_MOD);
+            }
+
+            pthread_mutex_unlock(&m->lock);
+        }
+    }
+
+    return NULL;
+}
+
+MultiModem *multimodem_new(int threads)
+{
+    MultiModem *p_mm;
+
+    if (threads <= 0 || threads > MULTIMODEM_MAX_THREADS) {
+        return NULL;
+    }
+
+    p_mm = (MultiModem *) calloc(1, sizeof(MultiModem));
+    if (p_mm == NULL) {
+        return NULL;
+    }
+
+    p_mm->threadCount = threads;
+    p_mm->epollFd = -1;
+    p_mm->stopFds[0] = p_mm->stopFds[1] = -1;
+    pthread_mutex_init(&p_mm->timerLock, NULL);
+
+    return p_mm;
+}
+
+static int addModem(MultiModem *p_mm, const char *name, const char *path,
+                        int fd)
+{
+    Modem *m;
+
+    if (p_mm->started) {
+        return -1;
+    }
+
+    if (p_mm->count == p_mm->capacity) {
+        int capacity = p_mm->capacity == 0 ? 8 : p_mm->capacity * 2;
+        Modem *modems;
+
+        modems = (Modem *) realloc(p_mm->modems, capacity * sizeof(Modem));
+        if (modems == NULL) {
+            return -1;
+        }
+
+        p_mm->modems = modems;
+        p_mm->capacity = capacity;
+    }
+
+    m = &p_mm->modems[p_mm->count];
+    memset(m, 0, sizeof(*m));
+
+    m->index = p_mm->count;
+    m->name = strdup(name);
+    m->path = path != NULL ? strdup(path) : NULL;
+    m->fd = fd;
+    m->state = MULTIMODEM_CLOSED;
+    m->rssi = 99;
+    m->regState = -1;
+
+    /* the channel keeps m, so it is set up in multimodem_start() */
+    return p_mm->count++;
+}
+
+int multimodem_add_device(MultiModem *p_mm, const char *path)
+{
+    return addModem(p_mm, path, path, -1);
+}
+
+int multimodem_add_fd(MultiModem *p_mm, const char *name, int fd)
+{
+    return addModem(p_mm, name, NULL, fd);
+}
+
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int multimodem_add_glob(MultiModem *p_mm, const char *pattern)
+{
+    const char *slash = strrchr(pattern, '/');
+    char dir[256];
+    char path[512];
+    char **names = NULL;
+    int count = 0;
+    int added = 0;
+    struct dirent *p_entry;
+    DIR *p_dir;
+    int i;
+
+    /* bionic has no glob(), so match the directory entries */
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if ((size_t) (slash - pattern) < sizeof(dir)) {
+        memcpy(dir, pattern, slash - pattern);
+        dir[slash - pattern] = '\0';
+        if (dir[0] == '\0') {
+            strcpy(dir, "/");
+        }
+    } else {
+        return 0;
+    }
+
+    p_dir = opendir(dir);
+    if (p_dir == NULL) {
+        return 0;
+    }
+
+    while ((p_entry = readdir(p_dir)) != NULL) {
+        char **grown;
+
+        if (fnmatch(slash != NULL ? slash + 1 : pattern,
+                        p_entry->d_name, FNM_PERIOD) != 0
+        ) {
+            continue;
+        }
+
+        grown = (char **) realloc(names, (count + 1) * sizeof(char *));
+        if (grown == NULL) {
+            break;
+        }
+        names = grown;
+        names[count++] = strdup(p_entry->d_name);
+    }
+
+    closedir(p_dir);
+
+    /* keep the modem numbers stable between runs */
+    qsort(names, count, sizeof(char *), compareNames);
+
+    for (i = 0 ; i < count ; i++) {
+        snprintf(path, sizeof(path), "%s/%s",
+                    slash != NULL ? dir : ".", names[i]);
+
+        if (multimodem_add_device(p_mm, path) >= 0) {
+            added++;
+        }
+        free(names[i]);
+    }
+
+    free(names);
+
+    return added;
+}
+
+void multimodem_set_sms_handler(MultiModem *p_mm,
+                                MultiModemSmsHandler handler, void *param)
+{
+    p_mm->smsHandler = handler;
+    p_mm->smsParam = param;
+}
+
+int multimodem_start(MultiModem *p_mm)
+{
+    struct epoll_event ev;
+    int i;
+
+    if (p_mm->started || p_mm->count == 0) {
+        return -1;
+    }
+
+    p_mm->epollFd = epoll_create(p_mm->count * 2 + 1);
+    if (p_mm->epollFd < 0 || pipe(p_mm->stopFds) < 0) {
+        ALOGE("Can't set up the modem pool: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = STOP_EVENT;
+    epoll_ctl(p_mm->epollFd, EPOLL_CTL_ADD, p_mm->stopFds[0], &ev);
+
+    p_mm->started = 1;
+
+    for (i = 0 ; i < p_mm->count ; i++) {
+        Modem *m = &p_mm->modems[i];
+
+        m->p_mm = p_mm;
+        pthread_mutex_init(&m->lock, NULL);
+
+        m->p_channel = at_channel_new(m);
+        if (m->p_channel == NULL) {
+            return -1;
+        }
+
+        pthread_mutex_lock(&m->lock);
+        openModem(m);
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    for (i = 0 ; i < p_mm->threadCount ; i++) {
+        if (pthread_create(&p_mm->threads[i], NULL, poolLoop, p_mm) != 0) {
+            ALOGE("Can't start pool thread: %s\n", strerror(errno));
+            p_mm->threadCount = i;
+            return i > 0 ? 0 : -1;
+        }
+    }
+
+    ALOGI("Driving %d modems with %d threads\n",
+            p_mm->count, p_mm->threadCount);
+
+    return 0;
+}
+
+void multimodem_stop(MultiModem *p_mm)
+{
+    int i;
+
+    if (!p_mm->started) {
+        return;
+    }
+
+    if (write(p_mm->stopFds[1], "", 1) < 0) {}
+
+    for (i = 0 ; i < p_mm->threadCount ; i++) {
+        pthread_join(p_mm->threads[i], NULL);
+    }
+
+    for (i = 0 ; i < p_mm->count ; i++) {
+        Modem *m = &p_mm->modems[i];
+
+        pthread_mutex_lock(&m->lock);
+        closeModem(m);
+        setReopenTime(m, 0);
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    p_mm->started = 0;
+}
+
+int multimodem_count(MultiModem *p_mm)
+{
+    return p_mm->count;
+}
+
+int multimodem_ready_count(MultiModem *p_mm)
+{
+    int ready = 0;
+    int i;
+
+    for (i = 0 ; i < p_mm->count ; i++) {
+        if (p_mm->modems[i].state == MULTIMODEM_READY) {
+            ready++;
+        }
+    }
+
+    return ready;
+}
+
+void multimodem_get_stats(MultiModem *p_mm, int modem,
+                            MultiModemStats *p_stats)
+{
+    Modem *m = &p_mm->modems[modem];
+
+    pthread_mutex_lock(&m->lock);
+
+    p_stats->name = m->name;
+    p_stats->state = m->state;
+    p_stats->timeToReadyMsec = m->readyNsec != 0
+                            ? (m->readyNsec - m->openNsec) / 1000000LL : -1;
+    p_stats->rssi = m->rssi;
+    p_stats->regState = m->regState;
+    p_stats->opens = m->opens;
+    p_stats->commands = m->commands;
+    p_stats->commandErrors = m->commandErrors;
+    p_stats->unsolicited = m->unsolicited;
+    p_stats->smsReceived = m->smsReceived;
+    p_stats->polls = m->polls;
+
+    pthread_mutex_unlock(&m->lock);
+}
+
+void multimodem_dump_stats(MultiModem *p_mm)
+{
+    static const char *s_stateNames[] = { "closed", "init", "ready" };
+    MultiModemStats stats;
+    int i;
+
+    ALOGI("%d modems, %d threads\n", p_mm->count, p_mm->threadCount);
+
+    for (i = 0 ; i < p_mm->count ; i++) {
+        multimodem_get_stats(p_mm, i, &stats);
+
+        ALOGI("%s: %s, ready in %lld ms, rssi %d, reg %d, opens %llu, "
+                "commands %llu (%llu failed), unsolicited %llu, sms %llu, "
+                "polls %llu\n",
+                stats.name, s_stateNames[stats.state],
+                stats.timeToReadyMsec, stats.rssi, stats.regState,
+                stats.opens, stats.commands, stats.commandErrors,
+                stats.unsolicited, stats.smsReceived, stats.polls);
+    }
+}
@@ -0,0 +1,97 @@
+/* //device/system/reference-ril/multimodem.h
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef MULTIMODEM_H
+#define MULTIMODEM_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Drives many modems from one process with a fixed pool of threads
+ * sharing one epoll set, instead of a reader and a dispatch thread per
+ * modem. Each modem is a polled ATChannel, see at_channel_poll(). Its
+ * init sequence and unsolicited handling run on whichever pool thread
+ * picks up its events, never on two threads at once.
+ *
+ * Add the modems, then call multimodem_start(). The modem set is fixed
+ * from then on
+ */
+
+#define MULTIMODEM_MAX_THREADS 16
+
+typedef struct MultiModem MultiModem;
+
+/* called on a pool thread for every SMS received; the PDU is hex */
+typedef void (*MultiModemSmsHandler)(int modem, const char *pdu,
+                                        void *param);
+
+typedef enum {
+    MULTIMODEM_CLOSED,      /* waiting to be (re)opened */
+    MULTIMODEM_INIT,        /* running the init sequence */
+    MULTIMODEM_READY
+} MultiModemState;
+
+typedef struct {
+    const char *name;
+    MultiModemState state;
+    long long timeToReadyMsec;  /* open to end of init, -1 if not ready */
+    int rssi;                   /* last ^RSSI or +CSQ, 99 if unknown */
+    int regState;               /* last +CREG stat, -1 if unknown */
+    unsigned long long opens;
+    unsigned long long commands;        /* completed */
+    unsigned long long commandErrors;   /* errors and timeouts */
+    unsigned long long unsolicited;
+    unsigned long long smsReceived;
+    unsigned long long polls;           /* at_channel_poll() calls */
+} MultiModemStats;
+
+/* threads is the pool size, at most MULTIMODEM_MAX_THREADS */
+MultiModem *multimodem_new(int threads);
+
+/* a device that is reopened after it goes away; returns the modem */
+int multimodem_add_device(MultiModem *p_mm, const char *path);
+
+/*
+ * every device matching a pattern like "/dev/ttyUSB*": only the last
+ * path component may have wildcards. returns the number of modems added
+ */
+int multimodem_add_glob(MultiModem *p_mm, const char *pattern);
+
+/* an already open stream, eg a socket, which is not reopened */
+int multimodem_add_fd(MultiModem *p_mm, const char *name, int fd);
+
+void multimodem_set_sms_handler(MultiModem *p_mm,
+                                MultiModemSmsHandler handler, void *param);
+
+int multimodem_start(MultiModem *p_mm);
+
+/* stops the pool threads and closes the modems */
+void multimodem_stop(MultiModem *p_mm);
+
+int multimodem_count(MultiModem *p_mm);
+int multimodem_ready_count(MultiModem *p_mm);
+void multimodem_get_stats(MultiModem *p_mm, int modem,
+                            MultiModemStats *p_stats);
+void multimodem_dump_stats(MultiModem *p_mm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*MULTIMODEM_H*/
@@ -0,0 +1,337 @@
+/* //device/system/reference-ril/multimodem_bench.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Scaling benchmark for multimodem.c: one emulator thread plays N
+ * modems over socketpairs, answering the init sequence and then pushing
+ * +CMT SMS deliveries (with a ^RSSI now and then) as fast as the engine
+ * acknowledges them with AT+CNMA. Reports, for each modem count, the
+ * time until every modem is ready, the SMS rate, the threads the
+ * process runs and the CPU time the engine used per SMS
+ *
+ * usage: multimodem_bench [-t <pool threads>] [-n <sms per modem>]
+ *        [modem counts, default 1 8 32]
+ */
+
+#include "multimodem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define MAX_MODEMS 256
+#define SMS_WINDOW 4        /* deliveries a modem sends before an ack */
+
+/* an SMS-DELIVER from 3GPP TS 23.040 */
+static const char s_cmt[] =
+    "\r\n+CMT: ,23\r\n"
+    "07911326040000F0040B911346610089F60000208062917314080CC8F71D14969741"
+    "F977FD07\r\n";
+static const char s_rssi[] = "\r\n^RSSI: 17\r\n";
+
+typedef struct {
+    int fd;
+    char line[256];
+    size_t len;
+    int toSend;
+    int outstanding;
+    int sent;
+} EmuModem;
+
+typedef struct {
+    EmuModem modems[MAX_MODEMS];
+    int count;
+    volatile int sending;
+    volatile int stop;
+    long long cpuNsec;      /* CPU time of the emulator thread */
+} Emulator;
+
+static volatile int s_smsReceived;
+
+static long long nowNsec(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long processCpuNsec()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL
+            + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static int countThreads()
+{
+    DIR *p_dir = opendir("/proc/self/task");
+    struct dirent *p_entry;
+    int count = 0;
+
+    if (p_dir == NULL) {
+        return -1;
+    }
+
+    while ((p_entry = readdir(p_dir)) != NULL) {
+        if (p_entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+
+    closedir(p_dir);
+
+    return count;
+}
+
+static void emuWrite(EmuModem *p_modem, const char *s, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(p_modem->fd, s, len);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        s += ret;
+        len -= ret;
+    }
+}
+
+static void emuCommand(EmuModem *p_modem, const char *command)
+{
+    static const char ok[] = "\r\nOK\r\n";
+    static const char csq[] = "\r\n+CSQ: 20,99\r\n\r\nOK\r\n";
+
+    if (0 == strncmp(command, "AT+CNMA", 7)) {
+        p_modem->outstanding--;
+        emuWrite(p_modem, ok, sizeof(ok) - 1);
+    } else if (0 == strcmp(command, "AT+CSQ")) {
+        emuWrite(p_modem, csq, sizeof(csq) - 1);
+    } else if (command[0] != '\0') {
+        emuWrite(p_modem, ok, sizeof(ok) - 1);
+    }
+}
+
+static void emuRead(EmuModem *p_modem)
+{
+    char buf[256];
+    ssize_t count;
+    ssize_t i;
+
+    count = read(p_modem->fd, buf, sizeof(buf));
+
+    for (i = 0 ; i < count ; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            p_modem->line[p_modem->len] = '\0';
+            emuCommand(p_modem, p_modem->line);
+            p_modem->len = 0;
+        } else if (p_modem->len < sizeof(p_modem->line) - 1) {
+            p_modem->line[p_modem->len++] = buf[i];
+        }
+    }
+}
+
+static void *emulatorLoop(void *arg)
+{
+    Emulator *p_emu = (Emulator *) arg;
+    struct pollfd fds[MAX_MODEMS];
+    int i;
+
+    while (!p_emu->stop) {
+        for (i = 0 ; i < p_emu->count ; i++) {
+            EmuModem *p_modem = &p_emu->modems[i];
+
+            while (p_emu->sending && p_modem->toSend > 0
+                    && p_modem->outstanding < SMS_WINDOW
+            ) {
+                if (p_modem->sent % 16 == 15) {
+                    emuWrite(p_modem, s_rssi, sizeof(s_rssi) - 1);
+                }
+                emuWrite(p_modem, s_cmt, sizeof(s_cmt) - 1);
+                p_modem->toSend--;
+                p_modem->outstanding++;
+                p_modem->sent++;
+            }
+
+            fds[i].fd = p_modem->fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, p_emu->count, 10) <= 0) {
+            continue;
+        }
+
+        for (i = 0 ; i < p_emu->count ; i++) {
+            if (fds[i].revents != 0) {
+                emuRead(&p_emu->modems[i]);
+            }
+        }
+    }
+
+    p_emu->cpuNsec = nowNsec(CLOCK_THREAD_CPUTIME_ID);
+
+    return NULL;
+}
+
+static void onSms(int modem, const char *pdu, void *param)
+{
+    (void) modem;
+    (void) pdu;
+    (void) param;
+
+    __sync_fetch_and_add(&s_smsReceived, 1);
+}
+
+static int runBench(int modems, int threads, int smsPerModem)
+{
+    static Emulator emu;
+    MultiModem *p_mm;
+    pthread_t tid;
+    long long start, ready, done, cpuStart, cpuEnd;
+    int total = modems * smsPerModem;
+    int threadCount;
+    int i;
+
+    memset(&emu, 0, sizeof(emu));
+    emu.count = modems;
+    s_smsReceived = 0;
+
+    p_mm = multimodem_new(threads);
+    if (p_mm == NULL) {
+        return -1;
+    }
+
+    for (i = 0 ; i < modems ; i++) {
+        int sv[2];
+        char name[32];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            return -1;
+        }
+
+        snprintf(name, sizeof(name), "emu%d", i);
+        multimodem_add_fd(p_mm, name, sv[0]);
+
+        emu.modems[i].fd = sv[1];
+        emu.modems[i].toSend = smsPerModem;
+    }
+
+    multimodem_set_sms_handler(p_mm, onSms, NULL);
+
+    pthread_create(&tid, NULL, emulatorLoop, &emu);
+
+    cpuStart = processCpuNsec();
+    start = nowNsec(CLOCK_MONOTONIC);
+
+    if (multimodem_start(p_mm) < 0) {
+        return -1;
+    }
+
+    while (multimodem_ready_count(p_mm) < modems) {
+        usleep(1000);
+    }
+    ready = nowNsec(CLOCK_MONOTONIC);
+
+    emu.sending = 1;
+
+    while (s_smsReceived < total) {
+        usleep(1000);
+    }
+    done = nowNsec(CLOCK_MONOTONIC);
+
+    threadCount = countThreads();
+
+    multimodem_stop(p_mm);
+
+    emu.stop = 1;
+    pthread_join(tid, NULL);
+    cpuEnd = processCpuNsec();
+
+    for (i = 0 ; i < modems ; i++) {
+        close(emu.modems[i].fd);
+    }
+
+    printf("%3d modems: ready in %6.1f ms, %8.0f sms/s, %2d threads, "
+            "%6.1f us engine cpu/sms\n",
+            modems, (ready - start) / 1e6,
+            total / ((done - ready) / 1e9), threadCount,
+            (cpuEnd - cpuStart - emu.cpuNsec) / 1e3 / total);
+
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    static const int defaultCounts[] = { 1, 8, 32 };
+    int threads = 2;
+    int smsPerModem = 2000;
+    int opt;
+    int i;
+
+    while ( -1 != (opt = getopt(argc, argv, "t:n:"))) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+
+            case 'n':
+                smsPerModem = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-t <pool threads>] "
+                        "[-n <sms per modem>] [modem counts]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("%d pool threads, %d SMS per modem\n", threads, smsPerModem);
+
+    if (optind == argc) {
+        for (i = 0 ; i < 3 ; i++) {
+            runBench(defaultCounts[i], threads, smsPerModem);
+        }
+    } else {
+        for (i = optind ; i < argc ; i++) {
+            int modems = atoi(argv[i]);
+
+            if (modems > 0 && modems <= MAX_MODEMS) {
+                runBench(modems, threads, smsPerModem);
+            }
+        }
+    }
+
+    return 0;
+}
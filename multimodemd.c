@@ -0,0 +1,117 @@
+/* //device/system/reference-ril/multimodemd.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Daemon for SMS gateways and test racks: drives every dongle given on
+ * the command line from one small thread pool, see multimodem.h, and
+ * prints the SMS PDUs they receive as "<modem> <pdu>" lines on stdout
+ */
+
+#include "multimodem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "MULTIMODEM"
+#include <utils/Log.h>
+
+/* backwards compatibility for pre-JB */
+#ifndef ALOGD
+#define ALOGD LOGD
+#define ALOGE LOGE
+#define ALOGI LOGI
+#endif
+
+static pthread_mutex_t s_stdoutMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(char *s)
+{
+    fprintf(stderr, "usage: %s [-t <threads>] [-i <stats interval s>] "
+            "/dev/ttyUSB0 '/dev/ttyUSB*'...\n", s);
+    exit(-1);
+}
+
+static void onSms(int modem, const char *pdu, void *param)
+{
+    (void) param;
+
+    pthread_mutex_lock(&s_stdoutMutex);
+    printf("%d %s\n", modem, pdu);
+    fflush(stdout);
+    pthread_mutex_unlock(&s_stdoutMutex);
+}
+
+int main (int argc, char **argv)
+{
+    MultiModem *p_mm;
+    int threads = 2;
+    int interval = 60;
+    int opt;
+    int i;
+
+    while ( -1 != (opt = getopt(argc, argv, "t:i:"))) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+
+            case 'i':
+                interval = atoi(optarg);
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || interval <= 0) {
+        usage(argv[0]);
+    }
+
+    p_mm = multimodem_new(threads);
+    if (p_mm == NULL) {
+        usage(argv[0]);
+    }
+
+    for (i = optind ; i < argc ; i++) {
+        if (strpbrk(argv[i], "*?[") != NULL) {
+            if (multimodem_add_glob(p_mm, argv[i]) == 0) {
+                ALOGE("No device matches %s\n", argv[i]);
+            }
+        } else {
+            multimodem_add_device(p_mm, argv[i]);
+        }
+    }
+
+    multimodem_set_sms_handler(p_mm, onSms, NULL);
+
+    if (multimodem_start(p_mm) < 0) {
+        ALOGE("No modems to drive\n");
+        return 1;
+    }
+
+    for (;;) {
+        sleep(interval);
+        multimodem_dump_stats(p_mm);
+    }
+
+    return 0;
+}
@@ -0,0 +1,809 @@
+/* //device/system/reference-ril/ril_bench.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Microbenchmarks of the parts of the RIL that don't need Android: the
+ * GSM alphabet, UCS2 and hex codecs of gsm.c, the SMS PDU encoder and
+ * decoder of sms_gsm.c, the CDMA conversion of sms.c, at_tok.c, the
+ * line-end scanners of misc.c against the byte loop they replaced and
+ * the command write path of atchannel.c against the one before it, each
+ * over a fixed corpus. It's built for the host too, with the logging
+ * shim in host/, eg
+ *
+ *   gcc -O2 -D_GNU_SOURCE -Ihost -I. -o ril_bench ril_bench.c gsm.c \
+ *       sms_gsm.c sms.c at_tok.c misc.c
+ *
+ * A benchmark is timed as samples of at least -t msec each, and the
+ * fastest and the median sample are reported. Noise only ever adds
+ * time, so the fastest is what's compared: with -b, to a baseline
+ * written earlier with -w, and the exit status is 1 if any is over -x
+ * percent slower. Every benchmark's output is checksummed first, and
+ * the exit status is 1 too if a checksum differs from the baseline, so
+ * a change that alters what the code computes shows up
+ *
+ * usage: ril_bench [-f <name filter>] [-t <msec per sample>]
+ *        [-r <samples>] [-c <cpu>] [-w <baseline>]
+ *        [-b <baseline> [-x <tolerance %>]]
+ */
+
+#include "gsm.h"
+#include "sms_gsm.h"
+#include "at_tok.h"
+#include "misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+#define MAX_SAMPLES 64
+#define MAX_NAME 32
+
+/* sms.c has no header, huaweigeneric-ril.c declares these too */
+extern char **cdma_to_gsmpdu(const char *);
+extern char *gsm_to_cdmapdu(const char *);
+
+/* a full single part GSM 7 bit message, with escaped characters */
+static const char s_gsm7Text[] =
+    "Your balance is 12.50 EUR. Top up at www.example.com/topup or "
+    "dial *100#. Roaming {EU} rates apply: calls 0.19/min, SMS 0.06 & "
+    "data 0.20/MB [until 31.12.]";
+
+/* Cyrillic, Greek and CJK, so UCS2, and short enough for one part */
+static const char s_ucs2Text[] =
+    "Баланс: 125 ₽. Το υπόλοιπο είναι χαμηλό. 余额不足，请充值。";
+
+/* long enough to be sent as 3 concatenated GSM 7 bit parts */
+static const char s_gsm7LongText[] =
+    "This is a long message that doesn't fit in a single SMS, so the "
+    "encoder has to split it into several parts, each with a user data "
+    "header carrying the reference, the part count and the part number. "
+    "The receiving phone puts them back together in order; this one is "
+    "exactly long enough to need three of them to carry all of its text "
+    "to the other end.";
+
+/* SMS-DELIVER from +31641600986, GSM 7 bit "How are you?" */
+static const char s_deliverPdu[] =
+    "07911326040000F0040B911346610089F60000208062917314080CC8F71D14969741"
+    "F977FD07";
+
+/* SMS-SUBMIT to +46708251358, GSM 7 bit "hellohello", as the framework
+   sends it: without a validity period */
+static const char s_submitPdu[] =
+    "0001000B916407281553F800000AE8329BFD4697D9EC37";
+
+/* SMS-DELIVER, UCS2, as smspdu_create_deliver_utf8() writes it */
+static const char s_deliverUcs2Pdu[] =
+    "00200B919761214365F70009218062917314803204110430043B0430043D0441003A"
+    "00200031003200350020044004430431002E00200421043F043004410438043104"
+    "3E0021";
+
+/* response lines captured from E1550 and E173 sticks */
+static const char * const s_atLines[] = {
+    "+CLCC: 1,0,0,0,0,\"+491701234567\",145",
+    "+CREG: 2,1,\"0F3C\",\"0099B2A1\",2",
+    "+CSQ: 17,99",
+    "^RSSI:14",
+    "+COPS: 0,2,\"26202\",2",
+    "+CGDCONT: 1,\"IP\",\"web.vodafone.de\",\"0.0.0.0\",0,0",
+    "^DSFLOWRPT:0000003C,00000F3A,00000D2E,000000000004A0F2,"
+        "00000000001B21C4,0003E800,0003E800",
+    "+CRSM: 144,0,\"98941000103132F4F9\"",
+};
+
+/* commands as the RIL writes them, the last an SMS PDU before its ^Z */
+static const char * const s_atCommands[] = {
+    "AT+CSQ",
+    "AT+CREG?",
+    "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
+    "AT^SYSINFO",
+    "AT+CLCC",
+    "AT+CGDCONT=1,\"IP\",\"web.vodafone.de\"",
+    "AT+CMGS=27",
+    "0011000C9194711032547600000AE8329BFD4697D9EC37",
+};
+
+/* a +COPS=? answer, the longest line the reader usually sees */
+static const char s_copsScan[] =
+    "+COPS: (2,\"Vodafone.de\",\"Vodafone\",\"26202\",2),"
+    "(1,\"Telekom.de\",\"TDG\",\"26201\",2),"
+    "(1,\"o2 - de\",\"o2 - de\",\"26207\",2),"
+    "(1,\"E-Plus\",\"E-Plus\",\"26203\",0),"
+    "(3,\"Vodafone.de\",\"Vodafone\",\"26202\",0),"
+    "(3,\"Telekom.de\",\"TDG\",\"26201\",0),"
+    "(3,\"o2 - de\",\"o2 - de\",\"26207\",0),,(0,1,2,3,4),(0,1,2)";
+
+/* the corpora in the forms the benchmarks start from */
+static byte_t s_gsm7Packed[160];
+static int s_gsm7Septets;
+static byte_t s_ucs2[512];
+static int s_ucs2Len;
+static byte_t s_hexBytes[140];
+static char s_hex[2 * sizeof(s_hexBytes)];
+static char s_cdmaPdu[512];
+static SmsAddressRec s_sender;
+static SmsTimeStampRec s_timestamp;
+static char s_scanInput[2048];  /* the lines as the reader gets them */
+static size_t s_scanLen;
+
+static int s_writeFds[2] = { -1, -1 };    /* the port, the modem */
+
+static volatile unsigned int s_sink;
+
+/* FNV-1a */
+static unsigned int checksum(unsigned int sum, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+
+    if (sum == 0) {
+        sum = 2166136261u;
+    }
+
+    while (len-- > 0) {
+        sum = (sum ^ *p++) * 16777619u;
+    }
+
+    return sum;
+}
+
+/*
+ * Each benchmark does one operation, and if p_sum isn't NULL
+ * checksums what it produced into it
+ */
+
+static void benchGsm7Pack(unsigned int *p_sum)
+{
+    byte_t packed[160];
+    int bits;
+
+    /* writing, it returns the bits written */
+    bits = utf8_to_gsm7((cbytes_t) s_gsm7Text, sizeof(s_gsm7Text) - 1,
+                        packed, 0);
+    s_sink += packed[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, packed, (bits + 7) / 8);
+    }
+}
+
+static void benchGsm7Unpack(unsigned int *p_sum)
+{
+    byte_t utf8[256];
+    int len;
+
+    len = utf8_from_gsm7(s_gsm7Packed, 0, s_gsm7Septets, utf8);
+    s_sink += utf8[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, utf8, len);
+    }
+}
+
+static void benchUtf8ToUcs2(unsigned int *p_sum)
+{
+    byte_t ucs2[512];
+    int len;
+
+    len = utf8_to_ucs2((cbytes_t) s_ucs2Text, sizeof(s_ucs2Text) - 1, ucs2);
+    s_sink += ucs2[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, ucs2, len * 2);
+    }
+}
+
+static void benchUcs2ToUtf8(unsigned int *p_sum)
+{
+    byte_t utf8[512];
+    int len;
+
+    len = ucs2_to_utf8(s_ucs2, s_ucs2Len, utf8);
+    s_sink += utf8[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, utf8, len);
+    }
+}
+
+static void benchHexEncode(unsigned int *p_sum)
+{
+    char hex[sizeof(s_hex)];
+
+    gsm_hex_from_bytes(hex, s_hexBytes, sizeof(s_hexBytes));
+    s_sink += hex[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, hex, sizeof(hex));
+    }
+}
+
+static void benchHexDecode(unsigned int *p_sum)
+{
+    byte_t bytes[sizeof(s_hexBytes)];
+
+    gsm_hex_to_bytes((cbytes_t) s_hex, sizeof(s_hex), bytes);
+    s_sink += bytes[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, bytes, sizeof(bytes));
+    }
+}
+
+static void createDeliver(const char *text, size_t len, unsigned int *p_sum)
+{
+    char hex[512];
+    SmsPDU *pdus;
+    int i;
+
+    pdus = smspdu_create_deliver_utf8((const unsigned char *) text, len,
+                                        &s_sender, &s_timestamp);
+    if (pdus == NULL) {
+        return;
+    }
+
+    for (i = 0 ; pdus[i] != NULL ; i++) {
+        int hexLen = smspdu_to_hex(pdus[i], hex, sizeof(hex));
+
+        s_sink += hex[0];
+
+        if (p_sum != NULL) {
+            *p_sum = checksum(*p_sum, hex, hexLen < (int) sizeof(hex)
+                                            ? hexLen : (int) sizeof(hex));
+        }
+    }
+
+    smspdu_free_list(pdus);
+}
+
+static void benchDeliverGsm7(unsigned int *p_sum)
+{
+    createDeliver(s_gsm7Text, sizeof(s_gsm7Text) - 1, p_sum);
+}
+
+static void benchDeliverGsm7Long(unsigned int *p_sum)
+{
+    createDeliver(s_gsm7LongText, sizeof(s_gsm7LongText) - 1, p_sum);
+}
+
+static void benchDeliverUcs2(unsigned int *p_sum)
+{
+    createDeliver(s_ucs2Text, sizeof(s_ucs2Text) - 1, p_sum);
+}
+
+/* decodes pdu the way the RIL does for +CMT and +CMGS */
+static void decodePdu(const char *pdu, size_t len, unsigned int *p_sum)
+{
+    SmsAddressRec address;
+    char number[32];
+    unsigned char text[512];
+    SmsPDU p_pdu;
+    int textLen;
+
+    p_pdu = smspdu_create_from_hex(pdu, len);
+    if (p_pdu == NULL) {
+        return;
+    }
+
+    if (smspdu_get_sender_address(p_pdu, &address) < 0) {
+        smspdu_get_receiver_address(p_pdu, &address);
+    }
+    sms_address_to_str(&address, number, sizeof(number));
+    textLen = smspdu_get_text_message(p_pdu, text, sizeof(text));
+    s_sink += text[0] + number[0];
+
+    if (p_sum != NULL && textLen >= 0) {
+        *p_sum = checksum(*p_sum, number, strlen(number));
+        *p_sum = checksum(*p_sum, text, textLen);
+    }
+
+    smspdu_free(p_pdu);
+}
+
+static void benchFromHexDeliver(unsigned int *p_sum)
+{
+    decodePdu(s_deliverPdu, sizeof(s_deliverPdu) - 1, p_sum);
+}
+
+static void benchFromHexSubmit(unsigned int *p_sum)
+{
+    decodePdu(s_submitPdu, sizeof(s_submitPdu) - 1, p_sum);
+}
+
+static void benchFromHexUcs2(unsigned int *p_sum)
+{
+    decodePdu(s_deliverUcs2Pdu, sizeof(s_deliverUcs2Pdu) - 1, p_sum);
+}
+
+static void benchGsmToCdma(unsigned int *p_sum)
+{
+    char *pdu = gsm_to_cdmapdu(s_submitPdu);
+
+    s_sink += pdu[0];
+
+    if (p_sum != NULL) {
+        *p_sum = checksum(*p_sum, pdu, strlen(pdu));
+    }
+}
+
+static void benchCdmaToGsm(unsigned int *p_sum)
+{
+    char **pdus = cdma_to_gsmpdu(s_cdmaPdu);
+    int i;
+
+    for (i = 0 ; pdus[i] != NULL ; i++) {
+        s_sink += pdus[i][0];
+
+        /* the PDUs carry the time of the conversion, so decode them */
+        if (p_sum != NULL) {
+            decodePdu(pdus[i], strlen(pdus[i]), p_sum);
+        }
+    }
+}
+
+static void benchAtTokSplit(unsigned int *p_sum)
+{
+    ATTokLine tok;
+    size_t i;
+    int f;
+
+    for (i = 0 ; i < NUM_ELEMS(s_atLines) ; i++) {
+        at_tok_split(s_atLines[i], &tok);
+
+        for (f = 0 ; f < tok.count ; f++) {
+            const ATTokField *p_field = &tok.fields[f];
+            int value = 0;
+
+            if (!p_field->quoted) {
+                at_tok_field_int(&tok, f, &value);
+            }
+            s_sink += value;
+
+            if (p_sum != NULL) {
+                *p_sum = checksum(*p_sum, p_field->p, p_field->len);
+                *p_sum = checksum(*p_sum, &value, sizeof(value));
+            }
+        }
+    }
+}
+
+static void benchAtTokNext(unsigned int *p_sum)
+{
+    char line[256];
+    char *cur;
+    char *str;
+    size_t i;
+    int value;
+
+    for (i = 0 ; i < NUM_ELEMS(s_atLines) ; i++) {
+        /* the RIL tokenizes a copy of the line */
+        strcpy(line, s_atLines[i]);
+        cur = line;
+        at_tok_start(&cur);
+
+        while (at_tok_hasmore(&cur)) {
+            if (*cur == '"') {
+                if (at_tok_nextstr(&cur, &str) < 0) break;
+                value = str[0];
+            } else if (at_tok_nextint(&cur, &value) < 0) {
+                break;
+            }
+            s_sink += value;
+
+            if (p_sum != NULL) {
+                *p_sum = checksum(*p_sum, &value, sizeof(value));
+            }
+        }
+    }
+}
+
+/*
+ * The reader splits its input into lines with findLineEnd() and
+ * skipLineEnds(). The byte loops below are what they replaced; both
+ * benchmarks split the same input, so their checksums must match
+ */
+
+static size_t byteFindLineEnd(const char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && s[i] != '\r' && s[i] != '\n') i++;
+
+    return i;
+}
+
+static size_t byteSkipLineEnds(const char *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && (s[i] == '\r' || s[i] == '\n')) i++;
+
+    return i;
+}
+
+static void splitLines(size_t (*findEnd)(const char *, size_t),
+                        size_t (*skipEnds)(const char *, size_t),
+                        unsigned int *p_sum)
+{
+    size_t pos = 0;
+
+    while (pos < s_scanLen) {
+        size_t len;
+
+        pos += skipEnds(s_scanInput + pos, s_scanLen - pos);
+        len = findEnd(s_scanInput + pos, s_scanLen - pos);
+        s_sink += len;
+
+        if (p_sum != NULL) {
+            *p_sum = checksum(*p_sum, &pos, sizeof(pos));
+            *p_sum = checksum(*p_sum, &len, sizeof(len));
+        }
+        pos += len;
+    }
+}
+
+static void benchScanLines(unsigned int *p_sum)
+{
+    splitLines(findLineEnd, skipLineEnds, p_sum);
+}
+
+static void benchScanLinesBytes(unsigned int *p_sum)
+{
+    splitLines(byteFindLineEnd, byteSkipLineEnds, p_sum);
+}
+
+/*
+ * writeTerminated() in atchannel.c sends a command and its terminator
+ * with one writev(); it used to take a write() for each. Over a
+ * socketpair, which like a USB serial port turns each call into a
+ * transfer of its own, with the modem's end drained after each command
+ */
+
+static void drainModem(size_t len, unsigned int *p_sum)
+{
+    char buf[256];
+    ssize_t n;
+
+    while (len > 0 && (n = read(s_writeFds[1], buf, sizeof(buf))) > 0) {
+        len -= n;
+        if (p_sum != NULL) {
+            *p_sum = checksum(*p_sum, buf, n);
+        }
+    }
+}
+
+static void benchWriteTwoWrites(unsigned int *p_sum)
+{
+    size_t i;
+
+    for (i = 0 ; i < NUM_ELEMS(s_atCommands) ; i++) {
+        const char *cmd = s_atCommands[i];
+        size_t len = strlen(cmd);
+        const char *terminator = i + 1 < NUM_ELEMS(s_atCommands)
+                                    ? "\r" : "\032";
+
+        s_sink += write(s_writeFds[0], cmd, len);
+        s_sink += write(s_writeFds[0], terminator, 1);
+        drainModem(len + 1, p_sum);
+    }
+}
+
+static void benchWriteWritev(unsigned int *p_sum)
+{
+    size_t i;
+
+    for (i = 0 ; i < NUM_ELEMS(s_atCommands) ; i++) {
+        struct iovec iov[2];
+        char terminator = i + 1 < NUM_ELEMS(s_atCommands) ? '\r' : '\032';
+
+        iov[0].iov_base = (void *) s_atCommands[i];
+        iov[0].iov_len = strlen(s_atCommands[i]);
+        iov[1].iov_base = &terminator;
+        iov[1].iov_len = 1;
+
+        s_sink += writev(s_writeFds[0], iov, 2);
+        drainModem(iov[0].iov_len + 1, p_sum);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*bench)(unsigned int *p_sum);
+} s_benches[] = {
+    { "gsm7_pack",              benchGsm7Pack },
+    { "gsm7_unpack",            benchGsm7Unpack },
+    { "utf8_to_ucs2",           benchUtf8ToUcs2 },
+    { "ucs2_to_utf8",           benchUcs2ToUtf8 },
+    { "hex_encode",             benchHexEncode },
+    { "hex_decode",             benchHexDecode },
+    { "deliver_utf8_gsm7",      benchDeliverGsm7 },
+    { "deliver_utf8_gsm7_x3",   benchDeliverGsm7Long },
+    { "deliver_utf8_ucs2",      benchDeliverUcs2 },
+    { "from_hex_deliver",       benchFromHexDeliver },
+    { "from_hex_submit",        benchFromHexSubmit },
+    { "from_hex_ucs2",          benchFromHexUcs2 },
+    { "gsm_to_cdmapdu",         benchGsmToCdma },
+    { "cdma_to_gsmpdu",         benchCdmaToGsm },
+    { "at_tok_split",           benchAtTokSplit },
+    { "at_tok_next",            benchAtTokNext },
+    { "scan_lines",             benchScanLines },
+    { "scan_lines_bytes",       benchScanLinesBytes },
+    { "write_cmd_writev",       benchWriteWritev },
+    { "write_cmd_two_writes",   benchWriteTwoWrites },
+};
+
+typedef struct {
+    char name[MAX_NAME];
+    double nsec;
+    unsigned int sum;
+} BenchResult;
+
+static long long nowNsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(char *s)
+{
+    fprintf(stderr, "usage: %s [-f <name filter>] [-t <msec per sample>] "
+            "[-r <samples>] [-c <cpu>] [-w <baseline>] "
+            "[-b <baseline> [-x <tolerance %%>]]\n", s);
+    exit(-1);
+}
+
+static void setupCorpora()
+{
+    size_t i;
+
+    s_gsm7Septets = utf8_to_gsm7((cbytes_t) s_gsm7Text,
+                                    sizeof(s_gsm7Text) - 1, NULL, 0);
+    utf8_to_gsm7((cbytes_t) s_gsm7Text, sizeof(s_gsm7Text) - 1,
+                    s_gsm7Packed, 0);
+    s_ucs2Len = utf8_to_ucs2((cbytes_t) s_ucs2Text, sizeof(s_ucs2Text) - 1,
+                                s_ucs2) * 2;
+
+    for (i = 0 ; i < sizeof(s_hexBytes) ; i++) {
+        s_hexBytes[i] = (byte_t) (i * 73 + 11);
+    }
+    gsm_hex_from_bytes(s_hex, s_hexBytes, sizeof(s_hexBytes));
+
+    sms_address_from_str(&s_sender, "+491701234567", 13);
+    /* 2012-08-26 19:37:41 +02:00, semi-octets */
+    memcpy(s_timestamp.data, "\x21\x80\x62\x91\x73\x14\x80", 7);
+
+    /* each line answered as a SINGLELINE query is, then the scan */
+    for (i = 0 ; i < NUM_ELEMS(s_atLines) ; i++) {
+        s_scanLen += snprintf(s_scanInput + s_scanLen,
+                                sizeof(s_scanInput) - s_scanLen,
+                                "\r\n%s\r\n\r\nOK\r\n", s_atLines[i]);
+    }
+    s_scanLen += snprintf(s_scanInput + s_scanLen,
+                            sizeof(s_scanInput) - s_scanLen,
+                            "\r\n%s\r\n\r\nOK\r\n", s_copsScan);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, s_writeFds) < 0) {
+        perror("socketpair");
+        exit(-1);
+    }
+
+    /* gsm_to_cdmapdu's result is a static buffer */
+    snprintf(s_cdmaPdu, sizeof(s_cdmaPdu), "%s", gsm_to_cdmapdu(s_submitPdu));
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+
+    return da < db ? -1 : da > db;
+}
+
+/**
+ * Times the benchmark, returns the fastest ns per operation of the
+ * samples, and the median in *p_median
+ */
+static double runBench(void (*bench)(unsigned int *), long long sampleNsec,
+                        int samples, double *p_median)
+{
+    double results[MAX_SAMPLES];
+    long long iterations = 1;
+    long long start, elapsed;
+    long long n;
+    int i;
+
+    /* warm up, and find how many iterations make a sample */
+    for (;;) {
+        start = nowNsec();
+        for (n = 0 ; n < iterations ; n++) {
+            bench(NULL);
+        }
+        elapsed = nowNsec() - start;
+
+        if (elapsed >= sampleNsec) {
+            break;
+        }
+
+        iterations = elapsed > 0 && sampleNsec / elapsed < 16
+                        ? iterations * sampleNsec / elapsed + 1
+                        : iterations * 16;
+    }
+
+    for (i = 0 ; i < samples ; i++) {
+        start = nowNsec();
+        for (n = 0 ; n < iterations ; n++) {
+            bench(NULL);
+        }
+        results[i] = (double) (nowNsec() - start) / iterations;
+    }
+
+    qsort(results, samples, sizeof(double), compareDoubles);
+    *p_median = results[samples / 2];
+
+    return results[0];
+}
+
+static int readBaseline(const char *path, BenchResult *p_results, int max)
+{
+    FILE *fp;
+    int count = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (count < max && fscanf(fp, "%31s %lf %x", p_results[count].name,
+                        &p_results[count].nsec, &p_results[count].sum) == 3) {
+        count++;
+    }
+
+    fclose(fp);
+
+    return count;
+}
+
+int main (int argc, char **argv)
+{
+    BenchResult baseline[NUM_ELEMS(s_benches)];
+    unsigned int sums[NUM_ELEMS(s_benches)];
+    const char *filter = NULL;
+    const char *baselinePath = NULL;
+    const char *writePath = NULL;
+    FILE *writeFp = NULL;
+    long long sampleNsec = 20000000LL;
+    int samples = 9;
+    int tolerance = 10;
+    int baselineCount = 0;
+    int failed = 0;
+    int opt;
+    size_t i;
+
+    while ( -1 != (opt = getopt(argc, argv, "f:t:r:c:w:b:x:"))) {
+        switch (opt) {
+            case 'f': filter = optarg; break;
+            case 't': sampleNsec = atoll(optarg) * 1000000LL; break;
+            case 'r': samples = atoi(optarg); break;
+            case 'w': writePath = optarg; break;
+            case 'b': baselinePath = optarg; break;
+            case 'x': tolerance = atoi(optarg); break;
+
+            case 'c': {
+                /* one core, so migrations and its siblings' caches
+                   don't add noise */
+                cpu_set_t set;
+
+                CPU_ZERO(&set);
+                CPU_SET(atoi(optarg), &set);
+                if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+                    perror("sched_setaffinity");
+                }
+                break;
+            }
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (samples < 1 || samples > MAX_SAMPLES || sampleNsec <= 0) {
+        usage(argv[0]);
+    }
+
+    if (baselinePath != NULL) {
+        baselineCount = readBaseline(baselinePath, baseline,
+                                        NUM_ELEMS(baseline));
+        if (baselineCount < 0) {
+            return 1;
+        }
+    }
+
+    if (writePath != NULL && (writeFp = fopen(writePath, "w")) == NULL) {
+        perror(writePath);
+        return 1;
+    }
+
+    setupCorpora();
+
+    /*
+     * checksum them all, in the same order whatever the filter:
+     * smspdu_create_deliver_utf8() numbers its concatenated messages
+     */
+    for (i = 0 ; i < NUM_ELEMS(s_benches) ; i++) {
+        sums[i] = 0;
+        s_benches[i].bench(&sums[i]);
+    }
+
+    printf("%-22s %10s %10s %10s  %s\n", "benchmark", "min", "median",
+            "baseline", "(ns/op)");
+
+    for (i = 0 ; i < NUM_ELEMS(s_benches) ; i++) {
+        const BenchResult *p_base = NULL;
+        const char *verdict = "";
+        double median, min;
+        int j;
+
+        if (filter != NULL && strstr(s_benches[i].name, filter) == NULL) {
+            continue;
+        }
+
+        min = runBench(s_benches[i].bench, sampleNsec, samples, &median);
+
+        for (j = 0 ; j < baselineCount ; j++) {
+            if (0 == strcmp(baseline[j].name, s_benches[i].name)) {
+                p_base = &baseline[j];
+            }
+        }
+
+        if (p_base != NULL && p_base->sum != sums[i]) {
+            verdict = "  CHECKSUM DIFFERS";
+            failed = 1;
+        } else if (p_base != NULL
+                && min > p_base->nsec * (100 + tolerance) / 100) {
+            verdict = "  SLOWER";
+            failed = 1;
+        }
+
+        if (p_base != NULL) {
+            printf("%-22s %10.1f %10.1f %10.1f%s\n", s_benches[i].name,
+                    min, median, p_base->nsec, verdict);
+        } else {
+            printf("%-22s %10.1f %10.1f %10s\n", s_benches[i].name,
+                    min, median, "-");
+        }
+
+        if (writeFp != NULL) {
+            fprintf(writeFp, "%s %.1f %08x\n", s_benches[i].name, min,
+                    sums[i]);
+        }
+    }
+
+    if (writeFp != NULL) {
+        fclose(writeFp);
+    }
+
+    return failed;
+}
@@ -0,0 +1,909 @@
+/* //device/system/reference-ril/ril_test.c
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Checks of atchannel.c against a scripted modem on a socketpair, for
+ * the cases the emulator can't make happen on demand, eg an answer
+ * that comes after the command timed out, round trips through the
+ * SMS codecs of sms_gsm.c and sms.c, and the +CREG forms of
+ * at_schema.c. Built for the host like ril_bench.c, eg
+ *
+ *   gcc -D_GNU_SOURCE -Ihost -I. -o ril_test ril_test.c atchannel.c \
+ *       misc.c at_tok.c at_capture.c at_trace.c gsm.c sms_gsm.c sms.c \
+ *       at_schema.c -lpthread
+ *
+ * Each check prints its name and "ok" or what went wrong, and the exit
+ * status is 1 if any failed
+ *
+ * usage: ril_test [-f <name filter>]
+ */
+
+#include "atchannel.h"
+#include "sms_gsm.h"
+#include "at_schema.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+/* sms.c has no header, huaweigeneric-ril.c declares these too */
+extern char **cdma_to_gsmpdu(const char *);
+extern char *gsm_to_cdmapdu(const char *);
+
+#define MAX_FAKE_LINE 1024
+#define MAX_FAKE_LOG 4096
+
+/* how a FakeModem answers the commands starting with prefix */
+typedef struct {
+    const char *prefix;
+    const char *response;   /* with its final result, "\r\n" separated */
+    int delayMsec;
+} FakeReply;
+
+/*
+ * The modem end of a socketpair. Like a real one, it handles a command
+ * at a time: the next is only read once the answer to the last one is
+ * out, however late. Commands without a FakeReply get "OK". The
+ * commands it got are kept in log, one per line
+ */
+typedef struct {
+    int fd;
+    const FakeReply *replies;
+    int replyCount;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    char log[MAX_FAKE_LOG];
+    size_t logLen;
+} FakeModem;
+
+static int s_failed;
+
+static void sleepMsec(int msec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000L;
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static void fakeWrite(FakeModem *p_modem, const char *s)
+{
+    size_t len = strlen(s);
+
+    while (len > 0) {
+        ssize_t ret = write(p_modem->fd, s, len);
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        s += ret;
+        len -= ret;
+    }
+}
+
+static void fakeCommand(FakeModem *p_modem, const char *line)
+{
+    char buf[MAX_FAKE_LINE + 8];
+    int i;
+
+    pthread_mutex_lock(&p_modem->mutex);
+    if (p_modem->logLen + strlen(line) + 2 <= sizeof(p_modem->log)) {
+        p_modem->logLen += sprintf(p_modem->log + p_modem->logLen, "%s\n",
+                                    line);
+    }
+    pthread_mutex_unlock(&p_modem->mutex);
+
+    for (i = 0 ; i < p_modem->replyCount ; i++) {
+        const FakeReply *p_reply = &p_modem->replies[i];
+
+        if (0 == strncasecmp(line, p_reply->prefix,
+                                strlen(p_reply->prefix))) {
+            sleepMsec(p_reply->delayMsec);
+            snprintf(buf, sizeof(buf), "\r\n%s\r\n", p_reply->response);
+            fakeWrite(p_modem, buf);
+            return;
+        }
+    }
+
+    fakeWrite(p_modem, "\r\nOK\r\n");
+}
+
+static void *fakeModemLoop(void *arg)
+{
+    FakeModem *p_modem = (FakeModem *) arg;
+    char line[MAX_FAKE_LINE];
+    size_t len = 0;
+    char c;
+
+    while (read(p_modem->fd, &c, 1) == 1) {
+        if (c != '\r') {
+            if (len < sizeof(line) - 1) {
+                line[len++] = c;
+            }
+            continue;
+        }
+
+        line[len] = '\0';
+        if (len > 0) {
+            fakeCommand(p_modem, line);
+        }
+        len = 0;
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts a fake modem with the replies, returns the fd of the RIL end
+ * or -1 on error
+ */
+static int fakeModemStart(FakeModem *p_modem, const FakeReply *replies,
+                            int replyCount)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    p_modem->fd = fds[1];
+    p_modem->replies = replies;
+    p_modem->replyCount = replyCount;
+    pthread_mutex_init(&p_modem->mutex, NULL);
+    p_modem->log[0] = '\0';
+    p_modem->logLen = 0;
+
+    if (pthread_create(&p_modem->tid, NULL, fakeModemLoop, p_modem) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    return fds[0];
+}
+
+/** returns where command is in the modem's log, -1 if it never got it */
+static int fakeModemFind(FakeModem *p_modem, const char *command)
+{
+    char line[MAX_FAKE_LINE + 2];
+    const char *found;
+    int ret;
+
+    snprintf(line, sizeof(line), "%s\n", command);
+
+    pthread_mutex_lock(&p_modem->mutex);
+    found = strstr(p_modem->log, line);
+    ret = found != NULL ? (int) (found - p_modem->log) : -1;
+    pthread_mutex_unlock(&p_modem->mutex);
+
+    return ret;
+}
+
+/** returns 1 if the modem got command */
+static int fakeModemGot(FakeModem *p_modem, const char *command)
+{
+    return fakeModemFind(p_modem, command) >= 0;
+}
+
+/** waits for the modem to see the RIL end closed */
+static void fakeModemStop(FakeModem *p_modem)
+{
+    pthread_join(p_modem->tid, NULL);
+    close(p_modem->fd);
+}
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+static void onUnsolicited(ATChannel *p_channel, const char *s,
+                            const char *sms_pdu, ATLineType type)
+{
+    (void) p_channel;
+    (void) s;
+    (void) sms_pdu;
+    (void) type;
+}
+
+static int s_timeouts;
+
+static void onTimeout(ATChannel *p_channel)
+{
+    (void) p_channel;
+
+    __sync_fetch_and_add(&s_timeouts, 1);
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    int err;
+} AsyncResult;
+
+static void onAsyncComplete(int err, ATResponse *p_response, void *param)
+{
+    AsyncResult *p_result = (AsyncResult *) param;
+
+    at_response_free(p_response);
+
+    pthread_mutex_lock(&p_result->mutex);
+    p_result->err = err;
+    p_result->done = 1;
+    pthread_cond_signal(&p_result->cond);
+    pthread_mutex_unlock(&p_result->mutex);
+}
+
+static void initAsync(AsyncResult *p_result)
+{
+    memset(p_result, 0, sizeof(*p_result));
+    pthread_mutex_init(&p_result->mutex, NULL);
+    pthread_cond_init(&p_result->cond, NULL);
+}
+
+/** returns the err onAsyncComplete() got, once it has */
+static int waitAsync(AsyncResult *p_result)
+{
+    pthread_mutex_lock(&p_result->mutex);
+    while (!p_result->done) {
+        pthread_cond_wait(&p_result->cond, &p_result->mutex);
+    }
+    pthread_mutex_unlock(&p_result->mutex);
+
+    return p_result->err;
+}
+
+/** sends AT+CGSN and checks it gets its own answer */
+static int checkCgsn(ATChannel *p_channel)
+{
+    ATResponse *p_response = NULL;
+    int err;
+
+    err = at_channel_send_command(p_channel, "AT+CGSN", NUMERIC, NULL,
+                                    NULL, 1000, &p_response);
+
+    CHECK(err == 0);
+    CHECK(p_response->success);
+    CHECK(p_response->p_intermediates != NULL);
+    CHECK(0 == strcmp(p_response->p_intermediates->line,
+                        "351234567890128"));
+
+    at_response_free(p_response);
+
+    return 0;
+}
+
+/*
+ * The +CSQ answer comes 200 ms after the command timed out. It must be
+ * discarded, not taken as the answer to the command written next, and
+ * the timeout handler runs for synchronous and asynchronous commands
+ */
+static int testLateReply()
+{
+    static const FakeReply replies[] = {
+        { "AT+CSQ",  "+CSQ: 20,99\r\n\r\nOK", 300 },
+        { "AT+CGSN", "351234567890128\r\n\r\nOK", 0 },
+    };
+    FakeModem modem;
+    ATChannel *p_channel;
+    ATResponse *p_response = NULL;
+    AsyncResult result;
+    int fd;
+    int err;
+
+    fd = fakeModemStart(&modem, replies, NUM_ELEMS(replies));
+    CHECK(fd >= 0);
+
+    p_channel = at_channel_new(NULL);
+    CHECK(p_channel != NULL);
+    at_channel_set_on_timeout(p_channel, onTimeout);
+    CHECK(at_channel_open(p_channel, fd, onUnsolicited) == 0);
+
+    s_timeouts = 0;
+
+    err = at_channel_send_command(p_channel, "AT+CSQ", SINGLELINE,
+                                    "+CSQ:", NULL, 100, &p_response);
+    CHECK(err == AT_ERROR_TIMEOUT);
+    CHECK(s_timeouts == 1);
+
+    if (checkCgsn(p_channel) < 0) return -1;
+
+    initAsync(&result);
+
+    err = at_channel_send_command_async(p_channel, "AT+CSQ", SINGLELINE,
+                                    "+CSQ:", NULL, 100, onAsyncComplete,
+                                    &result);
+    CHECK(err == 0);
+    CHECK(waitAsync(&result) == AT_ERROR_TIMEOUT);
+
+    if (checkCgsn(p_channel) < 0) return -1;
+
+    /* the handler runs on the reader, after the callback */
+    CHECK(s_timeouts == 2);
+
+    at_channel_close(p_channel);
+    fakeModemStop(&modem);
+
+    return 0;
+}
+
+/*
+ * With two secondary ports, +CPBS and the +CPBR after it must go to the
+ * same one even when the other is idle, or +CPBR reads the phonebook
+ * +CPBS didn't select
+ */
+static int testPinnedRoute()
+{
+    static const FakeReply replies[] = {
+        { "AT+COPS=?", "+COPS: (2,\"Emu\",\"Emu\",\"00101\",2)\r\n\r\nOK",
+                        300 },
+        { "AT+CPBR",   "+CPBR: 1,\"5551234\",129,\"Emu\"\r\n\r\nOK", 0 },
+    };
+    FakeModem modems[3];
+    ATChannel *p_channel;
+    ATResponse *p_response = NULL;
+    AsyncResult result;
+    int fd;
+    int i;
+
+    p_channel = at_channel_new(NULL);
+    CHECK(p_channel != NULL);
+
+    for (i = 0 ; i < 3 ; i++) {
+        fd = fakeModemStart(&modems[i], replies, NUM_ELEMS(replies));
+        CHECK(fd >= 0);
+        CHECK((i == 0 ? at_channel_open(p_channel, fd, onUnsolicited)
+                        : at_channel_open_port(p_channel, i, fd)) == 0);
+    }
+
+    /* a scan keeps port 1 busy, so port 2 has fewer commands */
+    initAsync(&result);
+    CHECK(at_channel_send_command_async(p_channel, "AT+COPS=?",
+                    MULTILINE, "+COPS:", NULL, AT_TIMEOUT_DEFAULT,
+                    onAsyncComplete, &result) == 0);
+
+    CHECK(at_channel_send_command(p_channel, "AT+CPBS=\"SM\"", NO_RESULT,
+                    NULL, NULL, AT_TIMEOUT_DEFAULT, NULL) == 0);
+    CHECK(at_channel_send_command(p_channel, "AT+CPBR=1,10", MULTILINE,
+                    "+CPBR:", NULL, AT_TIMEOUT_DEFAULT, &p_response) == 0);
+    CHECK(p_response->p_intermediates != NULL);
+    at_response_free(p_response);
+
+    CHECK(waitAsync(&result) == 0);
+
+    CHECK(fakeModemGot(&modems[1], "AT+COPS=?"));
+    CHECK(fakeModemGot(&modems[1], "AT+CPBS=\"SM\""));
+    CHECK(fakeModemGot(&modems[1], "AT+CPBR=1,10"));
+    CHECK(!fakeModemGot(&modems[2], "AT+CPBS=\"SM\""));
+    CHECK(!fakeModemGot(&modems[2], "AT+CPBR=1,10"));
+
+    at_channel_close(p_channel);
+    for (i = 0 ; i < 3 ; i++) {
+        fakeModemStop(&modems[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * A secondary port gets the port init before the first command routed
+ * to it, so that command fails with +CME ERROR like on port 0
+ */
+static int testPortInit()
+{
+    static const char * const portInit[] = {
+        "AT+CMEE=1",
+        "AT+CSCS=\"IRA\"",
+    };
+    static const FakeReply replies[] = {
+        { "AT+CRSM", "+CME ERROR: 10", 0 },
+    };
+    FakeModem modems[2];
+    ATChannel *p_channel;
+    ATResponse *p_response = NULL;
+    int fd;
+    int i;
+
+    p_channel = at_channel_new(NULL);
+    CHECK(p_channel != NULL);
+    at_channel_set_port_init(p_channel, portInit, NUM_ELEMS(portInit));
+
+    for (i = 0 ; i < 2 ; i++) {
+        fd = fakeModemStart(&modems[i], replies, NUM_ELEMS(replies));
+        CHECK(fd >= 0);
+        CHECK((i == 0 ? at_channel_open(p_channel, fd, onUnsolicited)
+                        : at_channel_open_port(p_channel, i, fd)) == 0);
+    }
+
+    CHECK(at_channel_send_command(p_channel, "AT+CRSM=176,28589,0,0,4",
+                    SINGLELINE, "+CRSM:", NULL, AT_TIMEOUT_DEFAULT,
+                    &p_response) == 0);
+    CHECK(at_get_cme_error(p_response) == CME_SIM_NOT_INSERTED);
+    at_response_free(p_response);
+
+    CHECK(fakeModemGot(&modems[1], "AT+CRSM=176,28589,0,0,4"));
+    CHECK(fakeModemFind(&modems[1], "ATE0Q0V1")
+            < fakeModemFind(&modems[1], "AT+CMEE=1"));
+    CHECK(fakeModemFind(&modems[1], "AT+CMEE=1")
+            < fakeModemFind(&modems[1], "AT+CSCS=\"IRA\""));
+    CHECK(fakeModemFind(&modems[1], "AT+CSCS=\"IRA\"")
+            < fakeModemFind(&modems[1], "AT+CRSM=176,28589,0,0,4"));
+    CHECK(!fakeModemGot(&modems[0], "AT+CMEE=1"));
+
+    at_channel_close(p_channel);
+    for (i = 0 ; i < 2 ; i++) {
+        fakeModemStop(&modems[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * A command and its terminator go out with one write call, not the two
+ * it used to take, so a USB serial port sends them as one transfer
+ */
+static int testWriteCalls()
+{
+    static const char * const commands[] = {
+        "AT+CSQ",
+        "AT+CREG?",
+        "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
+        "AT+CGDCONT=1,\"IP\",\"web.vodafone.de\"",
+    };
+    FakeModem modem;
+    ATChannel *p_channel;
+    ATPortStats stats;
+    size_t i;
+    int fd;
+
+    fd = fakeModemStart(&modem, NULL, 0);
+    CHECK(fd >= 0);
+
+    p_channel = at_channel_new(NULL);
+    CHECK(p_channel != NULL);
+    CHECK(at_channel_open(p_channel, fd, onUnsolicited) == 0);
+
+    for (i = 0 ; i < NUM_ELEMS(commands) ; i++) {
+        CHECK(at_channel_send_command(p_channel, commands[i], NO_RESULT,
+                        NULL, NULL, AT_TIMEOUT_DEFAULT, NULL) == 0);
+        CHECK(fakeModemGot(&modem, commands[i]));
+    }
+
+    at_channel_get_port_stats(p_channel, 0, &stats);
+    CHECK(stats.written >= NUM_ELEMS(commands));
+    CHECK(stats.writeCalls == stats.written);
+
+    at_channel_close(p_channel);
+    fakeModemStop(&modem);
+
+    return 0;
+}
+
+/*
+ * Basic commands go on a batched line without a separator, as V.250
+ * wants, extended ones with a ';' after them, and +COPS on its own
+ */
+static int testBatchSyntax()
+{
+    static const char * const commands[] = {
+        "ATE0",
+        "ATS0=0",
+        "AT&C1",
+        "AT+CMEE=1",
+        "AT+CRC=1;+CR=1",
+        "ATQ0",
+        "AT+COPS=0",
+        "AT+CLIP=1",
+        "AT^CURC=0",
+    };
+    FakeModem modem;
+    ATChannel *p_channel;
+    int fd;
+
+    fd = fakeModemStart(&modem, NULL, 0);
+    CHECK(fd >= 0);
+
+    p_channel = at_channel_new(NULL);
+    CHECK(p_channel != NULL);
+    CHECK(at_channel_open(p_channel, fd, onUnsolicited) == 0);
+
+    CHECK(at_channel_send_batch(p_channel, commands,
+                                    NUM_ELEMS(commands)) == 0);
+
+    CHECK(fakeModemGot(&modem, "ATE0S0=0&C1+CMEE=1;+CRC=1;+CR=1;Q0"));
+    CHECK(fakeModemGot(&modem, "AT+COPS=0"));
+    CHECK(fakeModemGot(&modem, "AT+CLIP=1;^CURC=0"));
+
+    at_channel_close(p_channel);
+    fakeModemStop(&modem);
+
+    return 0;
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int rssi;
+    int cmt;
+    int ring;
+    int open;       /* the handler waits for it on its first line */
+    int done;
+} UnsolCounts;
+
+static UnsolCounts s_unsol;
+
+/** counts the lines by type, once the test lets it */
+static void onCountUnsolicited(ATChannel *p_channel, const char *s,
+                                const char *sms_pdu, ATLineType type)
+{
+    (void) p_channel;
+    (void) s;
+
+    pthread_mutex_lock(&s_unsol.mutex);
+
+    /* the reader fills the queue meanwhile */
+    while (!s_unsol.open) {
+        pthread_cond_wait(&s_unsol.cond, &s_unsol.mutex);
+    }
+
+    if (type == AT_LINE_RSSI) {
+        s_unsol.rssi++;
+    } else if (type == AT_LINE_CMT && sms_pdu != NULL) {
+        s_unsol.cmt++;
+    } else if (type == AT_LINE_RING) {
+        s_unsol.ring++;
+    } else if (type == AT_LINE_CUSD) {
+        s_unsol.done = 1;
+        pthread_cond_broadcast(&s_unsol.cond);
+    }
+
+    pthread_mutex_unlock(&s_unsol.mutex);
+}
+
+/* 1000 ^RSSI with a +CMT and a RING after every other one */
+static void *writeUnsolBurst(void *arg)
+{
+    FakeModem *p_modem = (FakeModem *) arg;
+    char line[128];
+    int i;
+
+    for (i = 0 ; i < 1000 ; i++) {
+        snprintf(line, sizeof(line), "\r\n^RSSI:%d\r\n", i % 32);
+        fakeWrite(p_modem, line);
+
+        if (i % 2 == 0) {
+            fakeWrite(p_modem, "\r\n+CMT: ,24\r\n07911326040000F0040B91"
+                    "1346610089F60000208062917314080CC8F71D14969741F977FD07"
+                    "\r\n");
+            fakeWrite(p_modem, "\r\nRING\r\n");
+        }
+    }
+    fakeWrite(p_modem, "\r\n+CUSD: 0,\"done\",15\r\n");
+
+    return NULL;
+}
+
+/*
+ * A burst of unsolicited the dispatcher can't keep up with: ^RSSI may
+ * be dropped, but every +CMT and RING must get to the handler
+ */
+static int testUnsolBurst()
+{
+    FakeModem modem;
+    ATChannel *p_channel;
+    ATUnsolQueueStats stats;
+    pthread_t tid;
+    int fd;
+    int i;
+
+    memset(&s_unsol, 0, sizeof(s_unsol));
+    pthread_mutex_init(&s_unsol.mutex, NULL);
+    pthread_cond_init(&s_unsol.cond, NULL);
+
+    fd = fakeModemStart(&modem, NULL, 0);
+    CHECK(fd >= 0);
+
+    p_channel = at_channel_new(NULL);
+    CHECK(p_channel != NULL);
+    CHECK(at_channel_open(p_channel, fd, onCountUnsolicited) == 0);
+
+    /* the writes block while the reader waits */
+    CHECK(pthread_create(&tid, NULL, writeUnsolBurst, &modem) == 0);
+
+    /* until the reader has had to wait for room */
+    for (i = 0 ; i < 200 ; i++) {
+        at_channel_get_unsol_queue_stats(p_channel, &stats);
+        if (stats.waits > 0) break;
+        sleepMsec(10);
+    }
+
+    pthread_mutex_lock(&s_unsol.mutex);
+    s_unsol.open = 1;
+    pthread_cond_broadcast(&s_unsol.cond);
+    while (!s_unsol.done) {
+        pthread_cond_wait(&s_unsol.cond, &s_unsol.mutex);
+    }
+    pthread_mutex_unlock(&s_unsol.mutex);
+
+    pthread_join(tid, NULL);
+
+    at_channel_get_unsol_queue_stats(p_channel, &stats);
+
+    CHECK(s_unsol.cmt == 500);
+    CHECK(s_unsol.ring == 500);
+    CHECK(s_unsol.rssi + (int) stats.dropped == 1000);
+    CHECK(stats.dropped > 0);
+    CHECK(stats.waits > 0);
+
+    at_channel_close(p_channel);
+    fakeModemStop(&modem);
+
+    return 0;
+}
+
+/** decodes the hex PDU and checks its text */
+static int checkPduText(const char *hex, const char *text)
+{
+    unsigned char utf8[512];
+    SmsPDU pdu;
+    int len;
+
+    pdu = smspdu_create_from_hex(hex, strlen(hex));
+    CHECK(pdu != NULL);
+
+    len = smspdu_get_text_message(pdu, utf8, sizeof(utf8));
+    CHECK(len == (int) strlen(text));
+    CHECK(memcmp(utf8, text, len) == 0);
+
+    smspdu_free(pdu);
+
+    return 0;
+}
+
+/** encodes text as an SMS-DELIVER and decodes it again */
+static int checkDeliver(const char *text, int parts)
+{
+    SmsAddressRec sender;
+    SmsAddressRec address;
+    SmsTimeStampRec timestamp;
+    SmsTimeStampRec decoded;
+    SmsPDU *list;
+    SmsPDU pdu;
+    char hex[400];
+    char number[32];
+    int len;
+    int i;
+
+    sms_address_from_str(&sender, "+491701234567", 13);
+    /* 2012-08-26 19:37:41 +02:00, semi-octets */
+    memcpy(timestamp.data, "\x21\x80\x62\x91\x73\x14\x80", 7);
+
+    list = smspdu_create_deliver_utf8((const unsigned char *) text,
+                                        strlen(text), &sender, &timestamp);
+    CHECK(list != NULL);
+
+    for (i = 0 ; list[i] != NULL ; i++) ;
+    CHECK(i == parts);
+
+    len = smspdu_to_hex(list[0], hex, sizeof(hex) - 1);
+    CHECK(len < (int) sizeof(hex));
+    hex[len] = '\0';
+
+    /* frees the PDUs and the list */
+    smspdu_free_list(list);
+
+    pdu = smspdu_create_from_hex(hex, len);
+    CHECK(pdu != NULL);
+    CHECK(smspdu_get_type(pdu) == SMS_PDU_DELIVER);
+
+    CHECK(smspdu_get_sender_address(pdu, &address) == 0);
+    sms_address_to_str(&address, number, sizeof(number));
+    CHECK(0 == strcmp(number, "+491701234567"));
+
+    CHECK(smspdu_get_sc_timestamp(pdu, &decoded) == 0);
+    CHECK(0 == memcmp(decoded.data, timestamp.data, 7));
+
+    smspdu_free(pdu);
+
+    return parts == 1 ? checkPduText(hex, text) : 0;
+}
+
+/*
+ * SMS-DELIVER round trips, GSM 7 bit with characters outside ASCII and
+ * escaped ones, UCS2, and a text that takes three parts
+ */
+static int testSmsDeliver()
+{
+    if (checkDeliver("Caf\xc3\xa9 at 5? {ok} \xc3\x9c\xc3\xb1", 1) < 0) {
+        return -1;
+    }
+
+    if (checkDeliver("\xd0\x91\xd0\xb0\xd0\xbb\xd0\xb0\xd0\xbd\xd1\x81: "
+                        "125 \xe2\x82\xbd", 1) < 0) {
+        return -1;
+    }
+
+    return checkDeliver(
+        "This is a long message that doesn't fit in a single SMS, so the "
+        "encoder has to split it into several parts, each with a user data "
+        "header carrying the reference, the part count and the part number. "
+        "The receiving phone puts them back together in order; this one is "
+        "exactly long enough to need three of them to carry all of its text "
+        "to the other end.", 3);
+}
+
+/*
+ * SMS-SUBMIT as the framework sends it, with and without a relative
+ * validity period
+ */
+static int testSmsSubmit()
+{
+    static const char * const pdus[] = {
+        "0001000B916407281553F800000AE8329BFD4697D9EC37",
+        "0011000B916407281553F80000AA0AE8329BFD4697D9EC37",
+    };
+    SmsAddressRec address;
+    char number[32];
+    SmsPDU pdu;
+    size_t i;
+
+    for (i = 0 ; i < NUM_ELEMS(pdus) ; i++) {
+        pdu = smspdu_create_from_hex(pdus[i], strlen(pdus[i]));
+        CHECK(pdu != NULL);
+        CHECK(smspdu_get_type(pdu) == SMS_PDU_SUBMIT);
+
+        CHECK(smspdu_get_receiver_address(pdu, &address) == 0);
+        sms_address_to_str(&address, number, sizeof(number));
+        CHECK(0 == strcmp(number, "+46708251358"));
+
+        smspdu_free(pdu);
+
+        if (checkPduText(pdus[i], "hellohello") < 0) return -1;
+    }
+
+    return 0;
+}
+
+/* an SMS-SUBMIT to CDMA and back as an SMS-DELIVER */
+static int testSmsCdma()
+{
+    char cdma[512];
+    char **pdus;
+
+    snprintf(cdma, sizeof(cdma), "%s",
+        gsm_to_cdmapdu("0001000B916407281553F800000AE8329BFD4697D9EC37"));
+    CHECK(cdma[0] != '\0');
+
+    pdus = cdma_to_gsmpdu(cdma);
+    CHECK(pdus[0] != NULL);
+    CHECK(pdus[1] == NULL);
+
+    if (checkPduText(pdus[0], "hellohello") < 0) return -1;
+
+    /* a PDU cut short in its SMSC address, no CDMA message */
+    CHECK(gsm_to_cdmapdu("0791")[0] == '\0');
+
+    return 0;
+}
+
+/** parses line as a solicited or unsolicited +CREG, returns the count */
+static int parseReg(const char *line, int unsolicited, ATReg *p_reg)
+{
+    char copy[128];
+
+    snprintf(copy, sizeof(copy), "%s", line);
+    memset(p_reg, 0, sizeof(*p_reg));
+
+    return at_schema_parse_reg(copy, unsolicited, p_reg);
+}
+
+/*
+ * The answer to AT+CREG? is "<n>,<stat>...". An unsolicited report
+ * that took its place must not parse as one, or its quoted <lac> is
+ * taken for <stat>
+ */
+static int testRegForms()
+{
+    ATReg reg;
+
+    CHECK(parseReg("+CREG: 2,1,\"1A2B\",\"0042\"", 0, &reg) == 3);
+    CHECK(reg.n == 2 && reg.stat == 1 && reg.lac == 0x1A2B && reg.ci == 0x42);
+
+    CHECK(parseReg("+CGREG: 2,5,\"1A2B\",\"0042\",2", 0, &reg) == 4);
+    CHECK(reg.stat == 5 && reg.act == 2);
+
+    CHECK(parseReg("+CREG: 1,\"1A2B\",\"0042\",2", 0, &reg) < 0);
+    CHECK(parseReg("+CREG: 1,\"1A2B\",\"0042\"", 0, &reg) < 0);
+    CHECK(parseReg("+CREG: 1", 0, &reg) < 0);
+    CHECK(parseReg("+CREG: 2,1x", 0, &reg) < 0);
+
+    CHECK(parseReg("+CREG: 1,\"1A2B\",\"0042\",2", 1, &reg) == 4);
+    CHECK(reg.stat == 1 && reg.lac == 0x1A2B && reg.act == 2);
+    CHECK(parseReg("+CREG: 5", 1, &reg) == 1);
+    CHECK(reg.stat == 5);
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*test)();
+} s_tests[] = {
+    { "batch_syntax", testBatchSyntax },
+    { "late_reply", testLateReply },
+    { "pinned_route", testPinnedRoute },
+    { "port_init", testPortInit },
+    { "unsol_burst", testUnsolBurst },
+    { "write_calls", testWriteCalls },
+    { "sms_deliver", testSmsDeliver },
+    { "sms_submit", testSmsSubmit },
+    { "sms_cdma", testSmsCdma },
+    { "reg_forms", testRegForms },
+};
+
+static void usage(char *s)
+{
+    fprintf(stderr, "usage: %s [-f <name filter>]\n", s);
+    exit(-1);
+}
+
+int main (int argc, char **argv)
+{
+    const char *filter = NULL;
+    size_t i;
+    int opt;
+
+    while ( -1 != (opt = getopt(argc, argv, "f:"))) {
+        switch (opt) {
+            case 'f': filter = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    for (i = 0 ; i < NUM_ELEMS(s_tests) ; i++) {
+        if (filter != NULL && strstr(s_tests[i].name, filter) == NULL) {
+            continue;
+        }
+
+        printf("%s\n", s_tests[i].name);
+        fflush(stdout);
+
+        if (s_tests[i].test() < 0) {
+            s_failed++;
+        } else {
+            printf("  ok\n");
+        }
+    }
+
+    return s_failed > 0 ? 1 : 0;
+}
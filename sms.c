@@ -241,17 +241,25 @@ char **cdma_to_gsmpdu(char *msg) {
             smsaddr.toa = 0xd0;
         }
 	sms_timestamp_now(&smstime);
-	SmsPDU *pdu=smspdu_create_deliver_utf8((const unsigned char *)message,strlen(message),&smsaddr,&smstime);
+	SmsPDU *list=smspdu_create_deliver_utf8((const unsigned char *)message,strlen(message),&smsaddr,&smstime);
+	SmsPDU *pdu=list;
 	//hexpdu=malloc(512);
 	char *s=hexpdu;
-        while(*pdu) {
-                smspdu_to_hex(*pdu, s,512);
+	/* the list owns the PDUs, smspdu_free_list() frees both */
+        while(pdu && *pdu && i < 15) {
+                int room=hexpdu+sizeof(hexpdu)-s;
+                int len=smspdu_to_hex(*pdu, s, room-1);
+                if(len>=room) {
+                        ALOGE("Error: GSM PDUs too long");
+                        break;
+                }
+                s[len]=0;
                 hexpdus[i]=s;
-                s=s+strlen(s)+2;
-                smspdu_free(*pdu);
+                s=s+len+1;
                 i++;
                 pdu++;
         }
+	smspdu_free_list(list);
 	hexpdus[i]=0;
 	return hexpdus;
 }
@@ -264,6 +272,11 @@ char *gsm_to_cdmapdu(char *msg) {
 	sms_address_from_str(&smsaddr,"000000",6);
 
 	SmsPDU pdu=smspdu_create_from_hex( msg, strlen(msg) );
+	if(pdu==NULL) {
+		ALOGE("Error: bad GSM PDU");
+		hexpdu[0]=0;
+		return hexpdu;
+	}
 	if(smspdu_get_receiver_address(pdu,&smsaddr)<0) {
 		ALOGE("Error: no receiver address");
 		smspdu_get_sender_address(pdu,&smsaddr);
@@ -274,7 +287,10 @@ char *gsm_to_cdmapdu(char *msg) {
 		to[0]='0';
 		to[1]='0';
 	}
-	int length=smspdu_get_text_message(pdu, message, 256);
+	int length=smspdu_get_text_message(pdu, message, 255);
+	/* it returns the whole length, even if only 255 bytes fit */
+	if(length<0) length=0;
+	if(length>255) length=255;
 	message[length]=0;
 	smspdu_free(pdu);
 	ALOGD("GSM Message:%s To:%s\n",message,to);
@@ -2,6 +2,7 @@
 #include "gsm.h"
 #include <memory.h>
 #include <stdlib.h>
+#include <string.h>
 //#include <assert.h>
 
 /* maximum number of data bytes in a SMS data message */
@@ -544,9 +545,7 @@ smspdu_free( SmsPDU  pdu )
 {
     if (pdu) {
         free( pdu->base );
-        pdu->base = NULL;
-        pdu->end  = NULL;
-        pdu->tpdu = NULL;
+        free( pdu );
     }
 }
 
@@ -574,7 +573,7 @@ smspdu_get_sender_address( SmsPDU  pdu, SmsAddress  address )
 
     switch (mtiByte & 3) {
         case 0: /* SMS_PDU_DELIVER; */
-            return sms_get_sc_address( &data, end, address );
+            return sms_get_address( &data, end, address );
 
         default: return -1;
     }
@@ -592,7 +591,7 @@ smspdu_get_sc_timestamp( SmsPDU  pdu, SmsTimeStamp  ts )
             {
                 SmsAddressRec  address;
 
-                if ( sms_get_sc_address( &data, end, &address ) < 0 )
+                if ( sms_get_address( &data, end, &address ) < 0 )
                     return -1;
 
                 data += 2;  /* skip protocol identifer + coding scheme */
@@ -647,6 +646,8 @@ sms_get_coding_scheme( cbytes_t  *pcur,
         case 0x00:
         case 0x02:
         case 0x03:
+            /* eg 0x08, or 0x09 as smspdu_create_deliver_utf8() writes */
+            if (((dataCoding >> 2) & 3) == 2) return SMS_CODING_SCHEME_UCS2;
             return SMS_CODING_SCHEME_GSM7;
 
         case 0x01:
@@ -765,7 +766,7 @@ smspdu_get_text_message( SmsPDU  pdu, unsigned char*  utf8, int  utf8len )
                 GsmRopeRec       rope[1];
                 int              result;
 
-                if ( sms_get_sc_address( &data, end, &address ) < 0 )
+                if ( sms_get_address( &data, end, &address ) < 0 )
                     goto Fail;
 
                 data  += 1;  /* skip protocol identifier */
@@ -808,6 +809,13 @@ smspdu_get_text_message( SmsPDU  pdu, unsigned char*  utf8, int  utf8len )
                 if (coding == SMS_CODING_SCHEME_UNKNOWN)
                     goto Fail;
 
+                /* skip the validity period, its format is in bits 3-4 */
+                switch ((mtiByte >> 3) & 3) {
+                    case 2:  data += 1; break;  /* relative */
+                    case 1:                     /* enhanced */
+                    case 3:  data += 7; break;  /* absolute */
+                }
+
                 gsm_rope_init_alloc( rope, 0 );
                 if ( sms_get_text_utf8( &data, end, (mtiByte & 0x40), coding, rope ) < 0 ) {
                     gsm_rope_done( rope );
@@ -916,7 +924,6 @@ gsm_rope_add_sms_deliver_pdu( GsmRope                 rope,
         else
             gsm_rope_add_c( rope, count*2 );
 
-        gsm_rope_add_c( rope, count*2 );
         dst = gsm_rope_reserve( rope, count*2 );
         if (dst != NULL) {
             utf8_to_ucs2( utf8, utf8len, dst );
@@ -984,6 +991,29 @@ smspdu_free_list( SmsPDU*  pdus )
 
 
 
+/* skip the characters that fit in max septets (GSM 7 bit) or UCS2
+ * characters, without splitting an escaped one */
+static cbytes_t
+utf8_skip_units( cbytes_t  src, cbytes_t  end, int  use_gsm7, int  max )
+{
+    while (src < end) {
+        cbytes_t  next  = utf8_skip( src, end, 1 );
+        int       units = 1;
+
+        if (use_gsm7 && src[0] >= 0x80)
+            units = utf8_to_gsm7( src, next - src, NULL, 0 );
+        else if (use_gsm7 && src[0] != 0 && strchr( "\f^{}\\[~]|", src[0] ))
+            units = 2;  /* the ASCII characters GSM 7 bit escapes */
+
+        if (units > max)
+            break;
+
+        max -= units;
+        src  = next;
+    }
+    return src;
+}
+
 SmsPDU*
 smspdu_create_deliver_utf8( const unsigned char*   utf8,
                             int                    utf8len,
@@ -994,7 +1024,6 @@ smspdu_create_deliver_utf8( const unsigned char*   utf8,
     int              use_gsm7;
     int              count, block;
     int              num_pdus = 0;
-    int              leftover = 0;
     SmsPDU*          list = NULL;
 
     static unsigned char  ref_num = 0;
@@ -1007,22 +1036,34 @@ smspdu_create_deliver_utf8( const unsigned char*   utf8,
     /* can we encode the message with the GSM 7-bit alphabet ? */
     use_gsm7 = utf8_check_gsm7( utf8, utf8len );
 
-    /* count the number of SMS PDUs we'll need */
-    block = MAX_USER_DATA_SEPTETS - USER_DATA_HEADER_SIZE;
-
+    /* count the number of SMS PDUs we'll need: in septets or UCS2
+     * characters, a single part takes 160 or 70, each of several 153 or 67
+     * as its user data header takes 7 septets or 6 bytes */
     if (use_gsm7) {
         count = utf8_to_gsm7( utf8, utf8len, NULL, 0 );
+        block = MAX_USER_DATA_SEPTETS;
+        if (count > block)
+            block -= (USER_DATA_HEADER_SIZE*8 + 6) / 7;
     } else {
         count = utf8_to_ucs2( utf8, utf8len, NULL );
-        block = MAX_USER_DATA_BYTES - USER_DATA_HEADER_SIZE;
+        block = MAX_USER_DATA_BYTES / 2;
+        if (count > block)
+            block = (MAX_USER_DATA_BYTES - USER_DATA_HEADER_SIZE) / 2;
     }
 
-    num_pdus = count / block;
-    leftover = count - num_pdus*block;
-    if (leftover > 0)
-        num_pdus += 1;
+    if (count <= block) {
+        num_pdus = 1;
+    } else {
+        cbytes_t   src     = utf8;
+        cbytes_t   src_end = utf8 + utf8len;
+
+        do {
+            src = utf8_skip_units( src, src_end, use_gsm7, block );
+            num_pdus += 1;
+        } while (src < src_end);
+    }
 
-    list = calloc( sizeof(SmsPDU*), count + 1 );
+    list = calloc( sizeof(SmsPDU*), num_pdus + 1 );
     if (list == NULL)
         return NULL;
 
@@ -1034,13 +1075,10 @@ smspdu_create_deliver_utf8( const unsigned char*   utf8,
 
         for (nn = 0; nn < num_pdus; nn++)
         {
-            int       skip = block;
             cbytes_t  src_next;
 
-            if (leftover > 0 && nn == num_pdus-1)
-                skip = leftover;
-
-            src_next = utf8_skip( src, src_end, skip );
+            src_next = num_pdus == 1 ? src_end
+                                     : utf8_skip_units( src, src_end, use_gsm7, block );
             list[nn] = smspdu_create_deliver( src, src_next - src, use_gsm7, sender_address, timestamp,
                                               ref_num, num_pdus, nn );
             if (list[nn] == NULL)